@@ -20,7 +20,7 @@ def write_pxd(pxdname, files):
 		code_lines = [c.split('*/')[-1] + '\n' for c in code_lines]
 		i = 0
 
-		full_file += '\n\ncdef extern from "%s.h":\n\n\t' % fname
+		full_file += '\n\ncdef extern from "%s.h" nogil:\n\n\t' % fname
 
 		while i < len(code_lines):
 			inc = True
@@ -55,5 +55,6 @@ def write_pxd(pxdname, files):
 	f.close()
 
 write_pxd('pawpyc_extern.pxd',
-	['utils', 'projector', 'pseudoprojector', 'reader', 'density', 'sbt', 'linalg', 'radial', 'momentum'])
+	['utils', 'projector', 'pseudoprojector', 'reader', 'density', 'sbt', 'linalg', 'radial', 'momentum',
+	'wfcache', 'backend'])
 write_pxd('tests/testc_extern.pxd', ['tests/tests', 'utils'])
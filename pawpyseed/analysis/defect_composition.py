@@ -347,10 +347,8 @@ class BasisExpansion(PawpyData):
 			bg, cbm, vbm, _ = vr.eigenvalue_band_properties
 			dos = vr.tdos
 			basis = pr.basis
-			expansion = np.zeros((pr.wf.nband, basis.nband * basis.nwk * basis.nspin),
-				dtype=np.complex128)
-			for b in range(pr.wf.nband):
-				expansion[b,:] = pr.single_band_projection(b)
+			expansion = pr.all_band_projection().transpose(0, 1, 3, 2)\
+				.reshape(pr.wf.nband, basis.nband * basis.nwk * basis.nspin)
 			bes[wf_dir] = BasisExpansion(pr.wf.structure, expansion, dos=dos,
 				vbm = vbm, cbm = cbm)
 
@@ -0,0 +1,531 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include <omp.h>
+#include "utils.h"
+#include "backend.h"
+#if !defined(PAWPY_FFTW) || !defined(PAWPY_OPENBLAS)
+#include <mkl.h>
+#define PAWPY_MKL_LINKED
+#endif
+#if defined(PAWPY_FFTW)
+#include <fftw3.h>
+#endif
+
+#ifdef PAWPY_MKL_LINKED
+
+void* backend_malloc(size_t size, int alignment) {
+	return mkl_malloc(size, alignment);
+}
+
+void* backend_calloc(size_t num, size_t size, int alignment) {
+	return mkl_calloc(num, size, alignment);
+}
+
+void backend_free(void* ptr) {
+	mkl_free(ptr);
+}
+
+static void free_library_buffers(void) {
+	mkl_free_buffers();
+}
+
+static void set_library_thread_count(int num_threads) {
+	mkl_set_num_threads_local(num_threads);
+}
+
+#else
+
+void* backend_malloc(size_t size, int alignment) {
+	if (alignment < (int) sizeof(void*)) {
+		alignment = sizeof(void*);
+	}
+	// aligned_alloc needs a size that is a multiple of the alignment
+	size_t padded = (size + alignment - 1) / alignment * alignment;
+	return aligned_alloc(alignment, padded > 0 ? padded : alignment);
+}
+
+void* backend_calloc(size_t num, size_t size, int alignment) {
+	void* ptr = backend_malloc(num * size, alignment);
+	if (ptr != NULL) {
+		memset(ptr, 0, num * size);
+	}
+	return ptr;
+}
+
+void backend_free(void* ptr) {
+	free(ptr);
+}
+
+static void free_library_buffers(void) {}
+
+static void set_library_thread_count(int num_threads) {}
+
+#endif
+
+// number of backend_defer_buffer_frees(1) calls not yet matched by a
+// backend_defer_buffer_frees(0), and whether backend_free_buffers was
+// called in the meantime
+static int buffer_defers = 0;
+static int buffer_free_pending = 0;
+
+void backend_free_buffers(void) {
+	int deferred;
+	#pragma omp critical(backend_buffers)
+	{
+		deferred = buffer_defers > 0;
+		if (deferred) {
+			buffer_free_pending = 1;
+		}
+	}
+	if (!deferred) {
+		free_library_buffers();
+	}
+}
+
+void backend_defer_buffer_frees(int defer) {
+	int run = 0;
+	#pragma omp critical(backend_buffers)
+	{
+		if (defer) {
+			buffer_defers++;
+		} else if (buffer_defers > 0 && --buffer_defers == 0 && buffer_free_pending) {
+			buffer_free_pending = 0;
+			run = 1;
+		}
+	}
+	if (run) {
+		free_library_buffers();
+	}
+}
+
+void backend_set_thread_count(int num_threads) {
+#if defined(_OPENMP)
+	omp_set_num_threads(num_threads);
+#endif
+	set_library_thread_count(num_threads);
+}
+
+int backend_get_thread_count(void) {
+#if defined(_OPENMP)
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+const char* blas_backend_name(void) {
+#if defined(PAWPY_OPENBLAS)
+	return "openblas";
+#else
+	return "mkl";
+#endif
+}
+
+#if defined(PAWPY_FFTW)
+
+/*
+An FFTW plan, which is made for the alignment of the arrays it was
+planned with (see fftw_alignment_of), along with an FFTW_UNALIGNED
+plan for arrays that are not aligned the same way.
+FFTW does not scale its transforms, so the output is scaled afterwards.
+*/
+typedef struct fftw_backend_plan {
+	int precision;
+	int domain;
+	int direction;
+	long out_size; ///< number of real values in the output of the plan
+	long out_stride; ///< distance between output grids of real transforms
+	long out_grid; ///< number of real values in each output grid of real transforms
+	int length; ///< length of each transform of a strided plan
+	int howmany; ///< number of transforms of a strided plan
+	int stride; ///< stride of a strided plan, or 0 for other plans
+	int distance; ///< distance between the transforms of a strided plan
+	int batch; ///< number of sets of transforms of a strided plan
+	int batch_distance; ///< distance between the sets of a strided plan
+	double scale;
+	void* aligned;
+	void* unaligned;
+} fftw_backend_plan_t;
+
+const char* fft_backend_name(void) {
+	return "fftw";
+}
+
+const char* fft_error_message(int status) {
+	return "FFTW could not make a plan for the transform";
+}
+
+static void* make_fftw_plan(fftw_backend_plan_t* p, int dim, int* n, int howmany,
+	void* in, void* out, unsigned flags) {
+	int gridsize = 1;
+	for (int i = 0; i < dim; i++) {
+		gridsize *= n[i];
+	}
+	int halfsize = gridsize / n[dim-1] * (n[dim-1] / 2 + 1);
+	int sign = p->direction == FFT_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD;
+	if (p->precision == FFT_SINGLE) {
+		if (p->domain == FFT_COMPLEX) {
+			return fftwf_plan_many_dft(dim, n, howmany, in, NULL, 1, gridsize,
+				out, NULL, 1, gridsize, sign, flags);
+		} else if (p->direction == FFT_FORWARD) {
+			return fftwf_plan_many_dft_r2c(dim, n, howmany, in, NULL, 1, 2 * gridsize,
+				out, NULL, 1, halfsize, flags);
+		} else {
+			return fftwf_plan_many_dft_c2r(dim, n, howmany, in, NULL, 1, halfsize,
+				out, NULL, 1, 2 * gridsize, flags);
+		}
+	} else {
+		if (p->domain == FFT_COMPLEX) {
+			return fftw_plan_many_dft(dim, n, howmany, in, NULL, 1, gridsize,
+				out, NULL, 1, gridsize, sign, flags);
+		} else if (p->direction == FFT_FORWARD) {
+			return fftw_plan_many_dft_r2c(dim, n, howmany, in, NULL, 1, 2 * gridsize,
+				out, NULL, 1, halfsize, flags);
+		} else {
+			return fftw_plan_many_dft_c2r(dim, n, howmany, in, NULL, 1, halfsize,
+				out, NULL, 1, 2 * gridsize, flags);
+		}
+	}
+}
+
+void* create_fft_plan(int dim, int* lengths, int howmany,
+	int precision, int domain, int direction, double scale) {
+
+	fftw_backend_plan_t* p = (fftw_backend_plan_t*) malloc(sizeof(fftw_backend_plan_t));
+	CHECK_ALLOCATION(p);
+	p->precision = precision;
+	p->domain = domain;
+	p->direction = direction;
+	p->scale = scale;
+	long gridsize = 1;
+	for (int i = 0; i < dim; i++) {
+		gridsize *= lengths[i];
+	}
+	long halfsize = gridsize / lengths[dim-1] * (lengths[dim-1] / 2 + 1);
+	p->out_stride = 0;
+	p->out_grid = 0;
+	p->stride = 0;
+	if (domain == FFT_COMPLEX) {
+		p->out_size = 2 * gridsize * howmany;
+	} else if (direction == FFT_FORWARD) {
+		p->out_size = 2 * halfsize * howmany;
+	} else {
+		p->out_size = 2 * gridsize * howmany;
+		p->out_stride = 2 * gridsize;
+		p->out_grid = gridsize;
+	}
+
+	// plan on scratch arrays, since planning overwrites them
+	size_t real_size = precision == FFT_SINGLE ? sizeof(float) : sizeof(double);
+	size_t in_size = (domain == FFT_REAL && direction == FFT_BACKWARD ? 2 * halfsize
+		: 2 * gridsize) * howmany * real_size;
+	size_t out_size = (domain == FFT_REAL && direction == FFT_FORWARD ? 2 * halfsize
+		: 2 * gridsize) * howmany * real_size;
+	void* in = backend_malloc(in_size, 64);
+	void* out = domain == FFT_COMPLEX ? in : backend_malloc(out_size, 64);
+	CHECK_ALLOCATION(in);
+	CHECK_ALLOCATION(out);
+	p->aligned = make_fftw_plan(p, dim, lengths, howmany, in, out, FFTW_MEASURE);
+	p->unaligned = make_fftw_plan(p, dim, lengths, howmany, in, out,
+		FFTW_ESTIMATE | FFTW_UNALIGNED);
+	if (out != in) {
+		backend_free(out);
+	}
+	backend_free(in);
+	if (p->aligned == NULL || p->unaligned == NULL) {
+		CHECK_STATUS(-1);
+	}
+	return p;
+}
+
+static void* make_strided_fftw_plan(fftw_backend_plan_t* p, void* x, unsigned flags) {
+	int sign = p->direction == FFT_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD;
+	// the sets of transforms are the second dimension of the batch
+	if (p->precision == FFT_SINGLE) {
+		fftwf_iodim dim = {p->length, p->stride, p->stride};
+		fftwf_iodim loops[2] = {{p->howmany, p->distance, p->distance},
+			{p->batch, p->batch_distance, p->batch_distance}};
+		return fftwf_plan_guru_dft(1, &dim, 2, loops, x, x, sign, flags);
+	} else {
+		fftw_iodim dim = {p->length, p->stride, p->stride};
+		fftw_iodim loops[2] = {{p->howmany, p->distance, p->distance},
+			{p->batch, p->batch_distance, p->batch_distance}};
+		return fftw_plan_guru_dft(1, &dim, 2, loops, x, x, sign, flags);
+	}
+}
+
+void* create_strided_fft_plan(int length, int howmany, int stride, int distance,
+	int batch, int batch_distance, int precision, int direction, double scale) {
+
+	fftw_backend_plan_t* p = (fftw_backend_plan_t*) malloc(sizeof(fftw_backend_plan_t));
+	CHECK_ALLOCATION(p);
+	p->precision = precision;
+	p->domain = FFT_COMPLEX;
+	p->direction = direction;
+	p->scale = scale;
+	p->length = length;
+	p->howmany = howmany;
+	p->stride = stride;
+	p->distance = distance;
+	p->batch = batch;
+	p->batch_distance = batch_distance;
+	// last element touched by the plan, plus one
+	long extent = (long) (length - 1) * stride + (long) (howmany - 1) * distance
+		+ (long) (batch - 1) * batch_distance + 1;
+	p->out_size = 2 * extent;
+	p->out_stride = 0;
+	p->out_grid = 0;
+
+	size_t real_size = precision == FFT_SINGLE ? sizeof(float) : sizeof(double);
+	void* x = backend_malloc(2 * extent * real_size, 64);
+	CHECK_ALLOCATION(x);
+	p->aligned = make_strided_fftw_plan(p, x, FFTW_MEASURE);
+	p->unaligned = make_strided_fftw_plan(p, x, FFTW_ESTIMATE | FFTW_UNALIGNED);
+	backend_free(x);
+	if (p->aligned == NULL || p->unaligned == NULL) {
+		CHECK_STATUS(-1);
+	}
+	return p;
+}
+
+/*
+Scales the output of a strided plan, which does not cover
+a contiguous block of memory.
+*/
+static void scale_strided_output(fftw_backend_plan_t* p, void* output) {
+	for (long u = 0; u < p->batch; u++) {
+		for (long t = 0; t < p->howmany; t++) {
+			for (long i = 0; i < p->length; i++) {
+				long ind = u * p->batch_distance + t * p->distance + i * p->stride;
+				if (p->precision == FFT_SINGLE) {
+					((float complex*) output)[ind] *= (float) p->scale;
+				} else {
+					((double complex*) output)[ind] *= p->scale;
+				}
+			}
+		}
+	}
+}
+
+void execute_fft_plan(void* plan, void* input, void* output) {
+	fftw_backend_plan_t* p = (fftw_backend_plan_t*) plan;
+	int aligned;
+	if (p->precision == FFT_SINGLE) {
+		aligned = fftwf_alignment_of((float*) input) == 0
+			&& fftwf_alignment_of((float*) output) == 0;
+	} else {
+		aligned = fftw_alignment_of((double*) input) == 0
+			&& fftw_alignment_of((double*) output) == 0;
+	}
+	void* fplan = aligned ? p->aligned : p->unaligned;
+	if (p->precision == FFT_SINGLE) {
+		if (p->domain == FFT_COMPLEX) {
+			fftwf_execute_dft(fplan, input, output);
+		} else if (p->direction == FFT_FORWARD) {
+			fftwf_execute_dft_r2c(fplan, input, output);
+		} else {
+			fftwf_execute_dft_c2r(fplan, input, output);
+		}
+	} else {
+		if (p->domain == FFT_COMPLEX) {
+			fftw_execute_dft(fplan, input, output);
+		} else if (p->direction == FFT_FORWARD) {
+			fftw_execute_dft_r2c(fplan, input, output);
+		} else {
+			fftw_execute_dft_c2r(fplan, input, output);
+		}
+	}
+	if (p->scale == 1) {
+		return;
+	} else if (p->stride > 0) {
+		scale_strided_output(p, output);
+		return;
+	}
+	// complex-to-real output only fills the first half of each grid
+	long step = p->out_stride > 0 ? p->out_stride : p->out_size;
+	long count = p->out_stride > 0 ? p->out_grid : p->out_size;
+	for (long start = 0; start < p->out_size; start += step) {
+		if (p->precision == FFT_SINGLE) {
+			float* vals = (float*) output + start;
+			float scale = (float) p->scale;
+			for (long i = 0; i < count; i++) {
+				vals[i] *= scale;
+			}
+		} else {
+			double* vals = (double*) output + start;
+			for (long i = 0; i < count; i++) {
+				vals[i] *= p->scale;
+			}
+		}
+	}
+}
+
+void destroy_fft_plan(void* plan) {
+	fftw_backend_plan_t* p = (fftw_backend_plan_t*) plan;
+	if (p->precision == FFT_SINGLE) {
+		fftwf_destroy_plan(p->aligned);
+		fftwf_destroy_plan(p->unaligned);
+	} else {
+		fftw_destroy_plan(p->aligned);
+		fftw_destroy_plan(p->unaligned);
+	}
+	free(p);
+}
+
+#else
+
+/*
+A committed DFTI descriptor, along with its domain, which determines
+how it is executed.
+*/
+typedef struct dfti_backend_plan {
+	int domain;
+	int direction;
+	int batch; ///< number of sets of transforms of a strided plan, 1 for other plans
+	long batch_bytes; ///< bytes between the sets of a strided plan
+	DFTI_DESCRIPTOR_HANDLE handle;
+} dfti_backend_plan_t;
+
+const char* fft_backend_name(void) {
+	return "mkl";
+}
+
+const char* fft_error_message(int status) {
+	return DftiErrorMessage(status);
+}
+
+void* create_fft_plan(int dim, int* lengths, int howmany,
+	int precision, int domain, int direction, double scale) {
+
+	dfti_backend_plan_t* plan = (dfti_backend_plan_t*) malloc(sizeof(dfti_backend_plan_t));
+	CHECK_ALLOCATION(plan);
+	plan->domain = domain;
+	plan->direction = direction;
+	plan->batch = 1;
+	plan->batch_bytes = 0;
+	DFTI_DESCRIPTOR_HANDLE handle = 0;
+	MKL_LONG n[3];
+	for (int i = 0; i < 3; i++) {
+		n[i] = i < dim ? lengths[i] : 1;
+	}
+	int dfti_precision = precision == FFT_SINGLE ? DFTI_SINGLE : DFTI_DOUBLE;
+	int dfti_domain = domain == FFT_REAL ? DFTI_REAL : DFTI_COMPLEX;
+	MKL_LONG status;
+	if (dim == 1) {
+		status = DftiCreateDescriptor(&handle, dfti_precision, dfti_domain, 1, n[0]);
+	} else {
+		status = DftiCreateDescriptor(&handle, dfti_precision, dfti_domain, dim, n);
+	}
+	CHECK_STATUS(status);
+	if (domain == FFT_REAL) {
+		// out of place between real grids and conjugate-even grids
+		// that hold the first n2/2+1 points along the last axis
+		MKL_LONG n2h = n[2] / 2 + 1;
+		MKL_LONG real_strides[4] = {0, n[1] * n[2], n[2], 1};
+		MKL_LONG cce_strides[4] = {0, n[1] * n2h, n2h, 1};
+		// each real grid sits in the memory of a complex grid
+		MKL_LONG real_distance = 2 * n[0] * n[1] * n[2];
+		MKL_LONG cce_distance = n[0] * n[1] * n2h;
+		int fwd = direction == FFT_FORWARD;
+		status = DftiSetValue(handle, DFTI_CONJUGATE_EVEN_STORAGE, DFTI_COMPLEX_COMPLEX);
+		CHECK_STATUS(status);
+		status = DftiSetValue(handle, DFTI_PLACEMENT, DFTI_NOT_INPLACE);
+		CHECK_STATUS(status);
+		status = DftiSetValue(handle, DFTI_INPUT_STRIDES, fwd ? real_strides : cce_strides);
+		CHECK_STATUS(status);
+		status = DftiSetValue(handle, DFTI_OUTPUT_STRIDES, fwd ? cce_strides : real_strides);
+		CHECK_STATUS(status);
+		if (howmany > 1) {
+			status = DftiSetValue(handle, DFTI_NUMBER_OF_TRANSFORMS, (MKL_LONG) howmany);
+			CHECK_STATUS(status);
+			status = DftiSetValue(handle, DFTI_INPUT_DISTANCE,
+				fwd ? real_distance : cce_distance);
+			CHECK_STATUS(status);
+			status = DftiSetValue(handle, DFTI_OUTPUT_DISTANCE,
+				fwd ? cce_distance : real_distance);
+			CHECK_STATUS(status);
+		}
+	} else if (howmany > 1) {
+		// the transforms are stored one after another
+		MKL_LONG distance = n[0] * n[1] * n[2];
+		status = DftiSetValue(handle, DFTI_NUMBER_OF_TRANSFORMS, (MKL_LONG) howmany);
+		CHECK_STATUS(status);
+		status = DftiSetValue(handle, DFTI_INPUT_DISTANCE, distance);
+		CHECK_STATUS(status);
+		status = DftiSetValue(handle, DFTI_OUTPUT_DISTANCE, distance);
+		CHECK_STATUS(status);
+	}
+	if (scale != 1) {
+		status = DftiSetValue(handle, direction == FFT_FORWARD ?
+			DFTI_FORWARD_SCALE : DFTI_BACKWARD_SCALE, scale);
+		CHECK_STATUS(status);
+	}
+	status = DftiCommitDescriptor(handle);
+	CHECK_STATUS(status);
+	plan->handle = handle;
+	return plan;
+}
+
+void* create_strided_fft_plan(int length, int howmany, int stride, int distance,
+	int batch, int batch_distance, int precision, int direction, double scale) {
+
+	dfti_backend_plan_t* plan = (dfti_backend_plan_t*) malloc(sizeof(dfti_backend_plan_t));
+	CHECK_ALLOCATION(plan);
+	plan->domain = FFT_COMPLEX;
+	plan->direction = direction;
+	plan->batch = batch;
+	plan->batch_bytes = (long) batch_distance * (precision == FFT_SINGLE ?
+		sizeof(float complex) : sizeof(double complex));
+	DFTI_DESCRIPTOR_HANDLE handle = 0;
+	int dfti_precision = precision == FFT_SINGLE ? DFTI_SINGLE : DFTI_DOUBLE;
+	MKL_LONG status = DftiCreateDescriptor(&handle, dfti_precision, DFTI_COMPLEX,
+		1, (MKL_LONG) length);
+	CHECK_STATUS(status);
+	MKL_LONG strides[2] = {0, stride};
+	status = DftiSetValue(handle, DFTI_INPUT_STRIDES, strides);
+	CHECK_STATUS(status);
+	status = DftiSetValue(handle, DFTI_OUTPUT_STRIDES, strides);
+	CHECK_STATUS(status);
+	status = DftiSetValue(handle, DFTI_NUMBER_OF_TRANSFORMS, (MKL_LONG) howmany);
+	CHECK_STATUS(status);
+	status = DftiSetValue(handle, DFTI_INPUT_DISTANCE, (MKL_LONG) distance);
+	CHECK_STATUS(status);
+	status = DftiSetValue(handle, DFTI_OUTPUT_DISTANCE, (MKL_LONG) distance);
+	CHECK_STATUS(status);
+	if (scale != 1) {
+		status = DftiSetValue(handle, direction == FFT_FORWARD ?
+			DFTI_FORWARD_SCALE : DFTI_BACKWARD_SCALE, scale);
+		CHECK_STATUS(status);
+	}
+	status = DftiCommitDescriptor(handle);
+	CHECK_STATUS(status);
+	plan->handle = handle;
+	return plan;
+}
+
+void execute_fft_plan(void* plan, void* input, void* output) {
+	dfti_backend_plan_t* p = (dfti_backend_plan_t*) plan;
+	MKL_LONG status;
+	if (p->domain == FFT_REAL) {
+		status = p->direction == FFT_FORWARD ? DftiComputeForward(p->handle, input, output)
+			: DftiComputeBackward(p->handle, input, output);
+		CHECK_STATUS(status);
+		return;
+	}
+	for (int u = 0; u < p->batch; u++) {
+		void* set = (char*) input + u * p->batch_bytes;
+		status = p->direction == FFT_FORWARD ? DftiComputeForward(p->handle, set)
+			: DftiComputeBackward(p->handle, set);
+		CHECK_STATUS(status);
+	}
+}
+
+void destroy_fft_plan(void* plan) {
+	dfti_backend_plan_t* p = (dfti_backend_plan_t*) plan;
+	DftiFreeDescriptor(&(p->handle));
+	free(p);
+}
+
+#endif
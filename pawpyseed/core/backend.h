@@ -0,0 +1,139 @@
+/** \file
+Interface between pawpyseed and the libraries that perform its FFTs,
+linear algebra and aligned memory allocation. The backend is chosen
+when the C extension is compiled (see site.cfg.default):
+
+FFTs use the Intel MKL DFTI interface by default, or FFTW3 if
+PAWPY_FFTW is defined.
+
+BLAS routines are called through the standard CBLAS interface, which
+is taken from MKL by default or from OpenBLAS if PAWPY_OPENBLAS is defined.
+
+Aligned memory comes from MKL if it is linked and from the C library
+otherwise. The rest of pawpyseed only calls the routines in this file,
+so it does not depend on which libraries are linked.
+*/
+
+#ifndef BACKEND_H
+#define BACKEND_H
+#include <stddef.h>
+#include <complex.h>
+#if defined(PAWPY_OPENBLAS) && !defined(PAWPY_FFTW)
+#error "MKL FFTs must be used with MKL BLAS, since both provide CBLAS"
+#endif
+#if defined(PAWPY_OPENBLAS)
+#include <cblas.h>
+#else
+#include <mkl_cblas.h>
+#endif
+
+#define FFT_BACKWARD 0
+#define FFT_FORWARD 1
+#define FFT_DOUBLE 0
+#define FFT_SINGLE 1
+#define FFT_COMPLEX 0
+#define FFT_REAL 1
+
+/**
+Allocates size bytes aligned to alignment bytes, or returns NULL if the
+allocation fails. Memory from backend_malloc and backend_calloc is
+freed with backend_free.
+*/
+void* backend_malloc(size_t size, int alignment);
+
+/**
+Same as backend_malloc for num elements of size bytes, set to zero.
+*/
+void* backend_calloc(size_t num, size_t size, int alignment);
+
+/**
+Frees memory allocated by backend_malloc or backend_calloc.
+*/
+void backend_free(void* ptr);
+
+/**
+Releases the internal buffers the backend libraries keep between calls.
+This frees the buffers of every thread, so while other threads may be
+in backend calls it is skipped and done later (see
+backend_defer_buffer_frees).
+*/
+void backend_free_buffers(void);
+
+/**
+If defer is nonzero, makes backend_free_buffers do nothing until a
+matching call with defer equal to 0, which frees the buffers if
+backend_free_buffers was called in the meantime. Used while work runs
+on more than one thread that calls into the backend at once.
+*/
+void backend_defer_buffer_frees(int defer);
+
+/**
+Sets the number of threads used by the OpenMP parallel regions and,
+for MKL, by the backend libraries for calls made from the calling
+thread only, e.g. to keep a background thread from starting as many
+threads as the main thread.
+*/
+void backend_set_thread_count(int num_threads);
+
+/**
+Returns the number of threads the parallel regions of the calling
+thread use.
+*/
+int backend_get_thread_count(void);
+
+/** Returns the name of the FFT backend ("mkl" or "fftw"). */
+const char* fft_backend_name(void);
+
+/** Returns the name of the BLAS backend ("mkl" or "openblas"). */
+const char* blas_backend_name(void);
+
+/**
+Returns a message describing a nonzero status returned by the FFT backend.
+*/
+const char* fft_error_message(int status);
+
+/**
+Creates a plan for howmany transforms of dimension dim (1-3) with the
+given lengths, with precision FFT_DOUBLE or FFT_SINGLE, direction
+FFT_BACKWARD (sign +1) or FFT_FORWARD (sign -1), and every output
+multiplied by scale.
+If domain is FFT_COMPLEX, the transforms are in place and stored one
+after another. If domain is FFT_REAL (dim must be 3), the transforms
+are out of place between real grids and conjugate-even complex grids
+of lengths[0] x lengths[1] x (lengths[2]/2+1) points, stored one after
+another, while each real grid is stored in the space of a complex grid,
+i.e. the real grids are 2*lengths[0]*lengths[1]*lengths[2] numbers apart.
+Planning is not thread safe (see get_fft_plan in linalg.h, which
+caches plans), but a plan can be executed by several threads at once.
+*/
+void* create_fft_plan(int dim, int* lengths, int howmany,
+	int precision, int domain, int direction, double scale);
+
+/**
+Creates a plan for howmany in place complex 1D transforms of the given
+length, whose elements are stride numbers apart, with each transform
+starting distance numbers after the previous one. The plan runs batch
+such sets of transforms, each starting batch_distance numbers after
+the previous one. The other arguments are as in create_fft_plan.
+This is used to transform one axis of a batch of 3D grids at a time
+(see fft3d in linalg.h). FFTW runs all the transforms with one plan,
+while MKL, whose descriptors have only one batch dimension, runs the
+sets one after another.
+*/
+void* create_strided_fft_plan(int length, int howmany, int stride, int distance,
+	int batch, int batch_distance, int precision, int direction, double scale);
+
+/**
+Executes plan on input, writing the result to output. input must equal
+output for FFT_COMPLEX plans and must not for FFT_REAL plans. The arrays should come
+from backend_malloc (or be whole grids into such an array), since
+some backends require the alignment the plan was made for.
+*/
+void execute_fft_plan(void* plan, void* input, void* output);
+
+/**
+Frees a plan made by create_fft_plan or create_strided_fft_plan.
+*/
+void destroy_fft_plan(void* plan);
+
+#endif
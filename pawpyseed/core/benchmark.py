@@ -0,0 +1,181 @@
+## @package pawpyseed.core.benchmark
+# Times the FFT and BLAS heavy routines of pawpyseed so that builds
+# with different backends (see backend.h) can be compared on the same inputs.
+#
+# Run once with each build, then compare the results:
+#	python -m pawpyseed.core.benchmark run <vasp dir> -o mkl.json
+#	python -m pawpyseed.core.benchmark run <vasp dir> -o fftw.json
+#	python -m pawpyseed.core.benchmark compare mkl.json fftw.json
+
+import argparse
+import json
+import os
+import platform
+import time
+
+import numpy as np
+
+from pawpyseed.core import pawpyc
+
+# relative difference in checksums above which two runs are
+# reported as having computed different results
+CHECKSUM_TOL = 1e-6
+
+def _checksum(res):
+	return float(np.sum(np.abs(res)))
+
+def _time(func, repeats):
+	"""
+	Returns the shortest time of repeats calls to func (so that
+	planning and caching in the first call are not counted) and
+	the checksum of the result of the last call.
+	"""
+	best = None
+	for i in range(repeats):
+		start = time.perf_counter()
+		res = func()
+		elapsed = time.perf_counter() - start
+		best = elapsed if best is None else min(best, elapsed)
+	return best, _checksum(res)
+
+def _sbt():
+	# a 1s-like radial function on a logarithmic grid
+	r = np.exp(np.linspace(np.log(1e-4), np.log(20.0), 2048))
+	f = r * np.exp(-r)
+	return [pawpyc.spherical_bessel_transform(1e4, l, r, f)[1] for l in range(4)]
+
+def run_benchmarks(directory, repeats = 3, nbands = 8):
+	"""
+	Times the kernels of pawpyseed that use the FFT and BLAS
+	backends on the VASP calculation in directory.
+
+	Arguments:
+		directory (str): VASP output directory, as used by
+			Wavefunction.from_directory
+		repeats (int, 3): number of times each kernel is run.
+			The shortest time is reported.
+		nbands (int, 8): number of bands transformed to real space
+			in the 'states' kernel
+
+	Returns:
+		dict with the backends ('backends'), machine information
+		('machine') and, for each kernel, its time in seconds and
+		a checksum of its result ('results')
+	"""
+	from pawpyseed.core.wavefunction import Wavefunction
+	from pawpyseed.core.projector import Projector
+
+	results = {}
+	def record(name, t, checksum):
+		results[name] = {'time': t, 'checksum': checksum}
+
+	record('sbt', *_time(_sbt, repeats))
+
+	# the projector setup can only run once per Wavefunction
+	best = None
+	for i in range(repeats):
+		wf = Wavefunction.from_directory(directory, False)
+		start = time.perf_counter()
+		wf.check_c_projectors()
+		elapsed = time.perf_counter() - start
+		best = elapsed if best is None else min(best, elapsed)
+	record('projector_setup', best, 0.0)
+
+	bands = range(min(nbands, wf.nband))
+	record('states', *_time(lambda: [wf.get_state_realspace(b, 0, 0)
+		for b in bands], repeats))
+	record('density', *_time(wf.get_realspace_density, repeats))
+	record('pseudoprojection', *_time(lambda: wf.pseudoprojection_all(wf),
+		repeats))
+	pr = Projector(wf, wf, method = "aug_recip")
+	record('aug_recip_overlaps', *_time(pr.all_band_projection, repeats))
+	pawpyc.free_fft_plans()
+
+	return {
+		'backends': pawpyc.get_backends(),
+		'machine': {
+			'node': platform.node(),
+			'processor': platform.processor(),
+			'cpus': os.cpu_count(),
+			'omp_num_threads': os.environ.get('OMP_NUM_THREADS'),
+		},
+		'directory': os.path.abspath(directory),
+		'repeats': repeats,
+		'results': results,
+	}
+
+def compare_results(runs, labels):
+	"""
+	Returns a table (as a string) of the time of each kernel in each
+	of the runs (as returned by run_benchmarks), marking the fastest
+	run with a *, followed by warnings for runs whose checksums do not
+	match the first run.
+	"""
+	kernels = []
+	for run in runs:
+		for name in run['results']:
+			if name not in kernels:
+				kernels.append(name)
+	width = max([len(l) for l in labels] + [10])
+	lines = ['%-20s' % 'kernel' + ''.join([' %*s' % (width, l) for l in labels])]
+	warnings = []
+	for name in kernels:
+		times = [run['results'].get(name, {}).get('time') for run in runs]
+		valid = [t for t in times if t is not None]
+		fastest = min(valid) if valid else None
+		line = '%-20s' % name
+		for t in times:
+			if t is None:
+				line += ' %*s' % (width, '-')
+			else:
+				line += ' %*s' % (width, '%.4f%s' % (t, '*' if t == fastest else ' '))
+		lines.append(line)
+		ref = runs[0]['results'].get(name, {}).get('checksum')
+		for run, label in zip(runs[1:], labels[1:]):
+			other = run['results'].get(name, {}).get('checksum')
+			if ref is None or other is None:
+				continue
+			if abs(other - ref) > CHECKSUM_TOL * max(abs(ref), 1e-300):
+				warnings.append('WARNING: %s checksum of %s (%.10e) differs from %s (%.10e)'
+					% (name, label, other, labels[0], ref))
+	return '\n'.join(lines + warnings)
+
+def main():
+	parser = argparse.ArgumentParser(description="Benchmark the FFT and BLAS "
+		"backends pawpyseed was built with")
+	subparsers = parser.add_subparsers(dest='command')
+
+	parser_run = subparsers.add_parser('run', help="time the kernels with the current build")
+	parser_run.add_argument('directory', help="VASP output directory to use as input")
+	parser_run.add_argument('-o', '--output', default=None,
+		help="JSON file for the results (default: <fft>_<blas>.json)")
+	parser_run.add_argument('-r', '--repeats', default=3, type=int)
+	parser_run.add_argument('-n', '--nbands', default=8, type=int)
+
+	parser_compare = subparsers.add_parser('compare',
+		help="compare the results of runs with different builds")
+	parser_compare.add_argument('files', nargs='+', help="JSON files written by run")
+
+	args = parser.parse_args()
+	if args.command == 'run':
+		res = run_benchmarks(args.directory, args.repeats, args.nbands)
+		output = args.output
+		if output is None:
+			output = '%s_%s.json' % (res['backends']['fft'], res['backends']['blas'])
+		with open(output, 'w') as f:
+			json.dump(res, f, indent=1)
+		print(compare_results([res], [output]))
+	elif args.command == 'compare':
+		runs = []
+		for fname in args.files:
+			with open(fname, 'r') as f:
+				runs.append(json.load(f))
+		labels = ['%s/%s' % (r['backends']['fft'], r['backends']['blas']) for r in runs]
+		if len(set(labels)) < len(labels):
+			labels = args.files
+		print(compare_results(runs, labels))
+	else:
+		parser.print_help()
+
+if __name__ == '__main__':
+	main()
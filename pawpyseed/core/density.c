@@ -4,25 +4,27 @@
 #include <math.h>
 #include <omp.h>
 #include <time.h>
-#include <mkl.h>
-#include <mkl_types.h>
+#include "backend.h"
 #include "utils.h"
 #include "density.h"
 #include "linalg.h"
 
 #define PI 3.14159265359
 
+static void realspace_state_from_pseudo(double complex* x, int BAND_NUM, int KPOINT_NUM,
+	pswf_t* wf, int* fftg, int* labels, double* coords);
+
 // THE FOLLOWING TWO FUNCTIONS ARE NOT YET IMPLEMENTED
 /*
 double* ncl_ae_state_density(int BAND_NUM, pswf_t* wf, int* fftg, int* labels, double* coords) {
 	int gridsize = fftg[0] * fftg[1] * fftg[2];
-    double* P = mkl_calloc(gridsize, sizeof(double), 64);
+    double* P = backend_calloc(gridsize, sizeof(double), 64);
     int spin_mult = 2 / wf->nspin;
     double complex* x = realspace_state(b, k, wf, fftg, labels, coords);
     for (int i = 0; i < gridsize; i++) {
         P[i] += creal(x[i] * conj(x[i]));
     }
-    mkl_free(x);
+    backend_free(x);
     return P;	
 }
 */
@@ -31,14 +33,14 @@ void ae_state_density(double* P, int BAND_NUM, int KPOINT_NUM, pswf_t* wf,
 	int* fftg, int* labels, double* coords) {
 
 	int gridsize = fftg[0] * fftg[1] * fftg[2];
-	//double* P = mkl_calloc(gridsize, sizeof(double), 64);
-	double complex* x = mkl_malloc(gridsize * sizeof(double complex), 64);
+	//double* P = backend_calloc(gridsize, sizeof(double), 64);
+	double complex* x = backend_malloc(gridsize * sizeof(double complex), 64);
 	realspace_state(x, BAND_NUM, KPOINT_NUM,
 		wf, fftg, labels, coords);
 	for (int i = 0; i < gridsize; i++) {
 		P[i] += creal(x[i] * conj(x[i]));
 	}
-	mkl_free(x);
+	backend_free(x);
 }
 
 /*
@@ -48,10 +50,12 @@ void ae_state_density(double* P, int BAND_NUM, int KPOINT_NUM, pswf_t* wf,
 	ppot_t* pps = wf->pps;
 	int num_sites = wf->num_sites;
 
-	double complex* x = (double complex*) mkl_malloc(fftg[0]*fftg[1]*fftg[2]*sizeof(double complex), 64);
+	double complex* x = (double complex*) backend_malloc(fftg[0]*fftg[1]*fftg[2]*sizeof(double complex), 64);
+	band_t* band = wf->kpts[KPOINT_NUM]->bands[BAND_NUM];
 	fft3d(x, wf->G_bounds, wf->lattice, wf->kpts[KPOINT_NUM]->k,
-		wf->kpts[KPOINT_NUM]->Gs, wf->kpts[KPOINT_NUM]->bands[BAND_NUM]->Cs,
-		wf->kpts[KPOINT_NUM]->bands[BAND_NUM]->num_waves, fftg);
+		wf->kpts[KPOINT_NUM]->Gs, acquire_coeffs(band),
+		band->num_waves, fftg);
+	release_coeffs(band);
 	//printf("FINISH FT\n");
 	double* lattice = wf->lattice;
 	double vol = determinant(lattice);
@@ -151,37 +155,60 @@ void ae_state_density(double* P, int BAND_NUM, int KPOINT_NUM, pswf_t* wf,
 			}
 		}
 	}
-	mkl_free(x);
+	backend_free(x);
 }
 */
 
 void ae_chg_density(double* P, pswf_t* wf, int* fftg, int* labels, double* coords) {
 
-	int gridsize = fftg[0] * fftg[1] * fftg[2];
-	double complex* x = mkl_malloc(gridsize * sizeof(double complex), 64);
-	//double* P = mkl_calloc(gridsize, sizeof(double), 64);
+	long gridsize = fftg[0] * fftg[1] * fftg[2];
+	// the occupied bands of a k-point are transformed in batches
+	int batch = fft_batch_size(fftg, wf->nband, 1);
+	double complex* x = backend_malloc(batch * gridsize * sizeof(double complex), 64);
+	band_t** bands = (band_t**) malloc(batch * sizeof(band_t*));
+	int* band_nums = (int*) malloc(batch * sizeof(int));
+	CHECK_ALLOCATION(x);
+	CHECK_ALLOCATION(bands);
+	CHECK_ALLOCATION(band_nums);
+	//double* P = backend_calloc(gridsize, sizeof(double), 64);
 	int spin_mult = 2 / wf->nspin;
 	for (int k = 0; k < wf->nwk * wf->nspin; k++) {
 		//printf("KLOOP %d\n", k);
-		for (int b = 0; b < wf->nband; b++) {
-			if (wf->kpts[k]->bands[b]->occ > 0) {
-				realspace_state(x, b, k, wf, fftg, labels, coords);
+		kpoint_t* kpt = wf->kpts[k];
+		int b = 0;
+		while (b < wf->nband) {
+			int nb = 0;
+			for (; b < wf->nband && nb < batch; b++) {
+				if (kpt->bands[b]->occ > 0) {
+					bands[nb] = kpt->bands[b];
+					band_nums[nb++] = b;
+				}
+			}
+			if (nb == 0) {
+				continue;
+			}
+			fft3d_bands(x, wf->lattice, kpt, bands, nb, fftg);
+			for (int n = 0; n < nb; n++) {
+				double complex* xn = x + n * gridsize;
+				realspace_state_from_pseudo(xn, band_nums[n], k, wf, fftg, labels, coords);
 				for (int i = 0; i < gridsize; i++) {
-					P[i] += creal(x[i] * conj(x[i])) * wf->kpts[k]->weight
-							* wf->kpts[k]->bands[b]->occ * spin_mult;
+					P[i] += creal(xn[i] * conj(xn[i])) * kpt->weight
+							* bands[n]->occ * spin_mult;
 				}
 			}
 		}
 	}
-	mkl_free(x);
-	mkl_free_buffers();
+	free(bands);
+	free(band_nums);
+	backend_free(x);
+	backend_free_buffers();
 }
 
 void ncl_ae_chg_density(double* P, pswf_t* wf, int* fftg, int* labels, double* coords) {
 
 	int gridsize = fftg[0] * fftg[1] * fftg[2];
-	double complex* x = mkl_malloc(2 * gridsize * sizeof(double complex), 64);
-	//double* P = mkl_calloc(gridsize, sizeof(double), 64);
+	double complex* x = backend_malloc(2 * gridsize * sizeof(double complex), 64);
+	//double* P = backend_calloc(gridsize, sizeof(double), 64);
 	int spin_mult = 1;
 	for (int k = 0; k < wf->nwk * wf->nspin; k++) {
 		//printf("KLOOP %d\n", k);
@@ -197,8 +224,8 @@ void ncl_ae_chg_density(double* P, pswf_t* wf, int* fftg, int* labels, double* c
 			}
 		}
 	}
-	mkl_free(x);
-	mkl_free_buffers();
+	backend_free(x);
+	backend_free_buffers();
 }
 
 void project_realspace_state(double complex* projs, int BAND_NUM, pswf_t* wf, pswf_t* wf_R,
@@ -210,8 +237,8 @@ void project_realspace_state(double complex* projs, int BAND_NUM, pswf_t* wf, ps
 	int gridsize = fftg[0]*fftg[1]*fftg[2];
 	//double* projs = (double*) malloc(2*nband*nwk*nspin*sizeof(double));
 	double vol = determinant(wf->lattice);
-	double complex* state = mkl_malloc(gridsize * sizeof(double complex), 64);
-	double complex* state_R = mkl_malloc(gridsize * sizeof(double complex), 64);
+	double complex* state = backend_malloc(gridsize * sizeof(double complex), 64);
+	double complex* state_R = backend_malloc(gridsize * sizeof(double complex), 64);
 
 	for (int k = 0; k < nwk * nspin; k++) {
 		double complex overlap = 0;
@@ -223,20 +250,19 @@ void project_realspace_state(double complex* projs, int BAND_NUM, pswf_t* wf, ps
 			projs[b*nwk*nspin + k] = overlap;
 		}
 	}
-	mkl_free(state_R);
-	mkl_free(state);
+	backend_free(state_R);
+	backend_free(state);
 }
 
-void realspace_state(double complex* x, int BAND_NUM, int KPOINT_NUM,
+/*
+Turns the pseudo wavefunction x of band BAND_NUM at k-point KPOINT_NUM,
+as transformed by fft3d, into the all electron wavefunction
+(see realspace_state).
+*/
+static void realspace_state_from_pseudo(double complex* x, int BAND_NUM, int KPOINT_NUM,
 	pswf_t* wf, int* fftg, int* labels, double* coords) {
 
 	ppot_t* pps = wf->pps;
-	//double complex* x = mkl_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
-	//printf("START FT\n");
-	fft3d(x, wf->G_bounds, wf->lattice, wf->kpts[KPOINT_NUM]->k,
-		wf->kpts[KPOINT_NUM]->Gs, wf->kpts[KPOINT_NUM]->bands[BAND_NUM]->Cs,
-		wf->kpts[KPOINT_NUM]->bands[BAND_NUM]->num_waves, fftg);
-	//printf("FINISH FT\n");
 	double* lattice = wf->lattice;
 	double vol = determinant(lattice);
 	for (int i = 0; i < fftg[0]; i++) {
@@ -317,6 +343,17 @@ void realspace_state(double complex* x, int BAND_NUM, int KPOINT_NUM,
 	}
 }
 
+void realspace_state(double complex* x, int BAND_NUM, int KPOINT_NUM,
+	pswf_t* wf, int* fftg, int* labels, double* coords) {
+
+	//double complex* x = backend_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
+	//printf("START FT\n");
+	kpoint_t* kpt = wf->kpts[KPOINT_NUM];
+	fft3d_bands(x, wf->lattice, kpt, kpt->bands + BAND_NUM, 1, fftg);
+	//printf("FINISH FT\n");
+	realspace_state_from_pseudo(x, BAND_NUM, KPOINT_NUM, wf, fftg, labels, coords);
+}
+
 void remove_phase(double complex* x, int KPOINT_NUM, pswf_t* wf, int* fftg) {
 	for (int i = 0; i < fftg[0]; i++) {
 		double frac[3] = {0,0,0};
@@ -337,15 +374,18 @@ void ncl_realspace_state(double complex* x, int BAND_NUM, int KPOINT_NUM,
 	pswf_t* wf, int* fftg, int* labels, double* coords) {
 
 	ppot_t* pps = wf->pps;
-	double complex* xup = x;//mkl_calloc(2*fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
+	double complex* xup = x;//backend_calloc(2*fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
 	double complex* xdown = x + fftg[0]*fftg[1]*fftg[2];
-	int num_waves = wf->kpts[KPOINT_NUM]->bands[BAND_NUM]->num_waves / 2;
+	band_t* band = wf->kpts[KPOINT_NUM]->bands[BAND_NUM];
+	int num_waves = band->num_waves / 2;
+	float complex* Cs = acquire_coeffs(band);
 	fft3d(xup, wf->G_bounds, wf->lattice, wf->kpts[KPOINT_NUM]->k,
-		wf->kpts[KPOINT_NUM]->Gs, wf->kpts[KPOINT_NUM]->bands[BAND_NUM]->Cs,
+		wf->kpts[KPOINT_NUM]->Gs, Cs,
 		num_waves, fftg);
 	fft3d(xdown, wf->G_bounds, wf->lattice, wf->kpts[KPOINT_NUM]->k,
-		wf->kpts[KPOINT_NUM]->Gs, wf->kpts[KPOINT_NUM]->bands[BAND_NUM]->Cs + num_waves,
+		wf->kpts[KPOINT_NUM]->Gs, Cs + num_waves,
 		num_waves, fftg);
+	release_coeffs(band);
 	double* lattice = wf->lattice;
 	double vol = determinant(lattice);
 	for (int i = 0; i < fftg[0]; i++) {
@@ -429,7 +469,7 @@ double* realspace_state_ri(int BAND_NUM, int KPOINT_NUM,
 
 	int gridsize = fftg[0]*fftg[1]*fftg[2];
 
-	double complex* x = mkl_malloc(gridsize * sizeof(double complex), 64);
+	double complex* x = backend_malloc(gridsize * sizeof(double complex), 64);
 	realspace_state(x, BAND_NUM, KPOINT_NUM, wf, fftg, labels, coords);
 
 	double* rpip = (double*) malloc(2 * gridsize * sizeof(double));
@@ -438,7 +478,7 @@ double* realspace_state_ri(int BAND_NUM, int KPOINT_NUM,
 		rpip[i] = creal(x[i]);
 		rpip[i+gridsize] = cimag(x[i]);
 	}
-	mkl_free(x);
+	backend_free(x);
 
 	return rpip;
 }
@@ -448,7 +488,7 @@ double* realspace_state_ncl_ri(int BAND_NUM, int KPOINT_NUM,
 
 	int gridsize = 2*fftg[0]*fftg[1]*fftg[2];
 
-	double complex* x = mkl_malloc(2 * gridsize * sizeof(double complex), 64);
+	double complex* x = backend_malloc(2 * gridsize * sizeof(double complex), 64);
 	ncl_realspace_state(x, BAND_NUM, KPOINT_NUM, wf, fftg, labels, coords);
 
 	double* rpip = (double*) malloc(2*gridsize * sizeof(double));
@@ -457,7 +497,7 @@ double* realspace_state_ncl_ri(int BAND_NUM, int KPOINT_NUM,
 		rpip[i] = creal(x[i]);
 		rpip[i+gridsize] = cimag(x[i]);
 	}
-	mkl_free(x);
+	backend_free(x);
 
 	return rpip;
 }
@@ -509,7 +549,7 @@ double* write_density_return(char* filename, pswf_t* wf,
 	int* fftg, int* labels, double* coords) {
 
 	int gridsize = fftg[0] * fftg[1] * fftg[2];
-	double* x = mkl_calloc(gridsize, sizeof(double), 64);
+	double* x = backend_calloc(gridsize, sizeof(double), 64);
 	ae_chg_density(x, wf, fftg, labels, coords);
 	double scale = determinant(wf->lattice);
 	write_volumetric(filename, x, fftg, scale);
@@ -530,5 +570,5 @@ void write_density_noreturn(char* filename, pswf_t* wf,
 	setbuf(stdout, NULL);
 
 	double* x = write_density_return(filename, wf, fftg, labels, coords);
-	mkl_free(x);
+	backend_free(x);
 }
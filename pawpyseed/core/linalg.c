@@ -4,21 +4,233 @@
 #include <math.h>
 #include <omp.h>
 #include <time.h>
-#include <mkl.h>
-#include <mkl_types.h>
 #include "utils.h"
 #include "linalg.h"
 
 #define PI 3.14159265359
+// bytes of FFT grids each thread transforms at once in batched FFTs
+#define FFT_BATCH_BYTES (1l << 25)
+
+/*
+One plan in the FFT plan cache. The cache is a linked list,
+because a run only uses a handful of different plans.
+stride is 0 for plans made by create_fft_plan.
+*/
+typedef struct fft_plan {
+	int dim;
+	int lengths[3];
+	int howmany;
+	int stride;
+	int distance;
+	int batch;
+	int batch_distance;
+	int precision;
+	int domain;
+	int direction;
+	double scale;
+	void* handle;
+	struct fft_plan* next;
+} fft_plan_t;
+
+static fft_plan_t* fft_plans = NULL;
+
+/*
+Returns the cached plan with the given parameters, creating it if needed.
+*/
+static void* cached_fft_plan(int dim, int* lengths, int howmany, int stride,
+	int distance, int batch, int batch_distance, int precision, int domain,
+	int direction, double scale) {
+	void* handle = NULL;
+	#pragma omp critical(fft_plan_cache)
+	{
+	for (fft_plan_t* plan = fft_plans; plan != NULL; plan = plan->next) {
+		int match = plan->dim == dim && plan->howmany == howmany
+			&& plan->stride == stride && plan->distance == distance
+			&& plan->batch == batch && plan->batch_distance == batch_distance
+			&& plan->precision == precision && plan->domain == domain
+			&& plan->direction == direction && plan->scale == scale;
+		for (int i = 0; match && i < dim; i++) {
+			match = plan->lengths[i] == lengths[i];
+		}
+		if (match) {
+			handle = plan->handle;
+			break;
+		}
+	}
+	if (handle == NULL) {
+		fft_plan_t* plan = (fft_plan_t*) malloc(sizeof(fft_plan_t));
+		CHECK_ALLOCATION(plan);
+		plan->dim = dim;
+		for (int i = 0; i < 3; i++) {
+			plan->lengths[i] = i < dim ? lengths[i] : 1;
+		}
+		plan->howmany = howmany;
+		plan->stride = stride;
+		plan->distance = distance;
+		plan->batch = batch;
+		plan->batch_distance = batch_distance;
+		plan->precision = precision;
+		plan->domain = domain;
+		plan->direction = direction;
+		plan->scale = scale;
+		if (stride == 0) {
+			handle = create_fft_plan(dim, lengths, howmany,
+				precision, domain, direction, scale);
+		} else {
+			handle = create_strided_fft_plan(lengths[0], howmany, stride, distance,
+				batch, batch_distance, precision, direction, scale);
+		}
+		plan->handle = handle;
+		plan->next = fft_plans;
+		fft_plans = plan;
+	}
+	}
+	return handle;
+}
+
+void* get_fft_plan(int dim, int* lengths, int howmany,
+	int precision, int domain, int direction, double scale) {
+	return cached_fft_plan(dim, lengths, howmany, 0, 0, 1, 0,
+		precision, domain, direction, scale);
+}
+
+void* get_strided_fft_plan(int length, int howmany, int stride, int distance,
+	int batch, int batch_distance, int precision, int direction, double scale) {
+	return cached_fft_plan(1, &length, howmany, stride, distance, batch,
+		batch_distance, precision, FFT_COMPLEX, direction, scale);
+}
+
+void free_fft_plans(void) {
+	#pragma omp critical(fft_plan_cache)
+	{
+	while (fft_plans != NULL) {
+		fft_plan_t* next = fft_plans->next;
+		destroy_fft_plan(fft_plans->handle);
+		free(fft_plans);
+		fft_plans = next;
+	}
+	}
+}
+
+/*
+Finds the columns of the FFT grid fftg (the lines along its last axis)
+that contain plane waves of Gs. The columns of plane i (along the first
+axis) are given as two runs of consecutive columns, since the G-vectors
+wrap around the grid: runs[4*i+1] columns starting at column runs[4*i]
+and runs[4*i+3] columns starting at column runs[4*i+2].
+Either run may be empty. The runs cover every column between the lowest
+and highest G along the second axis in the plane, which is every column
+that contains a G-vector for a sphere.
+*/
+static void fft_column_runs(int* runs, int* Gs, int num_waves, int* fftg) {
+	int n0 = fftg[0], n1 = fftg[1];
+	int* lo = (int*) malloc(2 * n0 * sizeof(int));
+	CHECK_ALLOCATION(lo);
+	int* hi = lo + n0;
+	for (int i = 0; i < n0; i++) {
+		lo[i] = n1;
+		hi[i] = -n1;
+	}
+	for (int w = 0; w < num_waves; w++) {
+		int i = (Gs[3*w+0]+n0) % n0;
+		lo[i] = min(lo[i], Gs[3*w+1]);
+		hi[i] = max(hi[i], Gs[3*w+1]);
+	}
+	for (int i = 0; i < n0; i++) {
+		int* r = runs + 4 * i;
+		r[0] = r[1] = r[2] = r[3] = 0;
+		if (hi[i] < lo[i]) {
+			continue;
+		}
+		int count = hi[i] - lo[i] + 1;
+		int start = (lo[i]+n1) % n1;
+		if (count >= n1) {
+			r[1] = n1;
+		} else if (start + count <= n1) {
+			r[0] = start;
+			r[1] = count;
+		} else {
+			r[0] = start;
+			r[1] = n1 - start;
+			r[3] = count - r[1];
+		}
+	}
+	free(lo);
+}
+
+/*
+Transforms the num_grids grids stored one after another in x in place,
+one axis at a time, skipping the lines that only hold zeros (backward)
+or values that are not needed (forward). All the grids share the
+columns in runs (see fft_column_runs), so each step runs on every grid
+with one plan, and the plans are looked up once for the whole batch.
+The backward transform runs along the columns listed in runs, then along
+the second axis in the planes that contain any of those columns, then
+along the whole first axis.
+The forward transform runs the same steps in reverse order, so that only
+the columns in runs have the correct result. scale multiplies the output.
+x holds double complex values if precision is FFT_DOUBLE and
+float complex values if it is FFT_SINGLE.
+*/
+static void pruned_fft3d(void* x, int num_grids, int precision, int* runs,
+	int* fftg, int direction, double scale) {
+
+	int n0 = fftg[0], n1 = fftg[1], n2 = fftg[2];
+	int gridsize = n0 * n1 * n2;
+	size_t point = precision == FFT_SINGLE ? sizeof(float complex) : sizeof(double complex);
+	long plane = (long) n1 * n2;
+	int fwd = direction == FFT_FORWARD;
+	void* xplan = get_strided_fft_plan(n0, n1 * n2, n1 * n2, 1,
+		num_grids, gridsize, precision, direction, fwd ? 1 : scale);
+	void* yplan = get_strided_fft_plan(n1, n2, n2, 1,
+		num_grids, gridsize, precision, direction, 1);
+	// the column plans depend on the length of the run
+	void** count_plans = (void**) calloc(n1 + 1, sizeof(void*));
+	void** zplans = (void**) malloc(2 * n0 * sizeof(void*));
+	CHECK_ALLOCATION(count_plans);
+	CHECK_ALLOCATION(zplans);
+	for (int i = 0; i < 2 * n0; i++) {
+		int count = runs[2*i+1];
+		if (count > 0 && count_plans[count] == NULL) {
+			count_plans[count] = get_strided_fft_plan(n2, count, 1, n2,
+				num_grids, gridsize, precision, direction, fwd ? scale : 1);
+		}
+		zplans[i] = count_plans[count];
+	}
+	free(count_plans);
+
+	if (fwd) {
+		execute_fft_plan(xplan, x, x);
+	}
+	for (int i = 0; i < n0; i++) {
+		int* r = runs + 4 * i;
+		if (r[1] + r[3] == 0) {
+			continue;
+		}
+		char* xi = (char*) x + i * plane * point;
+		if (fwd) {
+			execute_fft_plan(yplan, xi, xi);
+		}
+		for (int s = 0; s < 2; s++) {
+			if (r[2*s+1] == 0) {
+				continue;
+			}
+			char* xz = xi + (long) r[2*s] * n2 * point;
+			execute_fft_plan(zplans[2*i+s], xz, xz);
+		}
+		if (!fwd) {
+			execute_fft_plan(yplan, xi, xi);
+		}
+	}
+	if (!fwd) {
+		execute_fft_plan(xplan, x, x);
+	}
+	free(zplans);
+}
 
 void fft3d(double complex* x, int* G_bounds, double* lattice,
 	double* kpt, int* Gs, float complex* Cs, int num_waves, int* fftg) {
 
-	MKL_LONG status = 0;
-	DFTI_DESCRIPTOR_HANDLE handle = 0;
-	MKL_LONG dim = 3;
-	MKL_LONG length[3] = {fftg[0], fftg[1], fftg[2]};
-
 	int gridsize = fftg[0] * fftg[1] * fftg[2];
 	for (int w = 0; w < gridsize; w++) {
 		x[w] = 0;
@@ -32,38 +244,25 @@ void fft3d(double complex* x, int* G_bounds, double* lattice,
 	}
 	double inv_sqrt_vol = pow(determinant(lattice), -0.5);
 
-	status = DftiCreateDescriptor(&handle, DFTI_DOUBLE, DFTI_COMPLEX, dim, length);
-	CHECK_STATUS(status);
-	status = DftiSetValue(handle, DFTI_BACKWARD_SCALE, inv_sqrt_vol);
-	CHECK_STATUS(status);
-	status = DftiCommitDescriptor(handle);
-	CHECK_STATUS(status);
-	status = DftiComputeBackward(handle, x);
-	CHECK_STATUS(status);
-	DftiFreeDescriptor(&handle);
+	int* runs = (int*) malloc(4 * fftg[0] * sizeof(int));
+	CHECK_ALLOCATION(runs);
+	fft_column_runs(runs, Gs, num_waves, fftg);
+	pruned_fft3d(x, 1, FFT_DOUBLE, runs, fftg, FFT_BACKWARD, inv_sqrt_vol);
+	free(runs);
 }
 
 void fwd_fft3d(double complex* x, int* G_bounds, double* lattice,
 	double* kpt, int* Gs, float complex* Cs, int num_waves, int* fftg) {
 
-	MKL_LONG status = 0;
-	DFTI_DESCRIPTOR_HANDLE handle = 0;
-	MKL_LONG dim = 3;
-	MKL_LONG length[3] = {fftg[0], fftg[1], fftg[2]};
-
-	int gridsize = fftg[0] * fftg[1] * fftg[2];
 	int g1, g2, g3;
 
 	double sqrt_vol = pow(determinant(lattice), 0.5);
 
-	status = DftiCreateDescriptor(&handle, DFTI_DOUBLE, DFTI_COMPLEX, dim, length);
-	CHECK_STATUS(status);
-	status = DftiSetValue(handle, DFTI_FORWARD_SCALE, sqrt_vol/fftg[0]/fftg[1]/fftg[2]);
-	CHECK_STATUS(status);
-	status = DftiCommitDescriptor(handle);
-	CHECK_STATUS(status);
-	status = DftiComputeForward(handle, x);
-	CHECK_STATUS(status);
+	int* runs = (int*) malloc(4 * fftg[0] * sizeof(int));
+	CHECK_ALLOCATION(runs);
+	fft_column_runs(runs, Gs, num_waves, fftg);
+	pruned_fft3d(x, 1, FFT_DOUBLE, runs, fftg, FFT_FORWARD, sqrt_vol/fftg[0]/fftg[1]/fftg[2]);
+	free(runs);
 
 	for (int w = 0; w < num_waves; w++) {
 		g1 = (Gs[3*w+0]+fftg[0]) % fftg[0];
@@ -71,6 +270,246 @@ void fwd_fft3d(double complex* x, int* G_bounds, double* lattice,
 		g3 = (Gs[3*w+2]+fftg[2]) % fftg[2];
 		Cs[w] = x[g1*fftg[1]*fftg[2] + g2*fftg[2] + g3];
 	}
-	
-	DftiFreeDescriptor(&handle);
+}
+
+int fft_batch_size(int* fftg, int num_bands, int num_kpts) {
+	long grid_bytes = (long) fftg[0] * fftg[1] * fftg[2] * sizeof(double complex);
+	int size = (int) (FFT_BATCH_BYTES / grid_bytes);
+	// keep at least one batch for each thread
+	int num_threads = omp_get_max_threads();
+	int per_thread = ((long) num_bands * num_kpts + num_threads - 1) / num_threads;
+	size = min(size, per_thread);
+	size = min(size, num_bands);
+	return max(size, 1);
+}
+
+/*
+Writes the index on the FFT grid fftg of each plane wave in Gs to inds.
+*/
+static void fft_indices(int* inds, int* Gs, int num_waves, int* fftg) {
+	int g1, g2, g3;
+	for (int w = 0; w < num_waves; w++) {
+		g1 = (Gs[3*w+0]+fftg[0]) % fftg[0];
+		g2 = (Gs[3*w+1]+fftg[1]) % fftg[1];
+		g3 = (Gs[3*w+2]+fftg[2]) % fftg[2];
+		inds[w] = g1*fftg[1]*fftg[2] + g2*fftg[2] + g3;
+	}
+}
+
+/*
+Writes the index in the conjugate-even grid (see get_fft_plan) of each G
+on the half sphere of a gamma-only k-point to inds[2*w], and the index
+of -G to inds[2*w+1], or -1 for the one that is not in that half of
+the grid. Both are set if G lies on one of the planes the grid shares
+with its conjugate half.
+*/
+static void gamma_fft_indices(int* inds, int* Gs, int num_waves, int* fftg) {
+	int n2h = fftg[2] / 2 + 1;
+	for (int w = 0; w < num_waves; w++) {
+		for (int sign = 0; sign < 2; sign++) {
+			int s = sign ? -1 : 1;
+			int g1 = (s*Gs[3*w+0]+fftg[0]) % fftg[0];
+			int g2 = (s*Gs[3*w+1]+fftg[1]) % fftg[1];
+			int g3 = (s*Gs[3*w+2]+fftg[2]) % fftg[2];
+			inds[2*w+sign] = g3 < n2h ? (g1*fftg[1] + g2) * n2h + g3 : -1;
+		}
+	}
+}
+
+/*
+Writes the ratio of the stored coefficient of each plane wave of a
+gamma-only k-point to C(G) to scales, see gsphere_half_points.
+*/
+static void gamma_coeff_scales(double* scales, int* Gs, int num_waves) {
+	for (int w = 0; w < num_waves; w++) {
+		int origin = Gs[3*w] == 0 && Gs[3*w+1] == 0 && Gs[3*w+2] == 0;
+		scales[w] = origin ? 1 : sqrt(2);
+	}
+}
+
+/*
+fft3d_bands for a gamma-only k-point. The stored coefficients are
+unscaled to C(G), and the real wavefunctions are computed with one
+batched complex-to-real FFT.
+*/
+static void fft3d_bands_gamma(double complex* x, double* lattice, kpoint_t* kpt,
+	band_t** bands, int num_bands, int* fftg) {
+
+	int num_waves = kpt->num_waves;
+	long gridsize = fftg[0] * fftg[1] * fftg[2];
+	long halfsize = fftg[0] * fftg[1] * (fftg[2] / 2 + 1);
+	double complex* y = (double complex*) backend_calloc(num_bands * halfsize,
+		sizeof(double complex), 64);
+	int* inds = (int*) malloc(2 * num_waves * sizeof(int));
+	double* scales = (double*) malloc(num_waves * sizeof(double));
+	CHECK_ALLOCATION(y);
+	CHECK_ALLOCATION(inds);
+	CHECK_ALLOCATION(scales);
+	gamma_fft_indices(inds, kpt->Gs, num_waves, fftg);
+	gamma_coeff_scales(scales, kpt->Gs, num_waves);
+	for (int b = 0; b < num_bands; b++) {
+		double complex* yb = y + b * halfsize;
+		float complex* Cs = acquire_coeffs(bands[b]);
+		for (int w = 0; w < num_waves; w++) {
+			double complex C = Cs[w] / scales[w];
+			if (inds[2*w] >= 0) yb[inds[2*w]] = C;
+			if (inds[2*w+1] >= 0) yb[inds[2*w+1]] = conj(C);
+		}
+		release_coeffs(bands[b]);
+	}
+	free(inds);
+	free(scales);
+	double inv_sqrt_vol = pow(determinant(lattice), -0.5);
+
+	void* handle = get_fft_plan(3, fftg, num_bands, FFT_DOUBLE,
+		FFT_REAL, FFT_BACKWARD, inv_sqrt_vol);
+	execute_fft_plan(handle, y, x);
+	backend_free(y);
+	// each real grid fills the first half of its complex grid,
+	// so spreading it from the end never overwrites unread values
+	for (int b = 0; b < num_bands; b++) {
+		double complex* xb = x + b * gridsize;
+		double* rb = (double*) xb;
+		for (long i = gridsize - 1; i >= 0; i--) {
+			xb[i] = rb[i];
+		}
+	}
+}
+
+/*
+fwd_fft3d_batch for a gamma-only k-point. The imaginary parts of
+the grids are dropped and the half sphere of coefficients is computed
+with one batched real-to-complex FFT, then scaled like the stored
+coefficients.
+*/
+static void fwd_fft3d_batch_gamma(double complex* x, double* lattice, kpoint_t* kpt,
+	float complex** Cs, int num_bands, int* fftg) {
+
+	int num_waves = kpt->num_waves;
+	long gridsize = fftg[0] * fftg[1] * fftg[2];
+	long halfsize = fftg[0] * fftg[1] * (fftg[2] / 2 + 1);
+	for (int b = 0; b < num_bands; b++) {
+		double complex* xb = x + b * gridsize;
+		double* rb = (double*) xb;
+		for (long i = 0; i < gridsize; i++) {
+			rb[i] = creal(xb[i]);
+		}
+	}
+	double complex* y = (double complex*) backend_malloc(num_bands * halfsize
+		* sizeof(double complex), 64);
+	CHECK_ALLOCATION(y);
+	double sqrt_vol = pow(determinant(lattice), 0.5);
+
+	void* handle = get_fft_plan(3, fftg, num_bands, FFT_DOUBLE,
+		FFT_REAL, FFT_FORWARD, sqrt_vol/fftg[0]/fftg[1]/fftg[2]);
+	execute_fft_plan(handle, x, y);
+
+	int* inds = (int*) malloc(2 * num_waves * sizeof(int));
+	double* scales = (double*) malloc(num_waves * sizeof(double));
+	CHECK_ALLOCATION(inds);
+	CHECK_ALLOCATION(scales);
+	gamma_fft_indices(inds, kpt->Gs, num_waves, fftg);
+	gamma_coeff_scales(scales, kpt->Gs, num_waves);
+	for (int b = 0; b < num_bands; b++) {
+		double complex* yb = y + b * halfsize;
+		for (int w = 0; w < num_waves; w++) {
+			double complex C = inds[2*w] >= 0 ? yb[inds[2*w]] : conj(yb[inds[2*w+1]]);
+			Cs[b][w] = scales[w] * C;
+		}
+	}
+	free(inds);
+	free(scales);
+	backend_free(y);
+}
+
+void fft3d_bands(double complex* x, double* lattice, kpoint_t* kpt,
+	band_t** bands, int num_bands, int* fftg) {
+
+	if (kpt->gamma) {
+		fft3d_bands_gamma(x, lattice, kpt, bands, num_bands, fftg);
+		return;
+	}
+	int num_waves = kpt->num_waves;
+	int gridsize = fftg[0] * fftg[1] * fftg[2];
+	for (long w = 0; w < (long) num_bands * gridsize; w++) {
+		x[w] = 0;
+	}
+	int* inds = (int*) malloc(num_waves * sizeof(int));
+	CHECK_ALLOCATION(inds);
+	fft_indices(inds, kpt->Gs, num_waves, fftg);
+	for (int b = 0; b < num_bands; b++) {
+		double complex* xb = x + (long) b * gridsize;
+		float complex* Cs = acquire_coeffs(bands[b]);
+		for (int w = 0; w < num_waves; w++) {
+			xb[inds[w]] = Cs[w];
+		}
+		release_coeffs(bands[b]);
+	}
+	free(inds);
+	double inv_sqrt_vol = pow(determinant(lattice), -0.5);
+
+	int* runs = (int*) malloc(4 * fftg[0] * sizeof(int));
+	CHECK_ALLOCATION(runs);
+	fft_column_runs(runs, kpt->Gs, num_waves, fftg);
+	pruned_fft3d(x, num_bands, FFT_DOUBLE, runs, fftg, FFT_BACKWARD, inv_sqrt_vol);
+	free(runs);
+}
+
+void fft3d_bands_single(float complex* x, double* lattice, kpoint_t* kpt,
+	band_t** bands, int num_bands, int* fftg) {
+
+	int num_waves = kpt->num_waves;
+	int gridsize = fftg[0] * fftg[1] * fftg[2];
+	for (long w = 0; w < (long) num_bands * gridsize; w++) {
+		x[w] = 0;
+	}
+	int* inds = (int*) malloc(num_waves * sizeof(int));
+	CHECK_ALLOCATION(inds);
+	fft_indices(inds, kpt->Gs, num_waves, fftg);
+	for (int b = 0; b < num_bands; b++) {
+		float complex* xb = x + (long) b * gridsize;
+		float complex* Cs = acquire_coeffs(bands[b]);
+		for (int w = 0; w < num_waves; w++) {
+			xb[inds[w]] = Cs[w];
+		}
+		release_coeffs(bands[b]);
+	}
+	free(inds);
+	double inv_sqrt_vol = pow(determinant(lattice), -0.5);
+
+	int* runs = (int*) malloc(4 * fftg[0] * sizeof(int));
+	CHECK_ALLOCATION(runs);
+	fft_column_runs(runs, kpt->Gs, num_waves, fftg);
+	pruned_fft3d(x, num_bands, FFT_SINGLE, runs, fftg, FFT_BACKWARD, inv_sqrt_vol);
+	free(runs);
+}
+
+void fwd_fft3d_batch(double complex* x, double* lattice, kpoint_t* kpt,
+	float complex** Cs, int num_bands, int* fftg) {
+
+	if (kpt->gamma) {
+		fwd_fft3d_batch_gamma(x, lattice, kpt, Cs, num_bands, fftg);
+		return;
+	}
+	int num_waves = kpt->num_waves;
+	int gridsize = fftg[0] * fftg[1] * fftg[2];
+	double sqrt_vol = pow(determinant(lattice), 0.5);
+
+	int* runs = (int*) malloc(4 * fftg[0] * sizeof(int));
+	CHECK_ALLOCATION(runs);
+	fft_column_runs(runs, kpt->Gs, num_waves, fftg);
+	pruned_fft3d(x, num_bands, FFT_DOUBLE, runs, fftg, FFT_FORWARD,
+		sqrt_vol/fftg[0]/fftg[1]/fftg[2]);
+	free(runs);
+
+	int* inds = (int*) malloc(num_waves * sizeof(int));
+	CHECK_ALLOCATION(inds);
+	fft_indices(inds, kpt->Gs, num_waves, fftg);
+	for (int b = 0; b < num_bands; b++) {
+		double complex* xb = x + (long) b * gridsize;
+		for (int w = 0; w < num_waves; w++) {
+			Cs[b][w] = xb[inds[w]];
+		}
+	}
+	free(inds);
 }
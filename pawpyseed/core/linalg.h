@@ -1,17 +1,50 @@
 /** \file
-Linear algebra routines performed by interacing with the Intel Math Kernel Library
+Linear algebra routines, which call the FFT and BLAS libraries
+through the backend layer (see backend.h)
 */
 
 #ifndef FFT_H
 #define FFT_H
-#include <mkl.h>
-#include <mkl_types.h>
+#include "utils.h"
+#include "backend.h"
+
+/**
+Returns a plan made by create_fft_plan (see backend.h) for howmany
+transforms of dimension dim (1-3) with the given lengths, precision
+(FFT_DOUBLE or FFT_SINGLE), domain (FFT_COMPLEX or FFT_REAL), direction
+(FFT_BACKWARD or FFT_FORWARD) and scale, to be run with execute_fft_plan.
+Plans are created once and kept in a cache shared by all threads,
+so the caller must not free the plan. A plan can be executed by
+several threads at the same time.
+*/
+void* get_fft_plan(int dim, int* lengths, int howmany,
+	int precision, int domain, int direction, double scale);
+
+/**
+Same as get_fft_plan for a plan made by create_strided_fft_plan
+(see backend.h).
+*/
+void* get_strided_fft_plan(int length, int howmany, int stride, int distance,
+	int batch, int batch_distance, int precision, int direction, double scale);
+
+/**
+Frees all the plans in the FFT plan cache. No transforms may be
+running while this is called, and plans returned by get_fft_plan
+before the call must not be used afterwards.
+*/
+void free_fft_plans(void);
 
 /**
 Uses the 3D fast fourier transform to calculate the wavefunction
 defined by plane-wave coefficients Cs in real space. These 
 values get stored in x. The fast index is z (i.e. the third
 lattice direction) for storage and computation.
+Since the G-vectors only fill part of the grid, the transform is done
+one axis at a time: along the z-columns that contain G-vectors, then
+along y in the planes that contain those columns, then along x.
+fwd_fft3d does the same in reverse, and only computes the
+coefficients at Gs. The same applies to fft3d_bands and
+fwd_fft3d_batch, except for gamma-point k-points.
 */
 void fft3d(double complex* x, int* G_bounds, double* lattice,
 	double* kpt, int* Gs, float complex* Cs, int num_waves, int* fftg);
@@ -19,4 +52,46 @@ void fft3d(double complex* x, int* G_bounds, double* lattice,
 void fwd_fft3d(double complex* x, int* G_bounds, double* lattice,
 	double* kpt, int* Gs, float complex* Cs, int num_waves, int* fftg);
 
+/**
+Returns the number of bands to transform at once with fft3d_bands and
+fwd_fft3d_batch on the grid fftg, when num_bands bands at each of num_kpts
+k-points are split between the threads. This keeps the grids each thread
+holds at a few tens of MB and leaves at least one batch for every thread.
+*/
+int fft_batch_size(int* fftg, int num_bands, int num_kpts);
+
+/**
+Same as fft3d for num_bands bands of the k-point kpt, which are
+transformed together, each step of the pruned transform running on
+all the grids with one plan. Band b is written to x + b * gridsize,
+so x must hold num_bands grids. The coefficients of each band
+are acquired (see acquire_coeffs) only while they are copied to x.
+If kpt->gamma is set, the stored coefficients are unscaled (see
+gsphere_half_points), the bands are filled in on the other half
+of the G-sphere by C(-G) = conj(C(G)) and transformed with a
+complex-to-real FFT.
+*/
+void fft3d_bands(double complex* x, double* lattice, kpoint_t* kpt,
+	band_t** bands, int num_bands, int* fftg);
+
+/**
+Same as fft3d_bands, but the grids and the transforms are in single
+precision, which halves the memory traffic of the transforms and of
+reading the grids afterwards. kpt must not be a gamma-point k-point.
+*/
+void fft3d_bands_single(float complex* x, double* lattice, kpoint_t* kpt,
+	band_t** bands, int num_bands, int* fftg);
+
+/**
+Same as fwd_fft3d for num_bands grids stored one after another in x,
+transformed together as in fft3d_bands. The plane-wave coefficients of
+grid b are written to Cs[b], which holds kpt->num_waves values.
+If kpt->gamma is set, the imaginary part of x is discarded, the grids
+are transformed with a real-to-complex FFT and only the coefficients
+on the stored half of the G-sphere are written, scaled as in the
+WAVECAR. x is overwritten.
+*/
+void fwd_fft3d_batch(double complex* x, double* lattice, kpoint_t* kpt,
+	float complex** Cs, int num_bands, int* fftg);
+
 #endif
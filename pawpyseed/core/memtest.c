@@ -21,7 +21,9 @@ void test_pseudoprojection() {
 	double kpt_wts[NUM_KPTS] = { 0.0 };
 	pswf_t* wf1 = read_wavefunctions("WAVECAR", kpt_wts);
 	pswf_t* wf2 = read_wavefunctions("WAVECAR", kpt_wts);
-	double* proj = pseudoprojection(wf2, wf1, 0);
+	double complex* proj = (double complex*) malloc(wf1->nband * wf1->nwk
+		* wf1->nspin * sizeof(double complex));
+	pseudoprojection(proj, wf2, wf1, 0);
 	free(proj);
 	free_pswf(wf1);
 	free_pswf(wf2);
@@ -31,12 +33,11 @@ void test_get_projector_list() {
 	int labels[4] = {0, 1, 10, 10};
 	int ls[1] = {0};
 	double rm[1] = {1.0};
-	double pg[10] = {0,0.1,0.2,0.3,0.4,0.5,0.6,0.7,0.8,0.9};
 	double wg[10] = {0,0.1,0.2,0.3,0.4,0.5,0.6,0.7,0.8,0.9};
 	double ae[10] = {0,0.1,0.2,0.3,0.4,0.5,0.6,0.7,0.8,0.9};
 	double ps[10] = {0,0.1,0.2,0.3,0.4,0.5,0.6,0.7,0.8,0.9};
 	double p[10] = {0,0.1,0.2,0.3,0.4,0.5,0.6,0.7,0.8,0.9};
-	ppot_t* lst = get_projector_list(1, labels, ls, pg, wg, p, ae, ps, rm, 7000);
+	ppot_t* lst = get_projector_list(1, labels, ls, wg, p, ae, ps, rm, 7000);
 	
 	make_pwave_overlap_matrices(lst);
 	free_ppot_list(lst, 1);
@@ -147,10 +148,13 @@ void test_compensation_terms() {
 	printf("terms\n");
 	setup_projections(wf_proj, pps, num_els, 4, fftg, selfnums, selfcoords);
 	setup_projections(wf_ref, pps, num_els, 4, fftg, selfnums, selfcoords);
-	overlap_setup_real(wf_ref, wf_proj, pps, selfnums, selfnums, selfcoords, selfcoords, M, M, M, M, 4, 4, 4);
-	double* terms = compensation_terms(0, wf_proj, wf_ref, pps,
+	overlap_setup_real(wf_ref, wf_proj, selfnums, selfnums, selfcoords, selfcoords, M, M, M, M, NULL, 4, 4, 4);
+	int num_terms = wf_ref->nband * wf_ref->nwk * wf_ref->nspin;
+	double complex* terms = (double complex*) calloc(num_terms, sizeof(double complex));
+	double complex* terms2 = (double complex*) calloc(num_terms, sizeof(double complex));
+	compensation_terms(terms, 0, wf_proj, wf_ref,
 		4, 0, 0, 0, M, M, N_S, N_S, N_S, N_S, selfnums, selfcoords, selfnums, selfcoords, fftg);
-	double* terms2 = compensation_terms(0, wf_proj, wf_ref, pps,
+	compensation_terms(terms2, 0, wf_proj, wf_ref,
 		0, 4, 4, 4, N_S, N_S, M, M, M, M, selfnums, selfcoords, selfnums, selfcoords, fftg);
 
 	free(ls);
@@ -2,7 +2,7 @@
 #include <stdlib.h>
 #include <complex.h>
 #include <math.h>
-#include <mkl.h>
+#include "backend.h"
 #include "utils.h"
 #include "reader.h"
 #include "sbt.h"
@@ -15,9 +15,6 @@
 void free_transform_spline_list(transform_spline_t* transforms, int num_transforms) {
 	for (int i = 0; i < num_transforms; i++) {
 		free(transforms[i].transform);
-		free(transforms[i].spline[0]);
-		free(transforms[i].spline[1]);
-		free(transforms[i].spline[2]);
 		free(transforms[i].spline);
 	}
 	free(transforms);
@@ -51,7 +48,7 @@ float complex pseudo_momentum(int* GP, int* G_bounds, double* lattice,
 	fftg[0] = fftgrid[0]*2;
 	fftg[1] = fftgrid[1]*2;
 	fftg[2] = fftgrid[2]*2;
-	float complex* x = (float complex*) mkl_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(float complex), 64);
+	float complex* x = (float complex*) backend_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(float complex), 64);
 
 	float complex total = 0;
 	int gridsize = fftg[0] * fftg[1] * fftg[2];
@@ -82,7 +79,7 @@ float complex pseudo_momentum(int* GP, int* G_bounds, double* lattice,
 	//	total += x[w];
 	//}
 
-	mkl_free(x);
+	backend_free(x);
 	return total;
 }
 
@@ -259,8 +256,10 @@ double complex get_momentum_matrix_element(pswf_t* wf, int* labels, double* coor
 	band_t* band1 = kpoint1->bands[b1];
 	band_t* band2 = kpoint2->bands[b2];
 
-	double complex total = pseudo_momentum(GP, wf->G_bounds, wf->lattice, kpoint1->Gs, band1->Cs, kpoint1->num_waves,
-											kpoint2->Gs, band2->Cs, kpoint2->num_waves, wf->fftg);
+	double complex total = pseudo_momentum(GP, wf->G_bounds, wf->lattice, kpoint1->Gs, acquire_coeffs(band1), kpoint1->num_waves,
+											kpoint2->Gs, acquire_coeffs(band2), kpoint2->num_waves, wf->fftg);
+	release_coeffs(band1);
+	release_coeffs(band2);
 
 	double G[3];
 	G[0] = GP[0];
@@ -366,49 +365,10 @@ void list_to_grid_map(int* grid, int* G_bounds, int* gdim, int* igall, int num_w
 	}
 }
 
-int get_momentum_grid(int* igall, pswf_t* wf, double nb1max, double nb2max, double nb3max, double encut) {
-
-	double* b1 = wf->reclattice + 0;
-	double* b2 = wf->reclattice + 3;
-	double* b3 = wf->reclattice + 6;
-
-	int ncnt = -1;
-	for (int ig3 = 0; ig3 <= 2 * nb3max; ig3++) {
-		int ig3p = ig3;
-		if (ig3 > nb3max) ig3p = ig3 - 2 * nb3max - 1;
-		for (int ig2 = 0; ig2 <= 2 * nb2max; ig2++) {
-			int ig2p = ig2;
-			if (ig2 > nb2max) ig2p = ig2 - 2 * nb2max - 1;
-			for (int ig1 = 0; ig1 <= 2 * nb1max; ig1++) {
-				int ig1p = ig1;
-				if (ig1 > nb1max) ig1p = ig1 - 2 * nb1max - 1;
-				double sumkg[3];
-				for (int j = 0; j < 3; j++) {
-					sumkg[j] = (ig1p) * b1[j]
-								+ (ig2p) * b2[j]
-								+ (ig3p) * b3[j];
-				}
-				double gtot = mag(sumkg);
-				double etot = pow(gtot,2.0) / c;
-				//printf("%lf %lf\n", etot, gtot);
-				if (etot <= encut) {
-					ncnt++;
-					igall[ncnt*3+0] = ig1p;
-					igall[ncnt*3+1] = ig2p;
-					igall[ncnt*3+2] = ig3p;
-					//if (ig1p < wf->G_bounds[0]) wf->G_bounds[0] = ig1p;
-					//else if (ig1p > wf->G_bounds[1]) wf->G_bounds[1] = ig1p;
-					//if (ig2p < wf->G_bounds[2]) wf->G_bounds[2] = ig2p;
-					//else if (ig2p > wf->G_bounds[3]) wf->G_bounds[3] = ig2p;
-					//if (ig3p < wf->G_bounds[4]) wf->G_bounds[4] = ig3p;
-					//else if (ig3p > wf->G_bounds[5]) wf->G_bounds[5] = ig3p;
-				}
-			}
-		}
-	}
-	ncnt++;
-
-	return ncnt;
+int get_momentum_grid(int* igall, int max_points, pswf_t* wf, double encut) {
+	double k[3] = {0, 0, 0};
+	gsphere_t gsphere = make_gsphere(wf->reclattice, encut);
+	return gsphere_points(igall, NULL, &gsphere, k, max_points);
 }
 
 void fill_grid(float complex* x, int* Gs, float complex* Cs, int* fftg, int numg) {
@@ -454,7 +414,8 @@ void fullwf_reciprocal(double complex* Cs, int* igall, pswf_t* wf, int numg,
 	float complex* x = (float complex*) malloc(gridsize * sizeof(float complex));
 	kpoint_t* kpt = wf->kpts[kpt_num];
 	band_t* band = wf->kpts[kpt_num]->bands[band_num];
-	fill_grid(x, kpt->Gs, band->Cs, fftg, kpt->num_waves);
+	fill_grid(x, kpt->Gs, acquire_coeffs(band), fftg, kpt->num_waves);
+	release_coeffs(band);
 
 	for (int w = 0; w < numg; w++) {
 		G[0] = igall[3*w+0];
@@ -67,7 +67,12 @@ void get_momentum_matrix(double complex* matrix, int numg, int* igall,
 void momentum_grid_size(pswf_t* wf, double* nb1max, double* nb2max, double* nb3max,
 						int* npmax, double encut);
 
-int get_momentum_grid(int* igall, pswf_t* wf, double nb1max, double nb2max, double nb3max, double encut);
+/**
+Stores the first max_points G with |G|^2 <= c*encut in igall
+(see gsphere_points; igall may be NULL) and returns the number of
+such G, so the grid can be sized with a first call.
+*/
+int get_momentum_grid(int* igall, int max_points, pswf_t* wf, double encut);
 
 void grid_bounds(int* G_bounds, int* gdim, int* igall, int num_waves);
 
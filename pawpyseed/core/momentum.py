@@ -1,5 +1,6 @@
 from pawpyseed.core.wavefunction import Wavefunction
 from pawpyseed.core import pawpyc
+from pawpyseed.core.utils import PAWpyError
 
 class MomentumMatrix(pawpyc.CMomentumMatrix):
 
@@ -31,6 +32,8 @@ class MomentumMatrix(pawpyc.CMomentumMatrix):
 				you can increase encut a bit to make sure all the necessary
 				plane waves are included.
 		"""
+		if wf.gamma:
+			raise PAWpyError("Momentum matrix elements are not supported for gamma-only wavefunctions!")
 		wf.check_c_projectors()
 		if encut == None:
 			encut = 4 * wf.encut
@@ -0,0 +1,243 @@
+# coding: utf-8
+
+## @package pawpyseed.core.parallel
+# Distributes projections over MPI ranks. The k-points and
+# spins (and optionally the bands of the basis) are split
+# between ranks, each rank reads only its share of the WAVECARs
+# and projects it with a Projector, and the results are gathered
+# on one rank in the layout of Projector.single_band_projection.
+#
+# Run with, for example,
+#   mpirun -np 4 python -m pawpyseed.core.parallel basis_dir wf_dir 0 1 2
+# mpi4py is only needed to run on more than one rank.
+#
+# The k-points of the basis and of the wavefunction are matched by
+# index, so both calculations must have the same k-points. Projecting
+# a defect supercell onto a symmetry-reduced bulk basis (unsym_basis
+# or unsym_wf in Projector) is not supported: desymmetrizing needs
+# every k-point of the WAVECAR on each rank, which is what this module
+# avoids. Such projections can be distributed by running the bulk
+# calculation without symmetry (ISYM = -1) on the k-points of the defect.
+
+from pawpyseed.core.projector import Projector
+from pawpyseed.core.wavefunction import Wavefunction
+from pawpyseed.core.utils import wavecar_path
+import numpy as np
+import os, sys
+import bz2, gzip
+
+
+class SerialComm:
+	"""
+	Stand-in for mpi4py's COMM_WORLD when mpi4py is not
+	installed or only one process is used.
+	"""
+
+	def Get_rank(self):
+		return 0
+
+	def Get_size(self):
+		return 1
+
+	def gather(self, obj, root=0):
+		return [obj]
+
+	def bcast(self, obj, root=0):
+		return obj
+
+
+def get_comm():
+	"""
+	Returns mpi4py's COMM_WORLD, or a SerialComm if mpi4py
+	is not installed.
+	"""
+	try:
+		from mpi4py import MPI
+	except ImportError:
+		return SerialComm()
+	return MPI.COMM_WORLD
+
+
+def wavecar_counts(path):
+	"""
+	Reads the number of spins, k-points and bands from the
+	header of a WAVECAR without reading the rest of the file.
+
+	Arguments:
+		path (str): WAVECAR file path, may be gzipped or bzipped
+
+	Returns:
+		nspin, nwk, nband (int)
+	"""
+	# compressed files are detected by name, as in PWFPointer
+	opener = open
+	if '.gz' in path:
+		opener = gzip.open
+	elif '.bz2' in path:
+		opener = bz2.open
+	with opener(path, 'rb') as f:
+		recl, nspin = np.frombuffer(f.read(16), dtype=np.float64)
+		f.seek(int(recl))
+		nwk, nband = np.frombuffer(f.read(16), dtype=np.float64)
+	return int(nspin), int(nwk), int(nband)
+
+
+def split_tasks(nspin, nwk, nband, size, band_blocks=1):
+	"""
+	Splits the spin/k-point pairs into contiguous chunks and the
+	bands of the basis into band_blocks blocks. Each task is a chunk
+	paired with a band block, and there are about size tasks, ordered
+	by chunk so that the blocks of a chunk are next to each other.
+
+	Returns:
+		list of (list of (spin, kpoint), (band_min, band_max))
+	"""
+	units = [(s, k) for s in range(nspin) for k in range(nwk)]
+	band_blocks = max(1, min(band_blocks, nband))
+	nchunks = max(1, min(size // band_blocks, len(units)))
+	chunks = [[(int(s), int(k)) for s, k in c]
+		for c in np.array_split(units, nchunks)]
+	blocks = [(int(b[0]), int(b[-1]) + 1)
+		for b in np.array_split(np.arange(nband), band_blocks)]
+	return [(c, b) for c in chunks for b in blocks]
+
+
+def rank_tasks(tasks, rank, size):
+	"""
+	Returns the tasks of split_tasks that rank runs, grouped by chunk:
+	each rank gets a contiguous range of the tasks, so it has as few
+	chunks as possible and sets up the wavefunction of each only once.
+
+	Returns:
+		list of (list of (spin, kpoint), list of (band_min, band_max))
+	"""
+	groups = []
+	for i in np.array_split(np.arange(len(tasks)), size)[rank]:
+		units, block = tasks[i]
+		if len(groups) > 0 and groups[-1][0] == units:
+			groups[-1][1].append(block)
+		else:
+			groups.append((units, [block]))
+	return groups
+
+
+def _project_task(basis_dir, wf_dir, band_nums, method, units, blocks, kwargs):
+	"""
+	Projects the bands band_nums of wf_dir onto each of the blocks of
+	bands of basis_dir at the spin/k-point pairs units. Only these
+	parts of the WAVECARs are read, and the wavefunction is read and
+	its projectors set up once for all the blocks. Returns a list with
+	one (spin, kpoints, block, {band: array of shape
+	(block size, len(kpoints))}) for each spin in units and block.
+	"""
+	wf_bands = (min(band_nums), max(band_nums) + 1)
+	pieces = []
+	for s in sorted(set(u[0] for u in units)):
+		kpts = [k for t, k in units if t == s]
+		wf = Wavefunction.from_directory(wf_dir, kpoints=kpts,
+			spin=s, bands=wf_bands, **kwargs)
+		for block in blocks:
+			basis = Wavefunction.from_directory(basis_dir, kpoints=kpts,
+				spin=s, bands=block, **kwargs)
+			pr = Projector(wf, basis, method=method)
+			res = {}
+			for b in band_nums:
+				res[b] = pr.single_band_projection(b - wf_bands[0]).reshape(
+					block[1] - block[0], len(kpts))
+			pieces.append((s, kpts, block, res))
+			del pr, basis
+		del wf
+	return pieces
+
+
+def distributed_projection(basis_dir, wf_dir, band_nums, method="aug_real",
+	band_blocks=1, comm=None, root=0, **kwargs):
+	"""
+	Projects the bands band_nums of the VASP output in wf_dir onto
+	all the bands of the VASP output in basis_dir, distributing the
+	k-points and spins over the ranks of comm. If band_blocks > 1,
+	the bands of the basis are split into band_blocks blocks as well,
+	which are distributed with the k-points. Each rank reads only the
+	k-points, spins and bands it projects, so the WAVECARs never have
+	to fit in the memory of one rank. Both calculations must have the
+	same (symmetrically reduced) k-points, as for Projector without
+	unsym_basis or unsym_wf; desymmetrizing a basis is not supported
+	(see the module documentation).
+
+	Arguments:
+		basis_dir (str): VASP output directory of the basis
+		wf_dir (str): VASP output directory of the wavefunction
+		band_nums (list of int): bands of wf_dir to project
+		method (str, "aug_real"): projection method, see Projector
+		band_blocks (int, 1): number of blocks the basis bands
+			are split into
+		comm (mpi4py communicator, None): communicator to distribute
+			the work over. Defaults to COMM_WORLD (see get_comm)
+		root (int, 0): rank on which the results are gathered
+		kwargs: passed to Wavefunction.from_directory (e.g. use_mmap)
+
+	Returns:
+		On rank root, a dict mapping each band in band_nums to
+		the np.array Projector.single_band_projection would return
+		for it. None on the other ranks.
+	"""
+	if comm is None:
+		comm = get_comm()
+	band_nums = sorted(set(band_nums))
+	if len(band_nums) == 0:
+		raise ValueError("No bands to project")
+	nspin, nwk, nband = wavecar_counts(wavecar_path(basis_dir))
+	wf_nspin, wf_nwk, wf_nband = wavecar_counts(wavecar_path(wf_dir))
+	if wf_nspin != nspin or wf_nwk != nwk:
+		raise ValueError("Spins and k-points of wf and basis are not matched")
+	if band_nums[0] < 0 or band_nums[-1] >= wf_nband:
+		raise ValueError("Band index out of range (0-indexed)")
+
+	rank, size = comm.Get_rank(), comm.Get_size()
+	tasks = split_tasks(nspin, nwk, nband, size, band_blocks)
+	local = []
+	for units, blocks in rank_tasks(tasks, rank, size):
+		local += _project_task(basis_dir, wf_dir, band_nums,
+			method, units, blocks, kwargs)
+
+	gathered = comm.gather(local, root=root)
+	if rank != root:
+		return None
+	result = {}
+	for b in band_nums:
+		full = np.zeros((nband, nspin, nwk), dtype=np.complex128)
+		for pieces in gathered:
+			for s, kpts, block, res in pieces:
+				full[block[0]:block[1], s, kpts] = res[b]
+		result[b] = full.flatten()
+	return result
+
+
+def main(argv=None):
+	import argparse
+	parser = argparse.ArgumentParser(description="Projects bands of "
+		"wf_dir onto the bands of basis_dir, distributed over MPI ranks.")
+	parser.add_argument("basis_dir")
+	parser.add_argument("wf_dir")
+	parser.add_argument("bands", type=int, nargs="+")
+	parser.add_argument("--method", default="aug_real",
+		choices=Projector.METHODS)
+	parser.add_argument("--band-blocks", type=int, default=1)
+	parser.add_argument("--out", default=None, help="if given, the "
+		"projections are saved to this .npz file, with one array per band")
+	args = parser.parse_args(argv)
+
+	res = distributed_projection(args.basis_dir, args.wf_dir, args.bands,
+		args.method, args.band_blocks)
+	if res is None:
+		return
+	if args.out is not None:
+		np.savez(args.out, **{str(b): res[b] for b in res})
+	else:
+		for b in sorted(res):
+			print("band", b, "norm", np.linalg.norm(res[b]))
+	sys.stdout.flush()
+
+
+if __name__ == '__main__':
+	main()
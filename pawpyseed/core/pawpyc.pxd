@@ -10,11 +10,12 @@ cdef class PWFPointer:
     cdef readonly np.ndarray kpts
     cdef readonly np.ndarray weights
     cdef readonly np.ndarray band_props
+    cdef readonly object source
 
     @staticmethod
     cdef PWFPointer from_pointer_and_kpts(ppc.pswf_t* ptr,
         structure, kpts, band_props, allkpts, weights, symprec,
-        time_reversal_symmetry)
+        time_reversal_symmetry, source=*, virtual_budget=*)
 
 cdef class PseudoWavefunction:
 
@@ -23,8 +24,10 @@ cdef class PseudoWavefunction:
     cdef readonly int nwk
     cdef readonly int nspin
     cdef readonly int ncl
+    cdef readonly int gamma
     cdef readonly np.ndarray kws
     cdef readonly np.ndarray kpts
+    cdef object source
 
 cdef class CWavefunction(PseudoWavefunction):
 
@@ -36,6 +39,7 @@ cdef class CWavefunction(PseudoWavefunction):
     cdef double[::1] coords
     cdef int number_projector_elements
     cdef readonly int projector_owner
+    cdef readonly int single_precision
 
 cdef class CProjector:
 
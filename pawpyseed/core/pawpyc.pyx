@@ -16,7 +16,6 @@ from libc.stdlib cimport malloc, free
 from libc.stdio cimport FILE
 from pymatgen.core.structure import Structure
 from pymatgen.io.vasp.outputs import Vasprun
-from monty.io import zopen
 import numpy as np
 from numpy.testing import assert_almost_equal
 cimport numpy as np
@@ -47,6 +46,9 @@ class Timer:
 #  MISCELLANEOUS PYTHON UTILS  #
 ################################  
 
+# coefficient storage formats, see COEFF_FLOAT32 in utils.h
+COEFF_STORAGE = {None: 0, 'float32': 0, 'float16': 1, 'bfloat16': 2}
+
 def el(site):
 	"""
 	Return the element symbol of a pymatgen
@@ -117,9 +119,6 @@ cpdef interpolate(np.ndarray[double, ndim=1] res,
 		res[i] = ppc.proj_interpolate(tst[i], rmax,
 			size, &xv[0], &yv[0], coef)
 
-	free(coef[0])
-	free(coef[1])
-	free(coef[2])
 	free(coef)
 
 cpdef spherical_bessel_transform(double encut, int l,
@@ -174,17 +173,129 @@ cpdef reciprocal_offsite_wave_overlap(np.ndarray[double, ndim=1] dcoord,
 		&k2v[0], &fk2v[0], s2, size2,
 		NULL, l1, m1, l2, m2)
 
-	free(s1[0])
-	free(s1[1])
-	free(s1[2])
 	free(s1)
-	free(s2[0])
-	free(s2[1])
-	free(s2[2])
 	free(s2)
 
 	return res
 
+def site_lists(np.ndarray[double, ndim=2] lattice,
+	coords_R, elems_R, rmax_R, coords_S, elems_S, rmax_S, double tol):
+	"""
+	Sorts the sites of structures R and S into the site lists of the
+	projection scheme with a periodic cell list (see make_site_lists in
+	projector.h).
+
+	Arguments:
+		lattice (3x3 np.ndarray): lattice vectors as rows, in Angstrom
+		coords_R, coords_S (Nx3 array): fractional coordinates of the sites
+		elems_R, elems_S (list of int): element id of each site
+		rmax_R, rmax_S (list of float): augmentation radius of each site
+		tol (float): sites of R and S of the same element closer than
+			tol are identical
+
+	Returns:
+		M_R, M_S, N_R, N_S, N_RS_R, N_RS_S (np.ndarray of int32), and
+		N_RS_paths (np.ndarray of shape (len(N_RS_R), 3)), the minimum image
+		cartesian path from site N_RS_R[i] to site N_RS_S[i]
+	"""
+	cdef double[::1] latticev = np.ascontiguousarray(lattice.flatten(), dtype=np.float64)
+	cdef double[::1] crv = np.ascontiguousarray(np.array(coords_R).flatten(), dtype=np.float64)
+	cdef double[::1] csv = np.ascontiguousarray(np.array(coords_S).flatten(), dtype=np.float64)
+	cdef int[::1] erv = np.array(elems_R, dtype=np.int32)
+	cdef int[::1] esv = np.array(elems_S, dtype=np.int32)
+	cdef double[::1] rrv = np.array(rmax_R, dtype=np.float64)
+	cdef double[::1] rsv = np.array(rmax_S, dtype=np.float64)
+	cdef int num_R = erv.shape[0]
+	cdef int num_S = esv.shape[0]
+
+	M_R = np.zeros(max(min(num_R, num_S), 1), dtype=np.int32)
+	M_S = np.zeros(max(min(num_R, num_S), 1), dtype=np.int32)
+	N_R = np.zeros(max(num_R, 1), dtype=np.int32)
+	N_S = np.zeros(max(num_S, 1), dtype=np.int32)
+	counts = np.zeros(3, dtype=np.int32)
+	cdef int[::1] mrv = M_R
+	cdef int[::1] msv = M_S
+	cdef int[::1] nrv = N_R
+	cdef int[::1] nsv = N_S
+	cdef int[::1] countsv = counts
+	cdef int[::1] prv
+	cdef int[::1] psv
+	cdef double[::1] pathv
+
+	cdef int max_pairs = 8 * (num_R + num_S) + 1
+	cdef int num_pairs
+	while True:
+		N_RS_R = np.zeros(max_pairs, dtype=np.int32)
+		N_RS_S = np.zeros(max_pairs, dtype=np.int32)
+		paths = np.zeros(3 * max_pairs, dtype=np.float64)
+		prv = N_RS_R
+		psv = N_RS_S
+		pathv = paths
+		num_pairs = ppc.make_site_lists(&latticev[0],
+			num_R, &crv[0] if num_R > 0 else NULL, &erv[0] if num_R > 0 else NULL,
+			&rrv[0] if num_R > 0 else NULL,
+			num_S, &csv[0] if num_S > 0 else NULL, &esv[0] if num_S > 0 else NULL,
+			&rsv[0] if num_S > 0 else NULL,
+			tol, &mrv[0], &msv[0], &nrv[0], &nsv[0], &countsv[0],
+			max_pairs, &prv[0], &psv[0], &pathv[0])
+		if num_pairs <= max_pairs:
+			break
+		# the buffers were too small, so try again with the right size
+		max_pairs = num_pairs
+
+	return M_R[:counts[0]], M_S[:counts[0]], N_R[:counts[1]], N_S[:counts[2]], \
+		N_RS_R[:num_pairs], N_RS_S[:num_pairs], paths[:3*num_pairs].reshape(-1, 3)
+
+def free_fft_plans():
+	"""
+	Frees the FFT plans cached by the C code (see get_fft_plan
+	in linalg.h). The cache is shared by all wavefunctions and
+	projectors and is only refilled when transforms are needed
+	again, so this is safe to call between calculations to release
+	the memory, but not while another thread is in a calculation.
+	"""
+	with nogil:
+		ppc.free_fft_plans()
+
+def defer_buffer_frees(bint defer):
+	"""
+	While deferred (defer is True), the C code does not free the
+	internal buffers of the backend libraries, which would free them
+	for every thread, and frees them when defer_buffer_frees(False)
+	is called instead (see backend_defer_buffer_frees in backend.h).
+	Calls must be paired, and are used while another Python thread
+	may call into the C code at the same time.
+	"""
+	ppc.backend_defer_buffer_frees(defer)
+
+def get_thread_count():
+	"""
+	Returns the number of threads the C code uses for calls
+	made from the calling Python thread.
+	"""
+	return ppc.backend_get_thread_count()
+
+def set_thread_count(int num_threads):
+	"""
+	Sets the number of threads the C code uses for calls made from
+	the calling Python thread, without changing it for other threads.
+	"""
+	if num_threads < 1:
+		raise ValueError("num_threads must be at least 1")
+	ppc.backend_set_thread_count(num_threads)
+
+def get_backends():
+	"""
+	Returns the libraries the C code was compiled to use
+	(see backend.h and site.cfg.default).
+
+	Returns:
+		dict with keys 'fft' ('mkl' or 'fftw') and
+		'blas' ('mkl' or 'openblas')
+	"""
+	return {'fft': ppc.fft_backend_name().decode('utf-8'),
+		'blas': ppc.blas_backend_name().decode('utf-8')}
+
 ############################
 #  PAWPYSEED BASE CLASSES  #
 ############################
@@ -197,8 +308,41 @@ cdef class PWFPointer:
 	objects without symmetry-reduced k-point sampling.
 	"""
 
-	def __init__(self, filename = None, vr = None):
+	def __init__(self, filename = None, vr = None, use_mmap = False,
+		cache_budget = None, bands = None, kpoints = None, spin = None,
+		energy_window = None, coeff_storage = None):
+		"""
+		Arguments:
+			filename (str): WAVECAR path, may be gzipped or bzipped
+			vr (str or Vasprun): vasprun.xml path or object
+			use_mmap (bool, False): memory-map the (uncompressed) WAVECAR
+				and use the mapped records directly as the plane wave
+				coefficients instead of copying them onto the heap
+			cache_budget (int, None): if not None, the (uncompressed) WAVECAR
+				is read lazily: band coefficients are only read when needed
+				and at most cache_budget bytes of them are kept in memory
+			bands ((int, int), None): read only bands bands[0] to bands[1]-1
+			kpoints (list of int, None): read only these k-point indices
+			spin (int, None): read only this spin channel (0 or 1)
+			energy_window ((float, float), None): read only the smallest
+				range of bands containing every eigenvalue in this window
+				(in eV, relative to the Fermi level) at the selected
+				k-points and spins. Cannot be combined with bands.
+			coeff_storage (str, None): if 'float16' or 'bfloat16', the plane
+				wave coefficients are kept in memory in that 16-bit format
+				with a scale per band, and decoded when needed (see
+				COEFF_FLOAT16 in utils.h for the error bounds). At most
+				cache_budget bytes of decoded coefficients are kept.
+		"""
 		cdef double[::1] kws
+		cdef int[::1] kinds
+		cdef ppc.wavecar_selection_t sel
+		cdef ppc.wavecar_selection_t* selptr = NULL
+		cdef int wctype
+		cdef int storage
+		cdef long budget
+		cdef char* cfname
+		cdef ppc.pswf_t* ptr
 		if filename == None or vr == None:
 			self.ptr = NULL
 		else:
@@ -209,20 +353,86 @@ cdef class PWFPointer:
 			self.kpts = np.array(vr.actual_kpoints, dtype=np.float64)
 			self.band_props = np.array(vr.eigenvalue_band_properties)
 			kws = self.weights
-			if '.gz' in filename or '.bz2' in filename:
-				f = zopen(filename, 'rb')
-				contents = f.read()
-				f.close()
-				self.ptr = ppc.read_wavefunctions_from_str(
-					contents, &kws[0])
+
+			if bands is not None or kpoints is not None or spin is not None\
+					or energy_window is not None:
+				if bands is not None and energy_window is not None:
+					raise ValueError('Only one of bands and energy_window can be set')
+				sel.band_min, sel.band_max, sel.num_kpts, sel.spin = 0, -1, -1, -1
+				if kpoints is not None:
+					kinds = np.unique(np.array(kpoints, dtype=np.int32))
+					sel.num_kpts = kinds.shape[0]
+					sel.kpt_inds = &kinds[0]
+				if spin is not None:
+					sel.spin = spin
+				if energy_window is not None:
+					bands = self._bands_in_window(vr, energy_window, kpoints, spin)
+				if bands is not None:
+					sel.band_min, sel.band_max = bands
+				selptr = &sel
+
+			if '.gz' in filename:
+				wctype = 3
+			elif '.bz2' in filename:
+				wctype = 4
+			elif use_mmap:
+				wctype = 2
 			else:
-				self.ptr = ppc.read_wavefunctions(filename.encode('utf-8'), &kws[0])
+				wctype = 0
+			if coeff_storage not in COEFF_STORAGE:
+				raise ValueError('coeff_storage must be one of {}'.format(
+					list(COEFF_STORAGE)))
+			storage = COEFF_STORAGE[coeff_storage]
+			if cache_budget is not None:
+				budget = max(int(cache_budget), 1)
+			else:
+				budget = 0
+			fname = filename.encode('utf-8')
+			cfname = fname
+			# the GIL is released so that other threads can run while
+			# the WAVECAR is read (see Projector.setup_multiple_projections)
+			with nogil:
+				ptr = ppc.read_wavefunctions_select(cfname, &kws[0],
+					wctype, budget, selptr, storage)
+			self.ptr = ptr
+			if self.ptr == NULL:
+				raise ValueError('Could not read {}'.format(filename))
+			if kpoints is not None:
+				self.weights = self.weights[np.asarray(kinds)]
+				self.kpts = self.kpts[np.asarray(kinds)]
 			sys.stdout.flush()
 
+	@staticmethod
+	def _bands_in_window(vr, energy_window, kpoints, spin):
+		"""
+		Returns the smallest band range (start, stop) containing all
+		eigenvalues in energy_window (relative to the Fermi level)
+		at the given k-points and spin.
+		"""
+		eigs = [vr.eigenvalues[s][:,:,0] for s in sorted(vr.eigenvalues,
+			key = lambda s: -s.value)]
+		if spin is not None:
+			eigs = [eigs[spin]]
+		eigs = np.array(eigs) - vr.efermi
+		if kpoints is not None:
+			eigs = eigs[:,np.unique(kpoints),:]
+		inds = np.nonzero(np.any((eigs >= energy_window[0])\
+			& (eigs <= energy_window[1]), axis=(0,1)))[0]
+		if len(inds) == 0:
+			raise ValueError('No bands in energy window {}'.format(energy_window))
+		return inds[0], inds[-1] + 1
+
 	@staticmethod
 	cdef PWFPointer from_pointer_and_kpts(ppc.pswf_t* ptr,
 		structure, kpts, band_props, allkpts, weights, symprec,
-		time_reversal_symmetry):
+		time_reversal_symmetry, source=None, virtual_budget=None):
+		"""
+		Makes the symmetry-expanded copy of the wavefunction ptr.
+		If virtual_budget is not None, the coefficients of the new
+		k-points are generated from ptr when they are needed, keeping
+		at most virtual_budget bytes of them (see expand_symm_wf_virtual),
+		and source must be the object owning ptr.
+		"""
 
 		return_kpts_and_weights = False
 		if (allkpts is None) or (weights is None):
@@ -251,16 +461,75 @@ cdef class PWFPointer:
 		cdef double[::1] drs_v = np.array(drs, np.float64, order='C', copy=False)
 		cdef int[::1] trs_v = np.array(trs, np.int32, order='C', copy=False)
 
-		cdef ppc.pswf_t* new_ptr = ppc.expand_symm_wf(ptr, len(orig_kptnums),
-				&orig_kptnums_v[0], &ops_v[0], &drs_v[0], &weights_v[0], &trs_v[0])
+		cdef ppc.pswf_t* new_ptr
+		cdef int num_kpts = len(orig_kptnums)
+		cdef long budget = 0 if virtual_budget is None else max(int(virtual_budget), 1)
+		with nogil:
+			if budget == 0:
+				new_ptr = ppc.expand_symm_wf(ptr, num_kpts,
+					&orig_kptnums_v[0], &ops_v[0], &drs_v[0], &weights_v[0], &trs_v[0])
+			else:
+				new_ptr = ppc.expand_symm_wf_virtual(ptr, num_kpts,
+					&orig_kptnums_v[0], &ops_v[0], &drs_v[0], &weights_v[0], &trs_v[0],
+					budget)
 
 		cdef PWFPointer pwfp = PWFPointer()
 		pwfp.ptr = new_ptr
+		if virtual_budget is not None:
+			pwfp.source = source
 		pwfp.kpts = kpts
 		pwfp.weights = weights
 		pwfp.band_props = np.array(band_props)
 		return pwfp
 
+	@staticmethod
+	def from_cache(filename, key, cache_budget = None, coeff_storage = None):
+		"""
+		Loads a wavefunction stored with CWavefunction._write_cache.
+
+		Arguments:
+			filename (str): path of the cache file
+			key (str): key identifying the inputs of the wavefunction
+			cache_budget (int, None): bytes of decoded coefficients to
+				keep if coeff_storage is set (see PWFPointer)
+			coeff_storage (str, None): if 'float16' or 'bfloat16', the
+				plane wave coefficients are stored in memory in that
+				format as in PWFPointer, instead of being used from
+				the memory-mapped cache file
+
+		Returns:
+			(PWFPointer, np.ndarray): pointer to the wavefunction and
+				the extra metadata passed to _write_cache, or (None, None)
+				if filename does not exist or was written for another key
+				or version of pawpyseed
+		"""
+		if coeff_storage not in COEFF_STORAGE:
+			raise ValueError('coeff_storage must be one of {}'.format(
+				list(COEFF_STORAGE)))
+		cdef int storage = COEFF_STORAGE[coeff_storage]
+		cdef long budget = 0
+		if cache_budget is not None:
+			budget = max(int(cache_budget), 1)
+		filename = str(filename).encode('utf-8')
+		key = key.encode('utf-8')
+		cdef int num_meta = ppc.wfcache_num_meta(filename, key)
+		if num_meta < 5:
+			return None, None
+		meta = np.zeros(num_meta, dtype=np.float64)
+		cdef double[::1] metav = meta
+		cdef ppc.pswf_t* ptr = ppc.read_wfcache(filename, key, &metav[0],
+			budget, storage)
+		if ptr == NULL:
+			return None, None
+		cdef PWFPointer pwfp = PWFPointer()
+		pwfp.ptr = ptr
+		# layout written by CWavefunction._write_cache
+		nkpts = int(meta[4])
+		pwfp.band_props = meta[:4].copy()
+		pwfp.kpts = meta[5:5+3*nkpts].reshape(nkpts, 3).copy()
+		pwfp.weights = meta[5+3*nkpts:5+4*nkpts].copy()
+		return pwfp, meta[5+4*nkpts:].copy()
+
 
 cdef class PseudoWavefunction:
 	"""
@@ -279,6 +548,8 @@ cdef class PseudoWavefunction:
 		wf_ptr (ctypes POINTER): c pointer to pswf_t object
 		ncl (bool): Whether the pseudowavefunction is from a noncollinear
 			VASP calculation
+		gamma (bool): Whether the pseudowavefunction is from a gamma-only
+			VASP calculation, which stores half of the plane waves
 		band_props (list): [band gap, conduction band minimum,
 			valence band maximum, whether the band gap is direct]
 	"""
@@ -291,9 +562,13 @@ cdef class PseudoWavefunction:
 		if pwf.ptr is NULL:
 			raise Exception("NULL PWFPointer ptr!")
 		self.wf_ptr = pwf.ptr
+		# a wavefunction with virtual k-points generates its
+		# coefficients from source, so it must outlive self
+		self.source = pwf.source
 		self.kpts = pwf.kpts.copy(order='C')
 		self.kws = pwf.weights.copy(order='C')
 		self.ncl = ppc.is_ncl(self.wf_ptr) > 0
+		self.gamma = ppc.is_gamma(self.wf_ptr) > 0
 		self.nband = ppc.get_nband(self.wf_ptr)
 		self.nwk = ppc.get_nwk(self.wf_ptr)
 		self.nspin = ppc.get_nspin(self.wf_ptr)
@@ -316,9 +591,37 @@ cdef class PseudoWavefunction:
 		"""
 		res = np.zeros(basis.nband * basis.nwk * basis.nspin, dtype = np.complex128)
 		cdef double complex[::1] resv = res
-		ppc.pseudoprojection(&resv[0], basis.wf_ptr, self.wf_ptr, band_num)
+		cdef int b = band_num
+		with nogil:
+			ppc.pseudoprojection(&resv[0], basis.wf_ptr, self.wf_ptr, b)
 		return res
 
+	def pseudoprojection_all(self, PseudoWavefunction basis):
+		"""
+		Computes <psibt_n1k|psit_n2k> for all n1, n2 and k, where
+		psibt are basis structures pseudowavefunctions and psit are
+		self pseudowavefunctions, with one matrix product per k-point
+		and spin.
+
+		Arguments:
+			basis (Pseudowavefunction): pseudowavefunctions onto whose bands
+				the bands of self are projected
+
+		Returns:
+			(np.array): complex array of shape
+				(self.nband, basis.nband, basis.nwk, basis.nspin),
+				where res[n2,n1,k,s] = <psibt_n1ks|psit_n2ks>.
+				res[n2].transpose(0,2,1).flatten() is
+				pseudoprojection(n2, basis).
+		"""
+		res = np.zeros(self.nband * basis.nband * basis.nwk * basis.nspin,
+			dtype = np.complex128)
+		cdef double complex[::1] resv = res
+		with nogil:
+			ppc.pseudoprojection_all(&resv[0], basis.wf_ptr, self.wf_ptr)
+		return res.reshape(self.nband, basis.nband, basis.nspin, basis.nwk)\
+			.transpose(0, 1, 3, 2)
+
 
 cdef class CWavefunction(PseudoWavefunction):
 	"""
@@ -335,6 +638,8 @@ cdef class CWavefunction(PseudoWavefunction):
 		int number_projector_elements: number of elements in the structure
 		readonly int projector_owner: Whether projector functions have
 			been initialized
+		readonly int single_precision: Whether the bands are projected
+			onto the projector functions in single precision
 	"""
 	
 	def __init__(self, PWFPointer pwf):
@@ -342,6 +647,7 @@ cdef class CWavefunction(PseudoWavefunction):
 		Initializes a CWavefunction from a PWFPointer
 		"""
 		self.projector_owner = 0
+		self.single_precision = 0
 		super(CWavefunction, self).__init__(pwf)
 
 	def _c_projector_setup(self, int num_elems, int num_sites,
@@ -384,10 +690,14 @@ cdef class CWavefunction(PseudoWavefunction):
 		cdef double[::1] rmaxs_v = rmaxs.astype(np.double)
 
 		print ("GRID ENCUT", grid_encut)
-		cdef ppc.ppot_t* projector_list = ppc.get_projector_list(
-							num_elems, &clabels_v[0], &ls_v[0], &wgrids_v[0],
+		cdef ppc.ppot_t* projector_list
+		cdef int cnum_elems = num_elems
+		cdef double cgrid_encut = grid_encut
+		with nogil:
+			projector_list = ppc.get_projector_list(
+							cnum_elems, &clabels_v[0], &ls_v[0], &wgrids_v[0],
 							&projectors_v[0], &aewaves_v[0], &pswaves_v[0],
-							&rmaxs_v[0], grid_encut)
+							&rmaxs_v[0], cgrid_encut)
 		end = time.monotonic()
 		print('--------------\nran get_projector_list in %f seconds\n---------------' % (end-start))
 
@@ -398,14 +708,61 @@ cdef class CWavefunction(PseudoWavefunction):
 
 		print("STARTING PROJSETUP")
 		sys.stdout.flush()
-		ppc.setup_projections(
-			self.wf_ptr, projector_list,
-			num_elems, num_sites, &self.dimv[0],
-			&self.nums[0], &self.coords[0]
-			)
+		cdef int cnum_sites = num_sites
+		with nogil:
+			ppc.setup_projections(
+				self.wf_ptr, projector_list,
+				cnum_elems, cnum_sites, &self.dimv[0],
+				&self.nums[0], &self.coords[0]
+				)
 
 		self.projector_owner = 1
 
+	def _restore_c_projector_setup(self, int num_elems, nums, coords, dim):
+		"""
+		Sets the projector attributes of a CWavefunction whose
+		pswf_t was read from a cache with its projections already
+		set up, instead of calling _c_projector_setup.
+		"""
+		self.number_projector_elements = num_elems
+		self.nums = np.array(nums, dtype = np.int32, copy = True)
+		self.coords = np.array(coords, dtype = np.float64, copy = True)
+		self.update_dimv(dim)
+		self.projector_owner = 1
+
+	def _write_cache(self, filename, key, band_props, double grid_encut, extra):
+		"""
+		Stores the wavefunction, including its projections if they are set
+		up, in the cache filename (see write_wfcache in wfcache.h).
+		band_props, the k-points and weights, and the 1D array extra
+		are stored as metadata, which PWFPointer.from_cache returns.
+
+		Returns:
+			True if the cache was written, False otherwise
+		"""
+		meta = np.concatenate([np.array(band_props, dtype=np.float64),
+			[len(self.kws)], np.array(self.kpts).ravel(), self.kws,
+			np.array(extra, dtype=np.float64)])
+		cdef double[::1] metav = np.ascontiguousarray(meta, dtype=np.float64)
+		return ppc.write_wfcache(str(filename).encode('utf-8'), key.encode('utf-8'),
+			self.wf_ptr, grid_encut, &metav[0], len(meta)) == 0
+
+	def _set_fft_precision(self, int single):
+		"""
+		Sets the precision of the FFTs that project the bands onto
+		the projector functions (see set_projection_precision in
+		projector.h). If the projectors are set up, the projections
+		are recomputed.
+		"""
+		cdef int* labels = NULL
+		cdef double* coords = NULL
+		if self.projector_owner:
+			labels = &self.nums[0]
+			coords = &self.coords[0]
+		with nogil:
+			ppc.set_projection_precision(self.wf_ptr, single, labels, coords)
+		self.single_precision = single
+
 	def update_dimv(self, dim):
 		dim = np.array(dim, dtype = np.int32, order = 'C', copy = False)
 		self.dimv = dim
@@ -519,10 +876,11 @@ cdef class CWavefunction(PseudoWavefunction):
 		return res
 
 	def _desymmetrized_pwf(self, structure, band_props, allkpts=None, weights=None,
-	                       symprec=1e-4, time_reversal_symmetry=True):
+	                       symprec=1e-4, time_reversal_symmetry=True,
+	                       virtual_budget=None):
 		return PWFPointer.from_pointer_and_kpts(<ppc.pswf_t*> self.wf_ptr, structure,
 							self.kpts, band_props, allkpts, weights, symprec,
-							time_reversal_symmetry)
+							time_reversal_symmetry, self, virtual_budget)
 
 	def _get_occs(self):
 		nk = self.nwk * self.nspin
@@ -643,7 +1001,7 @@ cdef class CProjector:
 	# HELPER FUNCTION ROUTINES FOR OVERLAP EVALUATION #
 	#-------------------------------------------------#
 
-	def _setup_overlap(self, site_cat, recip):
+	def _setup_overlap(self, site_cat, recip, N_RS_paths = None):
 
 		# set up site lists
 		self.M_R = np.array(site_cat[0], dtype=np.int32, order = 'C')
@@ -664,18 +1022,28 @@ cdef class CProjector:
 		cdef int* N_S = NULL if self.num_N_S == 0 else &self.N_S[0]
 		cdef int* N_RS_R = NULL if self.num_N_RS_R == 0 else &self.N_RS_R[0]
 		cdef int* N_RS_S = NULL if self.num_N_RS_S == 0 else &self.N_RS_S[0]
+
+		# minimum image paths between the N_RS pairs, computed in C if not given
+		cdef double[::1] pathsv
+		cdef double* paths = NULL
+		if N_RS_paths is not None and self.num_N_RS_R > 0:
+			pathsv = np.ascontiguousarray(np.array(N_RS_paths,
+				dtype=np.float64).flatten())
+			paths = &pathsv[0]
 		
 		# choose function
-		if recip:
-			ppc.overlap_setup_recip(self.basis.wf_ptr, self.wf.wf_ptr,
-				&self.basis.nums[0], &self.wf.nums[0], &self.basis.coords[0], &self.wf.coords[0],
-				N_R, N_S, N_RS_R, N_RS_S,
-				self.num_N_R, self.num_N_S, self.num_N_RS_R)
-		else:
-			ppc.overlap_setup_real(self.basis.wf_ptr, self.wf.wf_ptr,
-				&self.basis.nums[0], &self.wf.nums[0], &self.basis.coords[0], &self.wf.coords[0],
-				N_R, N_S, N_RS_R, N_RS_S,
-				self.num_N_R, self.num_N_S, self.num_N_RS_R)
+		cdef bint crecip = recip
+		with nogil:
+			if crecip:
+				ppc.overlap_setup_recip(self.basis.wf_ptr, self.wf.wf_ptr,
+					&self.basis.nums[0], &self.wf.nums[0], &self.basis.coords[0], &self.wf.coords[0],
+					N_R, N_S, N_RS_R, N_RS_S, paths,
+					self.num_N_R, self.num_N_S, self.num_N_RS_R)
+			else:
+				ppc.overlap_setup_real(self.basis.wf_ptr, self.wf.wf_ptr,
+					&self.basis.nums[0], &self.wf.nums[0], &self.basis.coords[0], &self.wf.coords[0],
+					N_R, N_S, N_RS_R, N_RS_S, paths,
+					self.num_N_R, self.num_N_S, self.num_N_RS_R)
 
 	def _add_augmentation_terms(self, np.ndarray[double complex, ndim=1] res, band_num):
 		
@@ -690,11 +1058,13 @@ cdef class CProjector:
 		cdef int* N_RS_S = NULL if self.num_N_RS_S == 0 else &self.N_RS_S[0]
 
 		# call compensation terms C routine
-		ppc.compensation_terms(&resv[0], band_num, self.wf.wf_ptr, self.basis.wf_ptr,
-			self.num_M_R, self.num_N_R, self.num_N_S, self.num_N_RS_R,
-			M_R, M_S, N_R, N_S, N_RS_R, N_RS_S,
-			&self.wf.nums[0], &self.wf.coords[0], &self.basis.nums[0], &self.basis.coords[0],
-			&self.wf.dimv[0])
+		cdef int cband_num = band_num
+		with nogil:
+			ppc.compensation_terms(&resv[0], cband_num, self.wf.wf_ptr, self.basis.wf_ptr,
+				self.num_M_R, self.num_N_R, self.num_N_S, self.num_N_RS_R,
+				M_R, M_S, N_R, N_S, N_RS_R, N_RS_S,
+				&self.wf.nums[0], &self.wf.coords[0], &self.basis.nums[0], &self.basis.coords[0],
+				&self.wf.dimv[0])
 
 	def _projection_recip(self, np.ndarray[double complex, ndim=1] res, band_num):
 		
@@ -709,11 +1079,57 @@ cdef class CProjector:
 		cdef int* N_RS_S = NULL if self.num_N_RS_S == 0 else &self.N_RS_S[0]
 
 		# call compensation terms C routine
-		ppc.compensation_terms_recip(&resv[0], band_num, self.wf.wf_ptr, self.basis.wf_ptr,
-			self.num_M_R, self.num_N_R, self.num_N_S, self.num_N_RS_R,
-			M_R, M_S, N_R, N_S, N_RS_R, N_RS_S,
-			&self.wf.nums[0], &self.wf.coords[0], &self.basis.nums[0], &self.basis.coords[0],
-			&self.wf.dimv[0])
+		cdef int cband_num = band_num
+		with nogil:
+			ppc.compensation_terms_recip(&resv[0], cband_num, self.wf.wf_ptr, self.basis.wf_ptr,
+				self.num_M_R, self.num_N_R, self.num_N_S, self.num_N_RS_R,
+				M_R, M_S, N_R, N_S, N_RS_R, N_RS_S,
+				&self.wf.nums[0], &self.wf.coords[0], &self.basis.nums[0], &self.basis.coords[0],
+				&self.wf.dimv[0])
+
+	def _add_augmentation_terms_batch(self, np.ndarray[double complex, ndim=2] res):
+		"""
+		Adds the compensation terms for every band of the wavefunction
+		to res, which has shape (wf.nband, basis.nband * basis.nwk * basis.nspin).
+		"""
+		self._compensation_terms_batch(res, False)
+
+	def _projection_recip_batch(self, np.ndarray[double complex, ndim=2] res):
+		"""
+		Same as _add_augmentation_terms_batch for reciprocal space
+		augmentation (see _projection_recip).
+		"""
+		self._compensation_terms_batch(res, True)
+
+	def _compensation_terms_batch(self, np.ndarray[double complex, ndim=2] res, recip):
+		
+		cdef double complex[:,::1] resv = res
+		cdef int[::1] band_nums = np.arange(self.wf.nband, dtype=np.int32)
+
+		# set up site lists
+		cdef int* M_R = NULL if self.num_M_R == 0 else &self.M_R[0]
+		cdef int* M_S = NULL if self.num_M_S == 0 else &self.M_S[0]
+		cdef int* N_R = NULL if self.num_N_R == 0 else &self.N_R[0]
+		cdef int* N_S = NULL if self.num_N_S == 0 else &self.N_S[0]
+		cdef int* N_RS_R = NULL if self.num_N_RS_R == 0 else &self.N_RS_R[0]
+		cdef int* N_RS_S = NULL if self.num_N_RS_S == 0 else &self.N_RS_S[0]
+
+		cdef bint crecip = recip
+		with nogil:
+			if crecip:
+				ppc.compensation_terms_recip_batch(&resv[0,0], self.wf.nband, &band_nums[0],
+					self.wf.wf_ptr, self.basis.wf_ptr,
+					self.num_M_R, self.num_N_R, self.num_N_S, self.num_N_RS_R,
+					M_R, M_S, N_R, N_S, N_RS_R, N_RS_S,
+					&self.wf.nums[0], &self.wf.coords[0], &self.basis.nums[0], &self.basis.coords[0],
+					&self.wf.dimv[0])
+			else:
+				ppc.compensation_terms_batch(&resv[0,0], self.wf.nband, &band_nums[0],
+					self.wf.wf_ptr, self.basis.wf_ptr,
+					self.num_M_R, self.num_N_R, self.num_N_S, self.num_N_RS_R,
+					M_R, M_S, N_R, N_S, N_RS_R, N_RS_S,
+					&self.wf.nums[0], &self.wf.coords[0], &self.basis.nums[0], &self.basis.coords[0],
+					&self.wf.dimv[0])
 
 	def _realspace_projection(self, int band_num, np.ndarray dim):
 		res = np.zeros(self.basis.nband * self.basis.nwk * self.basis.nspin,
@@ -742,16 +1158,10 @@ cdef class CMomentumMatrix:
 		ppc.free_density_ft_elem_list(self.elem_density_transforms, self.wf.num_elems)
 
 	def _setup_momentum_grid(self):
-		cdef double nb1max = 0
-		cdef double nb2max = 0
-		cdef double nb3max = 0
-		cdef int npmax = 0
-		ppc.momentum_grid_size(self.wf.wf_ptr, &nb1max, &nb2max, &nb3max, &npmax, self.momentum_encut)
-		grid = np.ascontiguousarray(np.zeros(3 * npmax, dtype=np.int32))
-		cdef int[::1] gridv = grid
-		actual_size = ppc.get_momentum_grid(&gridv[0], self.wf.wf_ptr,
-											nb1max, nb2max, nb3max, self.momentum_encut)
-		self.ggrid = grid[:3*actual_size]
+		actual_size = ppc.get_momentum_grid(NULL, 0, self.wf.wf_ptr, self.momentum_encut)
+		self.ggrid = np.zeros(3 * actual_size, dtype=np.int32)
+		cdef int[::1] gridv = self.ggrid
+		ppc.get_momentum_grid(&gridv[0], actual_size, self.wf.wf_ptr, self.momentum_encut)
 
 		self.gbounds = np.zeros(6, dtype=np.int32)
 		self.gdim = np.zeros(3, dtype=np.int32)
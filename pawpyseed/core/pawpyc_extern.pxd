@@ -2,7 +2,7 @@
 from libc.stdio cimport FILE
 
 
-cdef extern from "utils.h":
+cdef extern from "utils.h" nogil:
 
     ctypedef struct  funcset_t:
         int l
@@ -30,6 +30,7 @@ cdef extern from "utils.h":
         double* pspw_overlap_matrix
         double* aepw_overlap_matrix
         double* diff_overlap_matrix
+        double* aug_diff_matrix
         int proj_gridsize
         int wave_gridsize
         int num_cart_gridpts
@@ -45,6 +46,60 @@ cdef extern from "utils.h":
         int* ls
         int* ms
         double complex* overlaps
+    ctypedef struct  symm_map_t:
+        int num_waves
+        int* Gs
+        int* gmaps
+        double dr[3]
+        int tr
+        int G_min[3]
+        double complex* phases[3]
+    ctypedef struct  coeff_cache_t:
+        int fd
+        long budget
+        long used
+        int num_slots
+        long* offsets
+        int* num_waves
+        float complex** coeffs
+        int* pins
+        char* loading
+        int* prev
+        int* next
+        int head
+        int tail
+        void* lock
+        int record_size
+        int storage
+        unsigned short** compact
+        float* scales
+        void** sources
+        symm_map_t** symm
+    ctypedef struct  arena_t:
+        char* block
+        long used
+        long size
+        long pad[5]
+    ctypedef struct  setup_cache_t:
+        int setup_count
+        int num_wp_sites
+        int max_wp_sites
+        unsigned long* wp_keys
+        double* wp_coords
+        int* wp_fftg
+        int* wp_last_used
+        projection_t** wp
+        int num_pairs
+        int max_pairs
+        unsigned long* pair_keys
+        double* pair_dcoords
+        int* pair_sizes
+        int* pair_last_used
+        double complex** pair_overlaps
+        int num_aug_sites
+        unsigned long* aug_keys
+        double* aug_coords
+        int aug_fftg[3]
     ctypedef struct  band_t:
         int n
         int num_waves
@@ -58,6 +113,8 @@ cdef extern from "utils.h":
         projection_t* up_projections
         projection_t* down_projections
         projection_t* wave_projections
+        coeff_cache_t* cache
+        int cache_slot
     ctypedef struct  rayleigh_set_t:
         int l
         double complex* terms
@@ -70,6 +127,10 @@ cdef extern from "utils.h":
         int num_bands
         band_t** bands
         rayleigh_set_t** expansion
+        float complex* coeffs
+        int ld
+        symm_map_t* symm
+        int gamma
     ctypedef struct  pswf_t:
         double encut
         int num_elems
@@ -85,10 +146,20 @@ cdef extern from "utils.h":
         double* reclattice
         int* fftg
         int is_ncl
+        int is_gamma
+        int fft_precision
         int wp_num
         int num_aug_overlap_sites
         double* dcoords
         double complex** overlaps
+        char* wavecar_map
+        long wavecar_map_size
+        coeff_cache_t* cache
+        arena_t* proj_arenas
+        arena_t* wp_arenas
+        int num_proj_arenas
+        int num_wp_arenas
+        setup_cache_t* setup_cache
     ctypedef struct  projgrid_t:
         double complex* values
     ctypedef struct  real_proj_t:
@@ -108,6 +179,17 @@ cdef extern from "utils.h":
         int* indices
         double* paths
         real_proj_t* projs
+    ctypedef struct  gsphere_t:
+        double reclattice[9]
+        double encut
+        double r2
+        double h3
+        double b11
+        double b12
+        double b13
+        double u22
+        double u23
+        double u33
     cdef void affine_transform(double* out, double* op, double* inv)
     cdef void rotation_transform(double* out, double* op, double* inv)
     cdef int min(int a, int b)
@@ -116,6 +198,12 @@ cdef extern from "utils.h":
     cdef double dot(double* x1, double* x2)
     cdef double mag(double* x1)
     cdef double determinant(double* m)
+    cdef gsphere_t make_gsphere(double* reclattice, double encut)
+    cdef int gsphere_points(int* igall, int* G_bounds, gsphere_t* gs, double* k, int max_points)
+    cdef int gsphere_half_points(int* igall, int* G_bounds, gsphere_t* gs, int max_points)
+    cdef double gamma_dot(float complex* C1, float complex* C2, int num_waves)
+    cdef void gamma_gemm(int m, int n, int num_waves, float complex* A, int lda,
+        float complex* B, int ldb, float* out)
     cdef double dist_from_frac(double* coords1, double* coords2, double* lattice)
     cdef void frac_to_cartesian(double* coord, double* lattice)
     cdef void cartesian_to_frac(double* coord, double* reclattice)
@@ -124,6 +212,8 @@ cdef extern from "utils.h":
     cdef double complex trilinear_interpolate(double complex* c, double* frac, int* fftg)
     cdef void free_projection_list(projection_t* projlist, int num)
     cdef void clean_wave_projections(pswf_t* wf)
+    cdef void free_setup_cache(setup_cache_t* cache)
+    cdef void alloc_coeff_slab(kpoint_t* kpt)
     cdef void free_kpoint(kpoint_t* kpt, int num_elems, int num_sites, int wp_num, int* num_projs)
     cdef void free_ppot(ppot_t* pp)
     cdef void free_real_proj(real_proj_t* proj)
@@ -132,11 +222,21 @@ cdef extern from "utils.h":
     cdef void free_ptr(void* ptr)
     cdef void free_real_proj_site_list(real_proj_site_t* sites, int length)
     cdef void free_ppot_list(ppot_t* pps, int length)
+    cdef arena_t* make_arena_list(int num)
+    cdef void* arena_alloc(arena_t* arena, long size)
+    cdef void free_arena_list(arena_t* arenas, int num)
+    cdef coeff_cache_t* make_coeff_cache(int fd, int num_slots, long budget,
+        int record_size, int storage)
+    cdef void store_compact_coeffs(coeff_cache_t* cache, int slot, float complex* Cs, int num_waves)
+    cdef float complex* acquire_coeffs(band_t* band)
+    cdef void release_coeffs(band_t* band)
+    cdef void free_coeff_cache(coeff_cache_t* cache)
     cdef double* get_occs(pswf_t* wf)
     cdef int get_nband(pswf_t* wf)
     cdef int get_nwk(pswf_t* wf)
     cdef int get_nspin(pswf_t* wf)
     cdef int is_ncl(pswf_t* wf)
+    cdef int is_gamma(pswf_t* wf)
     cdef double get_encut(pswf_t* wf)
     cdef double get_energy(pswf_t* wf, int band, int kpt, int spin)
     cdef double get_occ(pswf_t* wf, int band, int kpt, int spin)
@@ -170,12 +270,14 @@ cdef extern from "utils.h":
     cdef double sbf(double x, int l)
     cdef pswf_t* expand_symm_wf(pswf_t* rwf, int num_kpts, int* maps,
         double* ops, double* drs, double* kws, int* trs)
+    cdef pswf_t* expand_symm_wf_virtual(pswf_t* rwf, int num_kpts, int* maps,
+        double* ops, double* drs, double* kws, int* trs, long cache_budget)
     cdef void CHECK_ALLOCATION(void* ptr)
     cdef void ALLOCATION_FAILED()
     cdef void CHECK_STATUS(int status)
     
 
-cdef extern from "projector.h":
+cdef extern from "projector.h" nogil:
 
     cdef ppot_t* get_projector_list(int num_els, int* labels, int* ls, double* wave_grids,
         double* projectors, double* aewaves, double* pswaves, double* rmaxs, double grid_encut)
@@ -185,28 +287,38 @@ cdef extern from "projector.h":
         double* lattice, double* reclattice, ppot_t* pps, int* fftg)
     cdef void onto_projector_helper(band_t* band, double complex* x, real_proj_site_t* sites,
         int num_sites, double* lattice, double* reclattice, double* kpt, int num_cart_gridpts,
-        int* fftg, projection_t* projections)
+        int* fftg, projection_t* projections, arena_t* arena)
     cdef void get_aug_freqs_helper(band_t* band, double complex* x, real_proj_site_t* sites,
         int num_sites, double* lattice, double* reclattice, double* kpt, int num_cart_gridpts,
         int* fftg, projection_t* projections)
     cdef void onto_projector(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
-        int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg)
+        int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg,
+        arena_t* arena)
     cdef void onto_projector_ncl(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
-        int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg)
+        int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg,
+        arena_t* arena)
     cdef void onto_smoothpw(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
-        int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg)
+        int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg,
+        arena_t* arena)
     cdef void get_aug_freqs(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
         int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg)
     cdef void add_num_cart_gridpts(ppot_t* pp_ptr, double* lattice, int* fftg)
     cdef void make_pwave_overlap_matrices(ppot_t* pp_ptr)
     cdef void setup_projections(pswf_t* wf, ppot_t* pps, int num_elems,
         int num_sites, int* fftg, int* labels, double* coords)
+    cdef void set_projection_precision(pswf_t* wf, int single, int* labels, double* coords)
+    cdef int make_site_lists(double* lattice, int num_R, double* coords_R, int* elems_R,
+        double* rmax_R, int num_S, double* coords_S, int* elems_S, double* rmax_S,
+        double tol, int* M_R, int* M_S, int* N_R, int* N_S, int* counts,
+        int max_pairs, int* N_RS_R, int* N_RS_S, double* N_RS_paths)
     cdef void overlap_setup_real(pswf_t* wf_R, pswf_t* wf_S,
         int* labels_R, int* labels_S, double* coords_R, double* coords_S,
-        int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, int num_N_R, int num_N_S, int num_N_RS)
+        int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, double* N_RS_paths,
+        int num_N_R, int num_N_S, int num_N_RS)
     cdef void overlap_setup_recip(pswf_t* wf_R, pswf_t* wf_S,
         int* labels_R, int* labels_S, double* coords_R, double* coords_S,
-        int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, int num_N_R, int num_N_S, int num_N_RS)
+        int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, double* N_RS_paths,
+        int num_N_R, int num_N_S, int num_N_RS)
     cdef void compensation_terms(double complex* overlap, int BAND_NUM, pswf_t* wf_S, pswf_t* wf_R,
         int num_M, int num_N_R, int num_N_S, int num_N_RS,
         int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
@@ -217,36 +329,65 @@ cdef extern from "projector.h":
         int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
         int* proj_labels, double* proj_coords, int* ref_labels, double* ref_coords,
         int* fft_grid)
+    cdef void compensation_terms_batch(double complex* overlap, int num_bands, int* band_nums,
+        pswf_t* wf_S, pswf_t* wf_R,
+        int num_M, int num_N_R, int num_N_S, int num_N_RS,
+        int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
+        int* proj_labels, double* proj_coords, int* ref_labels, double* ref_coords,
+        int* fft_grid)
+    cdef void compensation_terms_recip_batch(double complex* overlap, int num_bands, int* band_nums,
+        pswf_t* wf_S, pswf_t* wf_R,
+        int num_M, int num_N_R, int num_N_S, int num_N_RS,
+        int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
+        int* proj_labels, double* proj_coords, int* ref_labels, double* ref_coords,
+        int* fft_grid)
     cdef double* besselt(double* r, double* k, double* f, double encut, int N, int l)
     
 
-cdef extern from "pseudoprojector.h":
+cdef extern from "pseudoprojector.h" nogil:
 
     cdef void vc_pseudoprojection(pswf_t* wf_ref, pswf_t* wf_proj, int BAND_NUM, double* results)
     cdef void pseudoprojection(double complex* projections, pswf_t* wf_ref, pswf_t* wf_proj, int BAND_NUM)
+    cdef void pseudoprojection_all(double complex* projections, pswf_t* wf_ref, pswf_t* wf_proj)
     
 
-cdef extern from "reader.h":
+cdef extern from "reader.h" nogil:
 
     ctypedef struct  WAVECAR:
         int type
         FILE* fp
         char* start
         char* curr
+        long size
+        void* zfp
+        long pos
+    ctypedef struct  wavecar_selection_t:
+        int band_min
+        int band_max
+        int num_kpts
+        int* kpt_inds
+        int spin
     cdef WAVECAR* wcopen(char* f, int type)
-    cdef void wcseek(WAVECAR* wc, long loc)
-    cdef void wcread(void* ptr0, long size, long nmemb, WAVECAR* wc)
+    cdef int wcseek(WAVECAR* wc, long loc)
+    cdef int wcread(void* ptr0, long size, long nmemb, WAVECAR* wc)
+    cdef int wcpread(void* ptr0, long size, long loc, WAVECAR* wc)
     cdef void wcclose(WAVECAR* wc)
     cdef void setup(int nspin, int nwk, int nband,
         double* nb1, double* nb2, double* nb3, int* np, double ecut,
         double* lattice, double* reclattice)
-    cdef pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights)
+    cdef pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights, long cache_budget,
+        wavecar_selection_t* sel, int storage)
     cdef pswf_t* read_wavefunctions(char* filename, double* kpt_weights)
     cdef pswf_t* read_wavefunctions_from_str(char* start, double* kpt_weights)
+    cdef pswf_t* read_wavefunctions_compressed(char* filename, double* kpt_weights, int compression)
+    cdef pswf_t* read_wavefunctions_mapped(char* filename, double* kpt_weights)
+    cdef pswf_t* read_wavefunctions_lazy(char* filename, double* kpt_weights, long cache_budget)
+    cdef pswf_t* read_wavefunctions_select(char* filename, double* kpt_weights, int type,
+        long cache_budget, wavecar_selection_t* sel, int storage)
     cdef kpoint_t** read_one_band(int* G_bounds, double* kpt_weights, int* ns, int* nk, int* nb, int BAND_NUM, char* filename)
     
 
-cdef extern from "density.h":
+cdef extern from "density.h" nogil:
 
     cdef void realspace_state(double complex* x, int BAND_NUM, int KPOINT_NUM,
         pswf_t* wf, int* fftg, int* labels, double* coords)
@@ -275,7 +416,7 @@ cdef extern from "density.h":
         int* fftg, int* labels, double* coords)
     
 
-cdef extern from "sbt.h":
+cdef extern from "sbt.h" nogil:
 
     ctypedef struct  sbt_descriptor_t:
             double kmin
@@ -296,15 +437,27 @@ cdef extern from "sbt.h":
     cdef void free_sbt_descriptor(sbt_descriptor_t* d)
     
 
-cdef extern from "linalg.h":
+cdef extern from "linalg.h" nogil:
 
+    cdef void* get_fft_plan(int dim, int* lengths, int howmany,
+        int precision, int domain, int direction, double scale)
+    cdef void* get_strided_fft_plan(int length, int howmany, int stride, int distance,
+        int batch, int batch_distance, int precision, int direction, double scale)
+    cdef void free_fft_plans()
     cdef void fft3d(double complex* x, int* G_bounds, double* lattice,
         double* kpt, int* Gs, float complex* Cs, int num_waves, int* fftg)
     cdef void fwd_fft3d(double complex* x, int* G_bounds, double* lattice,
         double* kpt, int* Gs, float complex* Cs, int num_waves, int* fftg)
+    cdef int fft_batch_size(int* fftg, int num_bands, int num_kpts)
+    cdef void fft3d_bands(double complex* x, double* lattice, kpoint_t* kpt,
+        band_t** bands, int num_bands, int* fftg)
+    cdef void fft3d_bands_single(float complex* x, double* lattice, kpoint_t* kpt,
+        band_t** bands, int num_bands, int* fftg)
+    cdef void fwd_fft3d_batch(double complex* x, double* lattice, kpoint_t* kpt,
+        float complex** Cs, int num_bands, int* fftg)
     
 
-cdef extern from "radial.h":
+cdef extern from "radial.h" nogil:
 
     cdef double complex offsite_wave_overlap(double* dcoord, double* r1, double* f1, double** spline1, int size1,
         double* r2, double* f2, double** spline2, int size2,
@@ -315,7 +468,7 @@ cdef extern from "radial.h":
         double* lattice, int l1, int m1, int l2, int m2)
     
 
-cdef extern from "momentum.h":
+cdef extern from "momentum.h" nogil:
 
     ctypedef struct  transform_spline_t:
         double* transform
@@ -358,7 +511,7 @@ cdef extern from "momentum.h":
                             double encut)
     cdef void momentum_grid_size(pswf_t* wf, double* nb1max, double* nb2max, double* nb3max,
                             int* npmax, double encut)
-    cdef int get_momentum_grid(int* igall, pswf_t* wf, double nb1max, double nb2max, double nb3max, double encut)
+    cdef int get_momentum_grid(int* igall, int max_points, pswf_t* wf, double encut)
     cdef void grid_bounds(int* G_bounds, int* gdim, int* igall, int num_waves)
     cdef void list_to_grid_map(int* grid, int* G_bounds, int* gdim, int* igall, int num_waves)
     cdef void fill_grid(float complex* x, int* Gs, float complex* Cs, int* fftg, int numg)
@@ -368,4 +521,33 @@ cdef extern from "momentum.h":
         int l, int m, double* pos)
     cdef double complex quick_overlap(int* dG, double complex* C1s, double complex* C2s, int numg,
         int* Gs, int* gmap, int* G_bounds, int* gdim)
+    
+
+cdef extern from "wfcache.h" nogil:
+
+    cdef int write_wfcache(char* filename, char* key, pswf_t* wf,
+        double grid_encut, double* meta, int num_meta)
+    cdef int wfcache_num_meta(char* filename, char* key)
+    cdef pswf_t* read_wfcache(char* filename, char* key, double* meta,
+        long cache_budget, int storage)
+    
+
+cdef extern from "backend.h" nogil:
+
+    cdef void* backend_malloc(size_t size, int alignment)
+    cdef void* backend_calloc(size_t num, size_t size, int alignment)
+    cdef void backend_free(void* ptr)
+    cdef void backend_free_buffers()
+    cdef void backend_defer_buffer_frees(int defer)
+    cdef void backend_set_thread_count(int num_threads)
+    cdef int backend_get_thread_count()
+    cdef const char* fft_backend_name()
+    cdef const char* blas_backend_name()
+    cdef const char* fft_error_message(int status)
+    cdef void* create_fft_plan(int dim, int* lengths, int howmany,
+        int precision, int domain, int direction, double scale)
+    cdef void* create_strided_fft_plan(int length, int howmany, int stride, int distance,
+        int batch, int batch_distance, int precision, int direction, double scale)
+    cdef void execute_fft_plan(void* plan, void* input, void* output)
+    cdef void destroy_fft_plan(void* plan)
     
\ No newline at end of file
@@ -1,13 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <complex.h>
 #include <math.h>
 #include <omp.h>
 #include <time.h>
 #include "utils.h"
 #include "projector.h"
-#include <mkl.h>
-#include <mkl_types.h>
+#include "backend.h"
 #include "linalg.h"
 #include "quadrature.h"
 #include "radial.h"
@@ -42,6 +42,7 @@ ppot_t* get_projector_list(int num_els, int* labels, int* ls, double* wave_grids
 		pps[i].pspw_overlap_matrix = NULL;
 		pps[i].aepw_overlap_matrix = NULL;
 		pps[i].diff_overlap_matrix = NULL;
+		pps[i].aug_diff_matrix = NULL;
 		for (int j = 0; j < pps[i].wave_gridsize; j++) {
 			pps[i].wave_grid[j] = wave_grids[wgt];
 			wgt++;
@@ -152,16 +153,13 @@ ppot_t* get_projector_list(int num_els, int* labels, int* ls, double* wave_grids
 			funcs[k].smooth_diffwave = sdw;
 			funcs[k].smooth_diffwave_spline = sdw_spline;
 			free(smooth_diffwave);
-			free(smooth_wave_spline[0]);
-			free(smooth_wave_spline[1]);
-			free(smooth_wave_spline[2]);
 			free(smooth_wave_spline);
 		}
 		free_sbt_descriptor(d);
 		pps[i].funcs = funcs;
 		make_pwave_overlap_matrices(pps+i);
 	}
-	mkl_free_buffers();
+	backend_free_buffers();
 	printf("finished making projector list\n");
 	return pps;
 }
@@ -213,7 +211,7 @@ real_proj_site_t* smooth_pw_values(int num_N, int* Nlst, int* labels, double* co
 
 void onto_projector_helper(band_t* band, double complex* x, real_proj_site_t* sites,
 	int num_sites, double* lattice, double* reclattice, double* kpt, int num_cart_gridpts,
-	int* fftg, projection_t* projections) {
+	int* fftg, projection_t* projections, arena_t* arena) {
 
 	double dv = determinant(lattice) / fftg[0] / fftg[1] / fftg[2];
 
@@ -235,14 +233,11 @@ void onto_projector_helper(band_t* band, double complex* x, real_proj_site_t* si
 		indices = sites[s].indices;
 		projections[s].num_projs = sites[s].num_projs;
 		projections[s].total_projs = sites[s].total_projs;
-		projections[s].ns = malloc(sites[s].total_projs * sizeof(int));
-		projections[s].ls = malloc(sites[s].total_projs * sizeof(int));
-		projections[s].ms = malloc(sites[s].total_projs * sizeof(int));
-		projections[s].overlaps = (double complex*) malloc(sites[s].total_projs * sizeof(double complex));
-		CHECK_ALLOCATION(projections[s].ns);
-		CHECK_ALLOCATION(projections[s].ls);
-		CHECK_ALLOCATION(projections[s].ms);
-		CHECK_ALLOCATION(projections[s].overlaps);
+		projections[s].ns = arena_alloc(arena, sites[s].total_projs * sizeof(int));
+		projections[s].ls = arena_alloc(arena, sites[s].total_projs * sizeof(int));
+		projections[s].ms = arena_alloc(arena, sites[s].total_projs * sizeof(int));
+		projections[s].overlaps = (double complex*) arena_alloc(arena,
+			sites[s].total_projs * sizeof(double complex));
 		for (int i = 0; i < num_indices; i++) {
 			index = indices[i];
 			kdotr = dot(kpt_cart, sites[s].paths+i*3);
@@ -260,6 +255,193 @@ void onto_projector_helper(band_t* band, double complex* x, real_proj_site_t* si
 	free(xvals);
 }
 
+/*
+Same as onto_projector_helper for num_bands grids stored one after another
+in x, with the projections of grid b written to projections[b]. The phases
+of the grid points are computed once for all the grids, and the overlaps
+with each projector are computed for all the grids with one zgemv.
+*/
+static void onto_projector_batch_helper(double complex* x, int num_bands,
+	real_proj_site_t* sites, int num_sites, double* lattice, double* reclattice,
+	double* kpt, int num_cart_gridpts, int* fftg, projection_t** projections,
+	arena_t* arena) {
+
+	int gridsize = fftg[0] * fftg[1] * fftg[2];
+	double dv = determinant(lattice) / gridsize;
+
+	double kpt_cart[3] = {0,0,0};
+	kpt_cart[0] = kpt[0];
+	kpt_cart[1] = kpt[1];
+	kpt_cart[2] = kpt[2];
+	frac_to_cartesian(kpt_cart, reclattice);
+	double complex one = 1, zero = 0;
+	// xvals holds the values of band b at the points of a site in row b
+	double complex* xvals = (double complex*) malloc(
+		(long) num_bands * num_cart_gridpts * sizeof(double complex));
+	double complex* overlaps = (double complex*) malloc(num_bands * sizeof(double complex));
+	CHECK_ALLOCATION(xvals);
+	CHECK_ALLOCATION(overlaps);
+
+	for (int s = 0; s < num_sites; s++) {
+		int num_indices = sites[s].num_indices;
+		int* indices = sites[s].indices;
+		int total_projs = sites[s].total_projs;
+		for (int b = 0; b < num_bands; b++) {
+			projection_t* proj = projections[b] + s;
+			proj->num_projs = sites[s].num_projs;
+			proj->total_projs = total_projs;
+			proj->ns = arena_alloc(arena, total_projs * sizeof(int));
+			proj->ls = arena_alloc(arena, total_projs * sizeof(int));
+			proj->ms = arena_alloc(arena, total_projs * sizeof(int));
+			proj->overlaps = (double complex*) arena_alloc(arena,
+				total_projs * sizeof(double complex));
+			for (int p = 0; p < total_projs; p++) {
+				proj->ns[p] = sites[s].projs[p].func_num;
+				proj->ls[p] = sites[s].projs[p].l;
+				proj->ms[p] = sites[s].projs[p].m;
+			}
+		}
+		for (int i = 0; i < num_indices; i++) {
+			int index = indices[i];
+			double complex phase = cexp(I * dot(kpt_cart, sites[s].paths+i*3));
+			for (int b = 0; b < num_bands; b++) {
+				xvals[(long) b * num_indices + i] = x[(long) b * gridsize + index] * dv * phase;
+			}
+		}
+		for (int p = 0; p < total_projs; p++) {
+			if (num_indices == 0) {
+				for (int b = 0; b < num_bands; b++) {
+					projections[b][s].overlaps[p] = 0;
+				}
+				continue;
+			}
+			// overlaps[b] = conj(<p|psit_b>)
+			cblas_zgemv(CblasColMajor, CblasConjTrans, num_indices, num_bands,
+				&one, xvals, num_indices, sites[s].projs[p].values, 1,
+				&zero, overlaps, 1);
+			for (int b = 0; b < num_bands; b++) {
+				projections[b][s].overlaps[p] = conj(overlaps[b]);
+			}
+		}
+	}
+	free(xvals);
+	free(overlaps);
+}
+
+/*
+Same as onto_projector_batch_helper for grids in single precision
+(see fft3d_bands_single). The projector values of each site are converted
+to single precision once, and the overlaps of all the projectors with
+all the grids are computed with one cgemm.
+*/
+static void onto_projector_batch_helper_single(float complex* x, int num_bands,
+	real_proj_site_t* sites, int num_sites, double* lattice, double* reclattice,
+	double* kpt, int num_cart_gridpts, int* fftg, projection_t** projections,
+	arena_t* arena) {
+
+	int gridsize = fftg[0] * fftg[1] * fftg[2];
+	double dv = determinant(lattice) / gridsize;
+
+	double kpt_cart[3] = {0,0,0};
+	kpt_cart[0] = kpt[0];
+	kpt_cart[1] = kpt[1];
+	kpt_cart[2] = kpt[2];
+	frac_to_cartesian(kpt_cart, reclattice);
+	float complex one = 1, zero = 0;
+	int max_projs = 0;
+	for (int s = 0; s < num_sites; s++) {
+		max_projs = max(max_projs, sites[s].total_projs);
+	}
+	// xvals holds the values of band b at the points of a site in column b,
+	// and pvals the values of projector p in column p
+	float complex* xvals = (float complex*) malloc(
+		(long) num_bands * num_cart_gridpts * sizeof(float complex));
+	float complex* pvals = (float complex*) malloc(
+		(long) max_projs * num_cart_gridpts * sizeof(float complex));
+	float complex* overlaps = (float complex*) malloc(
+		(long) num_bands * max_projs * sizeof(float complex));
+	CHECK_ALLOCATION(xvals);
+	CHECK_ALLOCATION(pvals);
+	CHECK_ALLOCATION(overlaps);
+
+	for (int s = 0; s < num_sites; s++) {
+		int num_indices = sites[s].num_indices;
+		int* indices = sites[s].indices;
+		int total_projs = sites[s].total_projs;
+		for (int b = 0; b < num_bands; b++) {
+			projection_t* proj = projections[b] + s;
+			proj->num_projs = sites[s].num_projs;
+			proj->total_projs = total_projs;
+			proj->ns = arena_alloc(arena, total_projs * sizeof(int));
+			proj->ls = arena_alloc(arena, total_projs * sizeof(int));
+			proj->ms = arena_alloc(arena, total_projs * sizeof(int));
+			proj->overlaps = (double complex*) arena_alloc(arena,
+				total_projs * sizeof(double complex));
+			for (int p = 0; p < total_projs; p++) {
+				proj->ns[p] = sites[s].projs[p].func_num;
+				proj->ls[p] = sites[s].projs[p].l;
+				proj->ms[p] = sites[s].projs[p].m;
+				proj->overlaps[p] = 0;
+			}
+		}
+		if (num_indices == 0) {
+			continue;
+		}
+		for (int i = 0; i < num_indices; i++) {
+			int index = indices[i];
+			float complex phase = (float complex) (dv
+				* cexp(I * dot(kpt_cart, sites[s].paths+i*3)));
+			for (int b = 0; b < num_bands; b++) {
+				xvals[(long) b * num_indices + i] = x[(long) b * gridsize + index] * phase;
+			}
+		}
+		for (int p = 0; p < total_projs; p++) {
+			double complex* values = sites[s].projs[p].values;
+			for (int i = 0; i < num_indices; i++) {
+				pvals[(long) p * num_indices + i] = (float complex) values[i];
+			}
+		}
+		// overlaps[b * total_projs + p] = <p|psit_b>
+		cblas_cgemm(CblasColMajor, CblasConjTrans, CblasNoTrans,
+			total_projs, num_bands, num_indices, &one, pvals, num_indices,
+			xvals, num_indices, &zero, overlaps, total_projs);
+		for (int b = 0; b < num_bands; b++) {
+			for (int p = 0; p < total_projs; p++) {
+				projections[b][s].overlaps[p] = overlaps[b * total_projs + p];
+			}
+		}
+	}
+	free(xvals);
+	free(pvals);
+	free(overlaps);
+}
+
+/*
+Transforms the num_bands bands of kpt starting at bands to real space
+in x, which holds batch grids, and projects them onto sites, writing the
+projections of band b to projections[b]. The transforms and projections
+are in single precision if wf->fft_precision is FFT_SINGLE and kpt is
+not a gamma-point k-point, in which case x is used as float complex grids.
+*/
+static void project_band_batch(pswf_t* wf, kpoint_t* kpt, band_t** bands,
+	int num_bands, void* x, real_proj_site_t* sites, int num_sites,
+	int num_cart_gridpts, int* fftg, projection_t** projections, arena_t* arena) {
+
+	if (wf->fft_precision == FFT_SINGLE && !kpt->gamma) {
+		fft3d_bands_single((float complex*) x, wf->lattice, kpt,
+			bands, num_bands, fftg);
+		onto_projector_batch_helper_single((float complex*) x, num_bands,
+			sites, num_sites, wf->lattice, wf->reclattice, kpt->k,
+			num_cart_gridpts, fftg, projections, arena);
+	} else {
+		fft3d_bands((double complex*) x, wf->lattice, kpt,
+			bands, num_bands, fftg);
+		onto_projector_batch_helper((double complex*) x, num_bands,
+			sites, num_sites, wf->lattice, wf->reclattice, kpt->k,
+			num_cart_gridpts, fftg, projections, arena);
+	}
+}
+
 void get_aug_freqs_helper(band_t* band, double complex* x, real_proj_site_t* sites,
 	int num_sites, double* lattice, double* reclattice, double* kpt, int num_cart_gridpts,
 	int* fftg, projection_t* projections) {
@@ -316,77 +498,84 @@ void get_aug_freqs_helper(band_t* band, double complex* x, real_proj_site_t* sit
 }
 
 void onto_projector(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
-	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg) {
+	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg,
+	arena_t* arena) {
 
 	double* k = kpt->k;
-	int* Gs = kpt->Gs;
-	float complex* Cs = kpt->bands[band_num]->Cs;
-	int num_waves = kpt->num_waves;
 	
-	double complex* x = (double complex*) mkl_calloc(fftg[0]*fftg[1]*fftg[2],
+	double complex* x = (double complex*) backend_calloc(fftg[0]*fftg[1]*fftg[2],
 		sizeof(double complex), 64);
 	CHECK_ALLOCATION(x);
-	fft3d(x, G_bounds, lattice, k, Gs, Cs, num_waves, fftg);
+	fft3d_bands(x, lattice, kpt, kpt->bands + band_num, 1, fftg);
 
 	band_t* band = kpt->bands[band_num];
-	band->projections = (projection_t*) malloc(num_sites * sizeof(projection_t));
-	CHECK_ALLOCATION (band->projections);
+	band->projections = (projection_t*) arena_alloc(arena, num_sites * sizeof(projection_t));
 
 	onto_projector_helper(kpt->bands[band_num], x, sites, num_sites,
-		lattice, reclattice, k, num_cart_gridpts, fftg, band->projections);
+		lattice, reclattice, k, num_cart_gridpts, fftg, band->projections, arena);
 
 	//kpt->bands[band_num]->CRs = x;
-	mkl_free(x);
+	backend_free(x);
 }
 
 void onto_projector_ncl(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
-	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg) {
+	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg,
+	arena_t* arena) {
 
 	double* k = kpt->k;
 	int* Gs = kpt->Gs;
-	float complex* Cs = kpt->bands[band_num]->Cs;
+	float complex* Cs = acquire_coeffs(kpt->bands[band_num]);
 	int num_waves = kpt->num_waves;
 
-	double complex* xup = (double complex*) mkl_calloc(fftg[0]*fftg[1]*fftg[2],
+	double complex* xup = (double complex*) backend_calloc(fftg[0]*fftg[1]*fftg[2],
 		sizeof(double complex), 64);
-	double complex* xdown = (double complex*) mkl_calloc(fftg[0]*fftg[1]*fftg[2],
+	double complex* xdown = (double complex*) backend_calloc(fftg[0]*fftg[1]*fftg[2],
 		sizeof(double complex), 64);
 	CHECK_ALLOCATION(xup);
 	CHECK_ALLOCATION(xdown);
 	fft3d(xup, G_bounds, lattice, k, Gs, Cs, num_waves/2, fftg);
 	fft3d(xdown, G_bounds, lattice, k, Gs, Cs+num_waves/2, num_waves/2, fftg);
+	release_coeffs(kpt->bands[band_num]);
 
 	band_t* band = kpt->bands[band_num];
 	band->up_projections =
-		(projection_t*) malloc(num_sites * sizeof(projection_t));
+		(projection_t*) arena_alloc(arena, num_sites * sizeof(projection_t));
 	band->down_projections =
-		(projection_t*) malloc(num_sites * sizeof(projection_t));
+		(projection_t*) arena_alloc(arena, num_sites * sizeof(projection_t));
 	onto_projector_helper(kpt->bands[band_num], xup, sites, num_sites,
-		lattice, reclattice, k, num_cart_gridpts, fftg, band->up_projections);
+		lattice, reclattice, k, num_cart_gridpts, fftg, band->up_projections, arena);
 	onto_projector_helper(kpt->bands[band_num], xdown, sites, num_sites,
-		lattice, reclattice, k, num_cart_gridpts, fftg, band->down_projections);
+		lattice, reclattice, k, num_cart_gridpts, fftg, band->down_projections, arena);
 }
 
-void onto_smoothpw(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
-	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg) {
+/*
+Projections of band band_num of kpt onto the smooth partial waves of sites,
+written to projections (see onto_smoothpw).
+*/
+static void smoothpw_projections(kpoint_t* kpt, int band_num, real_proj_site_t* sites,
+	int num_sites, int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts,
+	int* fftg, projection_t* projections, arena_t* arena) {
 
 	double* k = kpt->k;
-	int* Gs = kpt->Gs;
-	float complex* Cs = kpt->bands[band_num]->Cs;
-	int num_waves = kpt->num_waves;
 
-	double complex* x = (double complex*) mkl_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
+	double complex* x = (double complex*) backend_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
 	CHECK_ALLOCATION(x);
-	fft3d(x, G_bounds, lattice, k, Gs, Cs, num_waves, fftg);
-
-	band_t* band = kpt->bands[band_num];
-	band->wave_projections = (projection_t*) malloc(num_sites * sizeof(projection_t));
-	CHECK_ALLOCATION (band->wave_projections);
+	fft3d_bands(x, lattice, kpt, kpt->bands + band_num, 1, fftg);
 
 	onto_projector_helper(kpt->bands[band_num], x, sites, num_sites,
-		lattice, reclattice, k, num_cart_gridpts, fftg, band->wave_projections);
+		lattice, reclattice, k, num_cart_gridpts, fftg, projections, arena);
+
+	backend_free(x);
+}
+
+void onto_smoothpw(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
+	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg,
+	arena_t* arena) {
 
-	mkl_free(x);
+	band_t* band = kpt->bands[band_num];
+	band->wave_projections = (projection_t*) arena_alloc(arena, num_sites * sizeof(projection_t));
+	smoothpw_projections(kpt, band_num, sites, num_sites, G_bounds, lattice, reclattice,
+		num_cart_gridpts, fftg, band->wave_projections, arena);
 }
 
 void get_aug_freqs(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
@@ -397,11 +586,8 @@ void get_aug_freqs(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num
 	}
 
 	double* k = kpt->k;
-	int* Gs = kpt->Gs;
-	float complex* Cs = kpt->bands[band_num]->Cs;
-	int num_waves = kpt->num_waves;
 
-	double complex* x = (double complex*) mkl_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
+	double complex* x = (double complex*) backend_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
 	CHECK_ALLOCATION(x);
 
 	band_t* band = kpt->bands[band_num];
@@ -409,15 +595,16 @@ void get_aug_freqs(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num
 	get_aug_freqs_helper(kpt->bands[band_num], x, sites, num_sites,
 		lattice, reclattice, k, num_cart_gridpts, fftg, band->projections);
 
-	band->CAs = (float complex*) mkl_calloc(kpt->num_waves, sizeof(float complex), 64);
-	fwd_fft3d(x, G_bounds, lattice, k, Gs, band->CAs, num_waves, fftg);
+	band->CAs = (float complex*) backend_calloc(kpt->num_waves, sizeof(float complex), 64);
+	CHECK_ALLOCATION(band->CAs);
+	fwd_fft3d_batch(x, lattice, kpt, &band->CAs, 1, fftg);
 	//for (int w = 0; w < kpt->num_waves; w++) {
 	//	band->CAs[w] += band->Cs[w];
 	//		printf("%f %f %f %f\n", creal(band->CAs[w]), cimag(band->CAs[w]),
 	//		creal(band->Cs[w]), cimag(band->Cs[w]));
 	//}
 
-	mkl_free(x);
+	backend_free(x);
 }
 
 
@@ -502,6 +689,12 @@ void make_pwave_overlap_matrices(ppot_t* pp_ptr) {
 				psov[i*pp.num_projs+j] = spline_integral(pp.wave_grid, psprod, psspline, pp.wave_gridsize);
 				aeov[i*pp.num_projs+j] = spline_integral(pp.wave_grid, aeprod, aespline, pp.wave_gridsize);
 				diov[i*pp.num_projs+j] = spline_integral(pp.wave_grid, diprod, displine, pp.wave_gridsize);
+				free(psspline);
+				free(aespline);
+				free(displine);
+				free(psprod);
+				free(aeprod);
+				free(diprod);
 			}
 		}
 	}
@@ -513,258 +706,809 @@ void make_pwave_overlap_matrices(ppot_t* pp_ptr) {
 		}
 	}
 
+	// expand aeov - psov over the projectors in the order of setup_site,
+	// i.e. m = -l..l for each radial function
+	double* augd = (double*) calloc(pp.total_projs * pp.total_projs, sizeof(double));
+	CHECK_ALLOCATION(augd);
+	int i0 = 0;
+	for (int ni = 0; ni < pp.num_projs; ni++) {
+		int li = pp.funcs[ni].l;
+		int j0 = 0;
+		for (int nj = 0; nj < pp.num_projs; nj++) {
+			int lj = pp.funcs[nj].l;
+			if (li == lj) {
+				for (int m = 0; m < 2*li+1; m++) {
+					augd[(i0+m)*pp.total_projs+j0+m] = aeov[pp.num_projs*ni+nj]
+						- psov[pp.num_projs*ni+nj];
+				}
+			}
+			j0 += 2*lj+1;
+		}
+		i0 += 2*li+1;
+	}
+
 	pp_ptr->pspw_overlap_matrix = psov;
 	pp_ptr->aepw_overlap_matrix = aeov;
 	pp_ptr->diff_overlap_matrix = diov;
+	pp_ptr->aug_diff_matrix = augd;
 }
 
-void setup_projections(pswf_t* wf, ppot_t* pps, int num_elems,
-	int num_sites, int* fftg, int* labels, double* coords) {
+/*
+Projects the bands of wf onto the projector functions of its sites,
+as set up by setup_projections, replacing any earlier projections.
+*/
+static void compute_projections(pswf_t* wf, int* labels, double* coords) {
 
-	wf->num_sites = num_sites;
-	wf->fftg = (int*) malloc(3*sizeof(int));
-	wf->fftg[0] = fftg[0];
-	wf->fftg[1] = fftg[1];
-	wf->fftg[2] = fftg[2];
-	wf->num_elems = num_elems;
-	wf->num_sites = num_sites;
-	wf->pps = pps;
-	printf("started setup_proj\n");
+	int* fftg = wf->fftg;
+	int num_sites = wf->num_sites;
 	int num_cart_gridpts = 0;
-	for (int p = 0; p < num_elems; p++) {
-		add_num_cart_gridpts(pps+p, wf->lattice, fftg);
-		if (pps[p].num_cart_gridpts > num_cart_gridpts) {
-			num_cart_gridpts = pps[p].num_cart_gridpts;
+	for (int p = 0; p < wf->num_elems; p++) {
+		if (wf->pps[p].num_cart_gridpts > num_cart_gridpts) {
+			num_cart_gridpts = wf->pps[p].num_cart_gridpts;
 		}
 	}
 	int NUM_KPTS = wf->nwk * wf->nspin;
 	int NUM_BANDS = wf->nband;
 	printf("calculating projector_values\n");
 	real_proj_site_t* sites = projector_values(num_sites, labels, coords,
-		wf->lattice, wf->reclattice, pps, fftg);
+		wf->lattice, wf->reclattice, wf->pps, fftg);
 	printf("onto_projector calcs\n");
 #if defined(_OPENMP)
 	omp_set_num_threads(omp_get_max_threads());
 #endif
-	#pragma omp parallel for 
-	for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
-		kpoint_t* kpt = wf->kpts[w % NUM_KPTS];
-		int band_num = w / NUM_KPTS;
-		onto_projector(kpt, band_num, sites, num_sites,
-			wf->G_bounds, wf->lattice, wf->reclattice, num_cart_gridpts, fftg);
-		if (wf->is_ncl) {
+	// each thread allocates the projections from its own arena
+	if (wf->proj_arenas != NULL) {
+		free_arena_list(wf->proj_arenas, wf->num_proj_arenas);
+	}
+	wf->num_proj_arenas = omp_get_max_threads();
+	wf->proj_arenas = make_arena_list(wf->num_proj_arenas);
+	if (wf->is_ncl) {
+		#pragma omp parallel for
+		for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
+			kpoint_t* kpt = wf->kpts[w % NUM_KPTS];
+			int band_num = w / NUM_KPTS;
+			arena_t* arena = wf->proj_arenas + omp_get_thread_num();
+			onto_projector(kpt, band_num, sites, num_sites,
+				wf->G_bounds, wf->lattice, wf->reclattice, num_cart_gridpts, fftg, arena);
 			onto_projector_ncl(kpt, band_num, sites, num_sites,
-				wf->G_bounds, wf->lattice, wf->reclattice, num_cart_gridpts, fftg);
+				wf->G_bounds, wf->lattice, wf->reclattice, num_cart_gridpts, fftg, arena);
+		}
+	} else {
+		// the bands of a k-point are transformed in batches
+		int batch = fft_batch_size(fftg, NUM_BANDS, NUM_KPTS);
+		int num_batches = (NUM_BANDS + batch - 1) / batch;
+		long gridsize = fftg[0] * fftg[1] * fftg[2];
+		#pragma omp parallel
+		{
+		double complex* x = (double complex*) backend_malloc(
+			batch * gridsize * sizeof(double complex), 64);
+		projection_t** projections = (projection_t**) malloc(batch * sizeof(projection_t*));
+		CHECK_ALLOCATION(x);
+		CHECK_ALLOCATION(projections);
+		arena_t* arena = wf->proj_arenas + omp_get_thread_num();
+		#pragma omp for schedule(dynamic)
+		for (int w = 0; w < num_batches * NUM_KPTS; w++) {
+			kpoint_t* kpt = wf->kpts[w % NUM_KPTS];
+			int b0 = (w / NUM_KPTS) * batch;
+			int nb = min(batch, NUM_BANDS - b0);
+			for (int b = 0; b < nb; b++) {
+				kpt->bands[b0+b]->projections = (projection_t*) arena_alloc(arena,
+					num_sites * sizeof(projection_t));
+				projections[b] = kpt->bands[b0+b]->projections;
+			}
+			project_band_batch(wf, kpt, kpt->bands + b0, nb, x, sites, num_sites,
+				num_cart_gridpts, fftg, projections, arena);
+		}
+		backend_free(x);
+		free(projections);
 		}
 	}
 	printf("Done \n");
 	free_real_proj_site_list(sites, num_sites);	
 }
 
-void overlap_setup_real(pswf_t* wf_R, pswf_t* wf_S,
-	int* labels_R, int* labels_S, double* coords_R, double* coords_S,
-	int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, int num_N_R, int num_N_S, int num_N_RS) {
-
-	clean_wave_projections(wf_R);
-	clean_wave_projections(wf_S);
+void setup_projections(pswf_t* wf, ppot_t* pps, int num_elems,
+	int num_sites, int* fftg, int* labels, double* coords) {
 
-	wf_R->wp_num = num_N_S;
-	wf_S->wp_num = num_N_R;
+	wf->num_sites = num_sites;
+	wf->fftg = (int*) malloc(3*sizeof(int));
+	wf->fftg[0] = fftg[0];
+	wf->fftg[1] = fftg[1];
+	wf->fftg[2] = fftg[2];
+	wf->num_elems = num_elems;
+	wf->num_sites = num_sites;
+	wf->pps = pps;
+	printf("started setup_proj\n");
+	for (int p = 0; p < num_elems; p++) {
+		add_num_cart_gridpts(pps+p, wf->lattice, fftg);
+	}
+	compute_projections(wf, labels, coords);
+}
 
-	double complex** overlaps = NULL;
-	if (num_N_RS > 0) {
-		overlaps = (double complex**) malloc(num_N_RS * sizeof(double complex*));
-		CHECK_ALLOCATION(overlaps);
+void set_projection_precision(pswf_t* wf, int single, int* labels, double* coords) {
+	int precision = single ? FFT_SINGLE : FFT_DOUBLE;
+	if (precision == wf->fft_precision) {
+		return;
+	}
+	wf->fft_precision = precision;
+	if (wf->proj_arenas == NULL || labels == NULL) {
+		return;
 	}
+	// the wave projections and CAs kept for overlap setups
+	// were computed from the old projections
+	clean_wave_projections(wf);
+	if (wf->setup_cache != NULL) {
+		free_setup_cache(wf->setup_cache);
+		wf->setup_cache = NULL;
+	}
+	compute_projections(wf, labels, coords);
+}
 
-	printf("STARTING OVERLAP_SETUP\n");
-	int NUM_KPTS = wf_R->nwk * wf_R->nspin;
-	int NUM_BANDS = wf_S->nband;
-	int max_num_indices = 0;
-	if (num_N_R > 0) {
-		real_proj_site_t* sites_N_R = smooth_pw_values(num_N_R, N_R, labels_R, coords_R,
-			wf_S->lattice, wf_S->reclattice, wf_R->pps, wf_S->fftg);
-		for (int s = 0; s < num_N_R; s++) {
-			if (sites_N_R[s].num_indices > max_num_indices) {
-				max_num_indices = sites_N_R[s].num_indices;
+/*
+Minimum image path from the site with fractional coordinates fr to
+the site fs, in cartesian coordinates, and its length.
+*/
+static double min_image_path(double* fr, double* fs, double* lattice, double* path) {
+	double d[3];
+	for (int i = 0; i < 3; i++) {
+		d[i] = fs[i] - fr[i];
+		d[i] -= round(d[i]);
+	}
+	double r = INFINITY;
+	// after rounding, the minimum image is at most one cell away
+	// in each direction unless the cell is very skewed
+	for (int i = -1; i <= 1; i++) {
+		for (int j = -1; j <= 1; j++) {
+			for (int k = -1; k <= 1; k++) {
+				double v[3] = {d[0] + i, d[1] + j, d[2] + k};
+				frac_to_cartesian(v, lattice);
+				double test = mag(v);
+				if (test < r) {
+					r = test;
+					path[0] = v[0];
+					path[1] = v[1];
+					path[2] = v[2];
+				}
 			}
 		}
-#if defined(_OPENMP)
-		omp_set_num_threads(omp_get_max_threads());
-#endif
-		#pragma omp parallel for
-		for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
-			kpoint_t* kpt_S = wf_S->kpts[w%NUM_KPTS];
-	
-			onto_smoothpw(kpt_S, w/NUM_KPTS, sites_N_R, num_N_R,
-				wf_S->G_bounds, wf_S->lattice, wf_S->reclattice, max_num_indices, wf_S->fftg);
-		}
-		free_real_proj_site_list(sites_N_R, num_N_R);
 	}
-	max_num_indices = 0;
-	printf("PART 1 DONE\n");
-	if (num_N_S > 0) {
-		real_proj_site_t* sites_N_S = smooth_pw_values(num_N_S, N_S, labels_S, coords_S,
-			wf_R->lattice, wf_R->reclattice, wf_S->pps, wf_R->fftg);
-		NUM_BANDS = wf_R->nband;
-		for (int s = 0; s < num_N_S; s++) {
-            if (sites_N_S[s].num_indices > max_num_indices) {
-                max_num_indices = sites_N_S[s].num_indices;
-            }
-        }
-#if defined(_OPENMP)
-		omp_set_num_threads(omp_get_max_threads());
-#endif
-		#pragma omp parallel for
-		for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
-			kpoint_t* kpt_R = wf_R->kpts[w%NUM_KPTS];
+	return r;
+}
 
-			onto_smoothpw(kpt_R, w/NUM_KPTS, sites_N_S, num_N_S,
-				wf_R->G_bounds, wf_R->lattice, wf_R->reclattice, max_num_indices, wf_R->fftg);
+static int cmp_int(const void* a, const void* b) {
+	int x = *(const int*) a;
+	int y = *(const int*) b;
+	return (x > y) - (x < y);
+}
+
+int make_site_lists(double* lattice, int num_R, double* coords_R, int* elems_R,
+	double* rmax_R, int num_S, double* coords_S, int* elems_S, double* rmax_S,
+	double tol, int* M_R, int* M_S, int* N_R, int* N_S, int* counts,
+	int max_pairs, int* N_RS_R, int* N_RS_S, double* N_RS_paths) {
+
+	double max_rmax_R = 0, max_rmax_S = 0;
+	for (int i = 0; i < num_R; i++) max_rmax_R = fmax(max_rmax_R, rmax_R[i]);
+	for (int j = 0; j < num_S; j++) max_rmax_S = fmax(max_rmax_S, rmax_S[j]);
+	double cutoff = fmax(tol, max_rmax_R + max_rmax_S);
+
+	// bins along each lattice vector are at least cutoff wide, measured
+	// perpendicular to the other two vectors, so all neighbors of a site
+	// are in the adjacent bins
+	int nbin[3];
+	double vol = fabs(determinant(lattice));
+	long total_bins = 1;
+	for (int a = 0; a < 3; a++) {
+		double res[3];
+		vcross(res, lattice + 3*((a+1)%3), lattice + 3*((a+2)%3));
+		double width = vol / mag(res);
+		nbin[a] = cutoff > 0 ? (int) (width / cutoff) : 1;
+		if (nbin[a] < 1) nbin[a] = 1;
+		total_bins *= nbin[a];
+	}
+	// fewer, wider bins are still correct, so limit the bins to a few per site
+	long max_bins = 8 * (long) num_S + 64;
+	while (total_bins > max_bins) {
+		int a = 0;
+		if (nbin[1] > nbin[a]) a = 1;
+		if (nbin[2] > nbin[a]) a = 2;
+		total_bins /= nbin[a];
+		nbin[a] = (nbin[a] + 1) / 2;
+		total_bins *= nbin[a];
+	}
+
+	// counting sort of the sites of S into the bins
+	int* bin_S = (int*) malloc((num_S > 0 ? num_S : 1) * sizeof(int));
+	int* bin_start = (int*) calloc(total_bins + 1, sizeof(int));
+	int* sorted_S = (int*) malloc((num_S > 0 ? num_S : 1) * sizeof(int));
+	int* matched_S = (int*) calloc(num_S > 0 ? num_S : 1, sizeof(int));
+	int* match_R = (int*) malloc((num_R > 0 ? num_R : 1) * sizeof(int));
+	int* neighbors = (int*) malloc((num_S > 0 ? num_S : 1) * sizeof(int));
+	CHECK_ALLOCATION(bin_S);
+	CHECK_ALLOCATION(bin_start);
+	CHECK_ALLOCATION(sorted_S);
+	CHECK_ALLOCATION(matched_S);
+	CHECK_ALLOCATION(match_R);
+	CHECK_ALLOCATION(neighbors);
+	for (int j = 0; j < num_S; j++) {
+		long b = 0;
+		for (int a = 0; a < 3; a++) {
+			double f = coords_S[3*j+a] - floor(coords_S[3*j+a]);
+			int ba = (int) (f * nbin[a]) % nbin[a];
+			b = b * nbin[a] + ba;
 		}
-		free_real_proj_site_list(sites_N_S, num_N_S);
+		bin_S[j] = (int) b;
+		bin_start[b+1]++;
 	}
-	printf("PART 2 DONE\n");
-	
-	double* dcoords =  NULL;
-	if (num_N_RS > 0) {
-		dcoords = (double*) malloc(3 * num_N_RS * sizeof(double));
-		CHECK_ALLOCATION(dcoords);
+	for (long b = 0; b < total_bins; b++) {
+		bin_start[b+1] += bin_start[b];
 	}
-#if defined(_OPENMP)
-	omp_set_num_threads(omp_get_max_threads());
-#endif
-	#pragma omp parallel for
-	for (int i = 0; i < num_N_RS; i++) {
-		double R = 0;
-		int l1, l2;
-		int s1 = N_RS_R[i];
-		int s2 = N_RS_S[i];
-		ppot_t pp1 = wf_R->pps[labels_R[s1]];
-		ppot_t pp2 = wf_S->pps[labels_S[s2]];
-		// CALCULATE THE DIFF COORD HERE, PASS TO offsite_wave_overlap AND SAVE IT FOR USE IN compensation_terms
-		overlaps[i] = (double complex*) calloc(pp1.total_projs * pp2.total_projs, sizeof(double complex));
-		CHECK_ALLOCATION(overlaps[i]);
-		double* coord1 = coords_R + 3 * s1;
-		double* coord2 = coords_S + 3 * s2;
-		min_cart_path(coord2, coord1, wf_R->lattice, dcoords + 3*i, &R);
-		int tj = 0;
-		for (int j = 0; j < pp1.num_projs; j++) {
-			l1 = pp1.funcs[j].l;
-			for (int m1 = -l1; m1 <= l1; m1++) {
-				int tk = 0;
-				for (int k = 0; k < pp2.num_projs; k++) {
-					l2 = pp2.funcs[k].l;
-					for (int m2 = -l2; m2 <= l2; m2++) {
-						overlaps[i][tj*pp2.total_projs+tk] = conj(
-                            reciprocal_offsite_wave_overlap(dcoords + 3*i,
-                            pp1.kwave_grid, pp1.funcs[j].kwave,
-                            pp1.funcs[j].kwave_spline, pp1.wave_gridsize,
-                            pp2.kwave_grid, pp2.funcs[k].kwave,
-                            pp2.funcs[k].kwave_spline, pp2.wave_gridsize,
-                            wf_R->lattice, l1, m1, l2, m2)
-                            );
-						tk++;
+	int* fill = (int*) malloc((total_bins + 1) * sizeof(int));
+	CHECK_ALLOCATION(fill);
+	memcpy(fill, bin_start, (total_bins + 1) * sizeof(int));
+	for (int j = 0; j < num_S; j++) {
+		sorted_S[fill[bin_S[j]]++] = j;
+	}
+	free(fill);
+
+	int num_M = 0, num_N_R = 0, num_N_S = 0, num_pairs = 0;
+	double path[3];
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < num_R; i++) {
+			if (pass == 1 && match_R[i] >= 0) {
+				continue;
+			}
+			// gather the sites of S in the bins adjacent to site i
+			int num_neighbors = 0;
+			int b0[3];
+			for (int a = 0; a < 3; a++) {
+				double f = coords_R[3*i+a] - floor(coords_R[3*i+a]);
+				b0[a] = (int) (f * nbin[a]) % nbin[a];
+			}
+			int lo[3], hi[3];
+			for (int a = 0; a < 3; a++) {
+				// with fewer than three bins, every bin is adjacent
+				lo[a] = nbin[a] < 3 ? 0 : b0[a] - 1;
+				hi[a] = nbin[a] < 3 ? nbin[a] - 1 : b0[a] + 1;
+			}
+			for (int x = lo[0]; x <= hi[0]; x++) {
+				for (int y = lo[1]; y <= hi[1]; y++) {
+					for (int z = lo[2]; z <= hi[2]; z++) {
+						long b = ((long) ((x + nbin[0]) % nbin[0]) * nbin[1]
+							+ (y + nbin[1]) % nbin[1]) * nbin[2] + (z + nbin[2]) % nbin[2];
+						for (int n = bin_start[b]; n < bin_start[b+1]; n++) {
+							neighbors[num_neighbors++] = sorted_S[n];
+						}
 					}
 				}
-				tj++;
+			}
+			qsort(neighbors, num_neighbors, sizeof(int), cmp_int);
+
+			if (pass == 0) {
+				// match site i to the first free site of S of the same
+				// element within tol
+				match_R[i] = -1;
+				for (int n = 0; n < num_neighbors; n++) {
+					int j = neighbors[n];
+					if (!matched_S[j] && elems_R[i] == elems_S[j]
+						&& min_image_path(coords_R+3*i, coords_S+3*j, lattice, path) <= tol) {
+						matched_S[j] = 1;
+						match_R[i] = j;
+						M_R[num_M] = i;
+						M_S[num_M] = j;
+						num_M++;
+						break;
+					}
+				}
+				continue;
+			}
+
+			N_R[num_N_R++] = i;
+			for (int n = 0; n < num_neighbors; n++) {
+				int j = neighbors[n];
+				if (matched_S[j]) {
+					continue;
+				}
+				double r = min_image_path(coords_R+3*i, coords_S+3*j, lattice, path);
+				if (r < rmax_R[i] + rmax_S[j]) {
+					if (num_pairs < max_pairs) {
+						N_RS_R[num_pairs] = i;
+						N_RS_S[num_pairs] = j;
+						N_RS_paths[3*num_pairs+0] = path[0];
+						N_RS_paths[3*num_pairs+1] = path[1];
+						N_RS_paths[3*num_pairs+2] = path[2];
+					}
+					num_pairs++;
+				}
 			}
 		}
 	}
-	wf_S->overlaps = overlaps;
-	wf_S->dcoords = dcoords;
-	wf_S->num_aug_overlap_sites = num_N_RS;
-	wf_R->num_aug_overlap_sites = num_N_RS;
-	printf("PART 3 DONE\nFINISHED OVERLAP SETUP\n");
+	for (int j = 0; j < num_S; j++) {
+		if (!matched_S[j]) {
+			N_S[num_N_S++] = j;
+		}
+	}
+
+	free(bin_S);
+	free(bin_start);
+	free(sorted_S);
+	free(matched_S);
+	free(match_R);
+	free(neighbors);
+	counts[0] = num_M;
+	counts[1] = num_N_R;
+	counts[2] = num_N_S;
+	return num_pairs;
 }
 
-void overlap_setup_recip(pswf_t* wf_R, pswf_t* wf_S,
-	int* labels_R, int* labels_S, double* coords_R, double* coords_S,
-	int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, int num_N_R, int num_N_S, int num_N_RS) {
+static unsigned long hash_bytes(unsigned long h, const void* data, size_t size) {
+	const unsigned char* bytes = (const unsigned char*) data;
+	for (size_t i = 0; i < size; i++) {
+		h ^= bytes[i];
+		h *= 1099511628211UL;
+	}
+	return h;
+}
 
-	clean_wave_projections(wf_R);
-	clean_wave_projections(wf_S);
+/*
+FNV-1a hash of the parts of pp that the wave projections and two-center
+overlaps depend on, used to recognize the same element in the ppot_t
+lists of different pswf_t.
+*/
+static unsigned long ppot_fingerprint(ppot_t* pp) {
+	unsigned long h = 14695981039346656037UL;
+	h = hash_bytes(h, &pp->num_projs, sizeof(int));
+	h = hash_bytes(h, &pp->proj_gridsize, sizeof(int));
+	h = hash_bytes(h, &pp->wave_gridsize, sizeof(int));
+	h = hash_bytes(h, &pp->rmax, sizeof(double));
+	h = hash_bytes(h, pp->wave_grid, pp->wave_gridsize * sizeof(double));
+	for (int k = 0; k < pp->num_projs; k++) {
+		h = hash_bytes(h, &pp->funcs[k].l, sizeof(int));
+		h = hash_bytes(h, pp->funcs[k].kwave, pp->wave_gridsize * sizeof(double));
+		h = hash_bytes(h, pp->funcs[k].smooth_diffwave, pp->proj_gridsize * sizeof(double));
+	}
+	return h;
+}
 
-	wf_R->wp_num = num_N_S;
-	wf_S->wp_num = num_N_R;
+static unsigned long* ppot_fingerprints(pswf_t* wf) {
+	unsigned long* keys = (unsigned long*) malloc(wf->num_elems * sizeof(unsigned long));
+	CHECK_ALLOCATION(keys);
+	for (int e = 0; e < wf->num_elems; e++) {
+		keys[e] = ppot_fingerprint(wf->pps + e);
+	}
+	return keys;
+}
+
+static int same_coord(double* a, double* b) {
+	return fabs(a[0]-b[0]) < 1e-8 && fabs(a[1]-b[1]) < 1e-8 && fabs(a[2]-b[2]) < 1e-8;
+}
+
+static int same_fftg(int* a, int* b) {
+	return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+static setup_cache_t* get_setup_cache(pswf_t* wf) {
+	if (wf->setup_cache == NULL) {
+		setup_cache_t* cache = (setup_cache_t*) calloc(1, sizeof(setup_cache_t));
+		CHECK_ALLOCATION(cache);
+		cache->num_aug_sites = -1;
+		wf->setup_cache = cache;
+	}
+	return wf->setup_cache;
+}
 
-	double complex** overlaps = NULL;
-	if (num_N_RS > 0) {
-		overlaps = (double complex**) malloc(num_N_RS * sizeof(double complex*));
-		CHECK_ALLOCATION(overlaps);
+/*
+Copies the num projections in projs, which must be onto the same site,
+into one allocation that starts with the projection_t list, so that
+the list and everything it points to is freed with one free.
+The projector indices ns, ls and ms are shared by the copies.
+*/
+static projection_t* pack_projections(projection_t* projs, int num) {
+	int total_projs = projs[0].total_projs;
+	size_t head = num * sizeof(projection_t) + 3 * total_projs * sizeof(int);
+	head = (head + 15) & ~(size_t) 15;
+	char* block = (char*) malloc(head + (size_t) num * total_projs * sizeof(double complex));
+	CHECK_ALLOCATION(block);
+	projection_t* packed = (projection_t*) block;
+	int* ns = (int*) (block + num * sizeof(projection_t));
+	int* ls = ns + total_projs;
+	int* ms = ls + total_projs;
+	double complex* overlaps = (double complex*) (block + head);
+	memcpy(ns, projs[0].ns, total_projs * sizeof(int));
+	memcpy(ls, projs[0].ls, total_projs * sizeof(int));
+	memcpy(ms, projs[0].ms, total_projs * sizeof(int));
+	for (int i = 0; i < num; i++) {
+		packed[i] = projs[i];
+		packed[i].ns = ns;
+		packed[i].ls = ls;
+		packed[i].ms = ms;
+		packed[i].overlaps = overlaps + (size_t) i * total_projs;
+		memcpy(packed[i].overlaps, projs[i].overlaps, total_projs * sizeof(double complex));
 	}
+	return packed;
+}
 
-	printf("STARTING OVERLAP_SETUP RECIP\n");
-	int NUM_KPTS = wf_R->nwk * wf_R->nspin;
-	int NUM_BANDS = wf_R->nband;
+/*
+Starts an overlap setup of wf_R and wf_S: the entries of their setup
+caches that are not used by this setup are freed by end_cache_setup.
+*/
+static void begin_cache_setup(pswf_t* wf_R, pswf_t* wf_S) {
+	get_setup_cache(wf_R)->setup_count++;
+	if (wf_S != wf_R) {
+		get_setup_cache(wf_S)->setup_count++;
+	}
+}
+
+/*
+Frees the wave projections and two-center overlaps in the setup cache
+of wf that were not used by the current overlap setup, so that the
+cache holds at most the sites and pairs of one setup between calls.
+*/
+static void evict_unused_entries(pswf_t* wf) {
+	setup_cache_t* cache = get_setup_cache(wf);
+	int num = 0;
+	for (int e = 0; e < cache->num_wp_sites; e++) {
+		if (cache->wp_last_used[e] != cache->setup_count) {
+			free(cache->wp[e]);
+			continue;
+		}
+		cache->wp_keys[num] = cache->wp_keys[e];
+		memcpy(cache->wp_coords + 3*num, cache->wp_coords + 3*e, 3 * sizeof(double));
+		memcpy(cache->wp_fftg + 3*num, cache->wp_fftg + 3*e, 3 * sizeof(int));
+		cache->wp_last_used[num] = cache->wp_last_used[e];
+		cache->wp[num] = cache->wp[e];
+		num++;
+	}
+	cache->num_wp_sites = num;
+	num = 0;
+	for (int p = 0; p < cache->num_pairs; p++) {
+		if (cache->pair_last_used[p] != cache->setup_count) {
+			free(cache->pair_overlaps[p]);
+			continue;
+		}
+		cache->pair_keys[2*num] = cache->pair_keys[2*p];
+		cache->pair_keys[2*num+1] = cache->pair_keys[2*p+1];
+		memcpy(cache->pair_dcoords + 3*num, cache->pair_dcoords + 3*p, 3 * sizeof(double));
+		cache->pair_sizes[num] = cache->pair_sizes[p];
+		cache->pair_last_used[num] = cache->pair_last_used[p];
+		cache->pair_overlaps[num] = cache->pair_overlaps[p];
+		num++;
+	}
+	cache->num_pairs = num;
+}
+
+static void end_cache_setup(pswf_t* wf_R, pswf_t* wf_S) {
+	evict_unused_entries(wf_R);
+	if (wf_S != wf_R) {
+		evict_unused_entries(wf_S);
+	}
+}
+
+/*
+Sets the wave_projections of every band of wf to the projections onto the
+smooth partial waves of the sites Nlst, whose elements are in wf_sites->pps.
+The projections onto sites already in the setup cache of wf (same
+element, position and FFT grid) are reused, so the bands are only
+transformed to real space if there are new sites. wf->wp_arenas must
+be set up.
+*/
+static void setup_wave_projections(pswf_t* wf, pswf_t* wf_sites, int num_N, int* Nlst,
+	int* labels, double* coords) {
+
+	if (num_N == 0) {
+		return;
+	}
+	setup_cache_t* cache = get_setup_cache(wf);
+	int NUM_KPTS = wf->nwk * wf->nspin;
+	int NUM_BANDS = wf->nband;
+	int* fftg = wf->fftg;
+	unsigned long* keys = ppot_fingerprints(wf_sites);
+	int* entries = (int*) malloc(num_N * sizeof(int));
+	int* new_N = (int*) malloc(num_N * sizeof(int));
+	CHECK_ALLOCATION(entries);
+	CHECK_ALLOCATION(new_N);
+	int num_new = 0;
+	for (int s = 0; s < num_N; s++) {
+		unsigned long key = keys[labels[Nlst[s]]];
+		double* coord = coords + 3 * Nlst[s];
+		entries[s] = -1;
+		for (int e = 0; e < cache->num_wp_sites; e++) {
+			if (cache->wp_keys[e] == key && same_coord(cache->wp_coords + 3*e, coord)
+				&& same_fftg(cache->wp_fftg + 3*e, fftg)) {
+				entries[s] = e;
+				break;
+			}
+		}
+		if (entries[s] >= 0) {
+			cache->wp_last_used[entries[s]] = cache->setup_count;
+			continue;
+		}
+		if (cache->num_wp_sites == cache->max_wp_sites) {
+			cache->max_wp_sites = 2 * cache->max_wp_sites + 8;
+			cache->wp_keys = (unsigned long*) realloc(cache->wp_keys,
+				cache->max_wp_sites * sizeof(unsigned long));
+			cache->wp_coords = (double*) realloc(cache->wp_coords,
+				3 * cache->max_wp_sites * sizeof(double));
+			cache->wp_fftg = (int*) realloc(cache->wp_fftg,
+				3 * cache->max_wp_sites * sizeof(int));
+			cache->wp_last_used = (int*) realloc(cache->wp_last_used,
+				cache->max_wp_sites * sizeof(int));
+			cache->wp = (projection_t**) realloc(cache->wp,
+				cache->max_wp_sites * sizeof(projection_t*));
+			CHECK_ALLOCATION(cache->wp_keys);
+			CHECK_ALLOCATION(cache->wp_coords);
+			CHECK_ALLOCATION(cache->wp_fftg);
+			CHECK_ALLOCATION(cache->wp_last_used);
+			CHECK_ALLOCATION(cache->wp);
+		}
+		int e = cache->num_wp_sites++;
+		cache->wp_keys[e] = key;
+		memcpy(cache->wp_coords + 3*e, coord, 3 * sizeof(double));
+		memcpy(cache->wp_fftg + 3*e, fftg, 3 * sizeof(int));
+		cache->wp_last_used[e] = cache->setup_count;
+		cache->wp[e] = NULL;
+		entries[s] = e;
+		new_N[num_new++] = s;
+	}
+
+	real_proj_site_t* sites = NULL;
 	int max_num_indices = 0;
-	if (num_N_R > 0) {
-		real_proj_site_t* sites_N_R = smooth_pw_values(num_N_R, N_R, labels_R, coords_R,
-			wf_R->lattice, wf_R->reclattice, wf_R->pps, wf_R->fftg);
-		for (int s = 0; s < num_N_R; s++) {
-			if (sites_N_R[s].num_indices > max_num_indices) {
-				max_num_indices = sites_N_R[s].num_indices;
+	if (num_new > 0) {
+		int* site_nums = (int*) malloc(num_new * sizeof(int));
+		CHECK_ALLOCATION(site_nums);
+		for (int n = 0; n < num_new; n++) {
+			site_nums[n] = Nlst[new_N[n]];
+		}
+		sites = smooth_pw_values(num_new, site_nums, labels, coords,
+			wf->lattice, wf->reclattice, wf_sites->pps, fftg);
+		free(site_nums);
+		for (int n = 0; n < num_new; n++) {
+			if (sites[n].num_indices > max_num_indices) {
+				max_num_indices = sites[n].num_indices;
 			}
 		}
+	}
+
 #if defined(_OPENMP)
-		omp_set_num_threads(omp_get_max_threads());
+	omp_set_num_threads(omp_get_max_threads());
 #endif
+	if (num_new > 0) {
+		// the projections are computed into arenas made for the current
+		// number of threads, then packed into one allocation per site
+		// so that sites can be evicted from the cache one at a time
+		int num_arenas = omp_get_max_threads();
+		arena_t* arenas = make_arena_list(num_arenas);
+		projection_t* new_projs = (projection_t*) malloc(
+			(size_t) num_new * NUM_BANDS * NUM_KPTS * sizeof(projection_t));
+		CHECK_ALLOCATION(new_projs);
+		// the bands of a k-point are transformed in batches
+		int batch = fft_batch_size(fftg, NUM_BANDS, NUM_KPTS);
+		int num_batches = (NUM_BANDS + batch - 1) / batch;
+		long gridsize = fftg[0] * fftg[1] * fftg[2];
+		#pragma omp parallel
+		{
+		double complex* x = (double complex*) backend_malloc(
+			batch * gridsize * sizeof(double complex), 64);
+		projection_t** projs = (projection_t**) malloc(batch * sizeof(projection_t*));
+		CHECK_ALLOCATION(x);
+		CHECK_ALLOCATION(projs);
+		arena_t* arena = arenas + omp_get_thread_num();
+		#pragma omp for schedule(dynamic)
+		for (int t = 0; t < num_batches * NUM_KPTS; t++) {
+			kpoint_t* kpt = wf->kpts[t % NUM_KPTS];
+			int b0 = (t / NUM_KPTS) * batch;
+			int nb = min(batch, NUM_BANDS - b0);
+			for (int b = 0; b < nb; b++) {
+				projs[b] = (projection_t*) arena_alloc(arena,
+					num_new * sizeof(projection_t));
+			}
+			project_band_batch(wf, kpt, kpt->bands + b0, nb, x, sites, num_new,
+				max_num_indices, fftg, projs, arena);
+			for (int b = 0; b < nb; b++) {
+				int w = (b0 + b) * NUM_KPTS + t % NUM_KPTS;
+				for (int n = 0; n < num_new; n++) {
+					new_projs[(size_t) n * NUM_BANDS * NUM_KPTS + w] = projs[b][n];
+				}
+			}
+		}
+		backend_free(x);
+		free(projs);
+		}
 		#pragma omp parallel for
-		for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
-			kpoint_t* kpt_R = wf_R->kpts[w%NUM_KPTS];
-	
-			get_aug_freqs(kpt_R, w/NUM_KPTS, sites_N_R, num_N_R,
-				wf_R->G_bounds, wf_R->lattice, wf_R->reclattice, max_num_indices, wf_R->fftg);
+		for (int n = 0; n < num_new; n++) {
+			cache->wp[entries[new_N[n]]] = pack_projections(
+				new_projs + (size_t) n * NUM_BANDS * NUM_KPTS, NUM_BANDS * NUM_KPTS);
 		}
-		free_real_proj_site_list(sites_N_R, num_N_R);
+		free(new_projs);
+		free_arena_list(arenas, num_arenas);
 	}
-	max_num_indices = 0;
-	printf("PART 1 DONE RECIP\n");
-	if (num_N_S > 0) {
-		real_proj_site_t* sites_N_S = smooth_pw_values(num_N_S, N_S, labels_S, coords_S,
-			wf_S->lattice, wf_S->reclattice, wf_S->pps, wf_S->fftg);
-		NUM_BANDS = wf_S->nband;
-		for (int s = 0; s < num_N_S; s++) {
-            if (sites_N_S[s].num_indices > max_num_indices) {
-                max_num_indices = sites_N_S[s].num_indices;
-            }
-        }
-#if defined(_OPENMP)
-		omp_set_num_threads(omp_get_max_threads());
-#endif
-		#pragma omp parallel for
-		for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
-			kpoint_t* kpt_S = wf_S->kpts[w%NUM_KPTS];
 
-			get_aug_freqs(kpt_S, w/NUM_KPTS, sites_N_S, num_N_S,
-				wf_S->G_bounds, wf_S->lattice, wf_S->reclattice, max_num_indices, wf_S->fftg);
+	#pragma omp parallel for
+	for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
+		band_t* band = wf->kpts[w%NUM_KPTS]->bands[w/NUM_KPTS];
+		band->wave_projections = (projection_t*) arena_alloc(
+			wf->wp_arenas + omp_get_thread_num(), num_N * sizeof(projection_t));
+		for (int s = 0; s < num_N; s++) {
+			band->wave_projections[s] = cache->wp[entries[s]][w];
 		}
-		free_real_proj_site_list(sites_N_S, num_N_S);
 	}
-	printf("PART 2 DONE RECIP\n");
-	
-	double* dcoords =  NULL;
-	if (num_N_RS > 0) {
-		dcoords = (double*) malloc(3 * num_N_RS * sizeof(double));
-		CHECK_ALLOCATION(dcoords);
+
+	if (sites != NULL) {
+		free_real_proj_site_list(sites, num_new);
+	}
+	free(keys);
+	free(entries);
+	free(new_N);
+}
+
+/*
+Computes the CAs of every band of wf for the sites Nlst (see
+get_aug_freqs), unless they were already computed for the same sites.
+If the sites changed, the old CAs are freed first, so no band keeps
+CAs for sites that are not in Nlst.
+*/
+static void setup_aug_freqs(pswf_t* wf, pswf_t* wf_sites, int num_N, int* Nlst,
+	int* labels, double* coords) {
+
+	setup_cache_t* cache = get_setup_cache(wf);
+	int NUM_KPTS = wf->nwk * wf->nspin;
+	int NUM_BANDS = wf->nband;
+	unsigned long* keys = ppot_fingerprints(wf_sites);
+	int same = cache->num_aug_sites == num_N && same_fftg(cache->aug_fftg, wf->fftg);
+	for (int s = 0; same && s < num_N; s++) {
+		same = cache->aug_keys[s] == keys[labels[Nlst[s]]]
+			&& same_coord(cache->aug_coords + 3*s, coords + 3*Nlst[s]);
+	}
+	if (same) {
+		free(keys);
+		return;
+	}
+
+	for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
+		band_t* band = wf->kpts[w%NUM_KPTS]->bands[w/NUM_KPTS];
+		if (band->CAs != NULL) {
+			backend_free(band->CAs);
+			band->CAs = NULL;
+		}
+	}
+	free(cache->aug_keys);
+	free(cache->aug_coords);
+	cache->aug_keys = (unsigned long*) malloc((num_N > 0 ? num_N : 1) * sizeof(unsigned long));
+	cache->aug_coords = (double*) malloc(3 * (num_N > 0 ? num_N : 1) * sizeof(double));
+	CHECK_ALLOCATION(cache->aug_keys);
+	CHECK_ALLOCATION(cache->aug_coords);
+	for (int s = 0; s < num_N; s++) {
+		cache->aug_keys[s] = keys[labels[Nlst[s]]];
+		cache->aug_coords[3*s+0] = coords[3*Nlst[s]+0];
+		cache->aug_coords[3*s+1] = coords[3*Nlst[s]+1];
+		cache->aug_coords[3*s+2] = coords[3*Nlst[s]+2];
+	}
+	cache->num_aug_sites = num_N;
+	memcpy(cache->aug_fftg, wf->fftg, 3 * sizeof(int));
+	free(keys);
+	if (num_N == 0) {
+		return;
+	}
+
+	real_proj_site_t* sites = smooth_pw_values(num_N, Nlst, labels, coords,
+		wf->lattice, wf->reclattice, wf_sites->pps, wf->fftg);
+	int max_num_indices = 0;
+	for (int s = 0; s < num_N; s++) {
+		if (sites[s].num_indices > max_num_indices) {
+			max_num_indices = sites[s].num_indices;
+		}
 	}
 #if defined(_OPENMP)
 	omp_set_num_threads(omp_get_max_threads());
 #endif
-	#pragma omp parallel for
+	// the bands of a k-point are transformed in batches
+	int* fftg = wf->fftg;
+	int batch = fft_batch_size(fftg, NUM_BANDS, NUM_KPTS);
+	int num_batches = (NUM_BANDS + batch - 1) / batch;
+	long gridsize = fftg[0] * fftg[1] * fftg[2];
+	#pragma omp parallel
+	{
+	double complex* x = (double complex*) backend_malloc(
+		batch * gridsize * sizeof(double complex), 64);
+	float complex** CAs = (float complex**) malloc(batch * sizeof(float complex*));
+	CHECK_ALLOCATION(x);
+	CHECK_ALLOCATION(CAs);
+	#pragma omp for schedule(dynamic)
+	for (int t = 0; t < num_batches * NUM_KPTS; t++) {
+		kpoint_t* kpt = wf->kpts[t % NUM_KPTS];
+		int b0 = (t / NUM_KPTS) * batch;
+		int nb = min(batch, NUM_BANDS - b0);
+		for (int b = 0; b < nb; b++) {
+			band_t* band = kpt->bands[b0+b];
+			get_aug_freqs_helper(band, x + b * gridsize, sites, num_N,
+				wf->lattice, wf->reclattice, kpt->k, max_num_indices, fftg,
+				band->projections);
+			band->CAs = (float complex*) backend_calloc(kpt->num_waves,
+				sizeof(float complex), 64);
+			CHECK_ALLOCATION(band->CAs);
+			CAs[b] = band->CAs;
+		}
+		fwd_fft3d_batch(x, wf->lattice, kpt, CAs, nb, fftg);
+	}
+	backend_free(x);
+	free(CAs);
+	}
+	free_real_proj_site_list(sites, num_N);
+}
+
+/*
+Sets wf_S->overlaps to <(phi1_i-phit1_i)|(phi2_j-phit2_j)> for the
+pairs of sites N_RS_R (in wf_R) and N_RS_S (in wf_S), and wf_S->dcoords
+to the path between them, which is copied from N_RS_paths or computed
+if N_RS_paths is NULL. The overlaps of pairs of the same elements
+along the same path are kept in the setup cache of wf_R and reused.
+*/
+static void setup_aug_overlaps(pswf_t* wf_R, pswf_t* wf_S,
+	int* labels_R, int* labels_S, double* coords_R, double* coords_S,
+	int* N_RS_R, int* N_RS_S, double* N_RS_paths, int num_N_RS) {
+
+	if (wf_S->overlaps != NULL) {
+		for (int i = 0; i < wf_S->num_aug_overlap_sites; i++) {
+			free(wf_S->overlaps[i]);
+		}
+		free(wf_S->overlaps);
+		wf_S->overlaps = NULL;
+	}
+	free(wf_S->dcoords);
+	wf_S->dcoords = NULL;
+	wf_S->num_aug_overlap_sites = num_N_RS;
+	wf_R->num_aug_overlap_sites = num_N_RS;
+	if (num_N_RS == 0) {
+		return;
+	}
+
+	setup_cache_t* cache = get_setup_cache(wf_R);
+	unsigned long* keys_R = ppot_fingerprints(wf_R);
+	unsigned long* keys_S = ppot_fingerprints(wf_S);
+	double complex** overlaps = (double complex**) malloc(num_N_RS * sizeof(double complex*));
+	double* dcoords = (double*) malloc(3 * num_N_RS * sizeof(double));
+	int* missing = (int*) malloc(num_N_RS * sizeof(int));
+	CHECK_ALLOCATION(overlaps);
+	CHECK_ALLOCATION(dcoords);
+	CHECK_ALLOCATION(missing);
+	int num_missing = 0;
 	for (int i = 0; i < num_N_RS; i++) {
 		double R = 0;
-		int l1, l2;
 		int s1 = N_RS_R[i];
 		int s2 = N_RS_S[i];
-		ppot_t pp1 = wf_R->pps[labels_R[s1]];
-		ppot_t pp2 = wf_S->pps[labels_S[s2]];
-		// CALCULATE THE DIFF COORD HERE, PASS TO offsite_wave_overlap AND SAVE IT FOR USE IN compensation_terms
-		overlaps[i] = (double complex*) calloc(pp1.total_projs * pp2.total_projs, sizeof(double complex));
+		int size = wf_R->pps[labels_R[s1]].total_projs * wf_S->pps[labels_S[s2]].total_projs;
+		overlaps[i] = (double complex*) calloc(size, sizeof(double complex));
 		CHECK_ALLOCATION(overlaps[i]);
-		double* coord1 = coords_R + 3 * s1;
-		double* coord2 = coords_S + 3 * s2;
-		min_cart_path(coord2, coord1, wf_R->lattice, dcoords + 3*i, &R);
+		if (N_RS_paths != NULL) {
+			memcpy(dcoords + 3*i, N_RS_paths + 3*i, 3 * sizeof(double));
+		} else {
+			min_cart_path(coords_S + 3 * s2, coords_R + 3 * s1, wf_R->lattice, dcoords + 3*i, &R);
+		}
+		int found = 0;
+		for (int p = 0; p < cache->num_pairs; p++) {
+			if (cache->pair_keys[2*p] == keys_R[labels_R[s1]]
+				&& cache->pair_keys[2*p+1] == keys_S[labels_S[s2]]
+				&& cache->pair_sizes[p] == size
+				&& same_coord(cache->pair_dcoords + 3*p, dcoords + 3*i)) {
+				memcpy(overlaps[i], cache->pair_overlaps[p], size * sizeof(double complex));
+				cache->pair_last_used[p] = cache->setup_count;
+				found = 1;
+				break;
+			}
+		}
+		if (!found) {
+			missing[num_missing++] = i;
+		}
+	}
+
+#if defined(_OPENMP)
+	omp_set_num_threads(omp_get_max_threads());
+#endif
+	#pragma omp parallel for
+	for (int n = 0; n < num_missing; n++) {
+		int i = missing[n];
+		int l1, l2;
+		ppot_t pp1 = wf_R->pps[labels_R[N_RS_R[i]]];
+		ppot_t pp2 = wf_S->pps[labels_S[N_RS_S[i]]];
 		int tj = 0;
 		for (int j = 0; j < pp1.num_projs; j++) {
 			l1 = pp1.funcs[j].l;
@@ -774,13 +1518,13 @@ void overlap_setup_recip(pswf_t* wf_R, pswf_t* wf_S,
 					l2 = pp2.funcs[k].l;
 					for (int m2 = -l2; m2 <= l2; m2++) {
 						overlaps[i][tj*pp2.total_projs+tk] = conj(
-                            reciprocal_offsite_wave_overlap(dcoords + 3*i,
-                            pp1.kwave_grid, pp1.funcs[j].kwave,
-                            pp1.funcs[j].kwave_spline, pp1.wave_gridsize,
-                            pp2.kwave_grid, pp2.funcs[k].kwave,
-                            pp2.funcs[k].kwave_spline, pp2.wave_gridsize,
-                            wf_R->lattice, l1, m1, l2, m2)
-                            );
+							reciprocal_offsite_wave_overlap(dcoords + 3*i,
+							pp1.kwave_grid, pp1.funcs[j].kwave,
+							pp1.funcs[j].kwave_spline, pp1.wave_gridsize,
+							pp2.kwave_grid, pp2.funcs[k].kwave,
+							pp2.funcs[k].kwave_spline, pp2.wave_gridsize,
+							wf_R->lattice, l1, m1, l2, m2)
+							);
 						tk++;
 					}
 				}
@@ -788,10 +1532,97 @@ void overlap_setup_recip(pswf_t* wf_R, pswf_t* wf_S,
 			}
 		}
 	}
+
+	for (int n = 0; n < num_missing; n++) {
+		int i = missing[n];
+		if (cache->num_pairs == cache->max_pairs) {
+			cache->max_pairs = 2 * cache->max_pairs + 8;
+			cache->pair_keys = (unsigned long*) realloc(cache->pair_keys,
+				2 * cache->max_pairs * sizeof(unsigned long));
+			cache->pair_dcoords = (double*) realloc(cache->pair_dcoords,
+				3 * cache->max_pairs * sizeof(double));
+			cache->pair_sizes = (int*) realloc(cache->pair_sizes,
+				cache->max_pairs * sizeof(int));
+			cache->pair_last_used = (int*) realloc(cache->pair_last_used,
+				cache->max_pairs * sizeof(int));
+			cache->pair_overlaps = (double complex**) realloc(cache->pair_overlaps,
+				cache->max_pairs * sizeof(double complex*));
+			CHECK_ALLOCATION(cache->pair_keys);
+			CHECK_ALLOCATION(cache->pair_dcoords);
+			CHECK_ALLOCATION(cache->pair_sizes);
+			CHECK_ALLOCATION(cache->pair_last_used);
+			CHECK_ALLOCATION(cache->pair_overlaps);
+		}
+		int p = cache->num_pairs++;
+		int size = wf_R->pps[labels_R[N_RS_R[i]]].total_projs
+			* wf_S->pps[labels_S[N_RS_S[i]]].total_projs;
+		cache->pair_keys[2*p] = keys_R[labels_R[N_RS_R[i]]];
+		cache->pair_keys[2*p+1] = keys_S[labels_S[N_RS_S[i]]];
+		memcpy(cache->pair_dcoords + 3*p, dcoords + 3*i, 3 * sizeof(double));
+		cache->pair_sizes[p] = size;
+		cache->pair_last_used[p] = cache->setup_count;
+		cache->pair_overlaps[p] = (double complex*) malloc(size * sizeof(double complex));
+		CHECK_ALLOCATION(cache->pair_overlaps[p]);
+		memcpy(cache->pair_overlaps[p], overlaps[i], size * sizeof(double complex));
+	}
+
+	free(keys_R);
+	free(keys_S);
+	free(missing);
 	wf_S->overlaps = overlaps;
 	wf_S->dcoords = dcoords;
-	wf_S->num_aug_overlap_sites = num_N_RS;
-	wf_R->num_aug_overlap_sites = num_N_RS;
+}
+
+void overlap_setup_real(pswf_t* wf_R, pswf_t* wf_S,
+	int* labels_R, int* labels_S, double* coords_R, double* coords_S,
+	int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, double* N_RS_paths,
+	int num_N_R, int num_N_S, int num_N_RS) {
+
+	clean_wave_projections(wf_R);
+	clean_wave_projections(wf_S);
+
+	wf_R->wp_num = num_N_S;
+	wf_S->wp_num = num_N_R;
+	// each thread allocates the wave projections from its own arena
+	wf_R->num_wp_arenas = omp_get_max_threads();
+	wf_R->wp_arenas = make_arena_list(wf_R->num_wp_arenas);
+	if (wf_S != wf_R) {
+		wf_S->num_wp_arenas = omp_get_max_threads();
+		wf_S->wp_arenas = make_arena_list(wf_S->num_wp_arenas);
+	}
+
+	begin_cache_setup(wf_R, wf_S);
+	printf("STARTING OVERLAP_SETUP\n");
+	setup_wave_projections(wf_S, wf_R, num_N_R, N_R, labels_R, coords_R);
+	printf("PART 1 DONE\n");
+	setup_wave_projections(wf_R, wf_S, num_N_S, N_S, labels_S, coords_S);
+	printf("PART 2 DONE\n");
+	setup_aug_overlaps(wf_R, wf_S, labels_R, labels_S, coords_R, coords_S,
+		N_RS_R, N_RS_S, N_RS_paths, num_N_RS);
+	end_cache_setup(wf_R, wf_S);
+	printf("PART 3 DONE\nFINISHED OVERLAP SETUP\n");
+}
+
+void overlap_setup_recip(pswf_t* wf_R, pswf_t* wf_S,
+	int* labels_R, int* labels_S, double* coords_R, double* coords_S,
+	int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, double* N_RS_paths,
+	int num_N_R, int num_N_S, int num_N_RS) {
+
+	clean_wave_projections(wf_R);
+	clean_wave_projections(wf_S);
+
+	wf_R->wp_num = num_N_S;
+	wf_S->wp_num = num_N_R;
+
+	begin_cache_setup(wf_R, wf_S);
+	printf("STARTING OVERLAP_SETUP RECIP\n");
+	setup_aug_freqs(wf_R, wf_R, num_N_R, N_R, labels_R, coords_R);
+	printf("PART 1 DONE RECIP\n");
+	setup_aug_freqs(wf_S, wf_S, num_N_S, N_S, labels_S, coords_S);
+	printf("PART 2 DONE RECIP\n");
+	setup_aug_overlaps(wf_R, wf_S, labels_R, labels_S, coords_R, coords_S,
+		N_RS_R, N_RS_S, N_RS_paths, num_N_RS);
+	end_cache_setup(wf_R, wf_S);
 	printf("PART 3 DONE RECIP\nFINISHED OVERLAP SETUP\n");
 }
 
@@ -816,8 +1647,6 @@ void compensation_terms(double complex* overlap, int BAND_NUM, pswf_t* wf_S, psw
 #endif
 	#pragma omp parallel for
 	for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
-		int ni = 0, nj = 0;
-
 		kpoint_t* kpt_R = wf_R->kpts[w%NUM_KPTS];
 		kpoint_t* kpt_S = wf_S->kpts[w%NUM_KPTS];
 		band_t* band_R = kpt_R->bands[w/NUM_KPTS];
@@ -825,23 +1654,18 @@ void compensation_terms(double complex* overlap, int BAND_NUM, pswf_t* wf_S, psw
 
 		double complex temp = 0 + 0 * I;
 		for (int s = 0; s < num_M; s++) {
-			ppot_t pp = wf_R->pps[ref_labels[M_R[s]]];
+			double* D = wf_R->pps[ref_labels[M_R[s]]].aug_diff_matrix;
 			int s1 = M_R[s];
 			int s2 = M_S[s];
 			projection_t pron = band_R->projections[s1];
 			projection_t ppron = band_S->projections[s2];
 
 			for (int i = 0; i < pron.total_projs; i++) {
+				double complex Dp = 0;
 				for (int j = 0; j < ppron.total_projs; j++) {
-					if (pron.ls[i] == ppron.ls[j]  && pron.ms[i] == ppron.ms[j]) {
-						nj = ppron.ns[j];
-						ni = pron.ns[i];
-						temp += conj(pron.overlaps[i])
-							* (pp.aepw_overlap_matrix[pp.num_projs*ni+nj]
-							- pp.pspw_overlap_matrix[pp.num_projs*ni+nj])
-							* ppron.overlaps[j];
-					}
+					Dp += D[i*ppron.total_projs+j] * ppron.overlaps[j];
 				}
+				temp += conj(pron.overlaps[i]) * Dp;
 			}
 		}
 		overlap[w] += temp;
@@ -920,8 +1744,6 @@ void compensation_terms_recip(double complex* overlap, int BAND_NUM, pswf_t* wf_
 	#pragma omp parallel for
 	for (int w = 0; w < NUM_BANDS * NUM_KPTS; w++) {
 
-		int ni = 0, nj = 0;
-
 		kpoint_t* kpt_R = wf_R->kpts[w%NUM_KPTS];
 		kpoint_t* kpt_S = wf_S->kpts[w%NUM_KPTS];
 		band_t* band_R = kpt_R->bands[w/NUM_KPTS];
@@ -933,19 +1755,29 @@ void compensation_terms_recip(double complex* overlap, int BAND_NUM, pswf_t* wf_
 		
 		if (band_R->CAs != NULL) {
 			curr_overlap = 0;
-			C1s = band_S->Cs;
+			C1s = acquire_coeffs(band_S);
 			C2s = band_R->CAs;
 			num_waves = kpt_R->num_waves;
-			cblas_cdotc_sub(num_waves, C2s, 1, C1s, 1, &curr_overlap);
+			if (kpt_R->gamma) {
+				curr_overlap = gamma_dot(C2s, C1s, num_waves);
+			} else {
+				cblas_cdotc_sub(num_waves, C2s, 1, C1s, 1, &curr_overlap);
+			}
+			release_coeffs(band_S);
 			overlap[w] += (double complex) curr_overlap;
 		}
 
 		if (band_S->CAs != NULL) {
 			curr_overlap = 0;
 			C1s = band_S->CAs;
-			C2s = band_R->Cs;
+			C2s = acquire_coeffs(band_R);
 			num_waves = kpt_R->num_waves;
-			cblas_cdotc_sub(num_waves, C2s, 1, C1s, 1, &curr_overlap);
+			if (kpt_R->gamma) {
+				curr_overlap = gamma_dot(C2s, C1s, num_waves);
+			} else {
+				cblas_cdotc_sub(num_waves, C2s, 1, C1s, 1, &curr_overlap);
+			}
+			release_coeffs(band_R);
 			overlap[w] += (double complex) curr_overlap;
 		}
 		//printf("part 1 %d %d %d %lf %lf %f %f\n", BAND_NUM, w/NUM_KPTS, w%NUM_KPTS,
@@ -954,23 +1786,18 @@ void compensation_terms_recip(double complex* overlap, int BAND_NUM, pswf_t* wf_
 
 		double complex temp = 0 + 0 * I;
 		for (int s = 0; s < num_M; s++) {
-			ppot_t pp = wf_R->pps[ref_labels[M_R[s]]];
+			double* D = wf_R->pps[ref_labels[M_R[s]]].aug_diff_matrix;
 			int s1 = M_R[s];
 			int s2 = M_S[s];
 			projection_t pron = band_R->projections[s1];
 			projection_t ppron = band_S->projections[s2];
 
 			for (int i = 0; i < pron.total_projs; i++) {
+				double complex Dp = 0;
 				for (int j = 0; j < ppron.total_projs; j++) {
-					if (pron.ls[i] == ppron.ls[j]  && pron.ms[i] == ppron.ms[j]) {
-						nj = ppron.ns[j];
-						ni = pron.ns[i];
-						temp += conj(pron.overlaps[i])
-							* (pp.aepw_overlap_matrix[pp.num_projs*ni+nj]
-							- pp.pspw_overlap_matrix[pp.num_projs*ni+nj])
-							* ppron.overlaps[j];
-					}
+					Dp += D[i*ppron.total_projs+j] * ppron.overlaps[j];
 				}
+				temp += conj(pron.overlaps[i]) * Dp;
 			}
 		}
 		overlap[w] += temp;
@@ -998,3 +1825,281 @@ void compensation_terms_recip(double complex* overlap, int BAND_NUM, pswf_t* wf_
 	}
 
 }
+
+// number of stacked projector rows per matrix product in the batched
+// compensation terms
+#define COMP_CHUNK 256
+
+/*
+One site term of the compensation terms, sum_ij <psi_R|p_i> D_ij <p_j|psi_S>,
+for the batched versions. The <p_i|psi_R> are taken from the projections
+(or wave_projections if R_wave) of site site_R of the bands of wf_R, and
+likewise for S. D_ij is aug[i][j] if aug is not NULL, otherwise
+D[i][j] exp(2 pi i k.dcoord) if D is not NULL, otherwise the identity.
+*/
+typedef struct comp_term {
+	int site_R;
+	int site_S;
+	int R_wave;
+	int S_wave;
+	double* aug;
+	double complex* D;
+	double* dcoord;
+} comp_term_t;
+
+static projection_t* term_projection(band_t* band, int wave, int site) {
+	return wave ? band->wave_projections + site : band->projections + site;
+}
+
+/*
+Lists the site terms of compensation_terms in the order M, N_R, N_S, N_RS
+(only M and N_RS if recip).
+*/
+static comp_term_t* make_comp_terms(pswf_t* wf_S, pswf_t* wf_R, int recip,
+	int num_M, int num_N_R, int num_N_S, int num_N_RS,
+	int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
+	int* ref_labels, int* num_terms) {
+
+	int n = num_M + num_N_RS + (recip ? 0 : num_N_R + num_N_S);
+	comp_term_t* terms = (comp_term_t*) malloc((n > 0 ? n : 1) * sizeof(comp_term_t));
+	CHECK_ALLOCATION(terms);
+	int t = 0;
+	for (int s = 0; s < num_M; s++) {
+		terms[t++] = (comp_term_t) {M_R[s], M_S[s], 0, 0,
+			wf_R->pps[ref_labels[M_R[s]]].aug_diff_matrix, NULL, NULL};
+	}
+	if (!recip) {
+		for (int s = 0; s < num_N_R; s++) {
+			terms[t++] = (comp_term_t) {N_R[s], s, 0, 1, NULL, NULL, NULL};
+		}
+		for (int s = 0; s < num_N_S; s++) {
+			terms[t++] = (comp_term_t) {s, N_S[s], 1, 0, NULL, NULL, NULL};
+		}
+	}
+	for (int s = 0; s < num_N_RS; s++) {
+		terms[t++] = (comp_term_t) {N_RS_R[s], N_RS_S[s], 0, 0,
+			NULL, wf_S->overlaps[s], wf_S->dcoords + 3*s};
+	}
+	*num_terms = t;
+	return terms;
+}
+
+/*
+Adds the site terms at k-point kpt_num to the NB_R x nb matrix C,
+C[b][i] += sum_terms sum_kl conj(<p_k|psi_R,b>) D_kl <p_l|psi_S,band_nums[i]>.
+The <p_k|psi_R> of the terms are stacked into the rows of AR, and the
+D <p|psi_S> into the rows of T, so that the terms are summed COMP_CHUNK
+rows at a time by one product C += AR^H T. AS is scratch space for
+the <p|psi_S> of one site.
+*/
+static void add_comp_terms(double complex* C, comp_term_t* terms, int num_terms,
+	pswf_t* wf_S, pswf_t* wf_R, int kpt_num, int nb, int* band_nums,
+	double complex* AR, double complex* T, double complex* AS, int chunk) {
+
+	kpoint_t* kpt_R = wf_R->kpts[kpt_num];
+	kpoint_t* kpt_S = wf_S->kpts[kpt_num];
+	int NB_R = wf_R->nband;
+	const double complex one = 1;
+	const double complex zero = 0;
+	int rows = 0;
+	for (int t = 0; t <= num_terms; t++) {
+		int tp_R = 0, tp_S = 0;
+		if (t < num_terms) {
+			tp_R = term_projection(kpt_R->bands[0], terms[t].R_wave, terms[t].site_R)->total_projs;
+			tp_S = term_projection(kpt_S->bands[0], terms[t].S_wave, terms[t].site_S)->total_projs;
+		}
+		if (rows > 0 && (t == num_terms || rows + tp_R > chunk)) {
+			cblas_zgemm(CblasRowMajor, CblasConjTrans, CblasNoTrans,
+				NB_R, nb, rows, &one, AR, NB_R, T, nb, &one, C, nb);
+			rows = 0;
+		}
+		if (t == num_terms) {
+			break;
+		}
+		comp_term_t term = terms[t];
+		for (int b = 0; b < NB_R; b++) {
+			double complex* ov = term_projection(kpt_R->bands[b],
+				term.R_wave, term.site_R)->overlaps;
+			for (int k = 0; k < tp_R; k++) {
+				AR[(rows+k)*NB_R+b] = ov[k];
+			}
+		}
+		int identity = term.aug == NULL && term.D == NULL;
+		double complex* dest = identity ? T + rows*nb : AS;
+		for (int i = 0; i < nb; i++) {
+			double complex* ov = term_projection(kpt_S->bands[band_nums[i]],
+				term.S_wave, term.site_S)->overlaps;
+			for (int l = 0; l < tp_S; l++) {
+				dest[l*nb+i] = ov[l];
+			}
+		}
+		if (term.aug != NULL) {
+			// real D: AS and T are read as real matrices with 2*nb columns
+			cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+				tp_R, 2*nb, tp_S, 1.0, term.aug, tp_S, (double*) AS, 2*nb,
+				0.0, (double*) (T + rows*nb), 2*nb);
+		} else if (term.D != NULL) {
+			double complex phase = cexp(2*I*PI * dot(kpt_R->k, term.dcoord));
+			cblas_zgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+				tp_R, nb, tp_S, &phase, term.D, tp_S, AS, nb, &zero, T + rows*nb, nb);
+		}
+		rows += tp_R;
+	}
+}
+
+/*
+Copies the coefficients, or the CAs if aug, of the bands band_nums
+(0 to n-1 if NULL) of kpt into the rows of mat. The rows of bands
+without CAs are zeroed. Returns the number of rows filled.
+*/
+static int pack_band_rows(float complex* mat, kpoint_t* kpt, int n, int* band_nums, int aug) {
+	int num_waves = kpt->num_waves;
+	int filled = 0;
+	for (int i = 0; i < n; i++) {
+		band_t* band = kpt->bands[band_nums == NULL ? i : band_nums[i]];
+		float complex* row = mat + (size_t) i * num_waves;
+		if (!aug) {
+			memcpy(row, acquire_coeffs(band), num_waves * sizeof(float complex));
+			release_coeffs(band);
+			filled++;
+		} else if (band->CAs != NULL) {
+			memcpy(row, band->CAs, num_waves * sizeof(float complex));
+			filled++;
+		} else {
+			memset(row, 0, num_waves * sizeof(float complex));
+		}
+	}
+	return filled;
+}
+
+/*
+Common part of compensation_terms_batch and compensation_terms_recip_batch.
+*/
+static void compensation_terms_batch_helper(double complex* overlap, int num_bands,
+	int* band_nums, pswf_t* wf_S, pswf_t* wf_R, int recip,
+	int num_M, int num_N_R, int num_N_S, int num_N_RS,
+	int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
+	int* ref_labels) {
+
+	int NUM_KPTS = wf_R->nwk * wf_R->nspin;
+	int NUM_BANDS = wf_R->nband;
+	int num_terms;
+	comp_term_t* terms = make_comp_terms(wf_S, wf_R, recip, num_M, num_N_R, num_N_S,
+		num_N_RS, M_R, M_S, N_R, N_S, N_RS_R, N_RS_S, ref_labels, &num_terms);
+	int max_tp = 0;
+	for (int t = 0; t < num_terms; t++) {
+		max_tp = max(max_tp, term_projection(wf_R->kpts[0]->bands[0],
+			terms[t].R_wave, terms[t].site_R)->total_projs);
+		max_tp = max(max_tp, term_projection(wf_S->kpts[0]->bands[0],
+			terms[t].S_wave, terms[t].site_S)->total_projs);
+	}
+	int chunk = max(COMP_CHUNK, max_tp);
+
+#if defined(_OPENMP)
+	omp_set_num_threads(omp_get_max_threads());
+#endif
+	// with one k-point, the threads are left to BLAS
+	#pragma omp parallel for if(NUM_KPTS > 1)
+	for (int kpt_num = 0; kpt_num < NUM_KPTS; kpt_num++) {
+		double complex* C = (double complex*) calloc(
+			(size_t) NUM_BANDS * num_bands, sizeof(double complex));
+		double complex* AR = (double complex*) backend_malloc(
+			(size_t) chunk * NUM_BANDS * sizeof(double complex), 64);
+		double complex* T = (double complex*) backend_malloc(
+			(size_t) chunk * num_bands * sizeof(double complex), 64);
+		double complex* AS = (double complex*) backend_malloc(
+			(size_t) max(max_tp, 1) * num_bands * sizeof(double complex), 64);
+		CHECK_ALLOCATION(C);
+		CHECK_ALLOCATION(AR);
+		CHECK_ALLOCATION(T);
+		CHECK_ALLOCATION(AS);
+
+		if (recip) {
+			kpoint_t* kpt_R = wf_R->kpts[kpt_num];
+			kpoint_t* kpt_S = wf_S->kpts[kpt_num];
+			int num_waves = kpt_R->num_waves;
+			float complex* MR = (float complex*) backend_malloc(
+				(size_t) NUM_BANDS * num_waves * sizeof(float complex), 64);
+			float complex* MS = (float complex*) backend_malloc(
+				(size_t) num_bands * num_waves * sizeof(float complex), 64);
+			float complex* FC = (float complex*) backend_malloc(
+				(size_t) NUM_BANDS * num_bands * sizeof(float complex), 64);
+			CHECK_ALLOCATION(MR);
+			CHECK_ALLOCATION(MS);
+			CHECK_ALLOCATION(FC);
+			const float complex fone = 1;
+			const float complex fzero = 0;
+			// pass 0 adds <CAs_R|Cs_S>, pass 1 adds <Cs_R|CAs_S>
+			for (int pass = 0; pass < 2; pass++) {
+				int filled_R = pack_band_rows(MR, kpt_R, NUM_BANDS, NULL, pass == 0);
+				int filled_S = pack_band_rows(MS, kpt_S, num_bands, band_nums, pass == 1);
+				if (filled_R == 0 || filled_S == 0) {
+					continue;
+				}
+				if (kpt_R->gamma) {
+					// the overlaps are real, see gamma_gemm
+					float* FR = (float*) FC;
+					gamma_gemm(num_bands, NUM_BANDS, num_waves, MS, num_waves,
+						MR, num_waves, FR);
+					for (int i = 0; i < num_bands; i++) {
+						for (int b = 0; b < NUM_BANDS; b++) {
+							C[(size_t) b * num_bands + i] += FR[(size_t) i * NUM_BANDS + b];
+						}
+					}
+					continue;
+				}
+				// FC[i][b] = sum_w MS[i][w] conj(MR[b][w])
+				cblas_cgemm(CblasRowMajor, CblasNoTrans, CblasConjTrans,
+					num_bands, NUM_BANDS, num_waves, &fone, MS, num_waves,
+					MR, num_waves, &fzero, FC, NUM_BANDS);
+				for (int i = 0; i < num_bands; i++) {
+					for (int b = 0; b < NUM_BANDS; b++) {
+						C[(size_t) b * num_bands + i] += FC[(size_t) i * NUM_BANDS + b];
+					}
+				}
+			}
+			backend_free(MR);
+			backend_free(MS);
+			backend_free(FC);
+		}
+
+		add_comp_terms(C, terms, num_terms, wf_S, wf_R, kpt_num, num_bands, band_nums,
+			AR, T, AS, chunk);
+
+		for (int i = 0; i < num_bands; i++) {
+			for (int b = 0; b < NUM_BANDS; b++) {
+				overlap[((size_t) i * NUM_BANDS + b) * NUM_KPTS + kpt_num]
+					+= C[(size_t) b * num_bands + i];
+			}
+		}
+		free(C);
+		backend_free(AR);
+		backend_free(T);
+		backend_free(AS);
+	}
+	free(terms);
+}
+
+void compensation_terms_batch(double complex* overlap, int num_bands, int* band_nums,
+	pswf_t* wf_S, pswf_t* wf_R,
+	int num_M, int num_N_R, int num_N_S, int num_N_RS,
+	int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
+	int* proj_labels, double* proj_coords, int* ref_labels, double* ref_coords,
+	int* fft_grid) {
+
+	compensation_terms_batch_helper(overlap, num_bands, band_nums, wf_S, wf_R, 0,
+		num_M, num_N_R, num_N_S, num_N_RS, M_R, M_S, N_R, N_S, N_RS_R, N_RS_S,
+		ref_labels);
+}
+
+void compensation_terms_recip_batch(double complex* overlap, int num_bands, int* band_nums,
+	pswf_t* wf_S, pswf_t* wf_R,
+	int num_M, int num_N_R, int num_N_S, int num_N_RS,
+	int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
+	int* proj_labels, double* proj_coords, int* ref_labels, double* ref_coords,
+	int* fft_grid) {
+
+	compensation_terms_batch_helper(overlap, num_bands, band_nums, wf_S, wf_R, 1,
+		num_M, num_N_R, num_N_S, num_N_RS, M_R, M_S, N_R, N_S, N_RS_R, N_RS_S,
+		ref_labels);
+}
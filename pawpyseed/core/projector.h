@@ -36,30 +36,36 @@ real_proj_site_t* smooth_pw_values(int num_N, int* Nlst, int* labels, double* co
 /**
 Helper function for onto_projector, which performs the FFT of the wavefunction
 into real space and calculates from <p_i|psit_nk> from the grid points found
-in projector_values.
+in projector_values. The arrays of projections are allocated from arena.
 */
 void onto_projector_helper(band_t* band, double complex* x, real_proj_site_t* sites,
     int num_sites, double* lattice, double* reclattice, double* kpt, int num_cart_gridpts,
-    int* fftg, projection_t* projections);
+    int* fftg, projection_t* projections, arena_t* arena);
 
 void get_aug_freqs_helper(band_t* band, double complex* x, real_proj_site_t* sites,
 	int num_sites, double* lattice, double* reclattice, double* kpt, int num_cart_gridpts,
 	int* fftg, projection_t* projections);
 
 /**
-Calculates <p_i|psit_nk> for all i={R,epsilon,l,m} in the structure for one band
+Calculates <p_i|psit_nk> for all i={R,epsilon,l,m} in the structure for one band.
+The projections are allocated from arena, which must not be used by another
+thread at the same time.
 */
 void onto_projector(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
-	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg);
+	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg,
+	arena_t* arena);
 
 void onto_projector_ncl(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
-	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg);
+	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg,
+	arena_t* arena);
 
 /**
-Calculates <(phi_i-phit_i)|psit_nk> for all i={R,epsilon,l,m} in the structure for one band
+Calculates <(phi_i-phit_i)|psit_nk> for all i={R,epsilon,l,m} in the structure for one band.
+The projections are allocated from arena, as in onto_projector.
 */
 void onto_smoothpw(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
-	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg);
+	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg,
+	arena_t* arena);
 
 void get_aug_freqs(kpoint_t* kpt, int band_num, real_proj_site_t* sites, int num_sites,
 	int* G_bounds, double* lattice, double* reclattice, int num_cart_gridpts, int* fftg);
@@ -79,10 +85,49 @@ void make_pwave_overlap_matrices(ppot_t* pp_ptr);
 
 /**
 Evaluates <p_i|psit_nk> for all bands and kpoints of wf.
+The projections are held in wf->proj_arenas, one arena per thread.
 */
 void setup_projections(pswf_t* wf, ppot_t* pps, int num_elems,
 	int num_sites, int* fftg, int* labels, double* coords);
 
+/**
+Sets the precision of the FFTs and real space gathers that project the
+bands of wf onto its sites: single precision if single is nonzero,
+double precision otherwise (see wf->fft_precision). Gamma-point
+k-points and noncollinear wavefunctions are always projected in double
+precision. If setup_projections was already called, the projections
+are recomputed for the sites labels and coords (the same as in that call;
+labels may be NULL to only set the precision), and the overlap setup
+results kept for wf are freed, so the overlap setup must be repeated.
+*/
+void set_projection_precision(pswf_t* wf, int single, int* labels, double* coords);
+
+/**
+Sorts the sites of the basis structure R and of the structure S
+into the site lists used by overlap_setup_real and compensation_terms,
+using a periodic cell list so that only nearby pairs of sites are compared.
+lattice holds the lattice vectors as rows, coords_R and coords_S the
+fractional coordinates of the sites, elems_R and elems_S an element id
+for each site and rmax_R and rmax_S the augmentation radius of each site.
+
+Each site of R is matched to the first unmatched site of S with the same
+element within a (minimum image) distance tol; the pairs are written to
+M_R and M_S, which must hold min(num_R, num_S) sites. The other sites are
+written in increasing order to N_R and N_S, which must hold num_R and num_S
+sites. counts is set to {number of M pairs, number of N_R, number of N_S}.
+
+The pairs of sites in N_R and N_S closer than the sum of their
+radii are written to N_RS_R and N_RS_S, along with the minimum image
+cartesian path from the R site to the S site in N_RS_paths (the dcoords of
+overlap_setup_real). At most max_pairs pairs are written, and the total
+number of pairs is returned, so the function can be called again with
+larger buffers if it exceeds max_pairs.
+*/
+int make_site_lists(double* lattice, int num_R, double* coords_R, int* elems_R,
+	double* rmax_R, int num_S, double* coords_S, int* elems_S, double* rmax_S,
+	double tol, int* M_R, int* M_S, int* N_R, int* N_S, int* counts,
+	int max_pairs, int* N_RS_R, int* N_RS_S, double* N_RS_paths);
+
 /**
 Much more efficient version of overlap_setup.
 Calculates three overlap terms for when bands have different
@@ -90,14 +135,30 @@ structures:
 <(phi1_i-phit1_i)|psit2_n2k>
 <(phi2_i-phit2_i)|psit1_n1k>
 <(phi1_i-phit1_i)|(phi2_i-phit2_i)>
+The projections of the bands of each pswf_t onto the sites of the other,
+and the two-center overlaps, are kept in the setup_cache of wf_R and
+wf_S and reused by later calls for the same sites (same element,
+position and FFT grid) and pairs of sites, so setting up many structures
+against one basis only repeats the work for the sites that differ.
+Cached sites and pairs that a call does not use are freed at its end.
+N_RS_paths holds the minimum image cartesian path from site N_RS_R[i]
+to site N_RS_S[i] for each pair, as returned by make_site_lists, or
+is NULL to compute the paths here.
 */
 void overlap_setup_real(pswf_t* wf_R, pswf_t* wf_S,
 	int* labels_R, int* labels_S, double* coords_R, double* coords_S,
-	int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, int num_N_R, int num_N_S, int num_N_RS);
+	int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, double* N_RS_paths,
+	int num_N_R, int num_N_S, int num_N_RS);
 
+/**
+Same as overlap_setup_real for reciprocal space augmentation: sets the
+CAs of the bands of wf_R for the sites N_R and of wf_S for the sites N_S.
+The CAs are only recomputed if the sites differ from the previous call.
+*/
 void overlap_setup_recip(pswf_t* wf_R, pswf_t* wf_S,
 	int* labels_R, int* labels_S, double* coords_R, double* coords_S,
-	int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, int num_N_R, int num_N_S, int num_N_RS);
+	int* N_R, int* N_S, int* N_RS_R, int* N_RS_S, double* N_RS_paths,
+	int num_N_R, int num_N_S, int num_N_RS);
 
 /**
 Calculates the components of the overlap operator in the augmentation
@@ -115,6 +176,36 @@ void compensation_terms_recip(double complex* overlap, int BAND_NUM, pswf_t* wf_
 	int* proj_labels, double* proj_coords, int* ref_labels, double* ref_coords,
 	int* fft_grid);
 
+/**
+Same as compensation_terms, but for the bands band_nums[0..num_bands-1]
+of wf_S at once. At each kpoint, the projector overlaps of all the
+bands of wf_R and of the selected bands of wf_S are stacked into
+matrices, so the site terms are summed by a few matrix products
+instead of one loop per pair of bands.
+
+overlap must hold num_bands * wf_R->nband * wf_R->nwk * wf_R->nspin
+values, and the terms are added to it laid out as the output of
+compensation_terms for band_nums[0], then band_nums[1], etc.
+*/
+void compensation_terms_batch(double complex* overlap, int num_bands, int* band_nums,
+	pswf_t* wf_S, pswf_t* wf_R,
+	int num_M, int num_N_R, int num_N_S, int num_N_RS,
+	int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
+	int* proj_labels, double* proj_coords, int* ref_labels, double* ref_coords,
+	int* fft_grid);
+
+/**
+Same as compensation_terms_recip for the bands band_nums[0..num_bands-1]
+of wf_S at once, with the same layout as compensation_terms_batch.
+The overlaps with the augmentation CAs are also computed as matrix products.
+*/
+void compensation_terms_recip_batch(double complex* overlap, int num_bands, int* band_nums,
+	pswf_t* wf_S, pswf_t* wf_R,
+	int num_M, int num_N_R, int num_N_S, int num_N_RS,
+	int* M_R, int* M_S, int* N_R, int* N_S, int* N_RS_R, int* N_RS_S,
+	int* proj_labels, double* proj_coords, int* ref_labels, double* ref_coords,
+	int* fft_grid);
+
 /**
 ###DEPRECATED###
 O(N^2) spherical Bessel transform
@@ -7,6 +7,7 @@
 from pawpyseed.core.wavefunction import *
 from pawpyseed.core import pawpyc
 from pawpyseed.core.pawpyc import Timer
+from concurrent.futures import ThreadPoolExecutor
 import warnings
 
 class Projector(pawpyc.CProjector):
@@ -42,7 +43,8 @@ class Projector(pawpyc.CProjector):
 	METHODS = ["pseudo", "realspace", "aug_recip", "aug_real"]
 
 	def __init__(self, wf, basis,
-		unsym_basis = False, unsym_wf = False, method = "aug_real"):
+		unsym_basis = False, unsym_wf = False, method = "aug_real",
+		virtual_budget = None, precision = "double"):
 		"""
 		Arguments:
 			wf (Wavefunction): The wavefunction objects whose
@@ -58,6 +60,20 @@ class Projector(pawpyc.CProjector):
 			method (str, "aug_recip"): Options: "pseudo", "realspace", "aug_recip", "aug_real";
 				The method to use for the projections. See method
 				options in the Attributes section.
+			virtual_budget (int, None): If not None, the desymmetrized
+				copies made for unsym_basis and unsym_wf generate their
+				plane wave coefficients from the original Wavefunction
+				when needed instead of storing them, keeping at most
+				virtual_budget bytes of them in memory
+				(see Wavefunction.desymmetrized_copy)
+			precision (str, "double"): Options: "double", "single", "validate";
+				The precision of the FFTs that project the bands of wf and
+				basis onto the projector functions (see
+				Wavefunction.set_fft_precision). "validate" uses single
+				precision after reporting how far its overlaps are from
+				the double precision ones (see validate_precision), and
+				stores the report in precision_deviation.
+				Not used by the "pseudo" method.
 
 		Returns:
 			Projector object
@@ -76,22 +92,27 @@ class Projector(pawpyc.CProjector):
 
 		if wf.ncl or basis.ncl:
 			raise PAWpyError("Projection not supported for noncollinear case!")
+		if wf.gamma != basis.gamma:
+			raise PAWpyError("Cannot project between gamma-only and standard wavefunctions!")
 
 		if unsym_basis and unsym_wf:
-			basis = basis.desymmetrized_copy()
-			wf = wf.desymmetrized_copy(basis.kpts, basis.kws)
+			basis = basis.desymmetrized_copy(virtual_budget=virtual_budget)
+			wf = wf.desymmetrized_copy(basis.kpts, basis.kws,
+				virtual_budget=virtual_budget)
 		elif unsym_wf and not unsym_basis:
 			if basis.kpts.shape[0] < wf.kpts.shape[0]:
 				raise PAWpyError("Basis doesn't have enough kpoints, needs to be desymmetrized!")
 			allkpts = basis.kpts
 			weights = basis.kws
-			wf = wf.desymmetrized_copy(allkpts, weights)
+			wf = wf.desymmetrized_copy(allkpts, weights,
+				virtual_budget=virtual_budget)
 		elif unsym_basis and not unsym_wf:
 			if wf.kpts.shape[0] < basis.kpts.shape[0]:
 				raise PAWpyError("Defect doesn't have enough kpoints, needs to be desymmetrized!")
 			allkpts = wf.kpts
 			weights = wf.kws
-			basis = basis.desymmetrized_copy(allkpts, weights)
+			basis = basis.desymmetrized_copy(allkpts, weights,
+				virtual_budget=virtual_budget)
 
 		if np.linalg.norm(basis.kpts - wf.kpts) > 1e-10:
 			raise PAWpyError("k-point grids for projection are not matched.")
@@ -100,7 +121,13 @@ class Projector(pawpyc.CProjector):
 		if wf.structure.lattice != basis.structure.lattice:
 			raise PAWpyError("Need the lattice to be the same for projections, and they are not")
 
+		if precision not in ("double", "single", "validate"):
+			raise PAWpyError("precision must be 'double', 'single' or 'validate'")
 		if self.method != "pseudo":
+			# validation starts from the double precision results
+			fft_precision = "double" if precision == "validate" else precision
+			basis.set_fft_precision(fft_precision)
+			wf.set_fft_precision(fft_precision)
 			basis.check_c_projectors()
 			wf.check_c_projectors()
 
@@ -108,6 +135,8 @@ class Projector(pawpyc.CProjector):
 
 		if "aug" in self.method:
 			self.setup_overlap()
+		if precision == "validate" and self.method != "pseudo":
+			self.precision_deviation = self.validate_precision()
 
 	def make_site_lists(self):
 		"""
@@ -115,6 +144,8 @@ class Projector(pawpyc.CProjector):
 		of sites which are identical in structures R (basis) and S (self). N_R and N_S contain all other
 		site indices, and N_RS contains pairs of indices in R and S with overlapping augmentation
 		spheres in the PAW formalism. R si for self.basis, S is for self.wf
+		The nearby sites are found with a periodic cell list (see pawpyc.site_lists),
+		so this scales linearly with the number of sites.
 
 		Returns:
 			M_R (numpy array): Indices of sites in basis which have an identical site in
@@ -125,33 +156,29 @@ class Projector(pawpyc.CProjector):
 			N_S (numpy array): Indices of sites in self but not in M_S
 			N_RS (numpy array): Pairs of indices (one in basis and one in self) which
 				are not identical but have overlapping augmentation regions
+			The minimum image cartesian path from the basis site to the site
+			of self of each pair in N_RS is stored in self.N_RS_paths, a dict
+			keyed by the pair, and passed on to the overlap setup.
 		"""
 
 		ref_sites = self.basis.structure.sites
 		sites = self.wf.structure.sites
-		M_R = []
-		M_S = []
-		for i in range(len(ref_sites)):
-			for j in range(len(sites)):
-				if ref_sites[i].distance(sites[j]) <= 0.02 and el(ref_sites[i]) == el(sites[j]):
-					M_R.append(i)
-					M_S.append(j)
-		N_R = []
-		N_S = []
-		for i in range(len(ref_sites)):
-			if not i in M_R:
-				N_R.append(i)
-		for j in range(len(sites)):
-			if (not j in N_S) and (not j in M_S):
-				N_S.append(j)
-		
-		N_RS = []
-		for i in N_R:
-			for j in N_S:
-				rmax1 = self.basis.cr.pps[el(ref_sites[i])].rmax
-				rmax2 = self.wf.cr.pps[el(sites[i])].rmax
-				if ref_sites[i].distance(sites[j]) < rmax1 + rmax2:
-					N_RS.append((i,j))
+		elems = {}
+		for site in ref_sites + sites:
+			elems.setdefault(el(site), len(elems))
+		M_R, M_S, N_R, N_S, N_RS_R, N_RS_S, paths = pawpyc.site_lists(
+			self.basis.structure.lattice.matrix,
+			[site.frac_coords for site in ref_sites],
+			[elems[el(site)] for site in ref_sites],
+			[self.basis.cr.pps[el(site)].rmax for site in ref_sites],
+			[site.frac_coords for site in sites],
+			[elems[el(site)] for site in sites],
+			[self.wf.cr.pps[el(site)].rmax for site in sites],
+			0.02)
+		M_R, M_S = M_R.tolist(), M_S.tolist()
+		N_R, N_S = N_R.tolist(), N_S.tolist()
+		N_RS = list(zip(N_RS_R.tolist(), N_RS_S.tolist()))
+		self.N_RS_paths = dict(zip(N_RS, paths))
 		return M_R, M_S, N_R, N_S, N_RS
 
 	def setup_overlap(self):
@@ -160,6 +187,7 @@ class Projector(pawpyc.CProjector):
 		as <(phi-phit)|psi> and <(phi_i-phit_i)|(phi_j-phit_j)>,
 		when needed
 		"""
+		self.N_RS_paths = {}
 		M_R, M_S, N_R, N_S, N_RS = self.make_site_lists()
 		num_N_RS = len(N_RS)
 		if num_N_RS > 0:
@@ -167,17 +195,74 @@ class Projector(pawpyc.CProjector):
 		else:
 			N_RS_R, N_RS_S = [], []
 		self.site_cat = [M_R, M_S, N_R, N_S, N_RS_R, N_RS_S]
+		# reuse the paths found with the site lists, unless the site
+		# lists were overridden (the paths are then recomputed in C)
+		paths = None
+		if all(pair in self.N_RS_paths for pair in N_RS):
+			paths = [self.N_RS_paths[pair] for pair in N_RS]
 		start = time.monotonic()
 		if self.method == "aug_recip":
-			self._setup_overlap(self.site_cat, True)
+			self._setup_overlap(self.site_cat, True, paths)
 		elif self.method == "aug_real":
-			self._setup_overlap(self.site_cat, False)
+			self._setup_overlap(self.site_cat, False, paths)
 		else:
 			raise PAWpyError("method must be aug type for setup_overlap call")
 		end = time.monotonic()
 		Timer.overlap_time(end-start)
 		print('-------------\nran overlap_setup in %f seconds\n---------------' % (end-start))
 
+	def _use_fft_precision(self, precision):
+		"""
+		Sets the precision of the projections of wf and basis,
+		repeating the overlap setup if they change.
+		"""
+		single = precision == "single"
+		changed = self.wf.single_precision != single \
+			or self.basis.single_precision != single
+		self.basis.set_fft_precision(precision)
+		self.wf.set_fft_precision(precision)
+		if changed and "aug" in self.method:
+			self.setup_overlap()
+
+	def validate_precision(self):
+		"""
+		Compares the overlaps (pseudoprojection plus compensation
+		terms, as returned by all_band_projection) computed with the
+		bands of wf and basis projected in single precision to those
+		computed in double precision (see Wavefunction.set_fft_precision).
+		The projections are recomputed for each precision, and the
+		Projector is left in single precision.
+
+		Returns:
+			dict with the largest absolute deviation of the single
+			precision overlaps ('max_abs'), the same relative to the
+			largest overlap ('max_rel') and to the largest compensation
+			term ('max_rel_compensation'), and the root mean square
+			deviation ('rms')
+		"""
+		if self.method == "pseudo":
+			raise PAWpyError("The pseudo method does not use the projections")
+		self._use_fft_precision("double")
+		ref = self.all_band_projection()
+		pseudo = self.wf.pseudoprojection_all(self.basis)
+		self._use_fft_precision("single")
+		res = self.all_band_projection()
+
+		diff = np.abs(res - ref)
+		max_ref = np.abs(ref).max()
+		max_comp = np.abs(ref - pseudo).max()
+		report = {
+			'max_abs': float(diff.max()),
+			'max_rel': float(diff.max() / max_ref) if max_ref > 0 else 0.0,
+			'max_rel_compensation': float(diff.max() / max_comp) if max_comp > 0 else 0.0,
+			'rms': float(np.sqrt(np.mean(diff**2))),
+		}
+		print('-------------\nsingle precision overlaps deviate from double precision '
+			'by at most %e (%e relative to the largest overlap, %e relative to '
+			'the largest compensation term), rms %e\n---------------' % (report['max_abs'],
+			report['max_rel'], report['max_rel_compensation'], report['rms']))
+		return report
+
 	def _single_band_projection_pseudo(self, band_num):
 		"""
 		Very rough approximation for the projection of the band_num band of self
@@ -255,6 +340,41 @@ class Projector(pawpyc.CProjector):
 			raise ValueError("Band index out of range (0-indexed)")
 		return self._single_band_projection(band_num, **kwargs)
 
+	def all_band_projection(self):
+		"""
+		Projection of every band of self onto all the bands of basis.
+		For all methods but 'realspace', the pseudowavefunction overlaps
+		of all bands at a k-point and spin are computed at once with a
+		matrix product (see PseudoWavefunction.pseudoprojection_all),
+		and the augmentation terms of all bands are then added with
+		block matrix products as well.
+
+		Returns:
+			(np.array): complex array of shape
+				(wf.nband, basis.nband, basis.nwk, basis.nspin),
+				where res[b0,b,k,s] = <basis;b,k,s|wf;b0,k,s>,
+				i.e. res[b0,b,k,s] is
+				single_band_projection(b0)[b*nwk*nspin + s*nwk + k]
+		"""
+		if self.method == "realspace":
+			res = np.array([self.single_band_projection(b)
+				for b in range(self.wf.nband)])
+			return res.reshape(self.wf.nband, self.basis.nband,
+				self.basis.nspin, self.basis.nwk).transpose(0, 1, 3, 2)
+
+		res = self.wf.pseudoprojection_all(self.basis)
+		# rows in the layout of single_band_projection, viewing res
+		rows = res.transpose(0, 1, 3, 2).reshape(self.wf.nband, -1)
+		start = time.monotonic()
+		if self.method == "aug_real":
+			self._add_augmentation_terms_batch(rows)
+		elif self.method == "aug_recip":
+			self._projection_recip_batch(rows)
+		end = time.monotonic()
+		if self.method == "aug_real":
+			Timer.augmentation_time(end-start)
+		return res
+
 	@staticmethod
 	def setup_bases(basis_dirs, desymmetrize = True,
 		atomate_compatible = True):
@@ -297,13 +417,29 @@ class Projector(pawpyc.CProjector):
 	def setup_multiple_projections(basis_dir, wf_dirs, method = "aug_real",
 									ignore_errors = False,
 									desymmetrize = False,
-									atomate_compatible = True):
+									atomate_compatible = True,
+									prefetch = True,
+									precision = "double",
+									prefetch_threads = None):
 		"""
 		A convenient generator function for processing the Kohn-Sham wavefunctions
 		of multiple structures with respect to one structure used as the basis.
-		All C memory is freed after each yield for the wavefunctions to be analyzed,
+		The generator keeps no reference to the wavefunctions it has yielded
+		once the next one is requested, so their C memory is freed as soon as
+		the caller drops them too (e.g. when the loop variable is rebound),
 		and C memory associated with the basis wavefunction is freed when
 		the generator is called after all wavefunctions have been yielded.
+		The basis-side overlap setup (projections of the basis bands onto
+		the sites of each structure and two-center overlaps) is cached on
+		the basis, so it is only computed for sites that differ from the
+		structures set up before.
+		If prefetch is True, the next wavefunction is read and its projectors
+		are set up on a background thread while the current one is set up
+		and used, so reading the WAVECARs overlaps with the projections.
+		The background thread uses prefetch_threads threads, so together
+		with the calling thread it does not oversubscribe the machine much,
+		and the backend libraries do not free their buffers until the
+		generator finishes, since that would free them for both threads.
 
 		Args:
 			basis_dir (str): path to the VASP output to be used as the basis structure
@@ -317,6 +453,15 @@ class Projector(pawpyc.CProjector):
 			atomate_compatible (bool, True): If True, checks for the gzipped
 				files created by the atomate workflow tools and reads the most
 				recent run based on title
+			prefetch (bool, True): If True, reads the next wavefunction
+				in the background while the current one is processed.
+				This holds up to one more wavefunction in memory.
+			precision (str, "double"): precision of the projections
+				of the bands, passed to each Projector
+			prefetch_threads (int, None): number of threads the prefetch
+				thread uses to set up the projectors of the next
+				wavefunction. Defaults to a quarter of the threads of
+				the calling thread (at least 1).
 
 		Returns:
 			list -- wf_dir, basis, wf
@@ -333,30 +478,75 @@ class Projector(pawpyc.CProjector):
 		
 		if desymmetrize:
 			basis = basis.desymmetrized_copy()
+		fft_precision = "double" if precision == "validate" else precision
+		basis.set_fft_precision(fft_precision)
 
-		errcount = 0
-		pr = None
-		for wf_dir in wf_dirs:
-
-			try:
-				if atomate_compatible:
-					wf = Wavefunction.from_atomate_directory(wf_dir, False)
-				else:
-					wf = Wavefunction.from_directory(wf_dir, False)
-
-				if desymmetrize:
-					pr = Projector(wf, basis, method = method, unsym_wf = True)
-				else:
-					pr = Projector(wf, basis, method = method)
+		def load(wf_dir):
+			# everything that only depends on wf_dir, so it can run
+			# on the prefetch thread
+			if atomate_compatible:
+				wf = Wavefunction.from_atomate_directory(wf_dir, False)
+			else:
+				wf = Wavefunction.from_directory(wf_dir, False)
+			if desymmetrize:
+				if basis.kpts.shape[0] < wf.kpts.shape[0]:
+					raise PAWpyError("Basis doesn't have enough kpoints, needs to be desymmetrized!")
+				wf = wf.desymmetrized_copy(basis.kpts, basis.kws)
+			if method != "pseudo":
+				wf.set_fft_precision(fft_precision)
+				wf.check_c_projectors()
+			return wf
+
+		executor = ThreadPoolExecutor(max_workers = 1) if prefetch else None
+		if prefetch_threads is None:
+			prefetch_threads = max(1, pawpyc.get_thread_count() // 4)
+		def prefetch_load(wf_dir):
+			# the thread count only applies to the prefetch thread
+			pawpyc.set_thread_count(prefetch_threads)
+			return load(wf_dir)
+		def submit(wf_dir):
+			if executor is None:
+				return wf_dir
+			return executor.submit(prefetch_load, wf_dir)
+		def result(job):
+			if executor is None:
+				return load(job)
+			return job.result()
 
-				yield [wf_dir, pr]
-			except Exception as e:
-				if ignore_errors:
-					errcount += 1
-				else:
-					raise PAWpyError('Unable to setup wavefunction in directory %s' % wf_dir\
-										+'\nGot the following error:\n'+str(e))
-		if not pr:
+		errcount = 0
+		num_done = 0
+		if executor is not None:
+			pawpyc.defer_buffer_frees(True)
+		try:
+			job = submit(wf_dirs[0]) if len(wf_dirs) > 0 else None
+			if method != "pseudo":
+				basis.check_c_projectors()
+			for i, wf_dir in enumerate(wf_dirs):
+				try:
+					wf = result(job)
+				except Exception as e:
+					wf = e
+				# start reading the next wavefunction before projecting this one
+				job = submit(wf_dirs[i+1]) if i + 1 < len(wf_dirs) else None
+				try:
+					if isinstance(wf, Exception):
+						raise wf
+					pr = Projector(wf, basis, method = method, precision = precision)
+					del wf
+					num_done += 1
+					yield [wf_dir, pr]
+					del pr
+				except Exception as e:
+					if ignore_errors:
+						errcount += 1
+					else:
+						raise PAWpyError('Unable to setup wavefunction in directory %s' % wf_dir\
+											+'\nGot the following error:\n'+str(e))
+		finally:
+			if executor is not None:
+				executor.shutdown(wait = True)
+				pawpyc.defer_buffer_frees(False)
+		if not num_done:
 			raise PAWpyError("Could not generate any projector setups")
 		print("Number of errors:", errcount)
 
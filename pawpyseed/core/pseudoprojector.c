@@ -4,6 +4,7 @@
 #include <math.h>
 #include <omp.h>
 #include <time.h>
+#include "backend.h"
 #include "pseudoprojector.h"
 #include "utils.h"
 
@@ -24,13 +25,19 @@ void vc_pseudoprojection(pswf_t* wf_ref, pswf_t* wf_proj, int BAND_NUM, double*
 		for (int kpt_num = 0; kpt_num < NUM_KPTS; kpt_num++)
 		{
 			float complex curr_overlap = 0;
-			float complex* C1s = kptspro[kpt_num]->bands[0]->Cs;
-			float complex* C2s = kpts[kpt_num]->bands[b]->Cs;
+			float complex* C1s = acquire_coeffs(kptspro[kpt_num]->bands[0]);
+			float complex* C2s = acquire_coeffs(kpts[kpt_num]->bands[b]);
 			int num_waves = kpts[kpt_num]->bands[b]->num_waves;
-			for (int w = 0; w < num_waves; w++)
-			{
-				curr_overlap += C1s[w] * conj(C2s[w]);
+			if (kpts[kpt_num]->gamma) {
+				curr_overlap = gamma_dot(C2s, C1s, num_waves);
+			} else {
+				for (int w = 0; w < num_waves; w++)
+				{
+					curr_overlap += C1s[w] * conj(C2s[w]);
+				}
 			}
+			release_coeffs(kptspro[kpt_num]->bands[0]);
+			release_coeffs(kpts[kpt_num]->bands[b]);
 			#pragma omp critical
 			{
 				if (kpts[kpt_num]->bands[b]->occ > 0.5)
@@ -75,11 +82,91 @@ void pseudoprojection(double complex* projections, pswf_t* wf_ref, pswf_t* wf_pr
 		for (int kpt_num = 0; kpt_num < NUM_KPTS; kpt_num++)
 		{
 			float complex curr_overlap = 0;
-			float complex* C1s = kptspro[kpt_num]->bands[BAND_NUM]->Cs;
-			float complex* C2s = kpts[kpt_num]->bands[b]->Cs;
+			float complex* C1s = acquire_coeffs(kptspro[kpt_num]->bands[BAND_NUM]);
+			float complex* C2s = acquire_coeffs(kpts[kpt_num]->bands[b]);
 			int num_waves = kpts[kpt_num]->bands[b]->num_waves;
-			cblas_cdotc_sub(num_waves, C2s, 1, C1s, 1, &curr_overlap);
+			if (kpts[kpt_num]->gamma) {
+				curr_overlap = gamma_dot(C2s, C1s, num_waves);
+			} else {
+				cblas_cdotc_sub(num_waves, C2s, 1, C1s, 1, &curr_overlap);
+			}
+			release_coeffs(kptspro[kpt_num]->bands[BAND_NUM]);
+			release_coeffs(kpts[kpt_num]->bands[b]);
 			projections[b*NUM_KPTS+kpt_num] = curr_overlap;
 		}
 	}
 }
+
+/*
+Returns the coefficients of the bands of kpt as a num_bands x ld
+matrix: the coefficient slab of kpt if it has one, otherwise a
+packed copy, which the caller frees with backend_free.
+*/
+static float complex* coeff_matrix(kpoint_t* kpt, int* ld, int* packed) {
+	if (kpt->coeffs != NULL) {
+		*ld = kpt->ld;
+		*packed = 0;
+		return kpt->coeffs;
+	}
+	int num_waves = kpt->num_waves;
+	float complex* mat = (float complex*) backend_malloc(
+		(size_t) kpt->num_bands * num_waves * sizeof(float complex), 64);
+	CHECK_ALLOCATION(mat);
+	for (int b = 0; b < kpt->num_bands; b++) {
+		float complex* Cs = acquire_coeffs(kpt->bands[b]);
+		for (int w = 0; w < num_waves; w++) {
+			mat[(size_t) b * num_waves + w] = Cs[w];
+		}
+		release_coeffs(kpt->bands[b]);
+	}
+	*ld = num_waves;
+	*packed = 1;
+	return mat;
+}
+
+void pseudoprojection_all(double complex* projections, pswf_t* wf_ref, pswf_t* wf_proj) {
+
+	int NUM_KPTS = wf_ref->nwk * wf_ref->nspin;
+	int NUM_BANDS = wf_ref->nband;
+	int NUM_PROJ_BANDS = wf_proj->nband;
+	const float complex alpha = 1;
+	const float complex beta = 0;
+
+	float complex* overlaps = (float complex*) backend_malloc(
+		(size_t) NUM_PROJ_BANDS * NUM_BANDS * sizeof(float complex), 64);
+	CHECK_ALLOCATION(overlaps);
+	for (int kpt_num = 0; kpt_num < NUM_KPTS; kpt_num++) {
+		kpoint_t* kpt = wf_ref->kpts[kpt_num];
+		kpoint_t* kptpro = wf_proj->kpts[kpt_num];
+		int ld, ldpro, packed, packedpro;
+		float complex* C1s = coeff_matrix(kptpro, &ldpro, &packedpro);
+		float complex* C2s = coeff_matrix(kpt, &ld, &packed);
+		// overlaps[b'][b] = <ref b|proj b'> = sum_w C1s[b'][w] conj(C2s[b][w])
+		if (kpt->gamma) {
+			// real overlaps, see gamma_gemm
+			float* real_overlaps = (float*) overlaps;
+			gamma_gemm(NUM_PROJ_BANDS, NUM_BANDS, kpt->num_waves,
+				C1s, ldpro, C2s, ld, real_overlaps);
+			for (long i = (long) NUM_PROJ_BANDS * NUM_BANDS - 1; i >= 0; i--) {
+				overlaps[i] = real_overlaps[i];
+			}
+		} else {
+			cblas_cgemm(CblasRowMajor, CblasNoTrans, CblasConjTrans,
+				NUM_PROJ_BANDS, NUM_BANDS, kpt->num_waves, &alpha,
+				C1s, ldpro, C2s, ld, &beta, overlaps, NUM_BANDS);
+		}
+		if (packedpro) {
+			backend_free(C1s);
+		}
+		if (packed) {
+			backend_free(C2s);
+		}
+		for (int bp = 0; bp < NUM_PROJ_BANDS; bp++) {
+			for (int b = 0; b < NUM_BANDS; b++) {
+				projections[((size_t) bp * NUM_BANDS + b) * NUM_KPTS + kpt_num]
+					= overlaps[bp * NUM_BANDS + b];
+			}
+		}
+	}
+	backend_free(overlaps);
+}
@@ -24,4 +24,21 @@ loop over bands
 */
 void pseudoprojection(double complex* projections, pswf_t* wf_ref, pswf_t* wf_proj, int BAND_NUM);
 
+/**
+Same as pseudoprojection for all bands of wf_proj at once. At each
+kpoint and spin, the overlaps of all bands of wf_proj with all bands
+of wf_ref are computed with one matrix product of their coefficient
+matrices (the coefficient slabs of the kpoints, see alloc_coeff_slab,
+or packed copies for bands that are mapped or cached).
+
+projections must hold wf_proj->nband * wf_ref->nband * wf_ref->nwk
+* wf_ref->nspin values, laid out as follows:
+loop over bands of wf_proj
+	loop over bands of wf_ref
+		loop over spins
+			loop over kpoints
+i.e. the output of pseudoprojection for each band of wf_proj in turn.
+*/
+void pseudoprojection_all(double complex* projections, pswf_t* wf_ref, pswf_t* wf_proj);
+
 #endif
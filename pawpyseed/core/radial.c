@@ -168,9 +168,6 @@ double complex reciprocal_offsite_wave_overlap(double* dcoord,
 				total += spline_integral(kgrid, ifunc, ispline, KGRID_SIZE)
 					* 2 / PI;
 		}
-		free(ispline[0]);
-		free(ispline[1]);
-		free(ispline[2]);
 		free(ispline);
 	}
 	free(kgrid);
@@ -1,22 +1,166 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <complex.h>
 #include <math.h>
 #include <omp.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <bzlib.h>
 #include "utils.h"
+#include "backend.h"
 #include "reader.h"
 
 #define PI 3.14159265358979323846
 #define c 0.262465831
 
+static int wcstreamed(WAVECAR* wc) {
+	return wc->type == 3 || wc->type == 4;
+}
+
+static void* bzopen_stream(FILE* fp, void* unused, int num_unused) {
+	int bzerror;
+	BZFILE* bzfp = BZ2_bzReadOpen(&bzerror, fp, 0, 0, unused, num_unused);
+	if (bzerror != BZ_OK) {
+		BZ2_bzReadClose(&bzerror, bzfp);
+		return NULL;
+	}
+	return bzfp;
+}
+
+static int bzread_all(WAVECAR* wc, char* ptr, long size) {
+	int bzerror;
+	while (size > 0) {
+		int chunk = size > (1<<30) ? (1<<30) : (int) size;
+		int num_read = BZ2_bzRead(&bzerror, (BZFILE*) wc->zfp, ptr, chunk);
+		if (bzerror == BZ_STREAM_END) {
+			// files written by parallel bzip2 contain several streams,
+			// so continue with the next one if there is data left
+			void* unused;
+			int num_unused;
+			char leftover[BZ_MAX_UNUSED];
+			BZ2_bzReadGetUnused(&bzerror, (BZFILE*) wc->zfp, &unused, &num_unused);
+			memcpy(leftover, unused, num_unused);
+			BZ2_bzReadClose(&bzerror, (BZFILE*) wc->zfp);
+			wc->zfp = bzopen_stream(wc->fp, leftover, num_unused);
+			if (wc->zfp == NULL || (num_read == 0 && num_unused == 0 && feof(wc->fp))) {
+				printf("ERROR: unexpected end of WAVECAR\n");
+				return -1;
+			}
+		} else if (bzerror != BZ_OK) {
+			printf("ERROR: could not decompress WAVECAR (bzip2 error %d)\n", bzerror);
+			return -1;
+		}
+		ptr += num_read;
+		size -= num_read;
+	}
+	return 0;
+}
+
+static int gzread_all(WAVECAR* wc, char* ptr, long size) {
+	while (size > 0) {
+		unsigned chunk = size > (1<<30) ? (1<<30) : (unsigned) size;
+		int num_read = gzread((gzFile) wc->zfp, ptr, chunk);
+		if (num_read <= 0) {
+			printf("ERROR: unexpected end of WAVECAR\n");
+			return -1;
+		}
+		ptr += num_read;
+		size -= num_read;
+	}
+	return 0;
+}
+
+static int wcstream_skip(WAVECAR* wc, long loc) {
+	if (loc < wc->pos) {
+		if (wc->type == 3) {
+			gzrewind((gzFile) wc->zfp);
+		} else {
+			int bzerror;
+			BZ2_bzReadClose(&bzerror, (BZFILE*) wc->zfp);
+			rewind(wc->fp);
+			wc->zfp = bzopen_stream(wc->fp, NULL, 0);
+			if (wc->zfp == NULL) {
+				printf("ERROR: could not decompress WAVECAR\n");
+				return -1;
+			}
+		}
+		wc->pos = 0;
+	}
+	char buf[65536];
+	while (wc->pos < loc) {
+		long chunk = loc - wc->pos > 65536 ? 65536 : loc - wc->pos;
+		int err = wc->type == 3 ? gzread_all(wc, buf, chunk)
+			: bzread_all(wc, buf, chunk);
+		if (err) {
+			return err;
+		}
+		wc->pos += chunk;
+	}
+	return 0;
+}
+
 WAVECAR* wcopen(char* f, int type) {
 	WAVECAR* wc = (WAVECAR*) malloc(sizeof(WAVECAR));
+	CHECK_ALLOCATION(wc);
+	wc->size = 0;
+	wc->zfp = NULL;
+	wc->pos = 0;
 	if (type == 0) {
 		wc->type = 0;
 		wc->fp = fopen(f, "rb");
 		wc->start = NULL;
 		wc->curr = NULL;
+	} else if (type == 2) {
+		wc->type = 2;
+		wc->fp = NULL;
+		int fd = open(f, O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+			if (fd >= 0) close(fd);
+			free(wc);
+			return NULL;
+		}
+		// MAP_PRIVATE keeps the pages shared with the page cache
+		// (and other processes mapping the same WAVECAR) until written
+		void* map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (map == MAP_FAILED) {
+			free(wc);
+			return NULL;
+		}
+		wc->start = (char*) map;
+		wc->curr = wc->start;
+		wc->size = (long) st.st_size;
+	} else if (type == 3) {
+		wc->type = 3;
+		wc->fp = NULL;
+		wc->start = NULL;
+		wc->curr = NULL;
+		wc->zfp = gzopen(f, "rb");
+		if (wc->zfp == NULL) {
+			free(wc);
+			return NULL;
+		}
+		gzbuffer((gzFile) wc->zfp, 1<<20);
+	} else if (type == 4) {
+		wc->type = 4;
+		wc->start = NULL;
+		wc->curr = NULL;
+		wc->fp = fopen(f, "rb");
+		if (wc->fp != NULL) {
+			wc->zfp = bzopen_stream(wc->fp, NULL, 0);
+		}
+		if (wc->zfp == NULL) {
+			if (wc->fp != NULL) fclose(wc->fp);
+			free(wc);
+			return NULL;
+		}
 	} else {
 		wc->type = 1;
 		wc->fp = NULL;
@@ -26,28 +170,77 @@ WAVECAR* wcopen(char* f, int type) {
 	return wc;
 }
 
-void wcseek(WAVECAR* wc, long loc) {
+int wcseek(WAVECAR* wc, long loc) {
 	if (wc->type == 0) {
-		fseek(wc->fp, loc, SEEK_SET);
+		return fseek(wc->fp, loc, SEEK_SET) == 0 ? 0 : -1;
+	} else if (wcstreamed(wc)) {
+		return wcstream_skip(wc, loc);
 	} else {
 		wc->curr = wc->start + loc;
 	}
+	return 0;
 }
 
-void wcread(void* ptr0, long size, long nmemb, WAVECAR* wc) {
+int wcread(void* ptr0, long size, long nmemb, WAVECAR* wc) {
+	int err = 0;
 	if (wc->type == 0) {
-		fread(ptr0, size, nmemb, wc->fp);
+		if (fread(ptr0, size, nmemb, wc->fp) != (size_t) nmemb) {
+			printf("ERROR: unexpected end of WAVECAR\n");
+			err = -1;
+		}
+	} else if (wc->type == 3) {
+		err = gzread_all(wc, (char*) ptr0, size * nmemb);
+		wc->pos += size * nmemb;
+	} else if (wc->type == 4) {
+		err = bzread_all(wc, (char*) ptr0, size * nmemb);
+		wc->pos += size * nmemb;
+	} else if (wc->type == 2 && wc->curr + size * nmemb > wc->start + wc->size) {
+		printf("ERROR: unexpected end of WAVECAR\n");
+		err = -1;
 	} else {
+		memcpy(ptr0, wc->curr, size * nmemb);
+	}
+	return err;
+}
+
+int wcpread(void* ptr0, long size, long loc, WAVECAR* wc) {
+	if (wc->type == 0) {
 		char* ptr = (char*) ptr0;
-		for (int i = 0; i < size * nmemb; i++) {
-			ptr[i] = wc->curr[i];
+		int fd = fileno(wc->fp);
+		long done = 0;
+		while (done < size) {
+			ssize_t num_read = pread(fd, ptr + done, size - done, loc + done);
+			if (num_read <= 0) {
+				printf("ERROR: unexpected end of WAVECAR\n");
+				return -1;
+			}
+			done += num_read;
+		}
+	} else if (wcstreamed(wc)) {
+		if (wcseek(wc, loc)) {
+			return -1;
 		}
+		return wcread(ptr0, size, 1, wc);
+	} else if (wc->type == 2 && loc + size > wc->size) {
+		printf("ERROR: unexpected end of WAVECAR\n");
+		return -1;
+	} else {
+		memcpy(ptr0, wc->start + loc, size);
 	}
+	return 0;
 }
 
 void wcclose(WAVECAR* wc) {
 	if (wc->type == 0) {
 		fclose(wc->fp);
+	} else if (wc->type == 2 && wc->start != NULL) {
+		munmap(wc->start, wc->size);
+	} else if (wc->type == 3) {
+		gzclose((gzFile) wc->zfp);
+	} else if (wc->type == 4) {
+		int bzerror;
+		BZ2_bzReadClose(&bzerror, (BZFILE*) wc->zfp);
+		fclose(wc->fp);
 	}
 	free(wc);
 }
@@ -124,7 +317,53 @@ void setup(int nspin, int nwk, int nband,
 	*nb3 = nb3max;
 }
 
-pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights) {
+/*
+Reads the first nplane coefficients of the band record at loc into coeff,
+converting them to single precision if record_size is 16 (nprec 45210).
+Returns 0, or -1 if the record cannot be read.
+*/
+static int read_band_coeffs(float complex* coeff, int nplane, long loc,
+	int record_size, WAVECAR* wc) {
+	if (record_size == sizeof(float complex)) {
+		return wcpread(coeff, nplane*sizeof(float complex), loc, wc);
+	}
+	double complex* record = (double complex*) malloc(nplane*sizeof(double complex));
+	CHECK_ALLOCATION(record);
+	int err = wcpread(record, nplane*sizeof(double complex), loc, wc);
+	for (int w = 0; w < nplane && !err; w++) {
+		coeff[w] = (float complex) record[w];
+	}
+	free(record);
+	return err;
+}
+
+/*
+Frees what read_wavecar has built when it fails after allocating
+the pswf_t. The k-points that were not read are NULL in wf->kpts.
+*/
+static void free_failed_wavecar(pswf_t* wf, int use_map) {
+	for (int i = 0; i < wf->nwk * wf->nspin; i++) {
+		kpoint_t* kpt = wf->kpts[i];
+		if (kpt == NULL) continue;
+		if (use_map) {
+			// Cs point into the mapped WAVECAR, which wcclose unmaps
+			for (int b = 0; b < kpt->num_bands; b++)
+				kpt->bands[b]->Cs = NULL;
+		}
+		free_kpoint(kpt, 0, 0, 0, NULL);
+	}
+	if (wf->cache != NULL) {
+		free_coeff_cache(wf->cache);
+	}
+	free(wf->kpts);
+	free(wf->G_bounds);
+	free(wf->lattice);
+	free(wf->reclattice);
+	free(wf);
+}
+
+pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights, long cache_budget,
+	wavecar_selection_t* sel, int storage) {
 
 	int nrecli, nspin, nwk, nband, nprec;
 	double nb1max, nb2max, nb3max, encut;
@@ -134,16 +373,36 @@ pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights) {
 
 	double readin[3];
 	double* ptr = readin;
-	wcread(ptr,24,1,wc);
+	if (wcread(ptr,24,1,wc)) {
+		free(lattice);
+		free(reclattice);
+		return NULL;
+	}
 	//fread(ptr,24,1,wc->fp);
 	nrecli = (int) round(readin[0]);
 	nspin = (int) round(readin[1]);
 	nprec = (int) round(readin[2]);
 	long nrecl = (long)nrecli;
+	// 45200 and 53300 (VASP 6) records hold complex floats,
+	// 45210 and 53310 complex doubles
+	int record_size;
+	if (nprec == 45200 || nprec == 53300) {
+		record_size = sizeof(float complex);
+	} else if (nprec == 45210 || nprec == 53310) {
+		record_size = sizeof(double complex);
+	} else {
+		printf("ERROR: unknown WAVECAR precision tag %d\n", nprec);
+		free(lattice);
+		free(reclattice);
+		return NULL;
+	}
 	double readarr[nrecl/8];
 	ptr = readarr;
-	wcseek(wc,1*nrecl);
-	wcread(ptr,nrecl,1,wc);
+	if (wcseek(wc,1*nrecl) || wcread(ptr,nrecl,1,wc)) {
+		free(lattice);
+		free(reclattice);
+		return NULL;
+	}
 	//fseek(wc->fp,1*nrecl,0);
 	//fread(ptr,nrecl,1,wc->fp);
 	nwk = (int) round(readarr[0]);
@@ -153,23 +412,78 @@ pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights) {
 		lattice[i] = readarr[i+3];
 	}
 
+	// resolve the selection into the WAVECAR spins, k-points and bands to read
+	int band_min = 0, sel_nband = nband, sel_nwk = nwk, sel_nspin = nspin;
+	int* sel_kpts = (int*) malloc(nwk * sizeof(int));
+	int sel_spins[2] = {0, 1};
+	CHECK_ALLOCATION(sel_kpts);
+	for (int k = 0; k < nwk; k++) sel_kpts[k] = k;
+	if (sel != NULL) {
+		int bad = 0;
+		if (sel->band_max >= 0) {
+			band_min = sel->band_min;
+			sel_nband = sel->band_max - sel->band_min;
+			bad |= band_min < 0 || sel_nband <= 0 || sel->band_max > nband;
+		}
+		if (sel->num_kpts >= 0) {
+			sel_nwk = sel->num_kpts;
+			bad |= sel_nwk == 0 || sel_nwk > nwk;
+			for (int k = 0; k < sel_nwk && !bad; k++) {
+				sel_kpts[k] = sel->kpt_inds[k];
+				bad |= sel_kpts[k] < 0 || sel_kpts[k] >= nwk;
+			}
+		}
+		if (sel->spin >= 0) {
+			sel_nspin = 1;
+			sel_spins[0] = sel->spin;
+			bad |= sel->spin >= nspin;
+		}
+		if (bad) {
+			printf("ERROR: band/k-point/spin selection out of range\n");
+			free(sel_kpts);
+			free(lattice);
+			free(reclattice);
+			return NULL;
+		}
+	}
+
 	setup(nspin, nwk, nband, &nb1max, &nb2max, &nb3max,
 		&npmax, encut, lattice, reclattice);
-	double* b1 = reclattice;
-	double* b2 = reclattice+3;
-	double* b3 = reclattice+6;
+	gsphere_t gsphere = make_gsphere(reclattice, encut);
 
 	pswf_t* wf = (pswf_t*) malloc(sizeof(pswf_t));
 
 	wf->num_sites = 0;
-	wf->nspin = nspin;
-	wf->nwk = nwk;
-	wf->nband = nband;
+	wf->nspin = sel_nspin;
+	wf->nwk = sel_nwk;
+	wf->nband = sel_nband;
 	wf->is_ncl = 0;
+	wf->is_gamma = 0;
+	wf->fft_precision = FFT_DOUBLE;
 	wf->overlaps = NULL;
+	wf->dcoords = NULL;
 	wf->num_projs = NULL;
+	wf->wavecar_map = NULL;
+	wf->wavecar_map_size = 0;
+	wf->cache = NULL;
+	wf->proj_arenas = NULL;
+	wf->wp_arenas = NULL;
+	wf->num_proj_arenas = 0;
+	wf->num_wp_arenas = 0;
+	wf->setup_cache = NULL;
+	if (storage != COEFF_FLOAT32) {
+		wf->cache = make_coeff_cache(-1, sel_nwk*sel_nspin*sel_nband,
+			cache_budget, record_size, storage);
+	} else if (cache_budget > 0 && wc->type == 0) {
+		wf->cache = make_coeff_cache(dup(fileno(wc->fp)),
+			sel_nwk*sel_nspin*sel_nband, cache_budget, record_size, storage);
+	}
+	// the bands can only point into a mapped WAVECAR
+	// if its records are stored as they are used
+	int use_map = wc->type == 2 && record_size == sizeof(float complex)
+		&& storage == COEFF_FLOAT32;
 
-	kpoint_t** kpts = (kpoint_t**) malloc(nwk*nspin*sizeof(kpoint_t*));
+	kpoint_t** kpts = (kpoint_t**) calloc(sel_nwk*sel_nspin, sizeof(kpoint_t*));
 	if (kpts == NULL) {
 		ALLOCATION_FAILED();
 	}
@@ -179,24 +493,54 @@ pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights) {
 	wf->reclattice = reclattice;
 	wf->G_bounds = (int*) calloc(6, sizeof(int));
 
-	double* kptr = (double*) malloc(nrecl);
-	float complex* cptr = (float complex*) malloc(nrecl);
-	//#pragma omp parallel for
-	for (int iwk = 0; iwk < nwk * nspin; iwk++) {
-		long irec = iwk * (long)(1 + nband);
+	// k-points are decoded independently, each thread reading its
+	// records with wcpread, and the G bounds are merged at the end.
+	// Compressed WAVECARs are streamed, so they are decoded in order.
+	// If a record cannot be read (a truncated or corrupt file) or its
+	// plane waves do not match the G-sphere, the remaining k-points
+	// are skipped and NULL is returned.
+	int failed = 0;
+	int* kpt_G_bounds = (int*) calloc(6*sel_nwk*sel_nspin, sizeof(int));
+	int* kpt_is_ncl = (int*) calloc(sel_nwk*sel_nspin, sizeof(int));
+	int* kpt_is_gamma = (int*) calloc(sel_nwk*sel_nspin, sizeof(int));
+	CHECK_ALLOCATION(kpt_G_bounds);
+	CHECK_ALLOCATION(kpt_is_ncl);
+	CHECK_ALLOCATION(kpt_is_gamma);
+#if defined(_OPENMP)
+	omp_set_num_threads(omp_get_max_threads());
+#endif
+	#pragma omp parallel for schedule(dynamic) if(!wcstreamed(wc))
+	for (int iwk = 0; iwk < sel_nwk * sel_nspin; iwk++) {
+		int skip;
+		#pragma omp atomic read
+		skip = failed;
+		if (skip) continue;
+		int wc_kpt = sel_kpts[iwk % sel_nwk];
+		long irec = (sel_spins[iwk / sel_nwk] * nwk + wc_kpt) * (long)(1 + nband);
+		int* G_bounds = kpt_G_bounds + 6*iwk;
+
+		double* kptr = (double*) malloc(nrecl);
+		CHECK_ALLOCATION(kptr);
+		if (wcpread(kptr, nrecl, irec*nrecl+2*nrecl, wc)) {
+			free(kptr);
+			#pragma omp atomic write
+			failed = 1;
+			continue;
+		}
 
 		kpoint_t* kpt = (kpoint_t*) malloc(sizeof(kpoint_t));
+		CHECK_ALLOCATION(kpt);
 		kpt->expansion = NULL;
-		kpt->num_bands = nband;
-		band_t** bands = (band_t**) malloc(nband*sizeof(band_t*));
+		kpt->coeffs = NULL;
+		kpt->ld = 0;
+		kpt->symm = NULL;
+		kpt->gamma = 0;
+		kpt->num_bands = sel_nband;
+		band_t** bands = (band_t**) malloc(sel_nband*sizeof(band_t*));
 		kpt->bands = bands;
-		if (kpt == NULL || bands == NULL) {
+		if (bands == NULL) {
 		    ALLOCATION_FAILED();
 		}
-		wcseek(wc, irec*nrecl+2*nrecl);
-		wcread(kptr, 8, nrecl/8, wc);
-		//fseek(wc->fp, irec*nrecl+2*nrecl, SEEK_SET);
-		//fread(kptr, 8, nrecl/8, wc->fp);
 		
 		int nplane = (int) round(kptr[0]);
 		kpt->num_waves = nplane;
@@ -208,111 +552,216 @@ pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights) {
 		kpt->k[0] = kptr[1];
 		kpt->k[1] = kptr[2];
 		kpt->k[2] = kptr[3];
-		double kx = kpt->k[0], ky = kpt->k[1], kz = kpt->k[2];
-		for (int i = 0; i < nband; i++) {
+		for (int i = 0; i < sel_nband; i++) {
 			band_t* band = (band_t*) malloc(sizeof(band_t));
+			band->n = band_min + i;
 			band->num_waves = nplane;
-			band->energy = kptr[4+i*3];
-			band->occ = kptr[6+i*3];
+			band->energy = kptr[4+band->n*3];
+			band->occ = kptr[6+band->n*3];
 			band->projections = NULL;
 			band->up_projections = NULL;
 			band->down_projections = NULL;
 			band->wave_projections = NULL;
 			band->CRs = NULL;
 			band->CAs = NULL;
+			band->cache = NULL;
+			band->cache_slot = -1;
 			kpt->bands[i] = band;
 		}
 
-		int ncnt = -1;
-		for (int ig3 = 0; ig3 <= 2 * nb3max; ig3++) {
-			int ig3p = ig3;
-			if (ig3 > nb3max) ig3p = ig3 - 2 * nb3max - 1;
-			for (int ig2 = 0; ig2 <= 2 * nb2max; ig2++) {
-				int ig2p = ig2;
-				if (ig2 > nb2max) ig2p = ig2 - 2 * nb2max - 1;
-				for (int ig1 = 0; ig1 <= 2 * nb1max; ig1++) {
-					int ig1p = ig1;
-					if (ig1 > nb1max) ig1p = ig1 - 2 * nb1max - 1;
-					double sumkg[3];
-					for (int j = 0; j < 3; j++) {
-						sumkg[j] = (kx+ig1p) * b1[j]
-									+ (ky+ig2p) * b2[j]
-									+ (kz+ig3p) * b3[j];
-					}
-					double gtot = mag(sumkg);
-					double etot = pow(gtot,2.0) / c;
-					//printf("%lf %lf\n", etot, gtot);
-					if (etot <= encut) {
-						ncnt++;
-						igall[ncnt*3+0] = ig1p;
-						igall[ncnt*3+1] = ig2p;
-						igall[ncnt*3+2] = ig3p;
-						if (ig1p < wf->G_bounds[0]) wf->G_bounds[0] = ig1p;
-						else if (ig1p > wf->G_bounds[1]) wf->G_bounds[1] = ig1p;
-						if (ig2p < wf->G_bounds[2]) wf->G_bounds[2] = ig2p;
-						else if (ig2p > wf->G_bounds[3]) wf->G_bounds[3] = ig2p;
-						if (ig3p < wf->G_bounds[4]) wf->G_bounds[4] = ig3p;
-						else if (ig3p > wf->G_bounds[5]) wf->G_bounds[5] = ig3p;
-					}
-				}
-			}
+		if (wf->cache == NULL && !use_map) {
+			alloc_coeff_slab(kpt);
 		}
-		ncnt++;
+
+		int ncnt = gsphere_points(igall, G_bounds, &gsphere, kpt->k, nplane);
+		int read_err = 0;
 
 		if (ncnt * 2 == nplane) {
 			//printf("This is an NCL wavefunction!\n");
-			wf->is_ncl = 1;
+			kpt_is_ncl[iwk] = 1;
 			for (int iplane = 0; iplane < nplane/2; iplane++) {
 				igall[3*(nplane/2+iplane)+0] = igall[3*iplane+0];
 				igall[3*(nplane/2+iplane)+1] = igall[3*iplane+1];
 				igall[3*(nplane/2+iplane)+2] = igall[3*iplane+2];
 			}
+		} else if (ncnt != nplane && nwk == 1
+			&& kpt->k[0] == 0 && kpt->k[1] == 0 && kpt->k[2] == 0
+			&& gsphere_half_points(igall, G_bounds, &gsphere, nplane) == nplane) {
+			// gamma-only WAVECAR, which stores half of the G-sphere
+			// at its only k-point
+			kpt->gamma = 1;
+			kpt_is_gamma[iwk] = 1;
 		} else if (ncnt != nplane) {
-			printf("ERROR %d %d %lf %lf %lf %lf\n", ncnt, nplane, kx,ky,kz, c);
+			// the plane waves cannot be matched to the coefficients
+			printf("ERROR: %d plane waves in the record of k-point %lf %lf %lf, "
+				"expected %d\n", nplane, kpt->k[0], kpt->k[1], kpt->k[2], ncnt);
+			read_err = -1;
 		}
 		//if (ncnt > npmax) printf("BIG ERROR");
 		//printf("%d %d\n", ncnt, npmax);
 
-		for (int iband = 0; iband < nband; iband++) {
-			irec++;
-			wcseek(wc, (long)irec*nrecl+2*(long)nrecl);
-			wcread(cptr, 8, nrecl/8, wc);
-			//fseek(wc->fp, (long)irec*nrecl+2*(long)nrecl, SEEK_SET);
-			//fread(cptr, 8, nrecl/8, wc->fp);
-			float complex* coeff = malloc(nplane*sizeof(float complex));
-			for (int iplane = 0; iplane < nplane; iplane++) {
-				coeff[iplane] = cptr[iplane];
+		for (int iband = 0; iband < sel_nband && !read_err; iband++) {
+			long brec = irec + 1 + band_min + iband;
+			if (wf->cache != NULL && storage == COEFF_FLOAT32) {
+				int slot = iwk * sel_nband + iband;
+				band_t* band = kpt->bands[iband];
+				band->Cs = NULL;
+				band->cache = wf->cache;
+				band->cache_slot = slot;
+				wf->cache->offsets[slot] = brec*nrecl+2*nrecl;
+				wf->cache->num_waves[slot] = nplane;
+				continue;
+			}
+			if (use_map) {
+				kpt->bands[iband]->Cs = (float complex*)
+					(wc->start + brec*nrecl+2*nrecl);
+				if (brec*nrecl+2*nrecl + nplane*sizeof(float complex) > wc->size) {
+					printf("ERROR: unexpected end of WAVECAR\n");
+					read_err = -1;
+				}
+				continue;
 			}
-			kpt->bands[iband]->Cs = coeff;
+			if (storage != COEFF_FLOAT32) {
+				int slot = iwk * sel_nband + iband;
+				band_t* band = kpt->bands[iband];
+				float complex* coeff = malloc(nplane*sizeof(float complex));
+				CHECK_ALLOCATION(coeff);
+				read_err = read_band_coeffs(coeff, nplane,
+					brec*nrecl+2*nrecl, record_size, wc);
+				if (!read_err) {
+					store_compact_coeffs(wf->cache, slot, coeff, nplane);
+				}
+				free(coeff);
+				band->Cs = NULL;
+				band->cache = wf->cache;
+				band->cache_slot = slot;
+				continue;
+			}
+			// only the first nplane coefficients of the record are used,
+			// so read them straight into the band's row of the slab
+			read_err = read_band_coeffs(kpt->bands[iband]->Cs, nplane,
+				brec*nrecl+2*nrecl, record_size, wc);
+		}
+
+		if (kpt->gamma && !read_err) {
+			// the half sphere starts at G=0, whose coefficient
+			// is real since the wavefunctions are real. Otherwise the
+			// record is not a gamma-only one, and its half sphere cannot
+			// be used as a full k-point either.
+			float C0_imag = cimagf(acquire_coeffs(kpt->bands[0])[0]);
+			release_coeffs(kpt->bands[0]);
+			if (fabsf(C0_imag) > 1e-4) {
+				printf("ERROR: gamma-only WAVECAR with complex G=0 coefficient %e\n",
+					C0_imag);
+				read_err = -1;
+			}
+		}
+		if (read_err) {
+			#pragma omp atomic write
+			failed = 1;
 		}
 		
 		//printf("iwk %d\n", iwk);
-		kpt->weight = kpt_weights[iwk%nwk];
+		kpt->weight = kpt_weights[wc_kpt];
 		kpt->Gs = igall;
 		kpts[iwk] = kpt;
+		free(kptr);
 	}
 
-	free(kptr);
-	free(cptr);
+	if (failed) {
+		free(kpt_G_bounds);
+		free(kpt_is_ncl);
+		free(kpt_is_gamma);
+		free(sel_kpts);
+		free_failed_wavecar(wf, use_map);
+		return NULL;
+	}
+
+	for (int iwk = 0; iwk < sel_nwk * sel_nspin; iwk++) {
+		int* G_bounds = kpt_G_bounds + 6*iwk;
+		for (int i = 0; i < 3; i++) {
+			wf->G_bounds[2*i] = min(wf->G_bounds[2*i], G_bounds[2*i]);
+			wf->G_bounds[2*i+1] = max(wf->G_bounds[2*i+1], G_bounds[2*i+1]);
+		}
+		if (kpt_is_ncl[iwk]) wf->is_ncl = 1;
+		if (kpt_is_gamma[iwk]) wf->is_gamma = 1;
+	}
+	free(kpt_G_bounds);
+	free(kpt_is_ncl);
+	free(kpt_is_gamma);
+	free(sel_kpts);
 
 	wf->pps = NULL;
 	wf->overlaps = NULL;
 	wf->encut = encut;
 
+	if (use_map) {
+		// the bands point into the mapping, so it now belongs to wf
+		wf->wavecar_map = wc->start;
+		wf->wavecar_map_size = wc->size;
+		wc->start = NULL;
+	}
+
 	return wf;
 }
 
 pswf_t* read_wavefunctions(char* filename, double* kpt_weights) {
 	setbuf(stdout,NULL);
 	WAVECAR* f = wcopen(filename, 0);
-	pswf_t* wf = read_wavecar(f, kpt_weights);
+	pswf_t* wf = read_wavecar(f, kpt_weights, 0, NULL, COEFF_FLOAT32);
 	wcclose(f);
 	return wf;
 }
 
 pswf_t* read_wavefunctions_from_str(char* start, double* kpt_weights) {
 	WAVECAR* f = wcopen(start, 1);
-	pswf_t* wf = read_wavecar(f, kpt_weights);
+	pswf_t* wf = read_wavecar(f, kpt_weights, 0, NULL, COEFF_FLOAT32);
+	wcclose(f);
+	return wf;
+}
+
+pswf_t* read_wavefunctions_compressed(char* filename, double* kpt_weights, int compression) {
+	setbuf(stdout,NULL);
+	WAVECAR* f = wcopen(filename, compression == 0 ? 3 : 4);
+	if (f == NULL) {
+		printf("ERROR: could not open %s\n", filename);
+		return NULL;
+	}
+	pswf_t* wf = read_wavecar(f, kpt_weights, 0, NULL, COEFF_FLOAT32);
+	wcclose(f);
+	return wf;
+}
+
+pswf_t* read_wavefunctions_mapped(char* filename, double* kpt_weights) {
+	setbuf(stdout,NULL);
+	WAVECAR* f = wcopen(filename, 2);
+	if (f == NULL) {
+		printf("ERROR: could not memory-map %s\n", filename);
+		return NULL;
+	}
+	pswf_t* wf = read_wavecar(f, kpt_weights, 0, NULL, COEFF_FLOAT32);
+	wcclose(f);
+	return wf;
+}
+
+pswf_t* read_wavefunctions_lazy(char* filename, double* kpt_weights, long cache_budget) {
+	setbuf(stdout,NULL);
+	WAVECAR* f = wcopen(filename, 0);
+	pswf_t* wf = read_wavecar(f, kpt_weights, cache_budget, NULL, COEFF_FLOAT32);
+	wcclose(f);
+	return wf;
+}
+
+pswf_t* read_wavefunctions_select(char* filename, double* kpt_weights, int type,
+	long cache_budget, wavecar_selection_t* sel, int storage) {
+	setbuf(stdout,NULL);
+	WAVECAR* f = wcopen(filename, type);
+	if (f == NULL || (type == 0 && f->fp == NULL)) {
+		printf("ERROR: could not open %s\n", filename);
+		if (f != NULL) free(f);
+		return NULL;
+	}
+	pswf_t* wf = read_wavecar(f, kpt_weights, cache_budget, sel, storage);
 	wcclose(f);
 	return wf;
 }
@@ -10,18 +10,67 @@ https://www.andrew.cmu.edu/user/feenstra/wavetrans/
 #define READER_H
 #include "utils.h"
 
+/**
+Handle for reading a WAVECAR. type is 0 for a file read with
+fread, 1 for a binary string already in memory, 2 for a file
+that is memory-mapped privately (start is the mapping and size
+its length in bytes), 3 for a gzipped file and 4 for a bzipped
+file. Types 3 and 4 are decompressed as a stream (zfp is the
+gzFile or BZFILE*, pos the offset in the decompressed file),
+so they are read in order and cannot be read concurrently.
+*/
 typedef struct WAVECAR_FILE {
 	int type;
 	FILE* fp;
 	char* start;
 	char* curr;
+	long size;
+	void* zfp;
+	long pos;
 } WAVECAR;
 
+/**
+Subset of the records of a WAVECAR to read. The bands band_min
+to band_max-1 are read at the k-points kpt_inds (indices into the
+k-points of the WAVECAR, in increasing order) for spin channel spin.
+A negative band_max, num_kpts or spin selects all bands, k-points
+or spins, respectively.
+*/
+typedef struct wavecar_selection {
+	int band_min; ///< first band to read
+	int band_max; ///< one past the last band to read
+	int num_kpts; ///< number of k-points to read
+	int* kpt_inds; ///< k-points to read
+	int spin; ///< spin channel to read
+} wavecar_selection_t;
+
+/**
+Open a WAVECAR of the given type (see WAVECAR). For type 1,
+f is the string containing the file, otherwise it is the filename.
+For types 2-4, returns NULL if the file cannot be opened.
+*/
 WAVECAR* wcopen(char* f, int type);
 
-void wcseek(WAVECAR* wc, long loc);
+/**
+Moves the read position of the WAVECAR to loc. Seeking backwards
+in a compressed WAVECAR restarts the decompression.
+Returns 0, or -1 if the WAVECAR ends before loc or cannot be decompressed.
+*/
+int wcseek(WAVECAR* wc, long loc);
+
+/**
+Reads nmemb items of size bytes at the read position of the WAVECAR.
+Returns 0, or -1 if the WAVECAR ends early or cannot be decompressed.
+*/
+int wcread(void* ptr0, long size, long nmemb, WAVECAR* wc);
 
-void wcread(void* ptr0, long size, long nmemb, WAVECAR* wc);
+/**
+Reads size bytes at offset loc of the WAVECAR into ptr0. For
+uncompressed WAVECARs, this does not move the position used by
+wcseek/wcread, so it can be called concurrently from several threads.
+Returns 0, or -1 if the record cannot be read (see wcread).
+*/
+int wcpread(void* ptr0, long size, long loc, WAVECAR* wc);
 
 void wcclose(WAVECAR* wc);
 
@@ -34,9 +83,26 @@ void setup(int nspin, int nwk, int nband,
 
 /**
 Handles reading WAVECAR objects, called by read_wavefunctions
-and read_wavefunctions_from_str
+and read_wavefunctions_from_str. If cache_budget > 0 and wc is
+a file (type 0), the band coefficients are not read; instead the
+bands are loaded on demand through a coeff_cache_t holding at most
+cache_budget bytes of coefficients (see acquire_coeffs).
+If sel is not NULL, only the selected records are read, and the
+nband, nwk and nspin of the returned pswf_t count the selected
+bands, k-points and spins (band->n is the band index in the WAVECAR).
+If storage is not COEFF_FLOAT32, the coefficients are kept in that
+compact format (see COEFF_FLOAT16) in a coeff_cache_t, which holds
+at most cache_budget bytes of decoded coefficients.
+Double precision records (nprec 45210 or 53310) are converted to
+single precision. Returns NULL if the selection is out of range,
+the precision of the records is unknown, a record cannot be read
+(a truncated file or a corrupt compressed stream), or the number of
+plane waves of a k-point matches neither its G-sphere, the two spinor
+components of a noncollinear run nor a gamma-only half sphere with
+a real G=0 coefficient.
 */
-pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights);
+pswf_t* read_wavecar(WAVECAR* wc, double* kpt_weights, long cache_budget,
+	wavecar_selection_t* sel, int storage);
 
 /**
 Given char* filename pointing to a WAVECAR file (VASP output),
@@ -52,7 +118,43 @@ WAVECAR object is opened from a .gz or .bz2 format by monty
 pswf_t* read_wavefunctions_from_str(char* start, double* kpt_weights);
 
 /**
-DEPRECATED, DO NOT USE: function to read a single band from a WAVECAR
+Same as read_wavefunctions for a gzipped (compression == 0) or
+bzipped (compression == 1) WAVECAR. The file is decompressed
+record by record straight into the band coefficients, so the
+decompressed file is never held in memory. Returns NULL if the
+file cannot be opened, or is truncated or corrupt.
+*/
+pswf_t* read_wavefunctions_compressed(char* filename, double* kpt_weights, int compression);
+
+/**
+Same as read_wavefunctions, but the WAVECAR is memory-mapped and
+the Cs of each band point directly into the mapping instead of
+being copied onto the heap. The mapping is owned by the returned
+pswf_t and released by free_pswf. Returns NULL if the file
+cannot be mapped.
+*/
+pswf_t* read_wavefunctions_mapped(char* filename, double* kpt_weights);
+
+/**
+Same as read_wavefunctions, but only the k-point headers (energies,
+occupations, plane waves) are read. The coefficients of each band
+are read from the WAVECAR the first time they are needed and kept
+in an LRU cache of at most cache_budget bytes.
+*/
+pswf_t* read_wavefunctions_lazy(char* filename, double* kpt_weights, long cache_budget);
+
+/**
+General form of the read_wavefunctions functions: opens the
+WAVECAR filename as the given WAVECAR type (0, 2, 3 or 4) and
+reads it with read_wavecar(wc, kpt_weights, cache_budget, sel, storage).
+Returns NULL if the file cannot be opened or read_wavecar fails.
+*/
+pswf_t* read_wavefunctions_select(char* filename, double* kpt_weights, int type,
+	long cache_budget, wavecar_selection_t* sel, int storage);
+
+/**
+DEPRECATED, DO NOT USE: function to read a single band from a WAVECAR.
+Use read_wavefunctions_select instead.
 */
 kpoint_t** read_one_band(int* G_bounds, double* kpt_weights, int* ns, int* nk, int* nb, int BAND_NUM, char* filename);
 
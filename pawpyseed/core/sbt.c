@@ -5,10 +5,10 @@
 #include <float.h>
 #include <omp.h>
 #include <time.h>
-#include <mkl.h>
-#include <mkl_types.h>
+#include "backend.h"
 #include "utils.h"
 #include "sbt.h"
+#include "linalg.h"
 
 #define c 0.262465831
 #define PI 3.14159265358979323846
@@ -109,39 +109,31 @@ double* wave_spherical_bessel_transform(sbt_descriptor_t* d, double* f, int l) {
 		fs[i] = f[i-N/2];
 	}
 
-	double complex* x = mkl_calloc(N, sizeof(double complex), 64);
+	double complex* x = backend_calloc(N, sizeof(double complex), 64);
 
-	DFTI_DESCRIPTOR_HANDLE handle = 0;
-	MKL_LONG dim = 1;
-	MKL_LONG length = N;
-	MKL_LONG status = 0;
+	void* handle = get_fft_plan(1, &N, 1, FFT_DOUBLE, FFT_COMPLEX, FFT_BACKWARD, 1);
 
 	double* vals = malloc(N / 2 * sizeof(double));
 
-	status = DftiCreateDescriptor(&handle, DFTI_DOUBLE, DFTI_COMPLEX, dim, length);
-	status = DftiCommitDescriptor(handle);
-
 	for (int m = 0; m < N; m++) {
 		x[m] = pow(r[m], 0.5) * fs[m];
 		// f is the radial part of the function times r,
 		// so only multiply by r^0.5 instead of r^1.5
 	}
-	status = DftiComputeBackward(handle, x);
-	CHECK_STATUS(status);
+	execute_fft_plan(handle, x, x);
 	for (int n = 0; n < N; n++) {
 		x[n] *= M[l][n];
 		if (n >= N/2) {
 			x[n] = 0;
 		}
 	}
-	status = DftiComputeBackward(handle, x);
-	CHECK_STATUS(status);
+	execute_fft_plan(handle, x, x);
 	for (int p = 0; p < N / 2; p++) {
 		vals[p] = creal(x[p]);
 		vals[p] *= 2 / pow(ks[p], 1.5);
 	}
 
-	mkl_free(x);
+	backend_free(x);
 	free(fs);
 	return vals;
 }
@@ -168,39 +160,31 @@ double* inverse_wave_spherical_bessel_transform(sbt_descriptor_t* d, double* f,
 		fs[i] = 0;
 	}
 
-	double complex* x = mkl_malloc(N * sizeof(double complex), 64);
+	double complex* x = backend_malloc(N * sizeof(double complex), 64);
 
-	DFTI_DESCRIPTOR_HANDLE handle = 0;
-	MKL_LONG dim = 1;
-	MKL_LONG length = N;
-	MKL_LONG status = 0;
+	void* handle = get_fft_plan(1, &N, 1, FFT_DOUBLE, FFT_COMPLEX, FFT_BACKWARD, 1);
 
 	double* vals = malloc(N / 2 * sizeof(double));
 
-	status = DftiCreateDescriptor(&handle, DFTI_DOUBLE, DFTI_COMPLEX, dim, length);
-	status = DftiCommitDescriptor(handle);
-
 	for (int m = 0; m < N; m++) {
 		x[m] = pow(r[m], 1.5) * fs[m];
 	}
 	
-	status = DftiComputeBackward(handle, x);
-	CHECK_STATUS(status);
+	execute_fft_plan(handle, x, x);
 	for (int n = 0; n < N; n++) {
 		x[n] *= M[l][n];
 		if (n >= N/2) {
 			x[n] = 0;
 		}
 	}
-	status = DftiComputeBackward(handle, x);
-	CHECK_STATUS(status);
+	execute_fft_plan(handle, x, x);
 	for (int p = 0; p < N / 2; p++) {
 		vals[p] = creal(x[p + N / 2]) / PI * 2;
 		//vals[p] *= 2 / pow(ks[p], 1.5);
 		vals[p] *= 2 / pow(ks[p + N / 2], 1.5);
 	}
 
-	mkl_free(x);
+	backend_free(x);
 	free(fs);
 	return vals;
 }
@@ -99,6 +99,38 @@ class TestC:
 			pawpyc.cartesian_to_frac(temp2, reclattice)
 			assert_almost_equal(np.linalg.norm(temp2-fcoord), 0.0)
 
+	def test_site_lists(self):
+		ref = Poscar.from_file("CONTCAR").structure * (2, 2, 1)
+		struct = ref.copy()
+		struct.translate_sites([0, 3], [0.05, 0.05, 0])
+		struct.remove_sites([5])
+		struct.replace(7, "N")
+		elems = {"Ga": 0, "N": 1}
+		rmax = {"Ga": 1.2, "N": 0.8}
+		M_R, M_S, N_R, N_S, N_RS_R, N_RS_S, paths = pawpyc.site_lists(
+			ref.lattice.matrix,
+			ref.frac_coords, [elems[el(s)] for s in ref], [rmax[el(s)] for s in ref],
+			struct.frac_coords, [elems[el(s)] for s in struct], [rmax[el(s)] for s in struct],
+			0.02)
+		bM_R, bM_S = [], []
+		for i in range(len(ref)):
+			for j in range(len(struct)):
+				if ref[i].distance(struct[j]) <= 0.02 and el(ref[i]) == el(struct[j]):
+					bM_R.append(i)
+					bM_S.append(j)
+		assert_equal(M_R, bM_R)
+		assert_equal(M_S, bM_S)
+		assert_equal(N_R, [i for i in range(len(ref)) if not i in bM_R])
+		assert_equal(N_S, [j for j in range(len(struct)) if not j in bM_S])
+		# the pairs are found with the radius of the site j of S. The
+		# Python site lists before the cell list used the radius of the
+		# S site with index i, which missed or added pairs of N next to Ga
+		pairs = [(i, j) for i in N_R for j in N_S if ref[i].distance(struct[j])
+			< rmax[el(ref[i])] + rmax[el(struct[j])]]
+		assert_equal(list(zip(N_RS_R, N_RS_S)), pairs)
+		for (i, j), path in zip(pairs, paths):
+			assert_almost_equal(np.linalg.norm(path), ref[i].distance(struct[j]))
+
 	def test_spline(self):
 		vr = self.vr
 		cr = self.cr
@@ -121,6 +153,41 @@ class TestC:
 		weights = np.array(vr.actual_kpoints_weights)
 		res = testc.fft_check("WAVECAR", weights, np.array([20,20,20], dtype=np.int32, order='C'))
 		assert_equal(res, 0)
+		# the cached plans are reused, and rebuilt after a teardown
+		res = testc.fft_check("WAVECAR", weights, np.array([20,20,20], dtype=np.int32, order='C'))
+		assert_equal(res, 0)
+		pawpyc.free_fft_plans()
+		res = testc.fft_check("WAVECAR", weights, np.array([20,20,20], dtype=np.int32, order='C'))
+		assert_equal(res, 0)
+		backends = pawpyc.get_backends()
+		assert backends['fft'] in ['mkl', 'fftw']
+		assert backends['blas'] in ['mkl', 'openblas']
+
+	def test_pruned_fft(self):
+		print("TEST PRUNED FFT")
+		# the sphere wraps around each grid, and the odd grids
+		# have no Nyquist planes
+		for dim in [[20,20,20], [15,17,19], [9,24,11]]:
+			res = testc.pruned_fft_check(np.array(dim, dtype=np.int32, order='C'), 3)
+			assert_equal(res, 0)
+
+	def test_gamma_fft(self):
+		print("TEST GAMMA FFT")
+		weights = np.array(self.vr.actual_kpoints_weights)
+		# the gamma-only bands transform to the same real space grids as
+		# the vasp_std bands, and back to the stored coefficients
+		for dim in [[20,20,20], [21,23,25]]:
+			res = testc.gamma_fft_check("gamma/WAVECAR_gam", "gamma/WAVECAR_std",
+				weights, np.array(dim, dtype=np.int32, order='C'))
+			assert_equal(res, 0)
+
+	def test_symm_identity(self):
+		print("TEST SYMM IDENTITY")
+		# k-points generated by the identity equal their reference
+		# k-points, including the second spinor half of NCL plane waves
+		weights = np.ones(64)
+		for wavecar in ["WAVECAR", "noncollinear/WAVECAR"]:
+			assert_equal(testc.symm_identity_check(wavecar, weights), 0)
 
 	def test_sbt(self):
 		from scipy.special import spherical_jn as jn
@@ -448,10 +515,243 @@ class TestPy:
 			'POTCAR', 'vasprun.xml', False)
 		wf = Wavefunction.from_files('CONTCAR', 'WAVECAR2.gz',
 			'POTCAR', 'vasprun.xml', False)
+		assert not wf.gamma
 		with assert_raises(FileNotFoundError):
 			wf = Wavefunction.from_files('bubbles', 'WAVECAR',
 				'POTCAR', 'vasprun.xml', True)
 
+	def test_gamma(self):
+		print("TEST GAMMA")
+		sys.stdout.flush()
+		# the same real bands written by vasp_gam and vasp_std,
+		# see gamma/make_wavecars.py
+		def load(kind):
+			return Wavefunction.from_files('CONTCAR', 'gamma/WAVECAR_' + kind,
+				'POTCAR', 'vasprun.xml', False)
+		gam = load('gam')
+		std = load('std')
+		assert gam.gamma
+		assert not std.gamma
+		assert gam.nwk == 1
+		# the fixture bands are orthonormal pseudowavefunctions
+		overlaps = gam.pseudoprojection_all(gam)[:,:,0,0]
+		assert_almost_equal(overlaps, np.identity(gam.nband), decimal=6)
+		assert_almost_equal(overlaps, std.pseudoprojection_all(std)[:,:,0,0],
+			decimal=6)
+		for method in ["pseudo", "aug_real", "aug_recip"]:
+			res_gam = Projector(load('gam'), load('gam'), method).all_band_projection()
+			res_std = Projector(load('std'), load('std'), method).all_band_projection()
+			assert_almost_equal(res_gam, res_std, decimal=5)
+
+	def test_malformed(self):
+		print("TEST MALFORMED")
+		sys.stdout.flush()
+		with open('gamma/WAVECAR_gam', 'rb') as f:
+			data = bytearray(f.read())
+		recl = int(np.frombuffer(data, dtype=np.float64, count=1)[0])
+		# a complex G=0 coefficient in the first band record
+		complex_g0 = bytearray(data)
+		complex_g0[3*recl+4:3*recl+8] = np.float32(0.5).tobytes()
+		# a plane wave count that fits no G-sphere
+		bad_count = bytearray(data)
+		nplane = np.frombuffer(data, dtype=np.float64, count=1, offset=2*recl)[0]
+		bad_count[2*recl:2*recl+8] = np.float64(nplane - 1).tobytes()
+		files = {'WAVECAR_g0_test': complex_g0, 'WAVECAR_count_test': bad_count}
+		try:
+			for name in files:
+				with open(name, 'wb') as f:
+					f.write(files[name])
+				with assert_raises(ValueError):
+					pawpyc.PWFPointer(name, 'vasprun.xml')
+		finally:
+			for name in files:
+				if os.path.isfile(name):
+					os.remove(name)
+
+	def test_mmap(self):
+		print("TEST MMAP")
+		sys.stdout.flush()
+		wf = Wavefunction.from_directory('.', False)
+		wf_mmap = Wavefunction.from_directory('.', False, use_mmap=True)
+		basis = Wavefunction.from_directory('.', False)
+		for b in [0, 6, 10]:
+			assert_almost_equal(wf.pseudoprojection(b, basis),
+				wf_mmap.pseudoprojection(b, basis))
+
+	def test_lazy(self):
+		print("TEST LAZY")
+		sys.stdout.flush()
+		wf = Wavefunction.from_directory('.', False)
+		# budget smaller than one k-point worth of bands
+		wf_lazy = Wavefunction.from_directory('.', False, cache_budget=20000)
+		basis = Wavefunction.from_directory('.', False)
+		for b in [0, 6, 10]:
+			assert_almost_equal(wf.pseudoprojection(b, basis),
+				wf_lazy.pseudoprojection(b, basis))
+		pr = Projector(wf_lazy, basis)
+		for b in [2, 10]:
+			v, c = pr.proportion_conduction(b)
+			assert_almost_equal(v + c, 1, decimal=4)
+
+	def test_select(self):
+		print("TEST SELECT")
+		sys.stdout.flush()
+		wf = Wavefunction.from_directory('.', False)
+		wf_sel = Wavefunction.from_directory('.', False, bands=(6, 12))
+		basis = Wavefunction.from_directory('.', False)
+		assert wf_sel.nband == 6
+		for b in [0, 4]:
+			assert_almost_equal(wf.pseudoprojection(b + 6, basis),
+				wf_sel.pseudoprojection(b, basis))
+		wf_sel = Wavefunction.from_directory('.', False, kpoints=[1], spin=1)
+		assert wf_sel.nwk == 1 and wf_sel.nspin == 1
+		with assert_raises(ValueError):
+			Wavefunction.from_directory('.', False, bands=(6, 100))
+
+	def test_compressed(self):
+		print("TEST COMPRESSED")
+		sys.stdout.flush()
+		import bz2, gzip
+		with open('WAVECAR', 'rb') as f:
+			data = f.read()
+		# parallel bzip2 writes several streams, which here end
+		# in the middle of records
+		cuts = [0, 12345, len(data) // 2 + 7, len(data)]
+		multi = b''.join(bz2.compress(data[i:j]) for i, j in zip(cuts[:-1], cuts[1:]))
+		single = bz2.compress(data)
+		gz = gzip.compress(data)
+		corrupt = bytearray(single)
+		corrupt[len(corrupt) // 2] ^= 0xff
+		files = {
+			'WAVECAR_test.bz2': single,
+			'WAVECAR_multi_test.bz2': multi,
+			'WAVECAR_test.gz': gz,
+			'WAVECAR_trunc_test.bz2': single[:len(single) // 2],
+			'WAVECAR_trunc_test.gz': gz[:len(gz) // 2],
+			'WAVECAR_corrupt_test.bz2': bytes(corrupt),
+		}
+		try:
+			for name in files:
+				with open(name, 'wb') as f:
+					f.write(files[name])
+			plain = pawpyc.PWFPointer('WAVECAR', 'vasprun.xml')
+			for name in ['WAVECAR_test.bz2', 'WAVECAR_multi_test.bz2', 'WAVECAR_test.gz']:
+				pwf = pawpyc.PWFPointer(name, 'vasprun.xml')
+				assert testc.compare_wavefunctions(pwf, plain) == 0
+			# truncated or corrupt files raise instead of exiting
+			for name in ['WAVECAR_trunc_test.bz2', 'WAVECAR_trunc_test.gz',
+				'WAVECAR_corrupt_test.bz2']:
+				with assert_raises(ValueError):
+					pawpyc.PWFPointer(name, 'vasprun.xml')
+		finally:
+			for name in files:
+				if os.path.isfile(name):
+					os.remove(name)
+
+	def test_read_threads(self):
+		print("TEST READ THREADS")
+		sys.stdout.flush()
+		# the k-points are read in parallel, which must not change
+		# the coefficients, energies or Gs of any of them
+		num_threads = pawpyc.get_thread_count()
+		try:
+			for name, vr, use_mmap in [('WAVECAR', 'vasprun.xml', False),
+				('WAVECAR', 'vasprun.xml', True),
+				('noncollinear/WAVECAR', 'noncollinear/vasprun.xml', False)]:
+				pawpyc.set_thread_count(1)
+				serial = pawpyc.PWFPointer(name, vr, use_mmap=use_mmap)
+				pawpyc.set_thread_count(4)
+				parallel = pawpyc.PWFPointer(name, vr, use_mmap=use_mmap)
+				assert testc.compare_wavefunctions(serial, parallel) == 0
+		finally:
+			pawpyc.set_thread_count(num_threads)
+
+	def test_cache(self):
+		print("TEST CACHE")
+		sys.stdout.flush()
+		cache = 'test.pawpyseed-cache'
+		if os.path.isfile(cache):
+			os.remove(cache)
+		try:
+			wf = Wavefunction.from_directory('.', False, cache_path=cache)
+			assert os.path.isfile(cache)
+			wf_cached = Wavefunction.from_directory('.', False, cache_path=cache)
+			assert wf_cached.projector_owner
+			assert_equal(wf.kpts, wf_cached.kpts)
+			assert_equal(wf.kws, wf_cached.kws)
+			assert_equal(wf.dim, wf_cached.dim)
+			basis = Wavefunction.from_directory('.', False)
+			for b in [0, 10]:
+				assert_almost_equal(wf.pseudoprojection(b, basis),
+					wf_cached.pseudoprojection(b, basis))
+			pr1 = Projector(wf, basis)
+			pr2 = Projector(wf_cached, basis)
+			assert_almost_equal(pr1.single_band_projection(10),
+				pr2.single_band_projection(10))
+			# a different WAVECAR subset must not reuse the cache
+			wf_sel = Wavefunction.from_directory('.', False,
+				bands=(6, 12), cache_path=cache)
+			assert wf_sel.nband == 6
+			# the WAVECAR is keyed on its stat and first records
+			key = input_hash([], [], ['WAVECAR'])
+			assert key == input_hash([], [], ['WAVECAR'])
+			st = os.stat('WAVECAR')
+			try:
+				os.utime('WAVECAR', ns=(st.st_atime_ns, st.st_mtime_ns + 10**9))
+				assert key != input_hash([], [], ['WAVECAR'])
+			finally:
+				os.utime('WAVECAR', ns=(st.st_atime_ns, st.st_mtime_ns))
+		finally:
+			if os.path.isfile(cache):
+				os.remove(cache)
+
+	def test_coeff_storage(self):
+		print("TEST COEFF STORAGE")
+		sys.stdout.flush()
+		for storage in ['float16', 'bfloat16']:
+			err, bound = check_coeff_storage('.', storage, bands=[0, 10])
+			assert err <= bound
+		# compact storage with a bounded decode cache
+		basis = Wavefunction.from_directory('.', False)
+		wf = Wavefunction.from_directory('.', False, cache_budget=10000,
+			coeff_storage='float16')
+		assert_almost_equal(wf.pseudoprojection(10, basis),
+			basis.pseudoprojection(10, basis), decimal=3)
+		assert_raises(ValueError, Wavefunction.from_directory, '.', False,
+			coeff_storage='float8')
+		# loads from a cache are stored the same way
+		cache = 'test_storage.pawpyseed-cache'
+		try:
+			wf = Wavefunction.from_directory('.', False, coeff_storage='float16',
+				cache_path=cache)
+			wf_cached = Wavefunction.from_directory('.', False,
+				coeff_storage='float16', cache_path=cache)
+			assert wf_cached.projector_owner
+			for b in [0, 10]:
+				assert_equal(wf_cached.pseudoprojection(b, basis),
+					wf.pseudoprojection(b, basis))
+		finally:
+			if os.path.isfile(cache):
+				os.remove(cache)
+
+	def test_single_precision(self):
+		print("TEST SINGLE PRECISION")
+		sys.stdout.flush()
+		for method in ['aug_real', 'aug_recip']:
+			wf1 = Wavefunction.from_directory('.', False)
+			basis = Wavefunction.from_directory('.', False)
+			pr = Projector(wf1, basis, method, precision='validate')
+			assert wf1.single_precision and basis.single_precision
+			dev = pr.precision_deviation
+			assert dev['max_rel'] < 1e-5
+			assert dev['max_rel_compensation'] < 1e-4
+			allres = pr.all_band_projection()
+			# switching back recomputes the projections in double precision
+			pr._use_fft_precision('double')
+			assert not wf1.single_precision
+			assert_almost_equal(pr.all_band_projection(), allres, decimal=5)
+		assert_raises(PAWpyError, wf1.set_fft_precision, 'half')
+
 	def test_writestate(self):
 		print("TEST WRITE")
 		sys.stdout.flush()
@@ -517,6 +817,13 @@ class TestPy:
 		pr = Projector(wf, basis, method = "pseudo")
 		res = pr.single_band_projection(6)
 		assert res.shape[0] == basis.nband * basis.nspin * basis.nwk
+		allres = pr.all_band_projection()
+		assert allres.shape == (wf.nband, basis.nband, basis.nwk, basis.nspin)
+		for b in [0, 6, wf.nband-1]:
+			assert_almost_equal(allres[b].transpose(0, 2, 1).flatten(),
+				pr.single_band_projection(b), decimal=5)
+		lazy = Wavefunction.from_directory('.', cache_budget=20000)
+		assert_almost_equal(lazy.pseudoprojection_all(basis), allres, decimal=5)
 		res = pr.defect_band_analysis(4, 10, False)
 		assert len(res.keys()) == 15
 
@@ -527,6 +834,10 @@ class TestPy:
 		wf1 = Wavefunction.from_directory('.', False)
 		basis = Wavefunction.from_directory('.', False)
 		pr = Projector(wf1, basis)
+		allres = pr.all_band_projection()
+		for b in [0, 10]:
+			assert_almost_equal(allres[b].transpose(0, 2, 1).flatten(),
+				pr.single_band_projection(b), decimal=5)
 		for b in range(wf1.nband):
 			v, c = pr.proportion_conduction(b)
 			if b < 6:
@@ -543,6 +854,10 @@ class TestPy:
 		wf1 = Wavefunction.from_directory('.', False)
 		basis = Wavefunction.from_directory('.', False)
 		pr = Projector(wf1, basis, 'aug_recip')
+		allres = pr.all_band_projection()
+		for b in [0, 10]:
+			assert_almost_equal(allres[b].transpose(0, 2, 1).flatten(),
+				pr.single_band_projection(b), decimal=5)
 		for b in range(wf1.nband):
 			v, c = pr.proportion_conduction(b)
 			if b < 6:
@@ -568,6 +883,39 @@ class TestPy:
 			pr.proportion_conduction(100)
 			pr.proportion_conduction(-1)
 
+	def test_setup_cache(self):
+		print("TEST SETUP CACHE")
+		sys.stdout.flush()
+		# the basis keeps the overlap setup of the sites it was last set
+		# up against, keyed on their element, position and FFT grid
+		def displaced(shift, dim=None):
+			wf = Wavefunction.from_directory('.', False)
+			wf.structure = wf.structure.copy()
+			wf.structure.translate_sites([0], shift, frac_coords=False)
+			if dim is not None:
+				wf.update_dim(dim)
+			return wf
+		def results(wf, basis, method):
+			pr = Projector(wf, basis, method)
+			return pr.single_band_projection(10), pr.all_band_projection()
+		def check(res, ref):
+			assert_almost_equal(res[0], ref[0], decimal=8)
+			assert_almost_equal(res[1], ref[1], decimal=8)
+		for method in ['aug_real', 'aug_recip']:
+			basis = Wavefunction.from_directory('.', False)
+			dim = basis.dim + 2
+			cold = results(displaced([0.3, 0, 0]), basis, method)
+			# warm setup of the same sites
+			check(results(displaced([0.3, 0, 0]), basis, method), cold)
+			# another structure, which evicts the first one's sites,
+			# and the first structure on another FFT grid
+			for shift, grid in [([0, 0.25, 0], None), ([0.3, 0, 0], dim)]:
+				fresh = Wavefunction.from_directory('.', False)
+				check(results(displaced(shift, grid), basis, method),
+					results(displaced(shift, grid), fresh, method))
+			# set up again after the eviction
+			check(results(displaced([0.3, 0, 0]), basis, method), cold)
+
 	def test_projector_gz(self):
 		print("TEST PROJGZ")
 		sys.stdout.flush()
@@ -589,6 +937,63 @@ class TestPy:
 		for wf_dir, wf in generator:
 			wf.defect_band_analysis(4, 10, spinpol=True)
 
+	def test_distributed(self):
+		print("TEST DISTRIBUTED")
+		sys.stdout.flush()
+		from pawpyseed.core import parallel
+		wf1 = Wavefunction.from_directory('.', False)
+		basis = Wavefunction.from_directory('.', False)
+		pr = Projector(wf1, basis)
+		expected = {b: pr.single_band_projection(b) for b in [3, 10]}
+		for band_blocks in [1, 3]:
+			res = parallel.distributed_projection('.', '.', [3, 10],
+				band_blocks=band_blocks, comm=parallel.SerialComm())
+			for b in expected:
+				assert_almost_equal(res[b], expected[b], decimal=6)
+		# each task runs on one rank, and a rank sets up each of
+		# its chunks of k-points once for all its band blocks
+		tasks = parallel.split_tasks(2, 3, 20, 2, band_blocks=4)
+		groups = [parallel.rank_tasks(tasks, r, 2) for r in range(2)]
+		assert sorted((tuple(map(tuple, u)), b) for g in groups
+			for u, blocks in g for b in blocks) \
+			== sorted((tuple(map(tuple, u)), b) for u, b in tasks)
+		for g in groups:
+			assert len(g) == 1 and len(g[0][1]) == 2
+		# a directory with only a compressed WAVECAR
+		import bz2, gzip, shutil
+		counts = parallel.wavecar_counts('WAVECAR')
+		with open('WAVECAR', 'rb') as f:
+			data = f.read()
+		for ext, compress in [('.bz2', bz2.compress), ('.gz', gzip.compress)]:
+			tmp = 'dist_test_dir'
+			os.mkdir(tmp)
+			try:
+				for name in ['CONTCAR', 'POTCAR', 'vasprun.xml']:
+					shutil.copy(name, tmp)
+				with open(os.path.join(tmp, 'WAVECAR' + ext), 'wb') as f:
+					f.write(compress(data))
+				assert wavecar_path(tmp) == os.path.join(tmp, 'WAVECAR' + ext)
+				assert parallel.wavecar_counts(wavecar_path(tmp)) == counts
+				res = parallel.distributed_projection(tmp, tmp, [3, 10],
+					comm=parallel.SerialComm())
+				for b in expected:
+					assert_almost_equal(res[b], expected[b], decimal=6)
+			finally:
+				shutil.rmtree(tmp)
+
+		try:
+			import mpi4py
+		except ImportError:
+			raise SkipTest("mpi4py is not installed")
+		out = os.path.abspath('dist_test.npz')
+		subprocess.check_call(['mpirun', '-np', '2', sys.executable, '-m',
+			'pawpyseed.core.parallel', '.', '.', '3', '10',
+			'--band-blocks', '2', '--out', out])
+		res = np.load(out)
+		for b in expected:
+			assert_almost_equal(res[str(b)], expected[b], decimal=6)
+		os.remove(out)
+
 	def test_offsite(self):
 		Projector = DummyProjector
 		print("TEST OFFSITE")
@@ -651,6 +1056,20 @@ class TestPy:
 				assert_almost_equal(test_vals[b][0], 0, decimal=7)
 				assert_almost_equal(test_vals[b][1], 1, decimal=3)
 
+		# virtual k-points generate the same coefficients
+		wf1 = Wavefunction.from_directory('.', False)
+		basis = Wavefunction.from_directory('nosym', False)
+		pr = Projector(wf1, basis, unsym_wf=True, unsym_basis=True,
+			virtual_budget=100000)
+		for b in range(wf1.nband):
+			assert_almost_equal(pr.proportion_conduction(b), test_vals[b], decimal=6)
+		wf2 = wf1.desymmetrized_copy()
+		wf3 = wf1.desymmetrized_copy(virtual_budget=100000)
+		del wf1
+		for b in [0, 10]:
+			assert_almost_equal(wf3.pseudoprojection(b, wf2),
+				wf2.pseudoprojection(b, wf2), decimal=6)
+
 	def test_norm(self):
 		wf = Wavefunction.from_directory('.', setup_projectors=True)
 		wf.check_c_projectors()
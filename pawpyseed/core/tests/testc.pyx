@@ -26,6 +26,28 @@ cpdef fft_check(str wavecar, np.ndarray[double, ndim=1] kpt_weights,
 	cdef int[::1] dimv = fftgrid
 	return tc.fft_check(wavecar.encode('utf-8'), &kws[0], &dimv[0]);
 
+cpdef gamma_fft_check(str wavecar_gam, str wavecar_std,
+	np.ndarray[double, ndim=1] kpt_weights, np.ndarray[int, ndim=1] fftgrid):
+
+	cdef double[::1] kws = kpt_weights
+	cdef int[::1] dimv = fftgrid
+	return tc.gamma_fft_check(wavecar_gam.encode('utf-8'),
+		wavecar_std.encode('utf-8'), &kws[0], &dimv[0]);
+
+cpdef pruned_fft_check(np.ndarray[int, ndim=1] fftgrid, int num_bands):
+
+	cdef int[::1] dimv = fftgrid
+	return tc.pruned_fft_check(&dimv[0], num_bands);
+
+cpdef compare_wavefunctions(pawpyc.PWFPointer wf1, pawpyc.PWFPointer wf2):
+
+	return tc.compare_wavefunctions(wf1.ptr, wf2.ptr);
+
+cpdef symm_identity_check(str wavecar, np.ndarray[double, ndim=1] kpt_weights):
+
+	cdef double[::1] kws = kpt_weights
+	return tc.symm_identity_check(wavecar.encode('utf-8'), &kws[0]);
+
 cpdef proj_check(pawpyc.CWavefunction wf):
 	for b in range(wf.nband):
 		for k in range(wf.nwk * wf.nspin):
@@ -2,14 +2,18 @@
 from libc.stdio cimport FILE
 
 
-cdef extern from "tests/tests.h":
+cdef extern from "tests/tests.h" nogil:
 
     cdef int fft_check(char* wavecar, double* kpt_weights, int* fftg)
+    cdef int gamma_fft_check(char* wavecar_gam, char* wavecar_std, double* kpt_weights, int* fftg)
+    cdef int pruned_fft_check(int* fftg, int num_bands)
+    cdef int compare_wavefunctions(pswf_t* wf1, pswf_t* wf2)
+    cdef int symm_identity_check(char* wavecar, double* kpt_weights)
     cdef void proj_check(int BAND_NUM, int KPOINT_NUM,
         pswf_t* wf, int* fftg, int* labels, double* coords)
     
 
-cdef extern from "utils.h":
+cdef extern from "utils.h" nogil:
 
     ctypedef struct  funcset_t:
         int l
@@ -37,6 +41,7 @@ cdef extern from "utils.h":
         double* pspw_overlap_matrix
         double* aepw_overlap_matrix
         double* diff_overlap_matrix
+        double* aug_diff_matrix
         int proj_gridsize
         int wave_gridsize
         int num_cart_gridpts
@@ -52,6 +57,60 @@ cdef extern from "utils.h":
         int* ls
         int* ms
         double complex* overlaps
+    ctypedef struct  symm_map_t:
+        int num_waves
+        int* Gs
+        int* gmaps
+        double dr[3]
+        int tr
+        int G_min[3]
+        double complex* phases[3]
+    ctypedef struct  coeff_cache_t:
+        int fd
+        long budget
+        long used
+        int num_slots
+        long* offsets
+        int* num_waves
+        float complex** coeffs
+        int* pins
+        char* loading
+        int* prev
+        int* next
+        int head
+        int tail
+        void* lock
+        int record_size
+        int storage
+        unsigned short** compact
+        float* scales
+        void** sources
+        symm_map_t** symm
+    ctypedef struct  arena_t:
+        char* block
+        long used
+        long size
+        long pad[5]
+    ctypedef struct  setup_cache_t:
+        int setup_count
+        int num_wp_sites
+        int max_wp_sites
+        unsigned long* wp_keys
+        double* wp_coords
+        int* wp_fftg
+        int* wp_last_used
+        projection_t** wp
+        int num_pairs
+        int max_pairs
+        unsigned long* pair_keys
+        double* pair_dcoords
+        int* pair_sizes
+        int* pair_last_used
+        double complex** pair_overlaps
+        int num_aug_sites
+        unsigned long* aug_keys
+        double* aug_coords
+        int aug_fftg[3]
     ctypedef struct  band_t:
         int n
         int num_waves
@@ -65,6 +124,8 @@ cdef extern from "utils.h":
         projection_t* up_projections
         projection_t* down_projections
         projection_t* wave_projections
+        coeff_cache_t* cache
+        int cache_slot
     ctypedef struct  rayleigh_set_t:
         int l
         double complex* terms
@@ -77,6 +138,10 @@ cdef extern from "utils.h":
         int num_bands
         band_t** bands
         rayleigh_set_t** expansion
+        float complex* coeffs
+        int ld
+        symm_map_t* symm
+        int gamma
     ctypedef struct  pswf_t:
         double encut
         int num_elems
@@ -92,10 +157,20 @@ cdef extern from "utils.h":
         double* reclattice
         int* fftg
         int is_ncl
+        int is_gamma
+        int fft_precision
         int wp_num
         int num_aug_overlap_sites
         double* dcoords
         double complex** overlaps
+        char* wavecar_map
+        long wavecar_map_size
+        coeff_cache_t* cache
+        arena_t* proj_arenas
+        arena_t* wp_arenas
+        int num_proj_arenas
+        int num_wp_arenas
+        setup_cache_t* setup_cache
     ctypedef struct  projgrid_t:
         double complex* values
     ctypedef struct  real_proj_t:
@@ -115,6 +190,17 @@ cdef extern from "utils.h":
         int* indices
         double* paths
         real_proj_t* projs
+    ctypedef struct  gsphere_t:
+        double reclattice[9]
+        double encut
+        double r2
+        double h3
+        double b11
+        double b12
+        double b13
+        double u22
+        double u23
+        double u33
     cdef void affine_transform(double* out, double* op, double* inv)
     cdef void rotation_transform(double* out, double* op, double* inv)
     cdef int min(int a, int b)
@@ -123,6 +209,12 @@ cdef extern from "utils.h":
     cdef double dot(double* x1, double* x2)
     cdef double mag(double* x1)
     cdef double determinant(double* m)
+    cdef gsphere_t make_gsphere(double* reclattice, double encut)
+    cdef int gsphere_points(int* igall, int* G_bounds, gsphere_t* gs, double* k, int max_points)
+    cdef int gsphere_half_points(int* igall, int* G_bounds, gsphere_t* gs, int max_points)
+    cdef double gamma_dot(float complex* C1, float complex* C2, int num_waves)
+    cdef void gamma_gemm(int m, int n, int num_waves, float complex* A, int lda,
+        float complex* B, int ldb, float* out)
     cdef double dist_from_frac(double* coords1, double* coords2, double* lattice)
     cdef void frac_to_cartesian(double* coord, double* lattice)
     cdef void cartesian_to_frac(double* coord, double* reclattice)
@@ -131,6 +223,8 @@ cdef extern from "utils.h":
     cdef double complex trilinear_interpolate(double complex* c, double* frac, int* fftg)
     cdef void free_projection_list(projection_t* projlist, int num)
     cdef void clean_wave_projections(pswf_t* wf)
+    cdef void free_setup_cache(setup_cache_t* cache)
+    cdef void alloc_coeff_slab(kpoint_t* kpt)
     cdef void free_kpoint(kpoint_t* kpt, int num_elems, int num_sites, int wp_num, int* num_projs)
     cdef void free_ppot(ppot_t* pp)
     cdef void free_real_proj(real_proj_t* proj)
@@ -139,11 +233,21 @@ cdef extern from "utils.h":
     cdef void free_ptr(void* ptr)
     cdef void free_real_proj_site_list(real_proj_site_t* sites, int length)
     cdef void free_ppot_list(ppot_t* pps, int length)
+    cdef arena_t* make_arena_list(int num)
+    cdef void* arena_alloc(arena_t* arena, long size)
+    cdef void free_arena_list(arena_t* arenas, int num)
+    cdef coeff_cache_t* make_coeff_cache(int fd, int num_slots, long budget,
+        int record_size, int storage)
+    cdef void store_compact_coeffs(coeff_cache_t* cache, int slot, float complex* Cs, int num_waves)
+    cdef float complex* acquire_coeffs(band_t* band)
+    cdef void release_coeffs(band_t* band)
+    cdef void free_coeff_cache(coeff_cache_t* cache)
     cdef double* get_occs(pswf_t* wf)
     cdef int get_nband(pswf_t* wf)
     cdef int get_nwk(pswf_t* wf)
     cdef int get_nspin(pswf_t* wf)
     cdef int is_ncl(pswf_t* wf)
+    cdef int is_gamma(pswf_t* wf)
     cdef double get_encut(pswf_t* wf)
     cdef double get_energy(pswf_t* wf, int band, int kpt, int spin)
     cdef double get_occ(pswf_t* wf, int band, int kpt, int spin)
@@ -177,6 +281,8 @@ cdef extern from "utils.h":
     cdef double sbf(double x, int l)
     cdef pswf_t* expand_symm_wf(pswf_t* rwf, int num_kpts, int* maps,
         double* ops, double* drs, double* kws, int* trs)
+    cdef pswf_t* expand_symm_wf_virtual(pswf_t* rwf, int num_kpts, int* maps,
+        double* ops, double* drs, double* kws, int* trs, long cache_budget)
     cdef void CHECK_ALLOCATION(void* ptr)
     cdef void ALLOCATION_FAILED()
     cdef void CHECK_STATUS(int status)
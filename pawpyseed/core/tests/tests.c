@@ -9,8 +9,7 @@
 #include "linalg.h"
 #include "projector.h"
 #include "sbt.h"
-#include <mkl.h>
-#include <mkl_types.h>
+#include "backend.h"
 #include <assert.h>
 
 #define PI 3.14159265359
@@ -29,7 +28,7 @@ int fft_check(char* wavecar, double* kpt_weights, int* fftg) {
 	setbuf(stdout, NULL);
 
 	pswf_t* wf = read_wavefunctions(wavecar, kpt_weights);
-	double complex* x = (double complex*) mkl_calloc(fftg[0]*fftg[1]*fftg[2],
+	double complex* x = (double complex*) backend_calloc(fftg[0]*fftg[1]*fftg[2],
 		sizeof(double complex), 64);
 	fft3d(x, wf->G_bounds, wf->lattice, wf->kpts[0]->k, wf->kpts[0]->Gs,
 		wf->kpts[0]->bands[0]->Cs, wf->kpts[0]->bands[0]->num_waves, fftg);
@@ -72,15 +71,215 @@ int fft_check(char* wavecar, double* kpt_weights, int* fftg) {
 	}
 	free(CAs);
 
-	mkl_free(x);
+	backend_free(x);
 	return 0;
 }
 
+int gamma_fft_check(char* wavecar_gam, char* wavecar_std, double* kpt_weights, int* fftg) {
+
+	setbuf(stdout, NULL);
+
+	pswf_t* wf_gam = read_wavefunctions(wavecar_gam, kpt_weights);
+	pswf_t* wf_std = read_wavefunctions(wavecar_std, kpt_weights);
+	kpoint_t* kpt_gam = wf_gam->kpts[0];
+	kpoint_t* kpt_std = wf_std->kpts[0];
+	if (!kpt_gam->gamma || kpt_std->gamma || wf_gam->nband != wf_std->nband)
+		return -1;
+	int num_bands = wf_gam->nband;
+	int gridsize = fftg[0]*fftg[1]*fftg[2];
+	double complex* xgam = (double complex*) backend_calloc(num_bands*gridsize,
+		sizeof(double complex), 64);
+	double complex* xstd = (double complex*) backend_calloc(num_bands*gridsize,
+		sizeof(double complex), 64);
+	fft3d_bands(xgam, wf_gam->lattice, kpt_gam, kpt_gam->bands, num_bands, fftg);
+	fft3d_bands(xstd, wf_std->lattice, kpt_std, kpt_std->bands, num_bands, fftg);
+	for (int i = 0; i < num_bands*gridsize; i++) {
+		if (cabs(xgam[i] - xstd[i]) > 1e-5)
+			return -2;
+	}
+
+	printf("GAMMA FFTCHECK ASSERTS\n");
+	float complex** CAs = (float complex**) malloc(num_bands * sizeof(float complex*));
+	for (int b = 0; b < num_bands; b++) {
+		CAs[b] = (float complex*) calloc(kpt_gam->num_waves, sizeof(float complex));
+	}
+	fwd_fft3d_batch(xgam, wf_gam->lattice, kpt_gam, CAs, num_bands, fftg);
+	for (int b = 0; b < num_bands; b++) {
+		for (int w = 0; w < kpt_gam->num_waves; w++) {
+			if (cabs(CAs[b][w] - kpt_gam->bands[b]->Cs[w]) > 1e-5)
+				return -3;
+		}
+		free(CAs[b]);
+	}
+	free(CAs);
+
+	backend_free(xgam);
+	backend_free(xstd);
+	free_pswf(wf_gam);
+	free_pswf(wf_std);
+	return 0;
+}
+
+int pruned_fft_check(int* fftg, int num_bands) {
+
+	setbuf(stdout, NULL);
+
+	// a sphere of G-vectors around G=0, which wraps around the
+	// grid, so each plane holds two runs of columns
+	int n0 = fftg[0], n1 = fftg[1], n2 = fftg[2];
+	int gridsize = n0 * n1 * n2;
+	double lattice[9] = {n0, 0, 0, 0, n1, 0, 0, 0, n2};
+	double r = 0.4 * fmin(n0, fmin(n1, n2));
+	int* Gs = (int*) malloc(3 * gridsize * sizeof(int));
+	int num_waves = 0;
+	for (int i = -n0/2; i <= (n0-1)/2; i++) {
+		for (int j = -n1/2; j <= (n1-1)/2; j++) {
+			for (int k = -n2/2; k <= (n2-1)/2; k++) {
+				if (i*i + j*j + k*k < r*r) {
+					Gs[3*num_waves+0] = i;
+					Gs[3*num_waves+1] = j;
+					Gs[3*num_waves+2] = k;
+					num_waves++;
+				}
+			}
+		}
+	}
+	kpoint_t kpt;
+	memset(&kpt, 0, sizeof(kpoint_t));
+	double k[3] = {0, 0, 0};
+	kpt.k = k;
+	kpt.Gs = Gs;
+	kpt.num_waves = num_waves;
+	kpt.num_bands = num_bands;
+	band_t** bands = (band_t**) malloc(num_bands * sizeof(band_t*));
+	float complex** CAs = (float complex**) malloc(num_bands * sizeof(float complex*));
+	srand(24);
+	for (int b = 0; b < num_bands; b++) {
+		bands[b] = (band_t*) calloc(1, sizeof(band_t));
+		bands[b]->num_waves = num_waves;
+		bands[b]->cache_slot = -1;
+		bands[b]->Cs = (float complex*) malloc(num_waves * sizeof(float complex));
+		CAs[b] = (float complex*) malloc(num_waves * sizeof(float complex));
+		for (int w = 0; w < num_waves; w++) {
+			bands[b]->Cs[w] = (float) rand() / RAND_MAX - 0.5f
+				+ I * ((float) rand() / RAND_MAX - 0.5f);
+		}
+	}
+	kpt.bands = bands;
+
+	// dense reference: the whole grids are transformed
+	double complex* y = (double complex*) backend_calloc((long) num_bands * gridsize,
+		sizeof(double complex), 64);
+	for (int b = 0; b < num_bands; b++) {
+		for (int w = 0; w < num_waves; w++) {
+			int g1 = (Gs[3*w+0]+n0) % n0;
+			int g2 = (Gs[3*w+1]+n1) % n1;
+			int g3 = (Gs[3*w+2]+n2) % n2;
+			y[(long) b * gridsize + (g1*n1 + g2)*n2 + g3] = bands[b]->Cs[w];
+		}
+	}
+	void* plan = get_fft_plan(3, fftg, num_bands, FFT_DOUBLE, FFT_COMPLEX,
+		FFT_BACKWARD, pow(determinant(lattice), -0.5));
+	execute_fft_plan(plan, y, y);
+
+	int res = 0;
+	double complex* x = (double complex*) backend_malloc((long) num_bands * gridsize
+		* sizeof(double complex), 64);
+	fft3d_bands(x, lattice, &kpt, bands, num_bands, fftg);
+	for (long i = 0; i < (long) num_bands * gridsize; i++) {
+		if (cabs(x[i] - y[i]) > 1e-10)
+			res = -1;
+	}
+	float complex* xs = (float complex*) x;
+	fft3d_bands_single(xs, lattice, &kpt, bands, num_bands, fftg);
+	for (long i = 0; i < (long) num_bands * gridsize; i++) {
+		if (cabs(xs[i] - y[i]) > 1e-5)
+			res = -2;
+	}
+	fwd_fft3d_batch(y, lattice, &kpt, CAs, num_bands, fftg);
+	for (int b = 0; b < num_bands; b++) {
+		for (int w = 0; w < num_waves; w++) {
+			if (cabs(CAs[b][w] - bands[b]->Cs[w]) > 1e-5)
+				res = -3;
+		}
+		free(bands[b]->Cs);
+		free(bands[b]);
+		free(CAs[b]);
+	}
+	free(bands);
+	free(CAs);
+	free(Gs);
+	backend_free(x);
+	backend_free(y);
+	return res;
+}
+
+int compare_wavefunctions(pswf_t* wf1, pswf_t* wf2) {
+
+	if (wf1->nspin != wf2->nspin || wf1->nwk != wf2->nwk || wf1->nband != wf2->nband)
+		return -1;
+	for (int i = 0; i < 6; i++) {
+		if (wf1->G_bounds[i] != wf2->G_bounds[i])
+			return -1;
+	}
+	for (int i = 0; i < wf1->nwk * wf1->nspin; i++) {
+		kpoint_t* kpt1 = wf1->kpts[i];
+		kpoint_t* kpt2 = wf2->kpts[i];
+		if (kpt1->num_waves != kpt2->num_waves || kpt1->gamma != kpt2->gamma
+			|| memcmp(kpt1->k, kpt2->k, 3*sizeof(double)))
+			return -2;
+		if (memcmp(kpt1->Gs, kpt2->Gs, 3*kpt1->num_waves*sizeof(int)))
+			return -3;
+		for (int b = 0; b < wf1->nband; b++) {
+			band_t* band1 = kpt1->bands[b];
+			band_t* band2 = kpt2->bands[b];
+			if (band1->n != band2->n || band1->energy != band2->energy
+				|| band1->occ != band2->occ)
+				return -4;
+			int diff = memcmp(acquire_coeffs(band1), acquire_coeffs(band2),
+				band1->num_waves*sizeof(float complex));
+			release_coeffs(band1);
+			release_coeffs(band2);
+			if (diff)
+				return -5;
+		}
+	}
+	return 0;
+}
+
+int symm_identity_check(char* wavecar, double* kpt_weights) {
+
+	setbuf(stdout, NULL);
+
+	pswf_t* wf = read_wavefunctions(wavecar, kpt_weights);
+	if (wf == NULL)
+		return -6;
+	// generate every k-point from itself with the identity
+	int num_kpts = wf->nwk;
+	int* maps = (int*) malloc(num_kpts * sizeof(int));
+	double* ops = (double*) calloc(9 * num_kpts, sizeof(double));
+	double* drs = (double*) calloc(3 * num_kpts, sizeof(double));
+	int* trs = (int*) calloc(num_kpts, sizeof(int));
+	for (int k = 0; k < num_kpts; k++) {
+		maps[k] = k;
+		ops[9*k+0] = ops[9*k+4] = ops[9*k+8] = 1;
+	}
+	pswf_t* ex = expand_symm_wf(wf, num_kpts, maps, ops, drs, kpt_weights, trs);
+	int res = compare_wavefunctions(ex, wf);
+	free_pswf(ex);
+	free_pswf(wf);
+	free(maps);
+	free(ops);
+	free(drs);
+	free(trs);
+	return res;
+}
+
 void proj_check(int BAND_NUM, int KPOINT_NUM,
 	pswf_t* wf, int* fftg, int* labels, double* coords) {
 
 	ppot_t* pps = wf->pps;
-	double complex* x = mkl_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
+	double complex* x = backend_calloc(fftg[0]*fftg[1]*fftg[2], sizeof(double complex), 64);
 	//printf("START FT\n");
 	fft3d(x, wf->G_bounds, wf->lattice, wf->kpts[KPOINT_NUM]->k,
 		wf->kpts[KPOINT_NUM]->Gs, wf->kpts[KPOINT_NUM]->bands[BAND_NUM]->Cs,
@@ -184,6 +383,6 @@ void proj_check(int BAND_NUM, int KPOINT_NUM,
 
 	printf("err magerr, normx normy %lf %lf %lf %lf\n", err/normy, err2/normy, normx, normy);
 
-	mkl_free(x);
+	backend_free(x);
 	free(y);
 }
@@ -5,6 +5,14 @@
 
 int fft_check(char* wavecar, double* kpt_weights, int* fftg);
 
+int gamma_fft_check(char* wavecar_gam, char* wavecar_std, double* kpt_weights, int* fftg);
+
+int pruned_fft_check(int* fftg, int num_bands);
+
+int compare_wavefunctions(pswf_t* wf1, pswf_t* wf2);
+
+int symm_identity_check(char* wavecar, double* kpt_weights);
+
 void proj_check(int BAND_NUM, int KPOINT_NUM,
 	pswf_t* wf, int* fftg, int* labels, double* coords);
 
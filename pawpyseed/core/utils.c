@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,8 +6,10 @@
 #include <math.h>
 #include <omp.h>
 #include <time.h>
-#include <mkl.h>
-#include <mkl_types.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "backend.h"
 #include "utils.h"
 
 #define PI 3.14159265358979323846
@@ -54,6 +57,143 @@ double determinant(double* m) {
 		-  m[0] * m[5] * m[7];
 }
 
+gsphere_t make_gsphere(double* reclattice, double encut) {
+	gsphere_t gs;
+	for (int i = 0; i < 9; i++) {
+		gs.reclattice[i] = reclattice[i];
+	}
+	double* b1 = reclattice;
+	double* b2 = reclattice+3;
+	double* b3 = reclattice+6;
+	gs.encut = encut;
+	gs.r2 = encut * CCONST;
+	double n12[3];
+	vcross(n12, b1, b2);
+	gs.h3 = fabs(dot(n12, b3)) / mag(n12);
+	gs.b11 = dot(b1, b1);
+	gs.b12 = dot(b1, b2);
+	gs.b13 = dot(b1, b3);
+	gs.u22 = dot(b2, b2) - gs.b12 * gs.b12 / gs.b11;
+	gs.u23 = dot(b2, b3) - gs.b12 * gs.b13 / gs.b11;
+	gs.u33 = dot(b3, b3) - gs.b13 * gs.b13 / gs.b11;
+	return gs;
+}
+
+/*
+Integer range [*lo, *hi] of i such that x = i + shift satisfies
+a*x^2 + 2*b*x + cc <= 0, widened slightly so that rounding never
+drops a point that passes the exact test in gsphere_points.
+*/
+static void quadratic_range(int* lo, int* hi, double a, double b, double cc, double shift) {
+	double disc = b * b - a * cc;
+	double half = disc > 0 ? sqrt(disc) / a : 0;
+	double center = -b / a;
+	*lo = (int) ceil(center - half - shift - 1e-6);
+	*hi = (int) floor(center + half - shift + 1e-6);
+}
+
+/*
+Common part of gsphere_points and gsphere_half_points.
+*/
+static int gsphere_points_helper(int* igall, int* G_bounds, gsphere_t* gs,
+	double* k, int max_points, int half) {
+	double* b1 = gs->reclattice;
+	double* b2 = gs->reclattice+3;
+	double* b3 = gs->reclattice+6;
+	int ncnt = 0;
+	int lo3, hi3, lo2, hi2, lo1, hi1;
+	// |k3+ig3| times the height of b3 above the b1-b2 plane
+	// bounds the distance of any point of the row from the origin
+	quadratic_range(&lo3, &hi3, gs->h3 * gs->h3, 0, -gs->r2, k[2]);
+	for (int pass3 = 0; pass3 < 2; pass3++) {
+		int start3 = pass3 ? lo3 : max(lo3, 0);
+		int end3 = pass3 ? min(hi3, -1) : hi3;
+		for (int ig3p = start3; ig3p <= end3; ig3p++) {
+			double z = k[2] + ig3p;
+			// b2 and b3 projected perpendicular to b1
+			quadratic_range(&lo2, &hi2, gs->u22, z * gs->u23,
+				z * z * gs->u33 - gs->r2, k[1]);
+			for (int pass2 = 0; pass2 < 2; pass2++) {
+				int start2 = pass2 ? lo2 : max(lo2, 0);
+				int end2 = pass2 ? min(hi2, -1) : hi2;
+				for (int ig2p = start2; ig2p <= end2; ig2p++) {
+					double y = k[1] + ig2p;
+					double v[3];
+					for (int j = 0; j < 3; j++) {
+						v[j] = y * b2[j] + z * b3[j];
+					}
+					quadratic_range(&lo1, &hi1, gs->b11, dot(b1, v),
+						dot(v, v) - gs->r2, k[0]);
+					for (int pass1 = 0; pass1 < 2; pass1++) {
+						int start1 = pass1 ? lo1 : max(lo1, 0);
+						int end1 = pass1 ? min(hi1, -1) : hi1;
+						for (int ig1p = start1; ig1p <= end1; ig1p++) {
+							// same test as WaveTrans, so that the number
+							// of plane waves matches the WAVECAR exactly
+							double sumkg[3];
+							for (int j = 0; j < 3; j++) {
+								sumkg[j] = (k[0]+ig1p) * b1[j]
+											+ (k[1]+ig2p) * b2[j]
+											+ (k[2]+ig3p) * b3[j];
+							}
+							double gtot = mag(sumkg);
+							if (gtot * gtot / CCONST > gs->encut) {
+								continue;
+							}
+							if (half && (ig1p < 0 || (ig1p == 0
+								&& (ig2p < 0 || (ig2p == 0 && ig3p < 0))))) {
+								continue;
+							}
+							if (igall != NULL && ncnt < max_points) {
+								igall[ncnt*3+0] = ig1p;
+								igall[ncnt*3+1] = ig2p;
+								igall[ncnt*3+2] = ig3p;
+							}
+							if (G_bounds != NULL) {
+								if (ig1p < G_bounds[0]) G_bounds[0] = ig1p;
+								else if (ig1p > G_bounds[1]) G_bounds[1] = ig1p;
+								if (ig2p < G_bounds[2]) G_bounds[2] = ig2p;
+								else if (ig2p > G_bounds[3]) G_bounds[3] = ig2p;
+								if (ig3p < G_bounds[4]) G_bounds[4] = ig3p;
+								else if (ig3p > G_bounds[5]) G_bounds[5] = ig3p;
+								if (half) {
+									G_bounds[0] = min(G_bounds[0], -ig1p);
+									G_bounds[1] = max(G_bounds[1], -ig1p);
+									G_bounds[2] = min(G_bounds[2], -ig2p);
+									G_bounds[3] = max(G_bounds[3], -ig2p);
+									G_bounds[4] = min(G_bounds[4], -ig3p);
+									G_bounds[5] = max(G_bounds[5], -ig3p);
+								}
+							}
+							ncnt++;
+						}
+					}
+				}
+			}
+		}
+	}
+	return ncnt;
+}
+
+int gsphere_points(int* igall, int* G_bounds, gsphere_t* gs, double* k, int max_points) {
+	return gsphere_points_helper(igall, G_bounds, gs, k, max_points, 0);
+}
+
+int gsphere_half_points(int* igall, int* G_bounds, gsphere_t* gs, int max_points) {
+	double k[3] = {0,0,0};
+	return gsphere_points_helper(igall, G_bounds, gs, k, max_points, 1);
+}
+
+double gamma_dot(float complex* C1, float complex* C2, int num_waves) {
+	return cblas_sdot(2 * num_waves, (float*) C1, 1, (float*) C2, 1);
+}
+
+void gamma_gemm(int m, int n, int num_waves, float complex* A, int lda,
+	float complex* B, int ldb, float* out) {
+	cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, m, n, 2 * num_waves,
+		1.0f, (float*) A, 2 * lda, (float*) B, 2 * ldb, 0.0f, out, n);
+}
+
 void min_cart_path(double* coord, double* center, double* lattice, double* path, double* r) {
 	*r = INFINITY;
 	double testvec[3]= {0,0,0};
@@ -182,18 +322,71 @@ void clean_wave_projections(pswf_t* wf) {
 	for (int i = 0; i < wf->nwk * wf->nspin; i++) {
 		kpoint_t* kpt = wf->kpts[i];
 		for (int b = 0; b < kpt->num_bands; b++) {
-			if (kpt->bands[b]->wave_projections != NULL) {
-				free_projection_list(kpt->bands[b]->wave_projections, wf->wp_num);
-			}
+			kpt->bands[b]->wave_projections = NULL;
+		}
+	}
+	if (wf->wp_arenas != NULL) {
+		free_arena_list(wf->wp_arenas, wf->num_wp_arenas);
+		wf->wp_arenas = NULL;
+		wf->num_wp_arenas = 0;
+	}
+
+}
+
+void free_setup_cache(setup_cache_t* cache) {
+	// the projections of each site are in one allocation
+	for (int i = 0; i < cache->num_wp_sites; i++) {
+		free(cache->wp[i]);
+	}
+	free(cache->wp);
+	free(cache->wp_keys);
+	free(cache->wp_coords);
+	free(cache->wp_fftg);
+	free(cache->wp_last_used);
+	for (int i = 0; i < cache->num_pairs; i++) {
+		free(cache->pair_overlaps[i]);
+	}
+	free(cache->pair_overlaps);
+	free(cache->pair_keys);
+	free(cache->pair_dcoords);
+	free(cache->pair_sizes);
+	free(cache->pair_last_used);
+	free(cache->aug_keys);
+	free(cache->aug_coords);
+	free(cache);
+}
+
+void alloc_coeff_slab(kpoint_t* kpt) {
+	// 8 float complex per 64 bytes
+	int ld = (kpt->num_waves + 7) & ~7;
+	kpt->ld = ld;
+	kpt->coeffs = (float complex*) backend_malloc(
+		(size_t) kpt->num_bands * ld * sizeof(float complex), 64);
+	CHECK_ALLOCATION(kpt->coeffs);
+	for (int b = 0; b < kpt->num_bands; b++) {
+		float complex* row = kpt->coeffs + (size_t) b * ld;
+		for (int w = kpt->num_waves; w < ld; w++) {
+			row[w] = 0;
 		}
+		kpt->bands[b]->Cs = row;
 	}
+}
 
+static void free_symm_map(symm_map_t* map) {
+	free(map->gmaps);
+	free(map->phases[0]);
+	free(map);
 }
 
 void free_kpoint(kpoint_t* kpt, int num_elems, int num_sites, int wp_num, int* num_projs) {
+	if (kpt->coeffs != NULL) {
+		backend_free(kpt->coeffs);
+	}
 	for (int b = 0; b < kpt->num_bands; b++) {
 		band_t* curr_band = kpt->bands[b];
-		free(curr_band->Cs);
+		if (kpt->coeffs == NULL) {
+			free(curr_band->Cs);
+		}
 		if (curr_band->projections != NULL) {
 			free_projection_list(curr_band->projections, num_sites);
 		}
@@ -207,10 +400,10 @@ void free_kpoint(kpoint_t* kpt, int num_elems, int num_sites, int wp_num, int* n
 			free_projection_list(curr_band->down_projections, num_sites);
 		}
 		if (curr_band->CRs != NULL) {
-			mkl_free(curr_band->CRs);
+			backend_free(curr_band->CRs);
 		}
 		if (curr_band->CAs != NULL) {
-			mkl_free(curr_band->CAs);
+			backend_free(curr_band->CAs);
 		}
 		free(curr_band);
 	}
@@ -219,6 +412,9 @@ void free_kpoint(kpoint_t* kpt, int num_elems, int num_sites, int wp_num, int* n
 			free_rayleigh_set_list(kpt->expansion[i], num_projs[i]);
 		free(kpt->expansion);
 	}
+	if (kpt->symm != NULL) {
+		free_symm_map(kpt->symm);
+	}
 	free(kpt->Gs);
 	free(kpt->bands);
 	free(kpt->k);
@@ -232,13 +428,6 @@ void free_ppot(ppot_t* pp) {
 		free(pp->funcs[i].aewave);
 		free(pp->funcs[i].diffwave);
 		free(pp->funcs[i].kwave);
-		for (int j = 0; j < 3; j++) {
-			free(pp->funcs[i].proj_spline[j]);
-			free(pp->funcs[i].aewave_spline[j]);
-			free(pp->funcs[i].pswave_spline[j]);
-			free(pp->funcs[i].diffwave_spline[j]);
-			free(pp->funcs[i].kwave_spline[j]);
-		}
 		free(pp->funcs[i].proj_spline);
 		free(pp->funcs[i].aewave_spline);
 		free(pp->funcs[i].pswave_spline);
@@ -251,6 +440,7 @@ void free_ppot(ppot_t* pp) {
 	free(pp->pspw_overlap_matrix);
 	free(pp->aepw_overlap_matrix);
 	free(pp->diff_overlap_matrix);
+	free(pp->aug_diff_matrix);
 }
 
 void free_real_proj(real_proj_t* proj) {
@@ -258,13 +448,42 @@ void free_real_proj(real_proj_t* proj) {
 }
 
 void free_pswf(pswf_t* wf) {
+	if (wf->wavecar_map != NULL) {
+		// Cs point into the mapped WAVECAR, not the heap
+		for (int i = 0; i < wf->nwk * wf->nspin; i++)
+			for (int b = 0; b < wf->kpts[i]->num_bands; b++)
+				wf->kpts[i]->bands[b]->Cs = NULL;
+	}
+	clean_wave_projections(wf);
+	if (wf->proj_arenas != NULL) {
+		// the projections are freed with their arenas below
+		for (int i = 0; i < wf->nwk * wf->nspin; i++) {
+			for (int b = 0; b < wf->kpts[i]->num_bands; b++) {
+				band_t* band = wf->kpts[i]->bands[b];
+				band->projections = NULL;
+				band->up_projections = NULL;
+				band->down_projections = NULL;
+			}
+		}
+		free_arena_list(wf->proj_arenas, wf->num_proj_arenas);
+	}
 	for (int i = 0; i < wf->nwk * wf->nspin; i++)
 		free_kpoint(wf->kpts[i], wf->num_elems, wf->num_sites, wf->wp_num, wf->num_projs);
+	if (wf->wavecar_map != NULL) {
+		munmap(wf->wavecar_map, wf->wavecar_map_size);
+	}
+	if (wf->cache != NULL) {
+		free_coeff_cache(wf->cache);
+	}
+	if (wf->setup_cache != NULL) {
+		free_setup_cache(wf->setup_cache);
+	}
 	if (wf->overlaps != NULL) {
 		for (int i = 0; i < wf->num_aug_overlap_sites; i++)
 			free(wf->overlaps[i]);
 		free(wf->overlaps);
 	}
+	free(wf->dcoords);
 	if (wf->num_projs != NULL) {
 		free(wf->num_projs);
 	}
@@ -306,6 +525,380 @@ void free_ppot_list(ppot_t* pps, int length) {
 	free(pps);
 }
 
+// size of the blocks of an arena, larger allocations get their own block
+#define ARENA_BLOCK_SIZE (1L << 16)
+// blocks start with the pointer to the previous block
+#define ARENA_HEADER_SIZE 16
+
+arena_t* make_arena_list(int num) {
+	arena_t* arenas = (arena_t*) backend_malloc(num * sizeof(arena_t), 64);
+	CHECK_ALLOCATION(arenas);
+	for (int i = 0; i < num; i++) {
+		arenas[i].block = NULL;
+		arenas[i].used = 0;
+		arenas[i].size = 0;
+	}
+	return arenas;
+}
+
+void* arena_alloc(arena_t* arena, long size) {
+	size = (size + 15) & ~15L;
+	if (arena->block == NULL || arena->used + size > arena->size) {
+		long block_size = ARENA_HEADER_SIZE + size;
+		if (block_size < ARENA_BLOCK_SIZE) {
+			block_size = ARENA_BLOCK_SIZE;
+		}
+		char* block = (char*) malloc(block_size);
+		CHECK_ALLOCATION(block);
+		*(char**) block = arena->block;
+		arena->block = block;
+		arena->used = ARENA_HEADER_SIZE;
+		arena->size = block_size;
+	}
+	void* ptr = arena->block + arena->used;
+	arena->used += size;
+	return ptr;
+}
+
+void free_arena_list(arena_t* arenas, int num) {
+	for (int i = 0; i < num; i++) {
+		char* block = arenas[i].block;
+		while (block != NULL) {
+			char* prev = *(char**) block;
+			free(block);
+			block = prev;
+		}
+	}
+	backend_free(arenas);
+}
+
+coeff_cache_t* make_coeff_cache(int fd, int num_slots, long budget,
+	int record_size, int storage) {
+	coeff_cache_t* cache = (coeff_cache_t*) malloc(sizeof(coeff_cache_t));
+	CHECK_ALLOCATION(cache);
+	cache->fd = fd;
+	cache->record_size = record_size;
+	cache->storage = storage;
+	cache->compact = NULL;
+	cache->scales = NULL;
+	cache->sources = NULL;
+	cache->symm = NULL;
+	if (storage != COEFF_FLOAT32) {
+		cache->compact = (unsigned short**) calloc(num_slots, sizeof(unsigned short*));
+		cache->scales = (float*) malloc(num_slots * sizeof(float));
+		CHECK_ALLOCATION(cache->compact);
+		CHECK_ALLOCATION(cache->scales);
+	}
+	cache->budget = budget;
+	cache->used = 0;
+	cache->num_slots = num_slots;
+	cache->offsets = (long*) malloc(num_slots * sizeof(long));
+	cache->num_waves = (int*) malloc(num_slots * sizeof(int));
+	cache->coeffs = (float complex**) calloc(num_slots, sizeof(float complex*));
+	cache->pins = (int*) calloc(num_slots, sizeof(int));
+	cache->loading = (char*) calloc(num_slots, sizeof(char));
+	cache->prev = (int*) malloc(num_slots * sizeof(int));
+	cache->next = (int*) malloc(num_slots * sizeof(int));
+	cache->lock = malloc(sizeof(omp_lock_t));
+	CHECK_ALLOCATION(cache->offsets);
+	CHECK_ALLOCATION(cache->num_waves);
+	CHECK_ALLOCATION(cache->coeffs);
+	CHECK_ALLOCATION(cache->pins);
+	CHECK_ALLOCATION(cache->loading);
+	CHECK_ALLOCATION(cache->prev);
+	CHECK_ALLOCATION(cache->next);
+	CHECK_ALLOCATION(cache->lock);
+	cache->head = -1;
+	cache->tail = -1;
+	omp_init_lock((omp_lock_t*) cache->lock);
+	return cache;
+}
+
+static void lru_unlink(coeff_cache_t* cache, int slot) {
+	if (cache->prev[slot] >= 0) cache->next[cache->prev[slot]] = cache->next[slot];
+	else cache->head = cache->next[slot];
+	if (cache->next[slot] >= 0) cache->prev[cache->next[slot]] = cache->prev[slot];
+	else cache->tail = cache->prev[slot];
+}
+
+static void lru_push_head(coeff_cache_t* cache, int slot) {
+	cache->prev[slot] = -1;
+	cache->next[slot] = cache->head;
+	if (cache->head >= 0) cache->prev[cache->head] = slot;
+	cache->head = slot;
+	if (cache->tail < 0) cache->tail = slot;
+}
+
+static unsigned short float_to_half(float f) {
+	unsigned int x;
+	memcpy(&x, &f, sizeof(float));
+	unsigned short sign = (x >> 16) & 0x8000;
+	unsigned int absx = x & 0x7fffffff;
+	if (absx > 0x7f800000) {
+		return sign | 0x7e00;
+	} else if (absx >= 0x47800000) {
+		return sign | 0x7c00;
+	} else if (absx < 0x38800000) {
+		// subnormal half, in units of 2^-24 (the product is exact)
+		return sign | (unsigned short) lrintf(fabsf(f) * 16777216.0f);
+	}
+	// rebias the exponent and round the mantissa to nearest even
+	unsigned int h = (absx - 0x38000000) >> 13;
+	unsigned int rem = absx & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+	return sign | h;
+}
+
+static float half_to_float(unsigned short h) {
+	unsigned int sign = (unsigned int) (h & 0x8000) << 16;
+	unsigned int exponent = (h >> 10) & 0x1f;
+	unsigned int mantissa = h & 0x3ff;
+	unsigned int x;
+	if (exponent == 0) {
+		float f = mantissa / 16777216.0f;
+		return sign ? -f : f;
+	} else if (exponent == 31) {
+		x = sign | 0x7f800000 | (mantissa << 13);
+	} else {
+		x = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	}
+	float f;
+	memcpy(&f, &x, sizeof(float));
+	return f;
+}
+
+static unsigned short float_to_bfloat(float f) {
+	unsigned int x;
+	memcpy(&x, &f, sizeof(float));
+	if ((x & 0x7fffffff) > 0x7f800000) {
+		return (x >> 16) | 0x40;
+	}
+	// round to nearest even
+	return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static float bfloat_to_float(unsigned short h) {
+	unsigned int x = (unsigned int) h << 16;
+	float f;
+	memcpy(&f, &x, sizeof(float));
+	return f;
+}
+
+void store_compact_coeffs(coeff_cache_t* cache, int slot, float complex* Cs, int num_waves) {
+	float scale = 0;
+	for (int w = 0; w < num_waves; w++) {
+		scale = fmaxf(scale, fmaxf(fabsf(crealf(Cs[w])), fabsf(cimagf(Cs[w]))));
+	}
+	if (scale == 0) {
+		scale = 1;
+	}
+	unsigned short* data = (unsigned short*) malloc(2 * num_waves * sizeof(unsigned short));
+	CHECK_ALLOCATION(data);
+	for (int w = 0; w < num_waves; w++) {
+		float re = crealf(Cs[w]) / scale;
+		float im = cimagf(Cs[w]) / scale;
+		if (cache->storage == COEFF_FLOAT16) {
+			data[2*w] = float_to_half(re);
+			data[2*w+1] = float_to_half(im);
+		} else {
+			data[2*w] = float_to_bfloat(re);
+			data[2*w+1] = float_to_bfloat(im);
+		}
+	}
+	free(cache->compact[slot]);
+	cache->compact[slot] = data;
+	cache->scales[slot] = scale;
+	cache->num_waves[slot] = num_waves;
+}
+
+static void decode_compact_coeffs(coeff_cache_t* cache, int slot, float complex* coeffs) {
+	unsigned short* data = cache->compact[slot];
+	float scale = cache->scales[slot];
+	for (int w = 0; w < cache->num_waves[slot]; w++) {
+		if (cache->storage == COEFF_FLOAT16) {
+			coeffs[w] = scale * (half_to_float(data[2*w])
+				+ I * half_to_float(data[2*w+1]));
+		} else {
+			coeffs[w] = scale * (bfloat_to_float(data[2*w])
+				+ I * bfloat_to_float(data[2*w+1]));
+		}
+	}
+}
+
+static void pread_all(int fd, char* dst, long size, long offset) {
+	long done = 0;
+	while (done < size) {
+		ssize_t num_read = pread(fd, dst + done, size - done, offset + done);
+		if (num_read <= 0) {
+			printf("ERROR: could not read band coefficients from WAVECAR\n");
+			exit(-1);
+		}
+		done += num_read;
+	}
+}
+
+/*
+Writes the phase of each plane wave of the symmetry map to factors.
+*/
+static void symm_phases(symm_map_t* map, double complex* factors) {
+	double complex* px = map->phases[0] - map->G_min[0];
+	double complex* py = map->phases[1] - map->G_min[1];
+	double complex* pz = map->phases[2] - map->G_min[2];
+	int* Gs = map->Gs;
+	for (int w = 0; w < map->num_waves; w++) {
+		factors[w] = px[Gs[3*w+0]] * py[Gs[3*w+1]] * pz[Gs[3*w+2]];
+	}
+}
+
+/*
+Writes the coefficients of the band generated from the reference
+band src by the symmetry map of its k-point to coeffs. factors are
+the phases from symm_phases, or NULL to compute them on the fly.
+*/
+static void generate_symm_coeffs(symm_map_t* map, double complex* factors,
+	band_t* src, float complex* coeffs) {
+	float complex* rCs = acquire_coeffs(src);
+	double complex* px = map->phases[0] - map->G_min[0];
+	double complex* py = map->phases[1] - map->G_min[1];
+	double complex* pz = map->phases[2] - map->G_min[2];
+	int* Gs = map->Gs;
+	for (int w = 0; w < map->num_waves; w++) {
+		double complex phase = (factors != NULL) ? factors[w]
+			: px[Gs[3*w+0]] * py[Gs[3*w+1]] * pz[Gs[3*w+2]];
+		float complex C = (float complex) (phase * rCs[map->gmaps[w]]);
+		coeffs[w] = map->tr ? conjf(C) : C;
+	}
+	release_coeffs(src);
+}
+
+/*
+Reads, decodes or generates the coefficients of slot into coeffs.
+Only reads fields of the cache that do not change after it is set up,
+so it is called without holding the cache lock.
+*/
+static void load_slot_coeffs(coeff_cache_t* cache, int slot, float complex* coeffs) {
+	int num_waves = cache->num_waves[slot];
+	if (cache->symm != NULL) {
+		generate_symm_coeffs(cache->symm[slot], NULL, (band_t*) cache->sources[slot], coeffs);
+	} else if (cache->storage != COEFF_FLOAT32) {
+		decode_compact_coeffs(cache, slot, coeffs);
+	} else if (cache->record_size == sizeof(double complex)) {
+		double complex* record = (double complex*) malloc(num_waves * sizeof(double complex));
+		CHECK_ALLOCATION(record);
+		pread_all(cache->fd, (char*) record,
+			num_waves * sizeof(double complex), cache->offsets[slot]);
+		for (int w = 0; w < num_waves; w++) {
+			coeffs[w] = (float complex) record[w];
+		}
+		free(record);
+	} else {
+		pread_all(cache->fd, (char*) coeffs,
+			num_waves * sizeof(float complex), cache->offsets[slot]);
+	}
+}
+
+float complex* acquire_coeffs(band_t* band) {
+	coeff_cache_t* cache = band->cache;
+	if (cache == NULL) {
+		return band->Cs;
+	}
+	int slot = band->cache_slot;
+	omp_lock_t* lock = (omp_lock_t*) cache->lock;
+	omp_set_lock(lock);
+	// pinned before the lock is released, so the slot cannot be
+	// evicted between being loaded and being returned
+	cache->pins[slot]++;
+	if (cache->coeffs[slot] != NULL) {
+		lru_unlink(cache, slot);
+		lru_push_head(cache, slot);
+		float complex* coeffs = cache->coeffs[slot];
+		omp_unset_lock(lock);
+		return coeffs;
+	} else if (cache->loading[slot]) {
+		// another thread is loading the slot, wait for it to publish
+		omp_unset_lock(lock);
+		while (1) {
+			sched_yield();
+			omp_set_lock(lock);
+			if (!cache->loading[slot]) {
+				lru_unlink(cache, slot);
+				lru_push_head(cache, slot);
+				float complex* coeffs = cache->coeffs[slot];
+				omp_unset_lock(lock);
+				return coeffs;
+			}
+			omp_unset_lock(lock);
+		}
+	}
+
+	long size = cache->num_waves[slot] * sizeof(float complex);
+	// evict least recently used bands that nobody is holding, and reserve
+	// the space of the slot so concurrent loads stay within the budget
+	int victim = cache->tail;
+	while (cache->used + size > cache->budget && victim >= 0) {
+		int prev = cache->prev[victim];
+		if (cache->pins[victim] == 0) {
+			lru_unlink(cache, victim);
+			free(cache->coeffs[victim]);
+			cache->coeffs[victim] = NULL;
+			cache->used -= cache->num_waves[victim] * sizeof(float complex);
+		}
+		victim = prev;
+	}
+	cache->used += size;
+	cache->loading[slot] = 1;
+	omp_unset_lock(lock);
+
+	// the read, decoding or generation runs without the lock, so
+	// threads loading different slots do not wait for each other
+	float complex* coeffs = (float complex*) malloc(size);
+	CHECK_ALLOCATION(coeffs);
+	load_slot_coeffs(cache, slot, coeffs);
+
+	omp_set_lock(lock);
+	cache->coeffs[slot] = coeffs;
+	cache->loading[slot] = 0;
+	lru_push_head(cache, slot);
+	omp_unset_lock(lock);
+	return coeffs;
+}
+
+void release_coeffs(band_t* band) {
+	coeff_cache_t* cache = band->cache;
+	if (cache == NULL) {
+		return;
+	}
+	omp_set_lock((omp_lock_t*) cache->lock);
+	cache->pins[band->cache_slot]--;
+	omp_unset_lock((omp_lock_t*) cache->lock);
+}
+
+void free_coeff_cache(coeff_cache_t* cache) {
+	for (int i = 0; i < cache->num_slots; i++) {
+		free(cache->coeffs[i]);
+		if (cache->compact != NULL) {
+			free(cache->compact[i]);
+		}
+	}
+	if (cache->fd >= 0) {
+		close(cache->fd);
+	}
+	free(cache->compact);
+	free(cache->scales);
+	free(cache->sources);
+	free(cache->symm);
+	omp_destroy_lock((omp_lock_t*) cache->lock);
+	free(cache->lock);
+	free(cache->offsets);
+	free(cache->num_waves);
+	free(cache->coeffs);
+	free(cache->pins);
+	free(cache->loading);
+	free(cache->prev);
+	free(cache->next);
+	free(cache);
+}
+
 int min(int a, int b) {
 	if (a > b)
 		return b;
@@ -353,6 +946,10 @@ int is_ncl(pswf_t* wf) {
 	return wf->is_ncl;
 }
 
+int is_gamma(pswf_t* wf) {
+	return wf->is_gamma;
+}
+
 double get_energy(pswf_t* wf, int band, int kpt, int spin) {
 	return wf->kpts[kpt+spin*wf->nwk]->bands[band]->energy;
 }
@@ -555,10 +1152,56 @@ double complex smooth_wave_value(funcset_t funcs, double* x, int m, double rmax,
 		funcs.smooth_diffwave_spline, funcs.l, m);
 }
 
+/*
+Sets grid to the number of FFT grid points to search on either side of
+center, the grid point nearest to coord, to cover a sphere of radius rmax.
+*/
+static void site_grid_range(int* grid, int* center, double rmax, double* coord,
+	double* lattice, int* fftg) {
+
+	double vol = determinant(lattice);
+	double res[3] = {0,0,0};
+	vcross(res, lattice+3, lattice+6);
+	grid[0] = (int) (mag(res) * rmax / vol * fftg[0]) + 1;
+	vcross(res, lattice+0, lattice+6);
+	grid[1] = (int) (mag(res) * rmax / vol * fftg[1]) + 1;
+	vcross(res, lattice+0, lattice+3);
+	grid[2] = (int) (mag(res) * rmax / vol * fftg[2]) + 1;
+	center[0] = (int) round(coord[0] * fftg[0]);
+	center[1] = (int) round(coord[1] * fftg[1]);
+	center[2] = (int) round(coord[2] * fftg[2]);
+}
+
+/*
+Number of FFT grid points within R0 of coord, counted the same way
+setup_site selects them. The arrays of a site are sized with this
+rather than num_cart_gridpts, which only holds for the grid the
+projectors were set up on.
+*/
+static int site_grid_count(double rmax, double R0, double* coord,
+	double* lattice, int* fftg) {
+
+	int grid[3], center[3];
+	double testcoord[3] = {0,0,0};
+	int count = 0;
+	site_grid_range(grid, center, rmax, coord, lattice, fftg);
+	for (int i = -grid[0] + center[0]; i <= grid[0] + center[0]; i++) {
+		for (int j = -grid[1] + center[1]; j <= grid[1] + center[1]; j++) {
+			for (int k = -grid[2] + center[2]; k <= grid[2] + center[2]; k++) {
+				testcoord[0] = (double) i / fftg[0] - coord[0];
+				testcoord[1] = (double) j / fftg[1] - coord[1];
+				testcoord[2] = (double) k / fftg[2] - coord[2];
+				frac_to_cartesian(testcoord, lattice);
+				if (mag(testcoord) < R0) count++;
+			}
+		}
+	}
+	return count;
+}
+
 void setup_site(real_proj_site_t* sites, ppot_t* pps, int num_sites, int* site_nums,
 	int* labels, double* coords, double* lattice, int* fftg, int pr0_pw1) {
 	
-	double vol = determinant(lattice);
 
 	for (int s = 0; s < num_sites; s++) {
 		int i = site_nums[s];
@@ -575,18 +1218,22 @@ void setup_site(real_proj_site_t* sites, ppot_t* pps, int num_sites, int* site_n
 		sites[s].coord[0] = coords[3*i+0];
 		sites[s].coord[1] = coords[3*i+1];
 		sites[s].coord[2] = coords[3*i+2];
-		sites[s].indices = calloc(pps[labels[i]].num_cart_gridpts, sizeof(int));
+		double R0 = (pps[labels[i]].proj_gridsize-1) * sites[s].rmax
+			/ pps[labels[s]].proj_gridsize;
+		int num_gridpts = site_grid_count(sites[s].rmax, R0, coords+3*i, lattice, fftg);
+		if (num_gridpts == 0) num_gridpts = 1;
+		sites[s].indices = calloc(num_gridpts, sizeof(int));
 		CHECK_ALLOCATION(sites[s].indices);
 		sites[s].projs = (real_proj_t*) malloc(sites[s].total_projs * sizeof(real_proj_t));
 		int p = 0;
-		sites[s].paths = malloc(3*pps[labels[i]].num_cart_gridpts * sizeof(double));
+		sites[s].paths = malloc(3*num_gridpts * sizeof(double));
 		CHECK_ALLOCATION(sites[s].paths);
 		for (int j = 0; j < sites[s].num_projs; j++) {
 			for (int m = -pps[labels[i]].funcs[j].l; m <= pps[labels[i]].funcs[j].l; m++) {
 				sites[s].projs[p].l = pps[labels[i]].funcs[j].l;
 				sites[s].projs[p].m = m;
 				sites[s].projs[p].func_num = j;
-				sites[s].projs[p].values = malloc(pps[labels[i]].num_cart_gridpts * sizeof(double complex));
+				sites[s].projs[p].values = malloc(num_gridpts * sizeof(double complex));
 				CHECK_ALLOCATION(sites[s].projs[p].values);
 				p++;
 			}
@@ -596,24 +1243,16 @@ void setup_site(real_proj_site_t* sites, ppot_t* pps, int num_sites, int* site_n
 	//#pragma omp parallel for
 	for (int s = 0; s < num_sites; s++) {
 		int p = site_nums[s];
-		double res[3] = {0,0,0};
 		double frac[3] = {0,0,0};
 		double testcoord[3] = {0,0,0};
-		vcross(res, lattice+3, lattice+6);
-		int grid1 = (int) (mag(res) * sites[s].rmax / vol * fftg[0]) + 1;
-		vcross(res, lattice+0, lattice+6);
-		int grid2 = (int) (mag(res) * sites[s].rmax / vol * fftg[1]) + 1;
-		vcross(res, lattice+0, lattice+3);
-		int grid3 = (int) (mag(res) * sites[s].rmax / vol * fftg[2]) + 1;
-		int center1 = (int) round(coords[3*p+0] * fftg[0]);
-		int center2 = (int) round(coords[3*p+1] * fftg[1]);
-		int center3 = (int) round(coords[3*p+2] * fftg[2]);
+		int grid[3], center[3];
+		site_grid_range(grid, center, sites[s].rmax, coords+3*p, lattice, fftg);
 		int ii=0, jj=0, kk=0;
 		double R0 = (pps[labels[p]].proj_gridsize-1) * sites[s].rmax
 			/ pps[labels[s]].proj_gridsize;
-		for (int i = -grid1 + center1; i <= grid1 + center1; i++) {
-			for (int j = -grid2 + center2; j <= grid2 + center2; j++) {
-				for (int k = -grid3 + center3; k <= grid3 + center3; k++) {
+		for (int i = -grid[0] + center[0]; i <= grid[0] + center[0]; i++) {
+			for (int j = -grid[1] + center[1]; j <= grid[1] + center[1]; j++) {
+				for (int k = -grid[2] + center[2]; k <= grid[2] + center[2]; k++) {
 					testcoord[0] = (double) i / fftg[0] - coords[3*p+0];
 					testcoord[1] = (double) j / fftg[1] - coords[3*p+1];
 					testcoord[2] = (double) k / fftg[2] - coords[3*p+2];
@@ -642,8 +1281,6 @@ void setup_site(real_proj_site_t* sites, ppot_t* pps, int num_sites, int* site_n
 									pps[labels[p]].proj_gridsize, coords+3*p, frac, lattice);
 						}
 						sites[s].num_indices++;
-						//if (sites[s].num_indices >= pps[labels[p]].num_cart_gridpts)
-						//	printf("SETUP_SITE ERROR %d %d %d\n", sites[s].num_indices, p, pr0_pw1);
 					}
 				}
 			}
@@ -653,14 +1290,11 @@ void setup_site(real_proj_site_t* sites, ppot_t* pps, int num_sites, int* site_n
 
 //adapted from VASP source code
 double** spline_coeff(double* x, double* y, int N) {
-	double** coeff = (double**) malloc(3 * sizeof(double*));
+	double** coeff = (double**) malloc(3 * sizeof(double*) + 3 * N * sizeof(double));
 	CHECK_ALLOCATION(coeff);
-	coeff[0] = (double*) malloc(N * sizeof(double));
-	coeff[1] = (double*) malloc(N * sizeof(double));
-	coeff[2] = (double*) malloc(N * sizeof(double));
-	CHECK_ALLOCATION(coeff[0]);
-	CHECK_ALLOCATION(coeff[1]);
-	CHECK_ALLOCATION(coeff[2]);
+	coeff[0] = (double*) (coeff + 3);
+	coeff[1] = coeff[0] + N;
+	coeff[2] = coeff[1] + N;
 
 	double d1p1 = (y[1] - y[0]) / (x[1] - x[0]);
 	if (d1p1 > 0.99E30) {
@@ -773,8 +1407,167 @@ double sbf(double x, int l) {
 	return jlp1;
 }
 
-pswf_t* expand_symm_wf(pswf_t* rwf, int num_kpts, int* maps,
-	double* ops, double* drs, double* kws, int* trs) {
+/*
+Scratch space of one thread of expand_symm_wf_helper, grown when a
+k-point needs more and reused for all the k-points of the thread.
+keys and vals are an open addressing hash table from the index of a
+plane wave in the box of its k-point to its index in the k-point.
+*/
+typedef struct symm_scratch {
+	int* keys;
+	int* vals;
+	int table_size; ///< power of two, at least twice the number of plane waves
+	int* gmaps;
+	double complex* factors; ///< phase of each plane wave, same size as gmaps
+	int gmaps_size;
+	double complex* phases;
+	int phases_size;
+} symm_scratch_t;
+
+static void free_symm_scratch(symm_scratch_t* scratch) {
+	free(scratch->keys);
+	free(scratch->vals);
+	free(scratch->gmaps);
+	free(scratch->factors);
+	free(scratch->phases);
+}
+
+static inline int symm_hash(int key, int table_size) {
+	return (int) (((unsigned int) key * 2654435761u) & (table_size - 1));
+}
+
+/*
+Fills in the symm_map_t of kpt, which is generated from rkpt by the
+rotation op, the translation dr and time reversal if tr is 1.
+kdiff is the reciprocal lattice vector that was subtracted from
+the rotated k-point, and G_bounds bounds the plane waves of kpt.
+map->gmaps and map->phases[0] must hold kpt->num_waves and
+(number of plane wave indices along each axis summed over the
+axes) values, respectively. If ncl is 1, the second half of the
+plane waves repeats the first for the second spinor component,
+so only the first half is matched and the second half is mapped
+to the second half of rkpt (the spinors themselves are not rotated).
+*/
+static void make_symm_map(symm_map_t* map, kpoint_t* kpt, kpoint_t* rkpt, double* op,
+	double* dr, int tr, double* kdiff, int* G_bounds, int ncl, symm_scratch_t* scratch) {
+
+	map->num_waves = kpt->num_waves;
+	map->Gs = kpt->Gs;
+	map->tr = tr;
+	map->dr[0] = dr[0];
+	map->dr[1] = dr[1];
+	map->dr[2] = dr[2];
+
+	int ngx = G_bounds[1] - G_bounds[0] + 1;
+	int gxmin = G_bounds[0];
+	int ngy = G_bounds[3] - G_bounds[2] + 1;
+	int gymin = G_bounds[2];
+	int ngz = G_bounds[5] - G_bounds[4] + 1;
+	int gzmin = G_bounds[4];
+
+	int table_size = scratch->table_size;
+	if (table_size < 2 * kpt->num_waves) {
+		while (table_size < 2 * kpt->num_waves) table_size *= 2;
+		free(scratch->keys);
+		free(scratch->vals);
+		scratch->keys = (int*) malloc(table_size * sizeof(int));
+		scratch->vals = (int*) malloc(table_size * sizeof(int));
+		CHECK_ALLOCATION(scratch->keys);
+		CHECK_ALLOCATION(scratch->vals);
+		scratch->table_size = table_size;
+	}
+	int* keys = scratch->keys;
+	int* vals = scratch->vals;
+	for (int i = 0; i < table_size; i++) keys[i] = -1;
+
+	// each G appears once in the first num_pw plane waves
+	int num_pw = ncl ? kpt->num_waves / 2 : kpt->num_waves;
+	int gx, gy, gz;
+	int* gmaps = map->gmaps;
+	for (int w = 0; w < kpt->num_waves; w++) gmaps[w] = -1;
+	for (int w = 0; w < num_pw; w++) {
+		gx = kpt->Gs[3*w+0];
+		gy = kpt->Gs[3*w+1];
+		gz = kpt->Gs[3*w+2];
+		int key = (gx-gxmin)*ngy*ngz + (gy-gymin)*ngz + (gz-gzmin);
+		int h = symm_hash(key, table_size);
+		while (keys[h] >= 0 && keys[h] != key) h = (h + 1) & (table_size - 1);
+		keys[h] = key;
+		vals[h] = w;
+	}
+
+	double pw[3];
+	for (int g = 0; g < num_pw; g++) {
+		pw[0] = rkpt->Gs[3*g+0];
+		pw[1] = rkpt->Gs[3*g+1];
+		pw[2] = rkpt->Gs[3*g+2];
+
+		rotation_transform(pw, op, pw);
+		if (tr == 1) {
+			pw[0] *= -1;
+			pw[1] *= -1;
+			pw[2] *= -1;
+		}
+		pw[0] += kdiff[0];
+		pw[1] += kdiff[1];
+		pw[2] += kdiff[2];
+
+		gx = (int) round(pw[0]);
+		gy = (int) round(pw[1]);
+		gz = (int) round(pw[2]);
+		int ind = -1;
+		if (gx >= gxmin && gx < gxmin + ngx && gy >= gymin && gy < gymin + ngy
+				&& gz >= gzmin && gz < gzmin + ngz) {
+			int key = (gx-gxmin)*ngy*ngz + (gy-gymin)*ngz + (gz-gzmin);
+			int h = symm_hash(key, table_size);
+			while (keys[h] >= 0 && keys[h] != key) h = (h + 1) & (table_size - 1);
+			if (keys[h] == key) ind = vals[h];
+		}
+		if (ind < 0) {
+			printf("ERROR, BAD PLANE WAVE MAPPING %d %d %d %d %d %d %lf %lf %lf\n %lf %lf %lf %lf %lf %lf %lf %lf %lf\n",
+					rkpt->Gs[3*g+0], rkpt->Gs[3*g+1], rkpt->Gs[3*g+2], gx, gy, gz,
+					pw[0], pw[1], pw[2], op[0],op[1],op[2],op[3],op[4],op[5],op[6],op[7],op[8]);
+		} else {
+			gmaps[ind] = g;
+		}
+	}
+	for (int w = 0; w < num_pw; w++) {
+		if (gmaps[w] < 0) {
+			printf("ERROR, INCOMPLETE PLANE WAVE MAPPING\n");
+			gmaps[w] = 0;
+		}
+	}
+	for (int w = num_pw; w < kpt->num_waves; w++) {
+		gmaps[w] = gmaps[w - num_pw] + num_pw;
+	}
+
+	// phase exp(-+2 pi i (k+G).dr) as a product of one factor per axis
+	double sign = (tr == 1) ? 1 : -1;
+	int num_G[3] = {ngx, ngy, ngz};
+	map->G_min[0] = gxmin;
+	map->G_min[1] = gymin;
+	map->G_min[2] = gzmin;
+	map->phases[1] = map->phases[0] + ngx;
+	map->phases[2] = map->phases[1] + ngy;
+	double complex kphase = cexp(sign * I * 2 * PI * dot(kpt->k, dr));
+	for (int i = 0; i < 3; i++) {
+		for (int g = 0; g < num_G[i]; g++) {
+			map->phases[i][g] = cexp(sign * I * 2 * PI * (map->G_min[i] + g) * dr[i]);
+		}
+	}
+	for (int g = 0; g < ngx; g++) {
+		map->phases[0][g] *= kphase;
+	}
+}
+
+/*
+Builds the symmetry-expanded wavefunction for expand_symm_wf
+(cache_budget == 0) and expand_symm_wf_virtual (cache_budget > 0).
+The k-points are expanded in parallel, and each thread reuses its
+scratch space (see symm_scratch_t) between k-points.
+*/
+static pswf_t* expand_symm_wf_helper(pswf_t* rwf, int num_kpts, int* maps,
+	double* ops, double* drs, double* kws, int* trs, long cache_budget) {
 
 	double* lattice = rwf->lattice;
 	double* reclattice = rwf->reclattice;
@@ -802,18 +1595,49 @@ pswf_t* expand_symm_wf(pswf_t* rwf, int num_kpts, int* maps,
 	wf->fftg = NULL;
 
 	wf->is_ncl = rwf->is_ncl;
+	// the half G-sphere of a gamma-only run does not map onto itself
+	// under the symmetry operations, so the expanded k-points are full
+	wf->is_gamma = 0;
+	wf->fft_precision = FFT_DOUBLE;
 
 	wf->num_aug_overlap_sites = 0;
 	wf->dcoords = NULL;
 	wf->overlaps = NULL;
 	wf->num_projs = NULL;
 	wf->wp_num = 0;
-
-	//#pragma omp parallel for
+	wf->wavecar_map = NULL;
+	wf->wavecar_map_size = 0;
+	wf->cache = NULL;
+	wf->proj_arenas = NULL;
+	wf->wp_arenas = NULL;
+	wf->num_proj_arenas = 0;
+	wf->num_wp_arenas = 0;
+	wf->setup_cache = NULL;
+	if (cache_budget > 0) {
+		int num_slots = num_kpts * wf->nspin * wf->nband;
+		wf->cache = make_coeff_cache(-1, num_slots, cache_budget,
+			sizeof(float complex), COEFF_FLOAT32);
+		wf->cache->sources = (void**) malloc(num_slots * sizeof(band_t*));
+		wf->cache->symm = (symm_map_t**) malloc(num_slots * sizeof(symm_map_t*));
+		CHECK_ALLOCATION(wf->cache->sources);
+		CHECK_ALLOCATION(wf->cache->symm);
+	}
+	gsphere_t gsphere = make_gsphere(reclattice, rwf->encut);
+	int is_ncl = 0;
+
+#if defined(_OPENMP)
+	omp_set_num_threads(omp_get_max_threads());
+#endif
+	#pragma omp parallel
+	{
+	symm_scratch_t scratch = {NULL, NULL, 1, NULL, NULL, 0, NULL, 0};
+	int G_bounds[6] = {0, 0, 0, 0, 0, 0};
+
+	#pragma omp for schedule(dynamic) reduction(|:is_ncl)
 	for (int knum = 0; knum < num_kpts * wf->nspin; knum++) {
 		wf->kpts[knum] = (kpoint_t*) malloc(sizeof(kpoint_t));
+		CHECK_ALLOCATION(wf->kpts[knum]);
 
-		double pw[3] = {0,0,0};
 		int rnum = maps[knum%num_kpts];
 		int tr = trs[knum%num_kpts];
 		if (knum >= num_kpts && rwf->nspin ==2) {
@@ -836,65 +1660,26 @@ pswf_t* expand_symm_wf(pswf_t* rwf, int num_kpts, int* maps,
 		kpt->k[0] -= kdiff[0];
 		kpt->k[1] -= kdiff[1];
 		kpt->k[2] -= kdiff[2];
-		//printf("OLD KPT %lf %lf %lf\n", rkpt->k[0], rkpt->k[1], rkpt->k[2]);
-		//printf("NEW KPT %lf %lf %lf\n", kpt->k[0], kpt->k[1], kpt->k[2]);
-		//kpt->Gs = (int*) malloc(3 * kpt->num_waves * sizeof(int));
 
 		kpt->weight = kws[knum%num_kpts];
 		kpt->num_bands = rkpt->num_bands;
 		kpt->bands = (band_t**) malloc(kpt->num_bands * sizeof(band_t*));
 		kpt->expansion = NULL;
+		kpt->coeffs = NULL;
+		kpt->ld = 0;
+		kpt->gamma = 0;
 
 		int* igall = malloc(3*kpt->num_waves*sizeof(int));
 		if (igall == NULL) {
 		    	ALLOCATION_FAILED();
 		}
-		int nb1max = rwf->G_bounds[1] - rwf->G_bounds[0] + 2;
-		int nb2max = rwf->G_bounds[3] - rwf->G_bounds[2] + 2;
-		int nb3max = rwf->G_bounds[5] - rwf->G_bounds[4] + 2;
-		double encut = rwf->encut;
-		double* b1 = reclattice;
-		double* b2 = reclattice+3;
-		double* b3 = reclattice+6;
-		int ncnt = -1;
-		for (int ig3 = 0; ig3 <= 2 * nb3max; ig3++) {
-			int ig3p = ig3;
-			if (ig3 > nb3max) ig3p = ig3 - 2 * nb3max - 1;
-			for (int ig2 = 0; ig2 <= 2 * nb2max; ig2++) {
-				int ig2p = ig2;
-				if (ig2 > nb2max) ig2p = ig2 - 2 * nb2max - 1;
-				for (int ig1 = 0; ig1 <= 2 * nb1max; ig1++) {
-					int ig1p = ig1;
-					if (ig1 > nb1max) ig1p = ig1 - 2 * nb1max - 1;
-					double sumkg[3];
-					for (int j = 0; j < 3; j++) {
-						sumkg[j] = (kpt->k[0]+ig1p) * b1[j]
-									+ (kpt->k[1]+ig2p) * b2[j]
-									+ (kpt->k[2]+ig3p) * b3[j];
-					}
-					double gtot = mag(sumkg);
-					double etot = pow(gtot,2.0) / CCONST;
-					//printf("%lf %lf\n", etot, gtot);
-					if (etot <= encut) {
-						ncnt++;
-						igall[ncnt*3+0] = ig1p;
-						igall[ncnt*3+1] = ig2p;
-						igall[ncnt*3+2] = ig3p;
-						if (ig1p < wf->G_bounds[0]) wf->G_bounds[0] = ig1p;
-						else if (ig1p > wf->G_bounds[1]) wf->G_bounds[1] = ig1p;
-						if (ig2p < wf->G_bounds[2]) wf->G_bounds[2] = ig2p;
-						else if (ig2p > wf->G_bounds[3]) wf->G_bounds[3] = ig2p;
-						if (ig3p < wf->G_bounds[4]) wf->G_bounds[4] = ig3p;
-						else if (ig3p > wf->G_bounds[5]) wf->G_bounds[5] = ig3p;
-					}
-				}
-			}
-		}
-		ncnt++;
+		// bounds of this k-point, merged into wf->G_bounds at the end
+		int kpt_bounds[6] = {0, 0, 0, 0, 0, 0};
+		int ncnt = gsphere_points(igall, kpt_bounds, &gsphere, kpt->k, kpt->num_waves);
 
 		if (ncnt * 2 == rkpt->num_waves) {
 			printf("This is an NCL wavefunction!\n");
-			wf->is_ncl = 1;
+			is_ncl = 1;
 			for (int iplane = 0; iplane < rkpt->num_waves/2; iplane++) {
 				igall[3*(rkpt->num_waves/2+iplane)+0] = igall[3*iplane+0];
 				igall[3*(rkpt->num_waves/2+iplane)+1] = igall[3*iplane+1];
@@ -905,75 +1690,45 @@ pswf_t* expand_symm_wf(pswf_t* rwf, int num_kpts, int* maps,
 				kpt->k[0], kpt->k[1], kpt->k[2], CCONST);
 		}
 		kpt->Gs = igall;
-
-		int ngx = wf->G_bounds[1] - wf->G_bounds[0] + 1;
-		int gxmin = wf->G_bounds[0];
-		int ngy = wf->G_bounds[3] - wf->G_bounds[2] + 1;
-		int gymin = wf->G_bounds[2];
-		int ngz = wf->G_bounds[5] - wf->G_bounds[4] + 1;
-		int gzmin = wf->G_bounds[4];
-		int* kptinds = (int*) malloc(ngx*ngy*ngz * sizeof(int));
-		for (int w = 0; w < ngx*ngy*ngz; w++) kptinds[w] = -1;
-
-		int gx, gy, gz;
-		int* gmaps = (int*) malloc(kpt->num_waves * sizeof(int));
-		float complex* factors = (float complex*) malloc(
-			kpt->num_waves * sizeof(float complex));
-		for (int w = 0; w < kpt->num_waves; w++) gmaps[w] = -1;
-		for (int w = 0; w < rkpt->num_waves; w++) {
-			gx = kpt->Gs[3*w+0];
-			gy = kpt->Gs[3*w+1];
-			gz = kpt->Gs[3*w+2];
-			kptinds[(gx-gxmin)*ngy*ngz + (gy-gymin)*ngz + (gz-gzmin)] = w;
+		for (int i = 0; i < 3; i++) {
+			G_bounds[2*i] = min(G_bounds[2*i], kpt_bounds[2*i]);
+			G_bounds[2*i+1] = max(G_bounds[2*i+1], kpt_bounds[2*i+1]);
 		}
 
-		double* dr = drs + 3 * (knum%num_kpts);
-		double* op = ops+OPSIZE*(knum%num_kpts);
-
-		for (int g = 0; g < kpt->num_waves; g++) {
-
-			//pw[0] = rkpt->k[0] + rkpt->Gs[3*g+0];
-			//pw[1] = rkpt->k[1] + rkpt->Gs[3*g+1];
-			//pw[2] = rkpt->k[2] + rkpt->Gs[3*g+2];
-			pw[0] = rkpt->Gs[3*g+0];
-			pw[1] = rkpt->Gs[3*g+1];
-			pw[2] = rkpt->Gs[3*g+2];
-
-			rotation_transform(pw, ops+OPSIZE*(knum%num_kpts), pw);
-			if (tr == 1) {
-				pw[0] *= -1;
-				pw[1] *= -1;
-				pw[2] *= -1;
+		int num_phases = kpt_bounds[1] - kpt_bounds[0] + kpt_bounds[3]
+			- kpt_bounds[2] + kpt_bounds[5] - kpt_bounds[4] + 3;
+		symm_map_t local_map;
+		symm_map_t* map = &local_map;
+		if (wf->cache != NULL) {
+			// kept with the k-point
+			map = (symm_map_t*) malloc(sizeof(symm_map_t));
+			CHECK_ALLOCATION(map);
+			map->gmaps = (int*) malloc(kpt->num_waves * sizeof(int));
+			map->phases[0] = (double complex*) malloc(num_phases * sizeof(double complex));
+			CHECK_ALLOCATION(map->gmaps);
+			CHECK_ALLOCATION(map->phases[0]);
+		} else {
+			if (scratch.gmaps_size < kpt->num_waves) {
+				free(scratch.gmaps);
+				free(scratch.factors);
+				scratch.gmaps = (int*) malloc(kpt->num_waves * sizeof(int));
+				scratch.factors = (double complex*) malloc(kpt->num_waves * sizeof(double complex));
+				CHECK_ALLOCATION(scratch.gmaps);
+				CHECK_ALLOCATION(scratch.factors);
+				scratch.gmaps_size = kpt->num_waves;
 			}
-
-			//pw[0] -= kpt->k[0];
-			//pw[1] -= kpt->k[1];
-			//pw[2] -= kpt->k[2];
-			pw[0] += kdiff[0];
-			pw[1] += kdiff[1];
-			pw[2] += kdiff[2];
-
-			gx = (int) round(pw[0]);
-			gy = (int) round(pw[1]);
-			gz = (int) round(pw[2]);
-			gmaps[kptinds[(gx-gxmin)*ngy*ngz + (gy-gymin)*ngz + (gz-gzmin)]] = g;
-			if (tr == 0) {
-				factors[kptinds[(gx-gxmin)*ngy*ngz + (gy-gymin)*ngz + (gz-gzmin)]] = cexpf(
-					-I * 2 * PI * (dot(kpt->k, dr) + dot(pw, dr)) );
-			} else {
-				factors[kptinds[(gx-gxmin)*ngy*ngz + (gy-gymin)*ngz + (gz-gzmin)]] = cexpf(
-					I * 2 * PI * (dot(kpt->k, dr) + dot(pw, dr)) );
-			}
-
-			if (kptinds[(gx-gxmin)*ngy*ngz + (gy-gymin)*ngz + (gz-gzmin)] < 0) {
-				printf("ERROR, BAD PLANE WAVE MAPPING %d %d %d %d %d %d %lf %lf %lf\n %lf %lf %lf %lf %lf %lf %lf %lf %lf\n",
-						rkpt->Gs[3*g+0], rkpt->Gs[3*g+1], rkpt->Gs[3*g+2], gx, gy, gz,
-						pw[0], pw[1], pw[2], op[0],op[1],op[2],op[3],op[4],op[5],op[6],op[7],op[8]);
+			if (scratch.phases_size < num_phases) {
+				free(scratch.phases);
+				scratch.phases = (double complex*) malloc(num_phases * sizeof(double complex));
+				CHECK_ALLOCATION(scratch.phases);
+				scratch.phases_size = num_phases;
 			}
-
-			//printf("OLD G %d %d %d\n", okpt->Gs[3*g+0], okpt->Gs[3*g+1], okpt->Gs[3*g+2]);
-			//printf("NEW G %d %d %d\n", kpt->Gs[3*g+0],  kpt->Gs[3*g+1],  kpt->Gs[3*g+2]);
+			map->gmaps = scratch.gmaps;
+			map->phases[0] = scratch.phases;
 		}
+		make_symm_map(map, kpt, rkpt, ops+OPSIZE*(knum%num_kpts),
+			drs + 3 * (knum%num_kpts), tr, kdiff, kpt_bounds,
+			ncnt * 2 == rkpt->num_waves, &scratch);
 
 		for (int b = 0; b < kpt->num_bands; b++) {
 			kpt->bands[b] = (band_t*) malloc(sizeof(band_t));
@@ -981,37 +1736,65 @@ pswf_t* expand_symm_wf(pswf_t* rwf, int num_kpts, int* maps,
 			kpt->bands[b]->num_waves = rkpt->bands[b]->num_waves;
 			kpt->bands[b]->occ = rkpt->bands[b]->occ;
 			kpt->bands[b]->energy = rkpt->bands[b]->energy;
-			kpt->bands[b]->Cs = (float complex*) malloc(
-				kpt->num_waves * sizeof(float complex));
+			kpt->bands[b]->Cs = NULL;
 			kpt->bands[b]->CRs = NULL;
 			kpt->bands[b]->CAs = NULL;
 			kpt->bands[b]->projections = NULL;
 			kpt->bands[b]->up_projections = NULL;
 			kpt->bands[b]->down_projections = NULL;
 			kpt->bands[b]->wave_projections = NULL;
-			//double total = 0;
-			for (int w = 0; w < kpt->num_waves; w++) {
-				if (gmaps[w] < 0) {
-					printf("ERROR, INCOMPLETE PLANE WAVE MAPPING\n");
-				}
-				kpt->bands[b]->Cs[w] = factors[w] * rkpt->bands[b]->Cs[gmaps[w]];
-				if (tr == 1) {
-					kpt->bands[b]->Cs[w] = conj(kpt->bands[b]->Cs[w]);
-				}
-				//total += cabs(cabs(kpt->bands[b]->Cs[w]) - cabs(okpt->bands[b]->Cs[w]));
+			kpt->bands[b]->cache = NULL;
+			kpt->bands[b]->cache_slot = -1;
+		}
+
+		if (wf->cache != NULL) {
+			kpt->symm = map;
+			for (int b = 0; b < kpt->num_bands; b++) {
+				int slot = knum * wf->nband + b;
+				kpt->bands[b]->cache = wf->cache;
+				kpt->bands[b]->cache_slot = slot;
+				wf->cache->num_waves[slot] = kpt->num_waves;
+				wf->cache->sources[slot] = rkpt->bands[b];
+				wf->cache->symm[slot] = map;
+			}
+		} else {
+			kpt->symm = NULL;
+			alloc_coeff_slab(kpt);
+			symm_phases(map, scratch.factors);
+			for (int b = 0; b < kpt->num_bands; b++) {
+				generate_symm_coeffs(map, scratch.factors, rkpt->bands[b], kpt->bands[b]->Cs);
 			}
-			//printf("energies %lf %lf %e\n", kpt->bands[b]->energy, okpt->bands[b]->energy, total);
 		}
-	
-		free(gmaps);
-		free(kptinds);
-		free(factors);
+	}
+
+	#pragma omp critical
+	{
+	for (int i = 0; i < 3; i++) {
+		wf->G_bounds[2*i] = min(wf->G_bounds[2*i], G_bounds[2*i]);
+		wf->G_bounds[2*i+1] = max(wf->G_bounds[2*i+1], G_bounds[2*i+1]);
+	}
+	}
+	free_symm_scratch(&scratch);
+	}
+	if (is_ncl) {
+		wf->is_ncl = 1;
 	}
 
 	wf->encut = rwf->encut;
 	return wf;
 }
 
+pswf_t* expand_symm_wf(pswf_t* rwf, int num_kpts, int* maps,
+	double* ops, double* drs, double* kws, int* trs) {
+	return expand_symm_wf_helper(rwf, num_kpts, maps, ops, drs, kws, trs, 0);
+}
+
+pswf_t* expand_symm_wf_virtual(pswf_t* rwf, int num_kpts, int* maps,
+	double* ops, double* drs, double* kws, int* trs, long cache_budget) {
+	return expand_symm_wf_helper(rwf, num_kpts, maps, ops, drs, kws, trs,
+		cache_budget > 0 ? cache_budget : 1);
+}
+
 void CHECK_ALLOCATION(void* ptr) {
 	if (ptr == NULL) {
 		ALLOCATION_FAILED();
@@ -1026,7 +1809,7 @@ void ALLOCATION_FAILED(void) {
 void CHECK_STATUS(int status) {
 	if (status != 0) {
 		printf("ROUTINE FAILED WITH STATUS %d:\n", status);
-		char* message = DftiErrorMessage(status);
+		const char* message = fft_error_message(status);
 		printf("%s\n", message);
 		exit(-1);
 	}
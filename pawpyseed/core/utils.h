@@ -55,6 +55,7 @@ typedef struct ppot {
 	double* pspw_overlap_matrix; ///< overlap matrix for pseudo partial waves
 	double* aepw_overlap_matrix; ///< overlap matrix for all electron partial waves
 	double* diff_overlap_matrix; ///< overlap matrix of difference between all electron and partial waves
+	double* aug_diff_matrix; ///< aepw_overlap_matrix - pspw_overlap_matrix expanded over the total_projs (n,l,m) projectors, zero unless l and m match
 	int proj_gridsize; ///< number of points on projector radial grid
 	int wave_gridsize; ///< number of points on partial wave radial grid
 	int num_cart_gridpts; ///< number of real space grid points that can fit in the projector sphere
@@ -74,6 +75,125 @@ typedef struct projection {
 	double complex* overlaps; ///< list of <p_i|psi>
 } projection_t;
 
+/**
+Storage formats of the plane wave coefficients of a band.
+COEFF_FLOAT32 keeps the float complex coefficients as read.
+The compact formats store each real and imaginary part in 16 bits,
+divided by the largest such part of the band (its scale), and are
+decoded into float complex by acquire_coeffs. For a band with
+N coefficients C and scale S, the decoded coefficients C' satisfy
+||C'-C|| <= 2^-11 ||C|| + sqrt(2N) 2^-25 S for COEFF_FLOAT16
+(IEEE half precision, the second term is from subnormals) and
+||C'-C|| <= 2^-8 ||C|| for COEFF_BFLOAT16, up to float rounding.
+Since S <= ||C||, an overlap <A|C> of normalized bands changes by at
+most about 4.9e-4 (plus 3e-8 sqrt(N)) or 3.9e-3, respectively (see
+check_coeff_storage in wavefunction.py). Both formats halve the
+memory of the coefficients, or quarter it for a double precision
+WAVECAR.
+*/
+#define COEFF_FLOAT32 0
+#define COEFF_FLOAT16 1
+#define COEFF_BFLOAT16 2
+
+/**
+Relates the plane waves of a k-point k generated by a symmetry operation
+(see expand_symm_wf) to those of the reference k-point it was generated
+from. The coefficient of plane wave w of a band is
+phase(w) * C[gmaps[w]], conjugated if tr is 1, where C are the coefficients
+of the same band at the reference k-point and
+phase(w) = exp(-+2 pi i (k + G_w).dr) (+ if tr is 1) is the product
+of phases[0][G_w[0]-G_min[0]], phases[1][...] and phases[2][...].
+The exp(-+2 pi i k.dr) factor is included in phases[0].
+*/
+typedef struct symm_map {
+	int num_waves; ///< number of plane waves
+	int* Gs; ///< plane waves of the generated k-point (owned by the k-point)
+	int* gmaps; ///< index in the reference k-point of the plane wave mapped onto each plane wave
+	double dr[3]; ///< fractional translation of the symmetry operation
+	int tr; ///< 1 if time reversal symmetry is applied, 0 otherwise
+	int G_min[3]; ///< smallest plane wave index along each axis
+	double complex* phases[3]; ///< phase of each plane wave index along each axis, in one allocation starting at phases[0]
+} symm_map_t;
+
+/**
+Bounded LRU cache of plane wave coefficients for a wavefunction
+whose bands are read from the WAVECAR on demand, kept in memory
+in a compact format (see COEFF_FLOAT16) and decoded on demand, or
+generated on demand from the bands of a symmetry-reduced wavefunction
+(see expand_symm_wf_virtual).
+Bands are identified by their slot, and the coefficients of a slot
+are only evicted when no caller holds them (see acquire_coeffs).
+*/
+typedef struct coeff_cache {
+	int fd; ///< file descriptor of the WAVECAR, -1 for compact storage
+	long budget; ///< maximum number of bytes of coefficients held in memory
+	long used; ///< number of bytes of coefficients currently held in memory
+	int num_slots; ///< number of bands managed by the cache
+	long* offsets; ///< offset of the coefficient record of each slot in the WAVECAR
+	int* num_waves; ///< number of plane wave coefficients of each slot
+	float complex** coeffs; ///< coefficients of each slot, NULL if not in memory
+	int* pins; ///< number of outstanding acquire_coeffs calls for each slot
+	char* loading; ///< 1 while a thread is loading the coefficients of a slot, 0 otherwise
+	int* prev; ///< next more recently used loaded slot, -1 for the head
+	int* next; ///< next less recently used loaded slot, -1 for the tail
+	int head; ///< most recently used loaded slot
+	int tail; ///< least recently used loaded slot
+	void* lock; ///< omp_lock_t guarding the cache
+	int record_size; ///< bytes per coefficient in the WAVECAR (8 or 16 for double precision)
+	int storage; ///< format of compact, COEFF_FLOAT32 if slots are read from fd
+	unsigned short** compact; ///< compact coefficients of each slot, two per plane wave
+	float* scales; ///< scale of the compact coefficients of each slot
+	void** sources; ///< band_t each slot is generated from by a symmetry operation, NULL if the slots are not generated
+	symm_map_t** symm; ///< symmetry map of the k-point of each generated slot, NULL if the slots are not generated
+} coeff_cache_t;
+
+/**
+Region that many small allocations are carved from with arena_alloc
+and that is only freed as a whole, so allocating is a pointer bump
+and teardown costs one free per block rather than one per allocation.
+An arena is not thread safe: parallel loops allocate from the arena
+of their thread in a list made by make_arena_list.
+*/
+typedef struct arena {
+	char* block; ///< current block, which starts with a pointer to the previous block
+	long used; ///< bytes of block in use
+	long size; ///< size of block in bytes
+	long pad[5]; ///< pads the struct to 64 bytes, so the arenas of different threads do not share a cache line
+} arena_t;
+
+/**
+Results of overlap_setup_real and overlap_setup_recip that only depend
+on one pswf_t and on the sites it is projected onto, kept between calls
+so that a basis shared by many Projector setups only repeats the work
+for sites that change. A site is identified by a fingerprint of its
+ppot_t, by its fractional coordinates and by the FFT grid the
+projections were computed on; wave projections are indexed by
+band * nwk * nspin + kpoint. Entries that an overlap setup does not use
+are freed at its end, so the cache holds at most the sites and pairs
+of the last setup.
+*/
+typedef struct setup_cache {
+	int setup_count; ///< number of overlap setups that used the cache
+	int num_wp_sites; ///< number of sites with cached wave projections
+	int max_wp_sites; ///< allocated length of the wp_ arrays
+	unsigned long* wp_keys; ///< ppot_t fingerprint of each site
+	double* wp_coords; ///< fractional coordinates of each site
+	int* wp_fftg; ///< FFT grid the projections onto each site were computed on
+	int* wp_last_used; ///< setup_count of the last setup that used each site
+	projection_t** wp; ///< projections of every band onto the smooth partial waves of each site, one allocation per site
+	int num_pairs; ///< number of cached two-center overlaps
+	int max_pairs; ///< allocated length of the pair_ arrays
+	unsigned long* pair_keys; ///< ppot_t fingerprints of the two sites of each pair
+	double* pair_dcoords; ///< cartesian path between the two sites of each pair
+	int* pair_sizes; ///< number of values in each overlap matrix
+	int* pair_last_used; ///< setup_count of the last setup that used each pair
+	double complex** pair_overlaps; ///< <(phi1_i-phit1_i)|(phi2_j-phit2_j)> for each pair
+	int num_aug_sites; ///< number of sites the CAs of the bands were computed for, -1 if none
+	unsigned long* aug_keys; ///< ppot_t fingerprint of each of those sites
+	double* aug_coords; ///< fractional coordinates of each of those sites
+	int aug_fftg[3]; ///< FFT grid the CAs were computed on
+} setup_cache_t;
+
 /**
 Stores the data for a single
 band, or Kohn Sham single particle
@@ -92,6 +212,8 @@ typedef struct band {
 	projection_t* up_projections; ///< length==number of sites in structure
 	projection_t* down_projections; ///< length==number of sites in structure
 	projection_t* wave_projections; ///< used for offsite compensation terms
+	coeff_cache_t* cache; ///< if not NULL, Cs is unused and the coefficients are loaded through the cache
+	int cache_slot; ///< slot of the band in cache
 } band_t;
 
 typedef struct rayleigh_set {
@@ -108,6 +230,10 @@ typedef struct kpoint {
 	int num_bands; ///< number of bands
 	band_t** bands; ///< bands with this k-point
 	rayleigh_set_t** expansion;
+	float complex* coeffs; ///< num_bands x ld matrix of the Cs of all bands (see alloc_coeff_slab), NULL if each band owns its Cs
+	int ld; ///< leading dimension of coeffs, in coefficients
+	symm_map_t* symm; ///< if not NULL, the coefficients are generated from another k-point (see symm_map_t)
+	int gamma; ///< 1 if only half of the G-sphere is stored, as in a gamma-only WAVECAR (see gsphere_half_points)
 } kpoint_t;
 
 typedef struct pswf {
@@ -126,11 +252,22 @@ typedef struct pswf {
 	int* fftg; ///< FFT grid dimensions
 
 	int is_ncl; ///< 1 if noncollinear, 0 otherwise
+	int is_gamma; ///< 1 if read from a gamma-only WAVECAR, 0 otherwise
+	int fft_precision; ///< FFT_DOUBLE or FFT_SINGLE, precision of the transforms that project the bands onto the sites (see set_projection_precision)
 
 	int wp_num; ///< length==size of wave_projections in each band
 	int num_aug_overlap_sites; ///< used for Projector operations
 	double* dcoords; ///< used for Projector operations
 	double complex** overlaps; ///< used for Projector operations
+
+	char* wavecar_map; ///< memory-mapped WAVECAR that the band Cs point into, NULL if Cs are heap-allocated
+	long wavecar_map_size; ///< length of wavecar_map in bytes
+	coeff_cache_t* cache; ///< cache the band coefficients are loaded through, NULL if they are all in memory
+	arena_t* proj_arenas; ///< arenas holding the projections, up_projections and down_projections of the bands, NULL before they are set up
+	arena_t* wp_arenas; ///< arenas holding the wave_projections of the bands, NULL before they are set up
+	int num_proj_arenas; ///< length of proj_arenas
+	int num_wp_arenas; ///< length of wp_arenas
+	setup_cache_t* setup_cache; ///< overlap setup results kept between Projector setups, NULL before the first
 } pswf_t;
 
 typedef struct projgrid {
@@ -158,6 +295,25 @@ typedef struct real_proj_site {
 	real_proj_t* projs;
 } real_proj_site_t;
 
+/**
+Geometry of the plane wave cutoff sphere |k+G|^2 <= c*encut for
+a reciprocal lattice. It does not depend on k, so it is computed
+once with make_gsphere and shared by all k-points passed to
+gsphere_points.
+*/
+typedef struct gsphere {
+	double reclattice[9]; ///< reciprocal lattice vectors b1, b2, b3
+	double encut; ///< cutoff energy
+	double r2; ///< squared cutoff radius
+	double h3; ///< distance of b3 from the b1-b2 plane
+	double b11; ///< b1.b1
+	double b12; ///< b1.b2
+	double b13; ///< b1.b3
+	double u22; ///< b2.b2 with b2 projected perpendicular to b1
+	double u23; ///< b2.b3 with b2 and b3 projected perpendicular to b1
+	double u33; ///< b3.b3 with b3 projected perpendicular to b1
+} gsphere_t;
+
 void affine_transform(double* out, double* op, double* inv);
 
 void rotation_transform(double* out, double* op, double* inv);
@@ -196,6 +352,55 @@ precondition m is 3x3 (length 9) and in row major order.
 */
 double determinant(double* m);
 
+/**
+Returns the gsphere_t for the reciprocal lattice reclattice
+(row major) and the cutoff energy encut.
+*/
+gsphere_t make_gsphere(double* reclattice, double encut);
+
+/**
+Enumerates the G (in units of the reciprocal lattice vectors)
+with |k+G|^2 <= c*encut in the order of the plane waves in a
+WAVECAR: G[2] varies slowest and each component runs 0, 1, ...,
+max, min, ..., -1. The range of each row is computed from the
+cutoff ellipsoid, so points outside the sphere are not visited.
+The first max_points G are stored in igall (if it is not NULL)
+and G_bounds (if it is not NULL) is widened to contain all of them.
+Returns the number of G in the sphere.
+*/
+int gsphere_points(int* igall, int* G_bounds, gsphere_t* gs, double* k, int max_points);
+
+/**
+Same as gsphere_points at k=0 for the half of the G-sphere stored in
+a gamma-only WAVECAR: G[0] > 0, or G[0] == 0 and G[1] > 0, or
+G[0] == G[1] == 0 and G[2] >= 0, so G=0 comes first. This is the
+half VASP 5.2.12 and later write (older versions stored G[2] > 0
+first, which is not supported). The other half holds the conjugates
+of these coefficients, since the wavefunctions are real. As in VASP,
+the stored coefficients of G != 0 are sqrt(2) times C(G), which
+keeps the half sphere normalized. G_bounds is widened to contain -G
+as well.
+*/
+int gsphere_half_points(int* igall, int* G_bounds, gsphere_t* gs, int max_points);
+
+/**
+Returns sum_G conj(C1(G)) C2(G) over the whole G-sphere for two bands
+stored on the half sphere of a gamma-only WAVECAR. Since C(-G) = conj(C(G))
+and the stored coefficients of G != 0 are scaled by sqrt(2) (see
+gsphere_half_points), this is the real part of the half sphere sum,
+computed with one real dot product of length 2*num_waves.
+*/
+double gamma_dot(float complex* C1, float complex* C2, int num_waves);
+
+/**
+gamma_dot for all pairs of the m rows of A and the n rows of B
+(num_waves coefficients each, leading dimensions lda and ldb, in
+coefficients), computed with one real sgemm: out[i*n+j] is
+gamma_dot(B[j], A[i]).
+*/
+void gamma_gemm(int m, int n, int num_waves, float complex* A, int lda,
+	float complex* B, int ldb, float* out);
+
 /**
 Given
 coords1: fractional coordinate in lattice (length 3)
@@ -218,8 +423,32 @@ double complex trilinear_interpolate(double complex* c, double* frac, int* fftg)
 
 void free_projection_list(projection_t* projlist, int num);
 
+/**
+Frees the wave_projections of every band of wf, which are held in
+wf->wp_arenas, and sets them to NULL.
+*/
 void clean_wave_projections(pswf_t* wf);
 
+/**
+Frees a setup_cache_t and everything it holds.
+*/
+void free_setup_cache(setup_cache_t* cache);
+
+/**
+Allocates the plane wave coefficients of all bands of kpt as one
+64-byte-aligned num_bands x ld matrix, kpt->coeffs, and points the Cs
+of each band at its row. ld is num_waves rounded up to a multiple of
+8, so every row is 64-byte aligned too; the padding is zeroed.
+kpt->num_bands, kpt->num_waves and the band_t structs must be set.
+The matrix can be passed to BLAS routines as is, and free_kpoint
+frees it in one call.
+*/
+void alloc_coeff_slab(kpoint_t* kpt);
+
+/**
+Frees kpt and its bands. If kpt->coeffs is not NULL, the Cs of
+the bands are rows of it and are not freed separately.
+*/
 void free_kpoint(kpoint_t* kpt, int num_elems, int num_sites, int wp_num, int* num_projs);
 
 void free_ppot(ppot_t* pp);
@@ -236,6 +465,62 @@ void free_real_proj_site_list(real_proj_site_t* sites, int length);
 
 void free_ppot_list(ppot_t* pps, int length);
 
+/**
+Makes a list of num empty arenas, one for each thread of a parallel
+loop (see arena_t). The first block of an arena is allocated by the
+first arena_alloc call.
+*/
+arena_t* make_arena_list(int num);
+
+/**
+Returns size bytes from arena, aligned to 16 bytes. The memory
+is valid until the arena is freed.
+*/
+void* arena_alloc(arena_t* arena, long size);
+
+/**
+Frees every block of the num arenas in arenas, and the list.
+*/
+void free_arena_list(arena_t* arenas, int num);
+
+/**
+Makes an empty coefficient cache with num_slots slots. If storage
+is COEFF_FLOAT32, the slots are read from the file descriptor fd,
+which the cache takes ownership of, and whose coefficients are
+record_size (8 or 16) byte complex numbers. Otherwise fd is -1 and
+the slots are filled with store_compact_coeffs. At most budget bytes
+of decoded coefficients are kept in memory, except when more than
+that are acquired at once.
+*/
+coeff_cache_t* make_coeff_cache(int fd, int num_slots, long budget,
+	int record_size, int storage);
+
+/**
+Encodes the num_waves coefficients Cs in the compact format of the
+cache and stores them in slot. Cs is not modified or kept.
+*/
+void store_compact_coeffs(coeff_cache_t* cache, int slot, float complex* Cs, int num_waves);
+
+/**
+Returns the plane wave coefficients of band. If the band is lazily
+loaded, compact or generated by a symmetry operation, the coefficients
+are read from the WAVECAR, decoded or generated from the reference
+band if they are not already cached, and they stay in memory
+until the matching call to release_coeffs. Thread safe: the cache lock
+is only held to update the bookkeeping, so threads load different bands
+concurrently, and a thread that acquires a band another thread is
+loading waits for that load instead of repeating it.
+*/
+float complex* acquire_coeffs(band_t* band);
+
+/**
+Releases coefficients returned by acquire_coeffs so that they
+can be evicted from the cache.
+*/
+void release_coeffs(band_t* band);
+
+void free_coeff_cache(coeff_cache_t* cache);
+
 /**
 Returns a list with the occupation of each band
 of the wavefunction at each kpoint as shown:
@@ -257,6 +542,9 @@ int get_nspin(pswf_t* wf);
 /** Return whether wf is noncollinear. */
 int is_ncl(pswf_t* wf);
 
+/** Return whether wf was read from a gamma-only WAVECAR. */
+int is_gamma(pswf_t* wf);
+
 /** Return the encut of the plane-wave basis of the wavefunction. */
 double get_encut(pswf_t* wf);
 
@@ -348,6 +636,8 @@ Set up spline coefficients for spline interpolation.
 Essentially a translation into C of the VASP SPLCOF function.
 G. Kresse and J. Hafner. Ab initio molecular dynamics for liquid metals.
 Phys. Rev. B, 47:558, 1993.
+The three coefficient arrays share one allocation with the
+returned list, so the spline is freed with a single free.
 */
 double** spline_coeff(double* x, double* y, int N);
 
@@ -376,6 +666,17 @@ additional kpoints.
 pswf_t* expand_symm_wf(pswf_t* rwf, int num_kpts, int* maps,
 	double* ops, double* drs, double* kws, int* trs);
 
+/**
+Same as expand_symm_wf, but the coefficients of the new k-points are
+not stored. Each k-point only keeps a symm_map_t to its reference
+k-point in rwf, and the coefficients of a band are generated from the
+reference band when they are acquired (see acquire_coeffs). At most
+cache_budget bytes of generated coefficients are kept in memory.
+rwf must not be freed before the returned wavefunction.
+*/
+pswf_t* expand_symm_wf_virtual(pswf_t* rwf, int num_kpts, int* maps,
+	double* ops, double* drs, double* kws, int* trs, long cache_budget);
+
 /**
 Called after a malloc or calloc call to check that
 the allocation was successful.
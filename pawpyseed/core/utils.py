@@ -3,6 +3,8 @@
 
 import numpy as np
 import os
+import hashlib
+import struct
 
 class PAWpyError(Exception):
 	"""
@@ -40,3 +42,54 @@ def el(site):
 	site object
 	"""
 	return site.specie.symbol
+
+def wavecar_path(path):
+	"""
+	Returns the path of the WAVECAR in the VASP output directory
+	path: WAVECAR, or WAVECAR.gz or WAVECAR.bz2 if only a compressed
+	one exists (the reader decompresses them while reading).
+	"""
+	for name in ["WAVECAR", "WAVECAR.gz", "WAVECAR.bz2"]:
+		filepath = os.path.join(path, name)
+		if os.path.isfile(filepath):
+			return filepath
+	return os.path.join(path, "WAVECAR")
+
+def _file_signature(h, path):
+	"""
+	Updates the hash h with the size, modification time and inode
+	of the file at path and with its first records, without reading
+	the rest of the file. For a WAVECAR, these are the header record,
+	the header of the first k-point and the coefficients of its first
+	band; for other (e.g. compressed) files, the first 1 MB.
+	"""
+	stat = os.stat(path)
+	h.update(repr((stat.st_size, stat.st_mtime_ns, stat.st_ino)).encode('utf-8'))
+	with open(path, 'rb') as f:
+		head = f.read(8)
+		recl = int(struct.unpack('d', head)[0]) if len(head) == 8 else 0
+		if recl <= 0 or recl > stat.st_size:
+			recl = 1 << 20
+		h.update(head + f.read(3 * recl - len(head)))
+
+def input_hash(paths, options, signature_paths = ()):
+	"""
+	Returns a hexadecimal SHA-256 hash of the contents of the
+	files in paths, of the signatures of the files in
+	signature_paths and of repr(options). Used as the key of
+	cached data made from these files, so that the cache is
+	not used after any of its inputs changes.
+	Large files such as the WAVECAR belong in signature_paths,
+	which are identified by their size, modification time, inode
+	and first records (see _file_signature) instead of being
+	read in full, so that checking the key stays cheap.
+	"""
+	h = hashlib.sha256()
+	for path in paths:
+		with open(path, 'rb') as f:
+			for chunk in iter(lambda: f.read(1 << 24), b''):
+				h.update(chunk)
+	for path in signature_paths:
+		_file_signature(h, path)
+	h.update(repr(options).encode('utf-8'))
+	return h.hexdigest()
@@ -238,8 +238,29 @@ class Wavefunction(pawpyc.CWavefunction):
 		self.dim = np.array(dim, dtype=np.int32)
 		self.update_dimv(dim)
 
+	def set_fft_precision(self, precision):
+		"""
+		Sets the precision of the FFTs and real space sums that
+		project the bands onto the projector functions of the sites.
+		Single precision halves the memory traffic of these steps, and
+		changes the compensation terms of the overlaps by about 1e-7
+		relative to their size (see Projector.validate_precision).
+		Gamma-only wavefunctions are always projected in double precision.
+		If the projectors are already set up, the projections are
+		recomputed, and Projectors using this Wavefunction must call
+		setup_overlap again.
+
+		Arguments:
+			precision (str): 'single' or 'double'
+		"""
+		if precision not in ("single", "double"):
+			raise PAWpyError("precision must be 'single' or 'double'")
+		single = precision == "single"
+		if single != self.single_precision:
+			self._set_fft_precision(single)
+
 	def desymmetrized_copy(self, allkpts=None, weights=None, symprec=None,
-							time_reversal_symmetry=True):
+							time_reversal_symmetry=True, virtual_budget=None):
 		"""
 		Returns a copy of self with a k-point mesh that is not reduced
 		using crystal symmetry.
@@ -254,18 +275,34 @@ class Wavefunction(pawpyc.CWavefunction):
 				If None, the symmetry precision used to generate the
 				Wavefunction will be used (the default).
 			time_reversal_symmetry: Whether time reversal symmetry is used.
-		"""
+			virtual_budget (int, None): If not None, the plane wave
+				coefficients of the new k-points are not stored. Instead,
+				they are generated from the coefficients of self when they
+				are needed, and at most virtual_budget bytes of them are
+				kept in memory, so the copy takes about as much memory as
+				its plane wave lists rather than a copy of every band at
+				every k-point. self is kept alive by the copy.
+			A gamma-only Wavefunction has no reduced k-point mesh to
+			expand, so it is returned as it is if allkpts is None or
+			only contains the gamma point.
+		"""
+		if self.gamma:
+			if allkpts is not None and np.linalg.norm(allkpts) > 1e-10:
+				raise PAWpyError("Gamma-only wavefunctions cannot be mapped onto other k-points!")
+			return self
 		if not symprec:
 			symprec = self.symprec
 
 		pwf = self._desymmetrized_pwf(self.structure, self.band_props, allkpts, weights,
-										symprec, time_reversal_symmetry)
+										symprec, time_reversal_symmetry, virtual_budget)
 		new_wf = Wavefunction(self.structure, pwf, self.cr, self.dim, symprec=symprec)
 		return new_wf
 
 	@staticmethod
 	def from_files(struct="CONTCAR", wavecar="WAVECAR", cr="POTCAR",
-		vr="vasprun.xml", setup_projectors=False):
+		vr="vasprun.xml", setup_projectors=False, use_mmap=False,
+		cache_budget=None, bands=None, kpoints=None, spin=None,
+		energy_window=None, cache_path=None, coeff_storage=None):
 		"""
 		Construct a Wavefunction object from file paths.
 
@@ -279,6 +316,41 @@ class Wavefunction(pawpyc.CWavefunction):
 				components of the wavefunctions. Pawpyseed will set up the projectors
 				automatically when they are first needed, so this generally
 				can be left as False.
+			use_mmap (bool, False): Whether to memory-map the WAVECAR instead
+				of copying the plane wave coefficients into memory. Useful
+				when many processes read the same large WAVECAR. Ignored
+				for compressed WAVECARs.
+			cache_budget (int, None): If not None, the plane wave coefficients
+				of each band are only read from the WAVECAR when they are
+				needed, and at most cache_budget bytes of them are kept in
+				memory at once. Useful when the WAVECAR does not fit in memory
+				but only a few bands are analyzed. Ignored for compressed
+				WAVECARs and when use_mmap is True.
+			bands ((int, int), None): If not None, only bands bands[0]
+				to bands[1]-1 are read. Band indices of the Wavefunction
+				then count from bands[0].
+			kpoints (list of int, None): If not None, only these k-points
+				are read, and k-point indices of the Wavefunction count
+				the selected k-points in increasing order. Such a
+				Wavefunction cannot be desymmetrized.
+			spin (int, None): If not None, only this spin channel is read.
+			energy_window ((float, float), None): If not None, only the
+				smallest range of bands containing all eigenvalues between
+				energy_window[0] and energy_window[1] (in eV, relative to
+				the Fermi level) is read. Cannot be combined with bands.
+			cache_path (str, None): If not None, the Wavefunction is loaded
+				from this pawpyseed cache file if it was made from the same
+				input files and WAVECAR subset, which skips reading the
+				WAVECAR and vasprun and setting up the projectors.
+				Otherwise, the Wavefunction is read with its projectors
+				set up and stored in cache_path for the next run.
+			coeff_storage (str, None): If 'float16' or 'bfloat16', the plane
+				wave coefficients are stored in memory in that 16-bit format,
+				which halves their memory, and decoded when needed. At most
+				cache_budget bytes of decoded coefficients are kept. Overlaps
+				of normalized bands change by at most about 5e-4 (float16)
+				or 4e-3 (bfloat16), see check_coeff_storage. Also applies
+				to Wavefunctions loaded from cache_path.
 
 		Returns:
 			Wavefunction object
@@ -286,19 +358,41 @@ class Wavefunction(pawpyc.CWavefunction):
 		for fname in [struct, wavecar, cr, vr]:
 			if not os.path.isfile(fname):
 				raise FileNotFoundError("File {} does not exist.".format(fname))
+		if cache_path is not None:
+			key = input_hash([struct, cr, vr],
+				[bands, kpoints, spin, energy_window, coeff_storage], [wavecar])
+			pwf, extra = pawpyc.PWFPointer.from_cache(cache_path, key,
+				cache_budget, coeff_storage)
+			if pwf is not None:
+				wf = Wavefunction(Poscar.from_file(struct).structure,
+					pwf, CoreRegion(Potcar.from_file(cr)),
+					extra[:3], extra[3])
+				wf._restore_c_projectors()
+				return wf
+			setup_projectors = True
 		vr = Vasprun(vr)
 		dim = np.array([vr.parameters["NGX"], vr.parameters["NGY"], vr.parameters["NGZ"]])
 		symprec = vr.parameters["SYMPREC"]
-		pwf = pawpyc.PWFPointer(wavecar, vr)
-		return Wavefunction(Poscar.from_file(struct).structure,
+		pwf = pawpyc.PWFPointer(wavecar, vr, use_mmap, cache_budget,
+			bands, kpoints, spin, energy_window, coeff_storage)
+		wf = Wavefunction(Poscar.from_file(struct).structure,
 			pwf, CoreRegion(Potcar.from_file(cr)),
 			dim, symprec, setup_projectors)
+		if cache_path is not None:
+			pps, nums, coords, grid_encut = wf._c_projector_inputs()
+			if not wf._write_cache(cache_path, key, wf.band_props, grid_encut,
+					np.append(wf.dim, wf.symprec)):
+				print("Could not write cache {}".format(cache_path))
+		return wf
 
 	@staticmethod
-	def from_directory(path, setup_projectors = False):
+	def from_directory(path, setup_projectors = False, use_mmap = False,
+		cache_budget = None, bands = None, kpoints = None, spin = None,
+		energy_window = None, cache_path = None, coeff_storage = None):
 		"""
 		Assumes VASP output has the default filenames and is located
-		in the directory specificed by path.
+		in the directory specificed by path. The WAVECAR may be
+		gzipped or bzipped (see wavecar_path).
 
 		Arguments:
 			path (str): VASP output directory
@@ -306,6 +400,16 @@ class Wavefunction(pawpyc.CWavefunction):
 				components of the wavefunctions. Pawpyseed will set up the projectors
 				automatically when they are first needed, so this generally
 				can be left as False.
+			use_mmap (bool, False): Whether to memory-map the WAVECAR,
+				see Wavefunction.from_files
+			cache_budget (int, None): Memory budget in bytes for lazily
+				loaded band coefficients, see Wavefunction.from_files
+			bands, kpoints, spin, energy_window: Subset of the WAVECAR
+				to read, see Wavefunction.from_files
+			cache_path (str, None): pawpyseed cache file to load the
+				Wavefunction from or store it in, see Wavefunction.from_files
+			coeff_storage (str, None): 16-bit storage format of the plane
+				wave coefficients, see Wavefunction.from_files
 
 		Returns:
 			Wavefunction object
@@ -313,7 +417,9 @@ class Wavefunction(pawpyc.CWavefunction):
 		filepaths = []
 		for d in ["CONTCAR", "WAVECAR", "POTCAR", "vasprun.xml"]:
 			filepaths.append(str(os.path.join(path, d)))
-		args = filepaths + [setup_projectors]
+		filepaths[1] = str(wavecar_path(path))
+		args = filepaths + [setup_projectors, use_mmap, cache_budget,
+			bands, kpoints, spin, energy_window, cache_path, coeff_storage]
 		return Wavefunction.from_files(*args)
 
 	@staticmethod
@@ -356,15 +462,18 @@ class Wavefunction(pawpyc.CWavefunction):
 
 		return wf
 
-	def _make_c_projectors(self):
-		"""
-		Uses the CoreRegion objects in self
-		to construct C representations of the projectors and partial waves
-		for a structure. Also assigns numerical labels for each element and
-		setups up a list of indices and positions which can be easily converted
-		to C lists for projection routines.
+	def _c_projector_inputs(self):
 		"""
+		Assigns numerical labels for each element and sets up a list
+		of indices and positions which can be easily converted to C lists
+		for projection routines.
 
+		Returns:
+			pps (dict): Pseudopotential for each element label
+			nums (np.ndarray): element label of each site
+			coords (np.ndarray): flattened fractional coordinates of the sites
+			grid_encut (float): cutoff energy of the FFT grid
+		"""
 		pps = {}
 		labels = {}
 		label = 0
@@ -375,17 +484,39 @@ class Wavefunction(pawpyc.CWavefunction):
 
 		nums = np.array([labels[el(s)] for s in self.structure], dtype=np.int32)
 		coords = np.array([], dtype = np.float64)
-
-		self.num_sites = len(self.structure)
-		self.num_elems = len(pps)
 		for s in self.structure:
 			coords = np.append(coords, s.frac_coords)
 
 		grid_encut = (np.pi * self.dim / self.structure.lattice.abc)**2 / 0.262
+		return pps, nums, coords, max(grid_encut)
 
-		self._c_projector_setup(self.num_elems, self.num_sites, max(grid_encut),
+	def _make_c_projectors(self):
+		"""
+		Uses the CoreRegion objects in self
+		to construct C representations of the projectors and partial waves
+		for a structure.
+		"""
+		pps, nums, coords, grid_encut = self._c_projector_inputs()
+
+		self.num_sites = len(self.structure)
+		self.num_elems = len(pps)
+
+		self._c_projector_setup(self.num_elems, self.num_sites, grid_encut,
 								nums, coords, self.dim, pps)
 
+	def _restore_c_projectors(self):
+		"""
+		Counterpart of _make_c_projectors for a Wavefunction loaded
+		from a cache, whose projectors and projections are already
+		set up in C.
+		"""
+		pps, nums, coords, grid_encut = self._c_projector_inputs()
+
+		self.num_sites = len(self.structure)
+		self.num_elems = len(pps)
+
+		self._restore_c_projector_setup(self.num_elems, nums, coords, self.dim)
+
 	def check_c_projectors(self):
 		"""
 		Check to see if the projector functions have been read in and set up.
@@ -567,3 +698,37 @@ class Wavefunction(pawpyc.CWavefunction):
 			symprec = self.symprec
 		return pawpy_symm.get_kpt_mapping(allkpts, self.kpts, self.structure,
 										symprec, gen_trsym)
+
+
+def check_coeff_storage(path, coeff_storage, bands=None):
+	"""
+	Validates a compact coefficient storage format on the VASP output
+	in the directory path by comparing the pseudoprojections of the
+	bands of the Wavefunction read with coeff_storage onto the bands
+	read in single precision.
+
+	Arguments:
+		path (str): VASP output directory
+		coeff_storage (str): 'float16' or 'bfloat16'
+		bands (list of int, None): bands to project, all bands if None
+
+	Returns:
+		(float, float): the largest absolute error of the overlaps
+			and the bound on it for normalized bands (see COEFF_FLOAT16
+			in utils.h)
+	"""
+	bounds = {'float16': 2.0**-11, 'bfloat16': 2.0**-8}
+	basis = Wavefunction.from_directory(path, False)
+	wf = Wavefunction.from_directory(path, False, coeff_storage=coeff_storage)
+	if bands is None:
+		bands = range(basis.nband)
+	err = 0
+	for b in bands:
+		ref = basis.pseudoprojection(b, basis)
+		res = wf.pseudoprojection(b, basis)
+		err = max(err, np.max(np.abs(res - ref)))
+	bound = bounds[coeff_storage]
+	if coeff_storage == 'float16':
+		# subnormal term, the FFT grid bounds the number of plane waves
+		bound += np.sqrt(2 * np.prod(basis.dim)) * 2.0**-25
+	return err, bound
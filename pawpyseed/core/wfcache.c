@@ -0,0 +1,524 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <complex.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "projector.h"
+#include "wfcache.h"
+
+#define WFCACHE_MAGIC "PAWPYWF"
+#define WFCACHE_ALIGN 64
+
+typedef struct wfcache_header {
+	char magic[8];
+	int version;
+	char key[WFCACHE_KEY_SIZE];
+	int nspin;
+	int nwk;
+	int nband;
+	int is_ncl;
+	int is_gamma;
+	int num_sites;
+	int num_elems;
+	int has_projections;
+	int num_meta;
+	double encut;
+	double grid_encut;
+	double lattice[9];
+	double reclattice[9];
+	int G_bounds[6];
+	int fftg[3];
+	long coeff_offset;
+	long size;
+} wfcache_header_t;
+
+static int write_items(void* ptr, size_t size, size_t nmemb, FILE* fp) {
+	if (nmemb == 0) return 0;
+	return fwrite(ptr, size, nmemb, fp) != nmemb;
+}
+
+static int write_projection_list(projection_t* projections, int num_sites, FILE* fp) {
+	int err = 0;
+	for (int s = 0; s < num_sites; s++) {
+		projection_t* proj = projections + s;
+		err |= write_items(&proj->num_projs, sizeof(int), 1, fp);
+		err |= write_items(&proj->total_projs, sizeof(int), 1, fp);
+		err |= write_items(proj->ns, sizeof(int), proj->total_projs, fp);
+		err |= write_items(proj->ls, sizeof(int), proj->total_projs, fp);
+		err |= write_items(proj->ms, sizeof(int), proj->total_projs, fp);
+		err |= write_items(proj->overlaps, sizeof(double complex), proj->total_projs, fp);
+	}
+	return err;
+}
+
+int write_wfcache(char* filename, char* key, pswf_t* wf,
+	double grid_encut, double* meta, int num_meta) {
+
+	if (strlen(key) >= WFCACHE_KEY_SIZE) {
+		return -1;
+	}
+	char* tmpname = (char*) malloc(strlen(filename) + 32);
+	CHECK_ALLOCATION(tmpname);
+	sprintf(tmpname, "%s.tmp%ld", filename, (long) getpid());
+	FILE* fp = fopen(tmpname, "wb");
+	if (fp == NULL) {
+		free(tmpname);
+		return -1;
+	}
+
+	int nkpts = wf->nwk * wf->nspin;
+	// single precision projections are not stored, so that a cache
+	// always gives the projections of the double precision path
+	int has_projections = wf->pps != NULL && wf->fftg != NULL
+		&& wf->kpts[0]->bands[0]->projections != NULL
+		&& wf->fft_precision == FFT_DOUBLE;
+	wfcache_header_t hdr;
+	memset(&hdr, 0, sizeof(wfcache_header_t));
+	strcpy(hdr.magic, WFCACHE_MAGIC);
+	hdr.version = WFCACHE_VERSION;
+	strcpy(hdr.key, key);
+	hdr.nspin = wf->nspin;
+	hdr.nwk = wf->nwk;
+	hdr.nband = wf->nband;
+	hdr.is_ncl = wf->is_ncl;
+	hdr.is_gamma = wf->is_gamma;
+	hdr.num_sites = has_projections ? wf->num_sites : 0;
+	hdr.num_elems = has_projections ? wf->num_elems : 0;
+	hdr.has_projections = has_projections;
+	hdr.num_meta = num_meta;
+	hdr.encut = wf->encut;
+	hdr.grid_encut = grid_encut;
+	for (int i = 0; i < 9; i++) {
+		hdr.lattice[i] = wf->lattice[i];
+		hdr.reclattice[i] = wf->reclattice[i];
+	}
+	for (int i = 0; i < 6; i++) {
+		hdr.G_bounds[i] = wf->G_bounds[i];
+	}
+	for (int i = 0; has_projections && i < 3; i++) {
+		hdr.fftg[i] = wf->fftg[i];
+	}
+
+	// the header is written again once the offsets are known
+	int err = write_items(&hdr, sizeof(wfcache_header_t), 1, fp);
+	err |= write_items(meta, sizeof(double), num_meta, fp);
+
+	for (int p = 0; p < hdr.num_elems; p++) {
+		ppot_t* pp = wf->pps + p;
+		err |= write_items(&pp->num_projs, sizeof(int), 1, fp);
+		err |= write_items(&pp->proj_gridsize, sizeof(int), 1, fp);
+		err |= write_items(&pp->wave_gridsize, sizeof(int), 1, fp);
+		err |= write_items(&pp->rmax, sizeof(double), 1, fp);
+		for (int k = 0; k < pp->num_projs; k++) {
+			err |= write_items(&pp->funcs[k].l, sizeof(int), 1, fp);
+		}
+		err |= write_items(pp->wave_grid, sizeof(double), pp->wave_gridsize, fp);
+		for (int k = 0; k < pp->num_projs; k++) {
+			err |= write_items(pp->funcs[k].proj, sizeof(double), pp->proj_gridsize, fp);
+			err |= write_items(pp->funcs[k].aewave, sizeof(double), pp->wave_gridsize, fp);
+			err |= write_items(pp->funcs[k].pswave, sizeof(double), pp->wave_gridsize, fp);
+		}
+	}
+
+	for (int i = 0; i < nkpts; i++) {
+		kpoint_t* kpt = wf->kpts[i];
+		err |= write_items(&kpt->num_waves, sizeof(int), 1, fp);
+		err |= write_items(&kpt->num_bands, sizeof(int), 1, fp);
+		err |= write_items(kpt->k, sizeof(double), 3, fp);
+		err |= write_items(&kpt->weight, sizeof(double), 1, fp);
+		err |= write_items(kpt->Gs, sizeof(int), 3 * kpt->num_waves, fp);
+		for (int b = 0; b < kpt->num_bands; b++) {
+			band_t* band = kpt->bands[b];
+			err |= write_items(&band->n, sizeof(int), 1, fp);
+			err |= write_items(&band->energy, sizeof(double), 1, fp);
+			err |= write_items(&band->occ, sizeof(double), 1, fp);
+			if (has_projections) {
+				err |= write_projection_list(band->projections, hdr.num_sites, fp);
+				if (hdr.is_ncl) {
+					err |= write_projection_list(band->up_projections, hdr.num_sites, fp);
+					err |= write_projection_list(band->down_projections, hdr.num_sites, fp);
+				}
+			}
+		}
+	}
+
+	long pos = ftell(fp);
+	hdr.coeff_offset = (pos + WFCACHE_ALIGN - 1) / WFCACHE_ALIGN * WFCACHE_ALIGN;
+	char padding[WFCACHE_ALIGN] = {0};
+	err |= write_items(padding, 1, hdr.coeff_offset - pos, fp);
+	for (int i = 0; i < nkpts; i++) {
+		kpoint_t* kpt = wf->kpts[i];
+		for (int b = 0; b < kpt->num_bands; b++) {
+			float complex* Cs = acquire_coeffs(kpt->bands[b]);
+			err |= write_items(Cs, sizeof(float complex), kpt->num_waves, fp);
+			release_coeffs(kpt->bands[b]);
+		}
+	}
+	hdr.size = ftell(fp);
+
+	err |= fseek(fp, 0, SEEK_SET) != 0;
+	err |= write_items(&hdr, sizeof(wfcache_header_t), 1, fp);
+	err |= fclose(fp) != 0;
+	if (err == 0) {
+		err = rename(tmpname, filename) != 0;
+	}
+	if (err) {
+		remove(tmpname);
+	}
+	free(tmpname);
+	return err ? -1 : 0;
+}
+
+/*
+Advances *p by size bytes if that stays before end,
+returns 0 (leaving *p unchanged) otherwise.
+*/
+static int skip_bytes(char** p, char* end, long size) {
+	if (size < 0 || end - *p < size) return 0;
+	*p += size;
+	return 1;
+}
+
+static int peek_int(char* p) {
+	int val;
+	memcpy(&val, p, sizeof(int));
+	return val;
+}
+
+/*
+Checks that the sizes stored in the cache are consistent with
+its length, so that read_wfcache can read it without bounds checks.
+*/
+static int wfcache_consistent(char* start, wfcache_header_t* hdr) {
+	if (hdr->coeff_offset < (long) sizeof(wfcache_header_t)
+		|| hdr->coeff_offset > hdr->size || hdr->num_meta < 0
+		|| hdr->nspin < 1 || hdr->nwk < 1 || hdr->nband < 1
+		|| hdr->num_elems < 0 || hdr->num_sites < 0) {
+		return 0;
+	}
+	char* p = start + sizeof(wfcache_header_t);
+	char* end = start + hdr->coeff_offset;
+	if (!skip_bytes(&p, end, hdr->num_meta * (long) sizeof(double))) return 0;
+	for (int e = 0; e < hdr->num_elems; e++) {
+		char* q = p;
+		if (!skip_bytes(&p, end, 3 * sizeof(int) + sizeof(double))) return 0;
+		long num_projs = peek_int(q);
+		long proj_gridsize = peek_int(q + sizeof(int));
+		long wave_gridsize = peek_int(q + 2 * sizeof(int));
+		if (num_projs < 1 || proj_gridsize < 1 || wave_gridsize < 2) return 0;
+		if (!skip_bytes(&p, end, num_projs * sizeof(int)
+			+ wave_gridsize * sizeof(double)
+			+ num_projs * (proj_gridsize + 2 * wave_gridsize) * sizeof(double))) return 0;
+	}
+	int num_sets = hdr->has_projections ? (hdr->is_ncl ? 3 : 1) : 0;
+	long num_coeffs = 0;
+	for (int i = 0; i < hdr->nwk * hdr->nspin; i++) {
+		char* q = p;
+		if (!skip_bytes(&p, end, 2 * sizeof(int) + 4 * sizeof(double))) return 0;
+		long num_waves = peek_int(q);
+		long num_bands = peek_int(q + sizeof(int));
+		if (num_waves < 1 || num_bands != hdr->nband) return 0;
+		if (!skip_bytes(&p, end, 3 * num_waves * sizeof(int))) return 0;
+		for (int b = 0; b < num_bands; b++) {
+			if (!skip_bytes(&p, end, sizeof(int) + 2 * sizeof(double))) return 0;
+			for (int s = 0; s < num_sets * hdr->num_sites; s++) {
+				q = p;
+				if (!skip_bytes(&p, end, 2 * sizeof(int))) return 0;
+				long total_projs = peek_int(q + sizeof(int));
+				if (!skip_bytes(&p, end, total_projs * (3 * sizeof(int)
+					+ sizeof(double complex)))) return 0;
+			}
+		}
+		num_coeffs += num_waves * num_bands;
+	}
+	return hdr->size == hdr->coeff_offset + num_coeffs * (long) sizeof(float complex);
+}
+
+static int read_wfcache_header(FILE* fp, char* key, wfcache_header_t* hdr) {
+	if (fread(hdr, sizeof(wfcache_header_t), 1, fp) != 1) return 0;
+	if (strncmp(hdr->magic, WFCACHE_MAGIC, 8) != 0) return 0;
+	if (hdr->version != WFCACHE_VERSION) return 0;
+	if (strncmp(hdr->key, key, WFCACHE_KEY_SIZE) != 0) return 0;
+	struct stat st;
+	if (fstat(fileno(fp), &st) != 0 || (long) st.st_size != hdr->size) return 0;
+	return 1;
+}
+
+int wfcache_num_meta(char* filename, char* key) {
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		return -1;
+	}
+	wfcache_header_t hdr;
+	int found = read_wfcache_header(fp, key, &hdr);
+	fclose(fp);
+	return found ? hdr.num_meta : -1;
+}
+
+static void* copy_next(char** p, long size) {
+	void* dst = malloc(size > 0 ? size : 1);
+	CHECK_ALLOCATION(dst);
+	memcpy(dst, *p, size);
+	*p += size;
+	return dst;
+}
+
+static int next_int(char** p) {
+	int val = peek_int(*p);
+	*p += sizeof(int);
+	return val;
+}
+
+static double next_double(char** p) {
+	double val;
+	memcpy(&val, *p, sizeof(double));
+	*p += sizeof(double);
+	return val;
+}
+
+static void* arena_copy_next(char** p, long size, arena_t* arena) {
+	void* val = arena_alloc(arena, size);
+	memcpy(val, *p, size);
+	*p += size;
+	return val;
+}
+
+static projection_t* read_projection_list(char** p, int num_sites, arena_t* arena) {
+	projection_t* projections = (projection_t*) arena_alloc(arena,
+		num_sites * sizeof(projection_t));
+	for (int s = 0; s < num_sites; s++) {
+		projection_t* proj = projections + s;
+		proj->num_projs = next_int(p);
+		proj->total_projs = next_int(p);
+		proj->ns = (int*) arena_copy_next(p, proj->total_projs * sizeof(int), arena);
+		proj->ls = (int*) arena_copy_next(p, proj->total_projs * sizeof(int), arena);
+		proj->ms = (int*) arena_copy_next(p, proj->total_projs * sizeof(int), arena);
+		proj->overlaps = (double complex*) arena_copy_next(p,
+			proj->total_projs * sizeof(double complex), arena);
+	}
+	return projections;
+}
+
+pswf_t* read_wfcache(char* filename, char* key, double* meta,
+	long cache_budget, int storage) {
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		return NULL;
+	}
+	wfcache_header_t hdr;
+	if (!read_wfcache_header(fp, key, &hdr)) {
+		fclose(fp);
+		return NULL;
+	}
+	// MAP_PRIVATE as in read_wavefunctions_mapped, so the coefficients
+	// can be used in place and are shared with the page cache
+	char* start = (char*) mmap(NULL, hdr.size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE, fileno(fp), 0);
+	fclose(fp);
+	if ((void*) start == MAP_FAILED) {
+		return NULL;
+	}
+	if (!wfcache_consistent(start, &hdr)) {
+		printf("ERROR: inconsistent pawpyseed cache %s\n", filename);
+		munmap(start, hdr.size);
+		return NULL;
+	}
+
+	char* p = start + sizeof(wfcache_header_t);
+	memcpy(meta, p, hdr.num_meta * sizeof(double));
+	p += hdr.num_meta * sizeof(double);
+
+	pswf_t* wf = (pswf_t*) malloc(sizeof(pswf_t));
+	CHECK_ALLOCATION(wf);
+	wf->encut = hdr.encut;
+	wf->num_elems = hdr.num_elems;
+	wf->num_projs = NULL;
+	wf->num_sites = hdr.num_sites;
+	wf->pps = NULL;
+	wf->nspin = hdr.nspin;
+	wf->nband = hdr.nband;
+	wf->nwk = hdr.nwk;
+	wf->is_ncl = hdr.is_ncl;
+	wf->is_gamma = hdr.is_gamma;
+	wf->fft_precision = FFT_DOUBLE;
+	wf->fftg = NULL;
+	wf->wp_num = 0;
+	wf->num_aug_overlap_sites = 0;
+	wf->dcoords = NULL;
+	wf->overlaps = NULL;
+	wf->wavecar_map = start;
+	wf->wavecar_map_size = hdr.size;
+	wf->cache = NULL;
+	wf->proj_arenas = NULL;
+	wf->wp_arenas = NULL;
+	wf->num_proj_arenas = 0;
+	wf->num_wp_arenas = 0;
+	wf->setup_cache = NULL;
+	if (hdr.has_projections) {
+		wf->num_proj_arenas = 1;
+		wf->proj_arenas = make_arena_list(1);
+	}
+	wf->lattice = (double*) malloc(9 * sizeof(double));
+	wf->reclattice = (double*) malloc(9 * sizeof(double));
+	wf->G_bounds = (int*) malloc(6 * sizeof(int));
+	CHECK_ALLOCATION(wf->lattice);
+	CHECK_ALLOCATION(wf->reclattice);
+	CHECK_ALLOCATION(wf->G_bounds);
+	memcpy(wf->lattice, hdr.lattice, 9 * sizeof(double));
+	memcpy(wf->reclattice, hdr.reclattice, 9 * sizeof(double));
+	memcpy(wf->G_bounds, hdr.G_bounds, 6 * sizeof(int));
+
+	// concatenate the projector tables in the layout
+	// expected by get_projector_list
+	int* labels = (int*) malloc((4 * hdr.num_elems + 1) * sizeof(int));
+	double* rmaxs = (double*) malloc((hdr.num_elems + 1) * sizeof(double));
+	CHECK_ALLOCATION(labels);
+	CHECK_ALLOCATION(rmaxs);
+	long num_ls = 0, num_grid = 0, num_proj = 0, num_wave = 0;
+	char* q = p;
+	for (int e = 0; e < hdr.num_elems; e++) {
+		int num_projs = next_int(&q);
+		int proj_gridsize = next_int(&q);
+		int wave_gridsize = next_int(&q);
+		q += sizeof(double) + num_projs * sizeof(int) + wave_gridsize * sizeof(double)
+			+ num_projs * (proj_gridsize + 2 * wave_gridsize) * sizeof(double);
+		num_ls += num_projs;
+		num_grid += wave_gridsize;
+		num_proj += num_projs * proj_gridsize;
+		num_wave += num_projs * wave_gridsize;
+	}
+	int* ls = (int*) malloc((num_ls + 1) * sizeof(int));
+	double* wave_grids = (double*) malloc((num_grid + 1) * sizeof(double));
+	double* projectors = (double*) malloc((num_proj + 1) * sizeof(double));
+	double* aewaves = (double*) malloc((num_wave + 1) * sizeof(double));
+	double* pswaves = (double*) malloc((num_wave + 1) * sizeof(double));
+	CHECK_ALLOCATION(ls);
+	CHECK_ALLOCATION(wave_grids);
+	CHECK_ALLOCATION(projectors);
+	CHECK_ALLOCATION(aewaves);
+	CHECK_ALLOCATION(pswaves);
+	num_ls = num_grid = num_proj = num_wave = 0;
+	for (int e = 0; e < hdr.num_elems; e++) {
+		int num_projs = next_int(&p);
+		int proj_gridsize = next_int(&p);
+		int wave_gridsize = next_int(&p);
+		labels[4*e+0] = e;
+		labels[4*e+1] = num_projs;
+		labels[4*e+2] = proj_gridsize;
+		labels[4*e+3] = wave_gridsize;
+		rmaxs[e] = next_double(&p);
+		memcpy(ls + num_ls, p, num_projs * sizeof(int));
+		p += num_projs * sizeof(int);
+		num_ls += num_projs;
+		memcpy(wave_grids + num_grid, p, wave_gridsize * sizeof(double));
+		p += wave_gridsize * sizeof(double);
+		num_grid += wave_gridsize;
+		for (int k = 0; k < num_projs; k++) {
+			memcpy(projectors + num_proj, p, proj_gridsize * sizeof(double));
+			p += proj_gridsize * sizeof(double);
+			num_proj += proj_gridsize;
+			memcpy(aewaves + num_wave, p, wave_gridsize * sizeof(double));
+			p += wave_gridsize * sizeof(double);
+			memcpy(pswaves + num_wave, p, wave_gridsize * sizeof(double));
+			p += wave_gridsize * sizeof(double);
+			num_wave += wave_gridsize;
+		}
+	}
+
+	int nkpts = hdr.nwk * hdr.nspin;
+	wf->kpts = (kpoint_t**) malloc(nkpts * sizeof(kpoint_t*));
+	CHECK_ALLOCATION(wf->kpts);
+	if (storage != COEFF_FLOAT32) {
+		wf->cache = make_coeff_cache(-1, nkpts * hdr.nband, cache_budget,
+			sizeof(float complex), storage);
+	}
+	char* coeffs = start + hdr.coeff_offset;
+	for (int i = 0; i < nkpts; i++) {
+		kpoint_t* kpt = (kpoint_t*) malloc(sizeof(kpoint_t));
+		CHECK_ALLOCATION(kpt);
+		kpt->up = 0;
+		kpt->expansion = NULL;
+		kpt->coeffs = NULL;
+		kpt->ld = 0;
+		kpt->symm = NULL;
+		// a gamma-only run only has k-points at gamma
+		kpt->gamma = hdr.is_gamma;
+		kpt->num_waves = next_int(&p);
+		kpt->num_bands = next_int(&p);
+		kpt->k = (double*) copy_next(&p, 3 * sizeof(double));
+		kpt->weight = next_double(&p);
+		kpt->Gs = (int*) copy_next(&p, 3 * kpt->num_waves * sizeof(int));
+		kpt->bands = (band_t**) malloc(kpt->num_bands * sizeof(band_t*));
+		CHECK_ALLOCATION(kpt->bands);
+		for (int b = 0; b < kpt->num_bands; b++) {
+			band_t* band = (band_t*) malloc(sizeof(band_t));
+			CHECK_ALLOCATION(band);
+			band->n = next_int(&p);
+			band->energy = next_double(&p);
+			band->occ = next_double(&p);
+			band->num_waves = kpt->num_waves;
+			band->Cs = (float complex*) coeffs;
+			coeffs += kpt->num_waves * sizeof(float complex);
+			band->CRs = NULL;
+			band->CAs = NULL;
+			band->projections = NULL;
+			band->up_projections = NULL;
+			band->down_projections = NULL;
+			band->wave_projections = NULL;
+			band->cache = NULL;
+			band->cache_slot = -1;
+			if (wf->cache != NULL) {
+				// the coefficients are recompacted as when
+				// reading a WAVECAR with this storage
+				band->cache = wf->cache;
+				band->cache_slot = i * hdr.nband + b;
+				store_compact_coeffs(wf->cache, band->cache_slot,
+					band->Cs, band->num_waves);
+				band->Cs = NULL;
+			}
+			if (hdr.has_projections) {
+				band->projections = read_projection_list(&p, hdr.num_sites,
+					wf->proj_arenas);
+				if (hdr.is_ncl) {
+					band->up_projections = read_projection_list(&p, hdr.num_sites,
+						wf->proj_arenas);
+					band->down_projections = read_projection_list(&p, hdr.num_sites,
+						wf->proj_arenas);
+				}
+			}
+			kpt->bands[b] = band;
+		}
+		wf->kpts[i] = kpt;
+	}
+	if (wf->cache != NULL) {
+		// everything else was copied out of the mapping
+		munmap(wf->wavecar_map, wf->wavecar_map_size);
+		wf->wavecar_map = NULL;
+		wf->wavecar_map_size = 0;
+	}
+
+	if (hdr.has_projections) {
+		wf->fftg = (int*) malloc(3 * sizeof(int));
+		CHECK_ALLOCATION(wf->fftg);
+		memcpy(wf->fftg, hdr.fftg, 3 * sizeof(int));
+		wf->pps = get_projector_list(hdr.num_elems, labels, ls, wave_grids,
+			projectors, aewaves, pswaves, rmaxs, hdr.grid_encut);
+		for (int e = 0; e < hdr.num_elems; e++) {
+			add_num_cart_gridpts(wf->pps + e, wf->lattice, wf->fftg);
+		}
+	}
+	free(labels);
+	free(rmaxs);
+	free(ls);
+	free(wave_grids);
+	free(projectors);
+	free(aewaves);
+	free(pswaves);
+	return wf;
+}
@@ -0,0 +1,58 @@
+/** \file
+Persistent binary cache of a set-up pswf_t, so that later runs on the
+same VASP output can skip reading the WAVECAR and computing the
+projections. The file is written in native byte order and contains,
+in this order: a fixed header (magic, format version, key identifying
+the inputs, sizes, lattice, G bounds and FFT grid), caller-defined
+metadata, the projector tables of each element (the radial data passed
+to get_projector_list), the k-points with their G vectors, band
+energies and <p_i|psi> overlaps, and finally the plane wave
+coefficients of every band, starting on a 64-byte boundary so
+they can be used directly from a memory mapping.
+*/
+
+#ifndef WFCACHE_H
+#define WFCACHE_H
+#include "utils.h"
+
+#define WFCACHE_VERSION 2
+#define WFCACHE_KEY_SIZE 72
+
+/**
+Writes wf to filename. key (at most WFCACHE_KEY_SIZE-1 characters)
+identifies the inputs wf was made from, and read_wfcache only loads
+the file if it is given the same key. meta holds num_meta doubles
+stored alongside wf (e.g. data parsed from vasprun.xml) and
+grid_encut is the value wf->pps was made with in get_projector_list.
+The projections of the bands are stored if wf->pps is not NULL.
+The file is written under a temporary name and renamed, so readers
+never see a partial cache. Returns 0 on success, -1 on failure.
+*/
+int write_wfcache(char* filename, char* key, pswf_t* wf,
+	double grid_encut, double* meta, int num_meta);
+
+/**
+Returns the number of metadata doubles stored in the cache filename,
+or -1 if filename is not a cache of the current version with the
+given key. Used to size the meta argument of read_wfcache.
+*/
+int wfcache_num_meta(char* filename, char* key);
+
+/**
+Reads a pswf_t written by write_wfcache. If storage is COEFF_FLOAT32,
+the coefficients are not copied: the file is memory-mapped privately
+and the Cs of each band point into the mapping, which is owned by the
+returned pswf_t (as for read_wavefunctions_mapped). Otherwise they are
+encoded into a coefficient cache with that storage and at most
+cache_budget bytes of decoded coefficients, as in
+read_wavefunctions_select, and the file is unmapped. If projections
+were stored, the ppot_t list is rebuilt from the stored projector
+tables and the projections are restored, so the result is equivalent
+to a pswf_t after setup_projections. meta must hold
+wfcache_num_meta(filename, key) doubles. Returns NULL if the file
+cannot be read, was written by another version or has a different key.
+*/
+pswf_t* read_wfcache(char* filename, char* key, double* meta,
+	long cache_budget, int storage);
+
+#endif
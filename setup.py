@@ -20,7 +20,7 @@ DEBUG = True
 reqs = "numpy>=1.14,scipy>=1.0,pymatgen>=2018.2.13,sympy>=1.1.1,matplotlib>=0.2.5".split(',')
 
 srcfiles = ['density', 'gaunt', 'linalg', 'projector', 'pseudoprojector', 'quadrature',\
-			'radial', 'reader', 'sbt', 'utils', 'momentum']
+			'radial', 'reader', 'sbt', 'utils', 'momentum', 'wfcache', 'backend']
 
 # READ CONFIGURATION FILE
 config = configparser.ConfigParser()
@@ -39,6 +39,22 @@ if 'compiler_name' in config['compiler']:
 if 'linker_name' in config['compiler']:
 	os.environ['LDSHARED'] = config['compiler']['linker_name']
 
+# choose the FFT and BLAS libraries (see backend.h)
+fft_backend = config['backend']['fft'].lower()
+blas_backend = config['backend']['blas'].lower()
+if fft_backend not in ['mkl', 'fftw']:
+	raise PawpyBuildError("fft backend must be mkl or fftw, not %s" % fft_backend)
+if blas_backend not in ['mkl', 'openblas']:
+	raise PawpyBuildError("blas backend must be mkl or openblas, not %s" % blas_backend)
+if fft_backend == 'mkl' and blas_backend == 'openblas':
+	raise PawpyBuildError("MKL FFTs must be used with MKL BLAS, since both provide CBLAS")
+use_mkl = fft_backend == 'mkl' or blas_backend == 'mkl'
+define_macros = [('MKL_Complex16', 'double complex'), ('MKL_Complex8', 'float complex')]
+if fft_backend == 'fftw':
+	define_macros.append(('PAWPY_FFTW', None))
+if blas_backend == 'openblas':
+	define_macros.append(('PAWPY_OPENBLAS', None))
+
 # set parallelization and interface options
 sdl = config['mkl'].getboolean('sdl')
 omp_loops = config['threading'].getboolean('omp_loops')
@@ -55,7 +71,9 @@ else:
 	sdl_platform_link_args = ['-Wl,--no-as-needed']
 
 
-if sdl:
+if not use_mkl:
+	link_args = '-lpthread -lm -ldl'.split()
+elif sdl:
 	link_args = sdl_platform_link_args + '-lmkl_rt -liomp5 -lpthread -lm -ldl'.split()
 else:
 	# interface layer
@@ -75,6 +93,14 @@ else:
 	link_args = '%s %s -lmkl_core %s -lpthread -lm -ldl' % (interfacelib, threadlib, omplib)
 	link_args = platform_link_args + link_args.split()
 
+if fft_backend == 'fftw':
+	link_args = ['-lfftw3', '-lfftw3f'] + link_args
+if blas_backend == 'openblas':
+	link_args = ['-lopenblas'] + link_args
+
+# zlib and bzip2 for streaming compressed WAVECARs
+link_args += ['-lz', '-lbz2']
+
 # set compiler openmp flag
 extra_args = '-std=c11 -fPIC -Wall'.split()
 if omp_loops:
@@ -83,12 +109,16 @@ if omp_loops:
 # add additional MKL libraries if found in cfg
 lib_dirs = []
 inc_dirs = ['pawpyseed/core', np.get_include()]
-if 'root' in config['mkl']:
+if use_mkl and 'root' in config['mkl']:
 	root_dirs = config['mkl']['root'].split(':')
 	for r in root_dirs:
 		lib_dirs.append(os.path.join(r, 'lib/intel64'))
 		lib_dirs.append(os.path.join(r, 'lib'))
 		inc_dirs.append(os.path.join(r, 'include'))
+if 'root' in config['backend']:
+	for r in config['backend']['root'].split(':'):
+		lib_dirs.append(os.path.join(r, 'lib'))
+		inc_dirs.append(os.path.join(r, 'include'))
 if 'extra_libs' in config['compiler']:
 	extra_dirs = config['compiler']['extra_libs'].split(':')
 	for d in extra_dirs:
@@ -111,7 +141,7 @@ else:
 	extra_args += ['-g']
 
 extensions = [Extension('pawpyseed.core.pawpyc', ext_files + ['pawpyseed/core/pawpyc.pyx'],
-	define_macros=[('MKL_Complex16', 'double complex'), ('MKL_Complex8', 'float complex')],
+	define_macros=define_macros,
 	library_dirs=lib_dirs,
 	extra_link_args=extra_args + link_args,
 	extra_compile_args=extra_args,
@@ -121,7 +151,7 @@ extensions = [Extension('pawpyseed.core.pawpyc', ext_files + ['pawpyseed/core/pa
 if DEBUG:
 	extensions.append(Extension('pawpyseed.core.tests.testc',
 		['pawpyseed/core/tests/testc.pyx', 'pawpyseed/core/tests/tests.c'] + ext_files,
-		define_macros=[('MKL_Complex16', 'double complex'), ('MKL_Complex8', 'float complex')],
+		define_macros=define_macros,
 		library_dirs=lib_dirs,
 		extra_link_args=extra_args + link_args,
 		extra_compile_args=extra_args,
@@ -142,6 +172,7 @@ setup(name='pawpyseed',
 	author_email='kylebystrom@berkeley.edu',
 	license='BSD',
 	install_requires=reqs,
+	extras_require={'mpi': ['mpi4py']},
 	packages=packages,
 	#package_data={'pawpyseed.core': cfiles+hfiles},
 	data_files=[('', ['LICENSE', 'README.md'])],
@@ -0,0 +1,100 @@
+# coding: utf-8
+
+"""
+Writes the gamma-point WAVECARs in this directory for the cell in
+../CONTCAR: WAVECAR_std in the layout of vasp_std, with the whole
+G-sphere, and WAVECAR_gam in the layout of vasp_gam, with the same
+bands stored on the half sphere. The bands are random smooth real
+wavefunctions, orthonormalized, so both files describe exactly the
+same states. vasp_gam (5.2.12 and later) stores the G with G1 > 0,
+or G1 = 0 and G2 > 0, or G1 = G2 = 0 and G3 >= 0, in the same order
+as vasp_std, and multiplies the coefficients of G != 0 by sqrt(2).
+"""
+
+import numpy as np
+
+ENCUT = 320.0
+NBAND = 6
+# hbar^2/2m in eV A^2, as in WaveTrans
+HSQDTM = 3.80998212
+LATTICE = np.array([
+	[4.3515518806929165, 0.0106499131953374, 0.0],
+	[-2.0970141186059448, 3.8129574195815592, 0.0],
+	[0.0, 0.0, 4.4060081425154092]])
+
+
+def g_sphere(half):
+	"""
+	G-vectors within ENCUT in the order VASP stores them: the third
+	index runs slowest, and each index runs over 0, 1, ..., then the
+	negative values.
+	"""
+	b = 2 * np.pi * np.linalg.inv(LATTICE).T
+	n = 12
+	order = list(range(0, n + 1)) + list(range(-n, 0))
+	gs = []
+	for g3 in order:
+		for g2 in order:
+			for g1 in order:
+				if half and (g1 < 0 or (g1 == 0 and (g2 < 0 or (g2 == 0 and g3 < 0)))):
+					continue
+				kg = np.dot([g1, g2, g3], b)
+				if HSQDTM * np.dot(kg, kg) <= ENCUT:
+					gs.append((g1, g2, g3))
+	return np.array(gs), b
+
+
+def real_bands():
+	"""
+	NBAND orthonormal real wavefunctions on the whole G-sphere,
+	with C(-G) = conj(C(G)).
+	"""
+	gs, b = g_sphere(False)
+	index = {tuple(g): i for i, g in enumerate(gs)}
+	kg2 = np.sum(np.dot(gs, b)**2, axis=1)
+	rng = np.random.RandomState(22)
+	coeffs = np.zeros((NBAND, len(gs)), dtype=np.complex128)
+	for i, g in enumerate(gs):
+		j = index[tuple(-g)]
+		if j < i:
+			continue
+		c = (rng.randn(NBAND) + 1j * rng.randn(NBAND)) * np.exp(-kg2[i] / 4)
+		if i == j:
+			c = c.real
+		coeffs[:, i] = c
+		coeffs[:, j] = np.conj(c)
+	# orthonormalize with real combinations, which keep the bands real
+	q, r = np.linalg.qr(np.concatenate([coeffs.real, coeffs.imag], axis=1).T)
+	q = q.T
+	coeffs = q[:, :len(gs)] + 1j * q[:, len(gs):]
+	return gs, coeffs
+
+
+def write_wavecar(filename, coeffs):
+	nplane = coeffs.shape[1]
+	recl = 8 * max(nplane, 4 + 3 * NBAND, 12)
+	eigs = np.linspace(-5, 5, NBAND)
+	occs = (np.arange(NBAND) < NBAND // 2).astype(np.float64)
+	with open(filename, 'wb') as f:
+		def record(values, dtype):
+			data = np.zeros(recl, dtype=np.uint8)
+			raw = np.asarray(values, dtype=dtype).tobytes()
+			data[:len(raw)] = np.frombuffer(raw, dtype=np.uint8)
+			f.write(data.tobytes())
+		record([recl, 1, 45200], np.float64)
+		record([1, NBAND, ENCUT] + list(LATTICE.flatten()), np.float64)
+		header = [nplane, 0, 0, 0]
+		for e, o in zip(eigs, occs):
+			header += [e, 0, o]
+		record(header, np.float64)
+		for c in coeffs:
+			record(c, np.complex64)
+
+
+if __name__ == '__main__':
+	gs, coeffs = real_bands()
+	write_wavecar("WAVECAR_std", coeffs)
+	half, b = g_sphere(True)
+	index = {tuple(g): i for i, g in enumerate(gs)}
+	scale = np.where(np.all(half == 0, axis=1), 1, np.sqrt(2))
+	write_wavecar("WAVECAR_gam", coeffs[:, [index[tuple(g)] for g in half]] * scale)